@@ -0,0 +1,426 @@
+/*
+ * Benchmarks the PVR texture codecs and measures the quality of their
+ * output, so that changes to them can be compared.
+ *
+ * Every format is run over a corpus of generated images (and any images
+ * given on the command line, scaled to each size) at a range of square
+ * and non-square sizes. For each one it prints a tab separated line with
+ * the compression and decompression speed in megapixels per second, the
+ * peak memory use, and the PSNR of a compress-then-decompress round trip.
+ * With --min-psnr it exits with a failure if any result is worse.
+ */
+
+#include <glib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <libhildondesktop/pvr-texture.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+typedef struct {
+  const gchar *name;
+  guint        min_width;
+  guchar    *(*compress)   (const guchar *data, gint width, gint height,
+                            guint n_threads, guint *size);
+  guchar    *(*decompress) (const guchar *data, gint width, gint height,
+                            guint n_threads);
+} Codec;
+
+typedef struct {
+  const gchar *name;
+  GdkPixbuf   *pixbuf;    /* NULL for the generated ones */
+  void       (*generate) (guchar *data, gint width, gint height);
+} Image;
+
+static gint     repeat = 3;
+static gint     n_threads = 1;
+static gint     min_size = 4;
+static gint     max_size = 1024;
+static gdouble  min_psnr = 0;
+static gchar   *only_format = NULL;
+static gchar  **only_images = NULL;
+
+static GOptionEntry entries[] =
+{
+  { "repeat", 'r', 0, G_OPTION_ARG_INT, &repeat,
+    "Time the best of N runs (default 3)", "N" },
+  { "threads", 't', 0, G_OPTION_ARG_INT, &n_threads,
+    "Threads to use, 0 for one per CPU (default 1)", "N" },
+  { "min-size", 'm', 0, G_OPTION_ARG_INT, &min_size,
+    "Smallest width or height to try (default 4)", "N" },
+  { "max-size", 's', 0, G_OPTION_ARG_INT, &max_size,
+    "Largest width or height to try (default 1024)", "N" },
+  { "min-psnr", 'p', 0, G_OPTION_ARG_DOUBLE, &min_psnr,
+    "Fail if any PSNR is below this", "DB" },
+  { "format", 'f', 0, G_OPTION_ARG_STRING, &only_format,
+    "Only run pvrtc4, pvrtc2 or etc1", "FORMAT" },
+  { "image", 'i', 0, G_OPTION_ARG_STRING_ARRAY, &only_images,
+    "Only run this generated image (noise, gradient, rings or alpha), "
+    "as well as any files; may be given more than once", "NAME" },
+  { NULL }
+};
+
+/* Wrappers so all the codecs look the same */
+
+static guchar *
+compress_pvrtc4 (const guchar *data, gint width, gint height,
+                 guint threads, guint *size)
+{
+  return pvr_texture_compress_pvrtc4_parallel (data, width, height,
+                                               threads, size);
+}
+
+static guchar *
+decompress_pvrtc4 (const guchar *data, gint width, gint height,
+                   guint threads)
+{
+  return pvr_texture_decompress_pvrtc4_parallel (data, width, height,
+                                                 threads);
+}
+
+static guchar *
+compress_pvrtc2 (const guchar *data, gint width, gint height,
+                 guint threads, guint *size)
+{
+  return pvr_texture_compress_pvrtc2 (data, width, height, size);
+}
+
+static guchar *
+decompress_pvrtc2 (const guchar *data, gint width, gint height,
+                   guint threads)
+{
+  return pvr_texture_decompress_pvrtc2 (data, width, height);
+}
+
+static guchar *
+compress_etc1 (const guchar *data, gint width, gint height,
+               guint threads, guint *size)
+{
+  return pvr_texture_compress_etc1 (data, width, height, FALSE, size);
+}
+
+static guchar *
+decompress_etc1 (const guchar *data, gint width, gint height,
+                 guint threads)
+{
+  return pvr_texture_decompress_etc1 (data, width, height);
+}
+
+static const Codec codecs[] =
+{
+  { "pvrtc4", 4, compress_pvrtc4, decompress_pvrtc4 },
+  { "pvrtc2", 8, compress_pvrtc2, decompress_pvrtc2 },
+  { "etc1",   4, compress_etc1,   decompress_etc1 },
+};
+
+/* The generated corpus. These are deterministic so results can be
+ * compared between runs */
+
+static guint32 random_state;
+
+static guchar
+random_byte (void)
+{
+  random_state = random_state * 1103515245 + 12345;
+  return random_state >> 16;
+}
+
+static void
+generate_noise (guchar *data, gint width, gint height)
+{
+  gint i;
+
+  random_state = 1;
+  for (i=0;i<width*height*4;i++)
+    data[i] = random_byte ();
+}
+
+static void
+generate_gradient (guchar *data, gint width, gint height)
+{
+  gint x, y;
+
+  for (y=0;y<height;y++)
+    for (x=0;x<width;x++)
+      {
+        guchar *p = &data[(x + y*width)*4];
+
+        p[0] = x * 255 / MAX(width-1, 1);
+        p[1] = y * 255 / MAX(height-1, 1);
+        p[2] = 255 - (p[0] + p[1]) / 2;
+        p[3] = 255;
+      }
+}
+
+static void
+generate_rings (guchar *data, gint width, gint height)
+{
+  gint x, y;
+
+  for (y=0;y<height;y++)
+    for (x=0;x<width;x++)
+      {
+        guchar *p = &data[(x + y*width)*4];
+        gdouble dx = x - width/2.0, dy = y - height/2.0;
+        gdouble r = sqrt (dx*dx + dy*dy);
+
+        p[0] = 128 + 127 * sin (r / 3);
+        p[1] = 128 + 127 * cos (r / 7);
+        p[2] = 128 + 127 * sin (r / 11);
+        p[3] = 255;
+      }
+}
+
+/* Mostly transparent, like a widget with a drop shadow */
+static void
+generate_alpha (guchar *data, gint width, gint height)
+{
+  gint x, y;
+
+  for (y=0;y<height;y++)
+    for (x=0;x<width;x++)
+      {
+        guchar *p = &data[(x + y*width)*4];
+        gint edge = MIN(MIN(x, width-1-x), MIN(y, height-1-y));
+
+        p[0] = 40;
+        p[1] = 80;
+        p[2] = 160;
+        p[3] = edge > 8 ? 255 : edge * 255 / 8;
+      }
+}
+
+static guchar *
+image_get_data (const Image *image, gint width, gint height)
+{
+  guchar *data = g_malloc (width*height*4);
+  GdkPixbuf *scaled;
+  gint y;
+
+  if (!image->pixbuf)
+    {
+      image->generate (data, width, height);
+      return data;
+    }
+
+  scaled = gdk_pixbuf_scale_simple (image->pixbuf, width, height,
+                                    GDK_INTERP_BILINEAR);
+  for (y=0;y<height;y++)
+    memcpy (&data[y*width*4],
+            gdk_pixbuf_get_pixels (scaled) + y*gdk_pixbuf_get_rowstride (scaled),
+            width*4);
+  g_object_unref (scaled);
+
+  return data;
+}
+
+/* Peak resident memory of the process in KiB. We try to reset the high
+ * water mark before each test, and if the kernel won't let us the figure
+ * is the peak so far */
+static void
+peak_memory_reset (void)
+{
+  FILE *file = fopen ("/proc/self/clear_refs", "w");
+
+  if (file)
+    {
+      fputs ("5", file);
+      fclose (file);
+    }
+}
+
+static glong
+peak_memory_get (void)
+{
+  FILE *file = fopen ("/proc/self/status", "r");
+  gchar line[256];
+  glong peak = -1;
+
+  if (file)
+    {
+      while (fgets (line, sizeof(line), file))
+        if (sscanf (line, "VmHWM: %ld", &peak) == 1)
+          break;
+      fclose (file);
+    }
+
+  if (peak < 0)
+    {
+      struct rusage usage;
+
+      getrusage (RUSAGE_SELF, &usage);
+      peak = usage.ru_maxrss;
+    }
+
+  return peak;
+}
+
+/* PSNR over the RGB channels, and alpha too if the format keeps it */
+static gdouble
+psnr (const guchar *a, const guchar *b, gint n_pixels, gboolean alpha)
+{
+  gint channels = alpha ? 4 : 3;
+  gdouble error = 0;
+  gint i, c;
+
+  for (i=0;i<n_pixels;i++)
+    for (c=0;c<channels;c++)
+      {
+        gdouble d = (gdouble)a[i*4 + c] - b[i*4 + c];
+
+        error += d*d;
+      }
+
+  if (error == 0)
+    return 99.0;
+
+  return 10 * log10 (255.0*255.0 * n_pixels * channels / error);
+}
+
+static gboolean
+run (const Codec *codec, const Image *image, gint width, gint height)
+{
+  guchar *data, *compressed = NULL, *decompressed = NULL;
+  gint64 compress_time = G_MAXINT64, decompress_time = G_MAXINT64;
+  guint size = 0;
+  gdouble megapixels = width * height / 1000000.0;
+  gdouble quality;
+  glong peak;
+  gint i;
+
+  data = image_get_data (image, width, height);
+
+  peak_memory_reset ();
+  for (i=0;i<repeat;i++)
+    {
+      gint64 start;
+
+      g_free (compressed);
+      g_free (decompressed);
+
+      start = g_get_monotonic_time ();
+      compressed = codec->compress (data, width, height, n_threads, &size);
+      compress_time = MIN(compress_time, g_get_monotonic_time () - start);
+
+      start = g_get_monotonic_time ();
+      decompressed = codec->decompress (compressed, width, height, n_threads);
+      decompress_time = MIN(decompress_time, g_get_monotonic_time () - start);
+    }
+  peak = peak_memory_get ();
+
+  if (!compressed || !decompressed)
+    {
+      fprintf (stderr, "%s failed on %s at %dx%d\n",
+               codec->name, image->name, width, height);
+      g_free (data);
+      return FALSE;
+    }
+
+  quality = psnr (data, decompressed, width*height,
+                  strcmp (codec->name, "etc1") != 0);
+
+  printf ("%s\t%s\t%d\t%d\t%u\t%.2f\t%.2f\t%ld\t%.2f\n",
+          codec->name, image->name, width, height, size,
+          megapixels / MAX(compress_time, 1) * 1000000.0,
+          megapixels / MAX(decompress_time, 1) * 1000000.0,
+          peak, quality);
+
+  g_free (data);
+  g_free (compressed);
+  g_free (decompressed);
+
+  return quality >= min_psnr;
+}
+
+static gboolean
+image_wanted (const gchar *name)
+{
+  guint i;
+
+  for (i=0;only_images[i];i++)
+    if (!strcmp (only_images[i], name))
+      return TRUE;
+
+  return FALSE;
+}
+
+int main(int argc, char *argv[]) {
+  GOptionContext *context;
+  GError *error = NULL;
+  GArray *images;
+  gboolean ok = TRUE;
+  guint c, i;
+  gint width, height;
+
+#if !GLIB_CHECK_VERSION(2,35,0)
+  g_type_init ();
+#endif
+
+  context = g_option_context_new ("[IMAGE...] - benchmark the PVR codecs");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      fprintf (stderr, "%s\n", error->message);
+      g_error_free (error);
+      return EXIT_FAILURE;
+    }
+  g_option_context_free (context);
+
+  images = g_array_new (FALSE, TRUE, sizeof(Image));
+  {
+    Image generated[] = {
+      { "noise", NULL, generate_noise },
+      { "gradient", NULL, generate_gradient },
+      { "rings", NULL, generate_rings },
+      { "alpha", NULL, generate_alpha },
+    };
+
+    for (i=0;i<G_N_ELEMENTS(generated);i++)
+      if (!only_images || image_wanted (generated[i].name))
+        g_array_append_val (images, generated[i]);
+  }
+  for (i=1;i<(guint)argc;i++)
+    {
+      Image image = { argv[i], NULL, NULL };
+      GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file (argv[i], &error);
+
+      if (!pixbuf)
+        {
+          fprintf (stderr, "%s\n", error->message);
+          g_clear_error (&error);
+          continue;
+        }
+      image.pixbuf = gdk_pixbuf_add_alpha (pixbuf, FALSE, 0, 0, 0);
+      g_object_unref (pixbuf);
+      g_array_append_val (images, image);
+    }
+
+  printf ("format\timage\twidth\theight\tbytes\t"
+          "compress_mps\tdecompress_mps\tpeak_kib\tpsnr\n");
+
+  for (c=0;c<G_N_ELEMENTS(codecs);c++)
+    {
+      if (only_format && strcmp (only_format, codecs[c].name))
+        continue;
+
+      for (i=0;i<images->len;i++)
+        for (width=4;width<=max_size;width*=4)
+          for (height=4;height<=max_size;height*=4)
+            /* keep to square and 4:1 either way, as that's plenty to
+             * exercise the twiddling of non-square textures */
+            if (width >= (gint)codecs[c].min_width &&
+                width >= min_size && height >= min_size &&
+                (width == height || width == height*4 || height == width*4))
+              ok &= run (&codecs[c], &g_array_index (images, Image, i),
+                         width, height);
+    }
+
+  for (i=0;i<images->len;i++)
+    if (g_array_index (images, Image, i).pixbuf)
+      g_object_unref (g_array_index (images, Image, i).pixbuf);
+  g_array_free (images, TRUE);
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -49,10 +49,15 @@ typedef struct _HDPluginInfo HDPluginInfo;
 
 struct _HDPluginInfo
 {
-  gchar    *plugin_id;
-  gchar    *desktop_file;
-  guint     priority;
-  gpointer  item;
+  gchar           *plugin_id;
+  gchar           *desktop_file;
+  guint            priority;
+  gpointer         item;
+
+  /* Set while the plugin is loaded */
+  HDPluginManager *manager;
+  GList           *link;
+  GList           *module_link;
 };
 
 static HDPluginInfo *hd_plugin_info_new  (const gchar           *plugin_id,
@@ -63,8 +68,6 @@ static void          hd_plugin_info_free (HDPluginInfo          *plugin_definiti
 static void hd_plugin_manager_items_configuration_loaded (HDPluginConfiguration *configuration,
                                                           GKeyFile              *keyfile);
 
-static gint cmp_info_plugin_id (const HDPluginInfo *a, const HDPluginInfo *b);
-
 enum
 {
   PLUGIN_ADDED,
@@ -76,7 +79,12 @@ struct _HDPluginManagerPrivate
 {
   GObject                *factory;
 
-  GList                  *plugins;
+  /* The loaded plugins (HDPluginInfo) in the order they were loaded,
+   * indexed by plugin id and by desktop file (a GQueue of the plugins
+   * for each, as there can be many of one module) */
+  GQueue                  plugins;
+  GHashTable             *plugins_by_id;
+  GHashTable             *plugins_by_desktop_file;
 
   HDLoadPriorityFunc      load_priority_func;
   gpointer                load_priority_data;
@@ -120,14 +128,79 @@ G_DEFINE_TYPE_WITH_PRIVATE (HDPluginManager, hd_plugin_manager, HD_TYPE_PLUGIN_C
 #define HD_PLUGIN_MANAGER_GET_PRIVATE(manager) \
   ((HDPluginManagerPrivate *)hd_plugin_manager_get_instance_private (manager))
 
+/* Adds info, which has just been loaded, to the plugins */
+static void
+hd_plugin_manager_add_info (HDPluginManager *manager,
+                            HDPluginInfo    *info)
+{
+  HDPluginManagerPrivate *priv = HD_PLUGIN_MANAGER_GET_PRIVATE (manager);
+  GQueue *module_plugins;
+
+  info->manager = manager;
+  g_queue_push_tail (&priv->plugins, info);
+  info->link = g_queue_peek_tail_link (&priv->plugins);
+
+  g_hash_table_insert (priv->plugins_by_id, info->plugin_id, info);
+
+  module_plugins = g_hash_table_lookup (priv->plugins_by_desktop_file,
+                                        info->desktop_file);
+  if (!module_plugins)
+    {
+      module_plugins = g_queue_new ();
+      g_hash_table_insert (priv->plugins_by_desktop_file,
+                           g_strdup (info->desktop_file),
+                           module_plugins);
+    }
+  g_queue_push_tail (module_plugins, info);
+  info->module_link = g_queue_peek_tail_link (module_plugins);
+}
+
+/* Takes info out of the plugins, without freeing it */
+static void
+hd_plugin_manager_unlink_info (HDPluginManager *manager,
+                               HDPluginInfo    *info)
+{
+  HDPluginManagerPrivate *priv = HD_PLUGIN_MANAGER_GET_PRIVATE (manager);
+  GQueue *module_plugins;
+
+  g_queue_delete_link (&priv->plugins, info->link);
+  info->link = NULL;
+
+  if (g_hash_table_lookup (priv->plugins_by_id, info->plugin_id) == info)
+    g_hash_table_remove (priv->plugins_by_id, info->plugin_id);
+
+  module_plugins = g_hash_table_lookup (priv->plugins_by_desktop_file,
+                                        info->desktop_file);
+  if (module_plugins)
+    {
+      g_queue_delete_link (module_plugins, info->module_link);
+      info->module_link = NULL;
+      if (g_queue_is_empty (module_plugins))
+        g_hash_table_remove (priv->plugins_by_desktop_file,
+                             info->desktop_file);
+    }
+}
+
+/* The plugin was destroyed while it was still loaded */
 static void
 delete_plugin (gpointer  data,
                GObject  *object_pointer)
 {
-  HDPluginInfo *info = ((GList *) data)->data;
+  HDPluginInfo *info = data;
+
+  hd_plugin_manager_unlink_info (info->manager, info);
+  hd_plugin_info_free (info);
+}
 
+/* Unloads the plugin info is for */
+static void
+hd_plugin_manager_remove_info (HDPluginManager *manager,
+                               HDPluginInfo    *info)
+{
+  g_object_weak_unref (G_OBJECT (info->item), delete_plugin, info);
+  hd_plugin_manager_unlink_info (manager, info);
+  g_signal_emit (manager, plugin_manager_signals[PLUGIN_REMOVED], 0, info->item);
   hd_plugin_info_free (info);
-  ((GList *) data)->data = NULL;
 }
 
 static void
@@ -135,26 +208,13 @@ hd_plugin_manager_remove_plugin_module (HDPluginManager *manager,
                                         const gchar     *desktop_file)
 {
   HDPluginManagerPrivate *priv = HD_PLUGIN_MANAGER_GET_PRIVATE (manager);
-  GList *p;
+  GQueue *module_plugins;
 
-  /* remove all plugins with desktop_file */
-  for (p = priv->plugins; p; )
-    {
-      GList *next = p->next;
-      HDPluginInfo *info = p->data;
-
-      if (!info)
-        continue;
-
-      if (!strcmp (info->desktop_file, desktop_file))
-        {
-          g_object_weak_unref (G_OBJECT (info->item), delete_plugin, p);
-          priv->plugins = g_list_delete_link (priv->plugins, p);
-          g_signal_emit (manager, plugin_manager_signals[PLUGIN_REMOVED], 0, info->item);
-        }
-
-      p = next;
-    }
+  /* remove all plugins with desktop_file (looked up each time, as the
+   * queue goes away with the last of them) */
+  while ((module_plugins = g_hash_table_lookup (priv->plugins_by_desktop_file,
+                                                desktop_file)))
+    hd_plugin_manager_remove_info (manager, g_queue_peek_head (module_plugins));
 }
 
 static void
@@ -162,25 +222,12 @@ hd_plugin_manager_remove_plugin (HDPluginManager *manager,
                                  const gchar     *plugin_id)
 {
   HDPluginManagerPrivate *priv = HD_PLUGIN_MANAGER_GET_PRIVATE (manager);
-  GList *p;
-
-  /* Remove the plugin with id plugin_id*/
-  for (p = priv->plugins; p; p = p->next)
-    {
-      HDPluginInfo *info = p->data;
-
-      if (!info)
-        continue;
+  HDPluginInfo *info;
 
-      if (!strcmp (info->plugin_id, plugin_id))
-        {
-          g_object_weak_unref (G_OBJECT (info->item), delete_plugin, p);
-          priv->plugins = g_list_delete_link (priv->plugins, p);
-          g_signal_emit (manager, plugin_manager_signals[PLUGIN_REMOVED], 0, info->item);
-          /* There is only one such plugin */
-          return;
-        }
-    }
+  /* Remove the plugin with id plugin_id */
+  info = g_hash_table_lookup (priv->plugins_by_id, plugin_id);
+  if (info)
+    hd_plugin_manager_remove_info (manager, info);
 }
 
 typedef struct
@@ -199,7 +246,6 @@ load_plugin_idle (gpointer idle_data)
   gchar *plugin_id = data->plugin_id;
   HDPluginManagerPrivate *priv = HD_PLUGIN_MANAGER_GET_PRIVATE (manager);
   HDPluginInfo *info;
-  GList *p;
   GObject *plugin;
   GError *error = NULL;
 
@@ -213,24 +259,20 @@ load_plugin_idle (gpointer idle_data)
 
   g_debug ("%s. Try to load plugin_id: %s", __FUNCTION__, plugin_id);
 
-  info = hd_plugin_info_new (plugin_id,
-                             desktop_file,
-                             0);
-
-  if (g_list_find_custom (priv->plugins,
-                          info,
-                          (GCompareFunc) cmp_info_plugin_id))
+  if (g_hash_table_lookup (priv->plugins_by_id, plugin_id))
     {
       /* plugin already loaded*/
       g_debug ("%s. Plugin with id %s already loaded.",
                __FUNCTION__,
                plugin_id);
 
-      hd_plugin_info_free (info);
-
       goto cleanup;
     }
 
+  info = hd_plugin_info_new (plugin_id,
+                             desktop_file,
+                             0);
+
   plugin = hd_plugin_loader_factory_create (HD_PLUGIN_LOADER_FACTORY (priv->factory),
                                             plugin_id,
                                             desktop_file,
@@ -258,10 +300,9 @@ load_plugin_idle (gpointer idle_data)
            __FUNCTION__,
            info->desktop_file);
 
-  p = g_list_append (NULL, info);
-  priv->plugins = g_list_concat (priv->plugins, p);
+  hd_plugin_manager_add_info (manager, info);
 
-  g_object_weak_ref (G_OBJECT (plugin), delete_plugin, p);
+  g_object_weak_ref (G_OBJECT (plugin), delete_plugin, info);
 
   g_signal_emit (manager, plugin_manager_signals[PLUGIN_ADDED], 0, plugin);
 
@@ -360,29 +401,22 @@ hd_plugin_manager_plugin_module_updated (HDPluginConfiguration *configuration,
 {
   HDPluginManager *manager = HD_PLUGIN_MANAGER (configuration);
   HDPluginManagerPrivate *priv = HD_PLUGIN_MANAGER_GET_PRIVATE (manager);
+  GQueue *module_plugins;
   GList *p, *plugin_ids = NULL;
   GKeyFile *items_file;
 
-  /* remove all plugins with desktop_file */
-  for (p = priv->plugins; p; )
-    {
-      GList *next = p->next;
-      HDPluginInfo *info = p->data;
-
-      if (!info)
-        continue;
-
-      if (!strcmp (info->desktop_file, desktop_file))
-        {
-          plugin_ids = g_list_prepend (plugin_ids, g_strdup (info->plugin_id));
+  /* remember the ids of all plugins with desktop_file and remove them */
+  module_plugins = g_hash_table_lookup (priv->plugins_by_desktop_file,
+                                        desktop_file);
+  if (module_plugins)
+    for (p = module_plugins->tail; p; p = p->prev)
+      {
+        HDPluginInfo *info = p->data;
 
-          g_object_weak_unref (G_OBJECT (info->item), delete_plugin, p);
-          priv->plugins = g_list_delete_link (priv->plugins, p);
-          g_signal_emit (manager, plugin_manager_signals[PLUGIN_REMOVED], 0, info->item);
-        }
+        plugin_ids = g_list_prepend (plugin_ids, g_strdup (info->plugin_id));
+      }
 
-      p = next;
-    }
+  hd_plugin_manager_remove_plugin_module (manager, desktop_file);
 
   /* readd them again */
   for (p = plugin_ids; p; p = p->next)
@@ -409,6 +443,13 @@ hd_plugin_manager_init (HDPluginManager *manager)
 
   priv->factory = hd_plugin_loader_factory_new ();
 
+  g_queue_init (&priv->plugins);
+  priv->plugins_by_id = g_hash_table_new (g_str_hash, g_str_equal);
+  priv->plugins_by_desktop_file = g_hash_table_new_full (g_str_hash,
+                                                         g_str_equal,
+                                                         g_free,
+                                                         (GDestroyNotify) g_queue_free);
+
   g_signal_connect (manager, "plugin-module-updated",
                     G_CALLBACK (hd_plugin_manager_plugin_module_updated), NULL);
 }
@@ -434,6 +475,17 @@ hd_plugin_manager_finalize (GObject *object)
 
   priv = HD_PLUGIN_MANAGER_GET_PRIVATE (HD_PLUGIN_MANAGER (object));
 
+  /* the plugins outlive the manager, so they mustn't call back into it */
+  while (!g_queue_is_empty (&priv->plugins))
+    {
+      HDPluginInfo *info = g_queue_pop_head (&priv->plugins);
+
+      g_object_weak_unref (G_OBJECT (info->item), delete_plugin, info);
+      hd_plugin_info_free (info);
+    }
+  g_hash_table_destroy (priv->plugins_by_id);
+  g_hash_table_destroy (priv->plugins_by_desktop_file);
+
   if (priv->factory)
     {
       g_object_unref (priv->factory);
@@ -454,90 +506,20 @@ hd_plugin_manager_finalize (GObject *object)
   G_OBJECT_CLASS (hd_plugin_manager_parent_class)->finalize (object);
 }
 
-/* Compare lists new and old and move elements unique in old
- * to to_remove and elements unique in new to to_add, elements
- * common in new and old are removed.
- *
- * old is destroyed by this function
- * new is destroyed by this function
- */
-static void
-create_sync_lists (GList          *old,
-                   GList          *new,
-                   GList         **to_add,
-                   GList         **to_remove,
-                   GCompareFunc    cmp_func,
-                   GDestroyNotify  destroy_func)
+/* Hash plugin id and desktop file */
+static guint
+hash_info_plugin_id (const HDPluginInfo *info)
 {
-  GList *add = NULL;
-  GList *remove = NULL;
-
-  g_return_if_fail (to_add != NULL);
-  g_return_if_fail (to_remove != NULL);
-
-  /* sort lists */
-  old = g_list_sort (old, cmp_func);
-  new = g_list_sort (new, cmp_func);
-
-  while (old && new)
-    {
-      gint c = cmp_func (old->data, new->data);
-
-      /* there is an element only in new 
-       * move it to list to_add */
-      if (c > 0)
-        {
-          GList *n = new;
-          new = g_list_remove_link (new, new);
-          add = g_list_concat (n, add);
-        }
-      /* there is an element only in old 
-       * move it to list to_remove */
-      else if (c < 0)
-        {
-          GList *o = old;
-          old = g_list_remove_link (old, old);
-          remove = g_list_concat (o, remove);
-        }
-      /* the next element is in old and new
-       * remove it */
-      else
-        {
-          destroy_func (old->data);
-          destroy_func (new->data);
-
-          old = g_list_delete_link (old, old);
-          new = g_list_delete_link (new, new);
-        }
-    }
-
-  /* add remaining elements to the approbiate lists */
-  *to_add = g_list_concat (new, add);
-  *to_remove = g_list_concat (old, remove);
+  return g_str_hash (info->plugin_id) * 31 + g_str_hash (info->desktop_file);
 }
 
 /* Compare plugin id and desktop file */
-static gint
-cmp_info_plugin_id (const HDPluginInfo *a,
-                    const HDPluginInfo *b)
-{
-  gint result;
-
-  result = g_strcmp0 (a->plugin_id, b->plugin_id);
-
-  if (result)
-    return result;
-
-  /* If plugin IDs are the same compare the desktop_file */
-  return strcmp (a->desktop_file, b->desktop_file);
-}
-
-/* Compare desktop file */
-static gint
-cmp_info_desktop_file (const HDPluginInfo *a,
-                       const HDPluginInfo *b)
+static gboolean
+equal_info_plugin_id (const HDPluginInfo *a,
+                      const HDPluginInfo *b)
 {
-  return strcmp (a->desktop_file, b->desktop_file);
+  return !strcmp (a->plugin_id, b->plugin_id) &&
+         !strcmp (a->desktop_file, b->desktop_file);
 }
 
 /* Compare priority */
@@ -560,33 +542,51 @@ hd_plugin_manager_sync_plugins (HDPluginManager *manager,
                                 GList           *new_plugins)
 {
   HDPluginManagerPrivate *priv = HD_PLUGIN_MANAGER_GET_PRIVATE (manager);
-  GList *old_plugins = NULL;
+  GHashTable *wanted;
   GList *p;
   GList *to_add = NULL, *to_remove = NULL;
 
-  for (p = priv->plugins; p; p = p->next)
+  /* The plugins which should be loaded, by plugin id and desktop file,
+   * and those of them which aren't yet */
+  wanted = g_hash_table_new_full ((GHashFunc) hash_info_plugin_id,
+                                  (GEqualFunc) equal_info_plugin_id,
+                                  (GDestroyNotify) hd_plugin_info_free,
+                                  NULL);
+  for (p = new_plugins; p; p = p->next)
     {
       HDPluginInfo *info = p->data;
+      HDPluginInfo *loaded;
 
-      if (!info)
-        continue;
+      if (g_hash_table_lookup (wanted, info))
+        {
+          hd_plugin_info_free (info);
+          continue;
+        }
+      g_hash_table_insert (wanted, info, info);
 
-      old_plugins = g_list_prepend (old_plugins, hd_plugin_info_new (info->plugin_id,
-                                                                     info->desktop_file,
-                                                                     0));
+      loaded = g_hash_table_lookup (priv->plugins_by_id, info->plugin_id);
+      if (!loaded || strcmp (loaded->desktop_file, info->desktop_file))
+        to_add = g_list_prepend (to_add, info);
     }
+  g_list_free (new_plugins);
+
+  /* The loaded plugins which shouldn't be */
+  for (p = priv->plugins.head; p; p = p->next)
+    {
+      HDPluginInfo *info = p->data;
 
-  create_sync_lists (old_plugins, new_plugins, &to_add, &to_remove,
-                     (GCompareFunc) cmp_info_plugin_id, (GDestroyNotify) hd_plugin_info_free);
+      if (!g_hash_table_lookup (wanted, info))
+        to_remove = g_list_prepend (to_remove, g_strdup (info->plugin_id));
+    }
 
   /* remove plugins */
   for (p = to_remove; p; p = p->next)
     {
-      HDPluginInfo *info = p->data;
+      gchar *plugin_id = p->data;
 
-      hd_plugin_manager_remove_plugin (manager, info->plugin_id);
+      hd_plugin_manager_remove_plugin (manager, plugin_id);
 
-      hd_plugin_info_free (info);
+      g_free (plugin_id);
     }
 
   to_add = g_list_sort (to_add, (GCompareFunc) cmp_info_priority);
@@ -597,12 +597,11 @@ hd_plugin_manager_sync_plugins (HDPluginManager *manager,
       HDPluginInfo *info = p->data;
 
       hd_plugin_manager_load_plugin (manager, info->desktop_file, info->plugin_id);
-
-      hd_plugin_info_free (info);
     }
 
   g_list_free (to_remove);
   g_list_free (to_add);
+  g_hash_table_destroy (wanted);
 }
 
 static void
@@ -655,6 +654,7 @@ hd_plugin_manager_items_configuration_loaded (HDPluginConfiguration *configurati
   HDPluginManager *manager = HD_PLUGIN_MANAGER (configuration);
   HDPluginManagerPrivate *priv = HD_PLUGIN_MANAGER_GET_PRIVATE (manager);
   GList *new_plugins = NULL;
+  GHashTable *new_desktop_files;
   gchar **safe_set = NULL;
   gboolean removed_unsafe_plugins = FALSE;
   gboolean in_startup = hd_plugin_configuration_get_in_startup (configuration);
@@ -693,6 +693,9 @@ hd_plugin_manager_items_configuration_loaded (HDPluginConfiguration *configurati
       g_free (contents);
     }
 
+  /* The desktop files of new_plugins, so all plugins are only added once */
+  new_desktop_files = g_hash_table_new (g_str_hash, g_str_equal);
+
   if (keyfile)
     {
       gchar **groups;
@@ -705,6 +708,7 @@ hd_plugin_manager_items_configuration_loaded (HDPluginConfiguration *configurati
         {
           for (i = 0; groups[i]; i++)
             {
+              HDPluginInfo *info;
               gchar *desktop_file;
               guint priority = G_MAXUINT;
 
@@ -762,9 +766,11 @@ hd_plugin_manager_items_configuration_loaded (HDPluginConfiguration *configurati
               if (priv->load_priority_func)
                 priority = priv->load_priority_func (groups[i], keyfile, priv->load_priority_data);
 
-              new_plugins = g_list_prepend (new_plugins, hd_plugin_info_new (groups[i],
-                                                                             desktop_file,
-                                                                             priority));
+              info = hd_plugin_info_new (groups[i],
+                                         desktop_file,
+                                         priority);
+              new_plugins = g_list_prepend (new_plugins, info);
+              g_hash_table_insert (new_desktop_files, info->desktop_file, info);
               g_free (desktop_file);
             }
         }
@@ -786,17 +792,17 @@ hd_plugin_manager_items_configuration_loaded (HDPluginConfiguration *configurati
 
           for (i = 0; all_plugins[i]; i++)
             {
-              HDPluginInfo *info = hd_plugin_info_new (NULL,
-                                                       all_plugins[i],
-                                                       G_MAXUINT);
+              HDPluginInfo *info;
 
-              if (!g_list_find_custom (new_plugins, info, (GCompareFunc) cmp_info_desktop_file))
-                {
-                  info->plugin_id = g_path_get_basename (info->desktop_file);
-                  new_plugins = g_list_prepend (new_plugins, info);
-                }
-              else
-                hd_plugin_info_free (info);
+              if (g_hash_table_lookup (new_desktop_files, all_plugins[i]))
+                continue;
+
+              info = hd_plugin_info_new (NULL,
+                                         all_plugins[i],
+                                         G_MAXUINT);
+              info->plugin_id = g_path_get_basename (info->desktop_file);
+              new_plugins = g_list_prepend (new_plugins, info);
+              g_hash_table_insert (new_desktop_files, info->desktop_file, info);
             }
 
           g_strfreev (all_plugins);
@@ -810,24 +816,22 @@ hd_plugin_manager_items_configuration_loaded (HDPluginConfiguration *configurati
             {
               HDPluginInfo *info;
 
-              if (!safe_set[i][0])
+              if (!safe_set[i][0] ||
+                  g_hash_table_lookup (new_desktop_files, safe_set[i]))
                 continue;
 
               info = hd_plugin_info_new (NULL,
                                          safe_set[i],
                                          G_MAXUINT);
-
-              if (!g_list_find_custom (new_plugins, info, (GCompareFunc) cmp_info_desktop_file))
-                {
-                  info->plugin_id = g_path_get_basename (info->desktop_file);
-                  new_plugins = g_list_prepend (new_plugins, info);
-                }
-              else
-                hd_plugin_info_free (info);
+              info->plugin_id = g_path_get_basename (info->desktop_file);
+              new_plugins = g_list_prepend (new_plugins, info);
+              g_hash_table_insert (new_desktop_files, info->desktop_file, info);
             }
         }
     }
 
+  g_hash_table_destroy (new_desktop_files);
+
   /* Don't load plugins from X-Debug-Plugins list */
   if (priv->debug_plugins != NULL)
     {
@@ -0,0 +1,45 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_PVR_TEXTURE_PRIVATE_H__
+#define __HD_PVR_TEXTURE_PRIVATE_H__
+/* internals of hd-pvr-texture.c that the tests need to get at */
+
+#include "hd-pvr-texture.h"
+
+G_BEGIN_DECLS
+
+/* Bump this whenever the compressed output for the same input changes,
+ * so that stale textures aren't served from the cache */
+#define HD_PVR_TEXTURE_CACHE_VERSION 2
+
+/* The key pixbuf would be cached under if it was saved in format, by a
+ * library whose HD_PVR_TEXTURE_CACHE_VERSION was version. 0 if pixbuf
+ * can't be saved at all */
+guint64 _hd_pvr_texture_cache_key (GdkPixbuf          *pixbuf,
+                                   HDPvrTextureFormat  format,
+                                   gboolean            mipmaps,
+                                   guint               version);
+
+G_END_DECLS
+
+#endif /* __HD_PVR_TEXTURE_PRIVATE_H__ */
@@ -25,146 +25,805 @@
 
 #include <glib.h>
 #include <glib/gstdio.h>
+#include <errno.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "hd-pvr-texture.h"
+#include "hd-pvr-texture-private.h"
 #include "pvr-texture.h"
 
-/* Save the given pixbuf as a PVRTC4 texture. PVRTC4 textures must be 2^n
- * in width and height, so any texture not of these dimensions will be
- * padded with black (zero alpha if alpha is used).
+static PvrTextureCache *texture_cache = NULL;
+G_LOCK_DEFINE_STATIC (texture_cache);
+
+static PvrTextureCache *
+texture_cache_get (void)
+{
+  PvrTextureCache *cache = NULL;
+
+  G_LOCK (texture_cache);
+  if (texture_cache)
+    cache = pvr_texture_cache_ref (texture_cache);
+  G_UNLOCK (texture_cache);
+
+  return cache;
+}
+
+/* While a batch is going, textures are saved into its group, and
+ * cache_inserts are the cache entries to add for them once it has been
+ * committed. n_writers counts the saves still adding to the group, which
+ * hd_pvr_texture_end_batch() waits for before committing it */
+typedef struct {
+  PvrTextureCache *cache;
+  guint64          key;
+  gchar           *file;
+} CacheInsert;
+
+typedef struct {
+  PvrTextureSaveGroup *group;
+  GSList              *cache_inserts;
+  guint                n_writers;
+} SaveBatch;
+
+static SaveBatch *save_batch = NULL;
+static GCond save_batch_drained;
+G_LOCK_DEFINE_STATIC (save_batch);
+
+/* Returns the current batch, which can't be committed until it is given
+ * to save_batch_leave(), or NULL if there isn't one */
+static SaveBatch *
+save_batch_join (void)
+{
+  SaveBatch *batch;
+
+  G_LOCK (save_batch);
+  batch = save_batch;
+  if (batch)
+    batch->n_writers++;
+  G_UNLOCK (save_batch);
+
+  return batch;
+}
+
+/* Done with batch. insert, if not NULL, is added to the cache once it
+ * has been committed */
+static void
+save_batch_leave (SaveBatch   *batch,
+                  CacheInsert *insert)
+{
+  G_LOCK (save_batch);
+  if (insert)
+    batch->cache_inserts = g_slist_prepend (batch->cache_inserts, insert);
+  if (--batch->n_writers == 0)
+    g_cond_broadcast (&save_batch_drained);
+  G_UNLOCK (save_batch);
+}
+
+static gboolean
+save_batch_is_active (void)
+{
+  gboolean active;
+
+  G_LOCK (save_batch);
+  active = save_batch != NULL;
+  G_UNLOCK (save_batch);
+
+  return active;
+}
+
+/* The cache key: the pixels, plus everything else that makes a
+ * difference to the file we write */
+static guint64
+texture_cache_key (const PvrTextureSource *source,
+                   guint                   pvr_format,
+                   gboolean                mipmaps,
+                   guint                   version)
+{
+  guint32 settings[8];
+
+  settings[0] = version;
+  settings[1] = pvr_format;
+  settings[2] = mipmaps;
+  settings[3] = source->width;
+  settings[4] = source->height;
+  settings[5] = source->n_channels;
+  settings[6] = source->padded_width;
+  settings[7] = source->padded_height;
+
+  return pvr_texture_source_hash (source,
+                                  pvr_texture_hash ((const guchar *)settings,
+                                                    sizeof(settings), 0));
+}
+
+/* Sets up source to read the pixels of pixbuf in place, padded out to a
+ * power of 2 in each direction. Returns FALSE if it's not a format we
+ * deal with.
  */
-gboolean
-hd_pvr_texture_save (const gchar  *file,
-                     GdkPixbuf    *pixbuf,
-                     GError      **error)
+static gboolean
+pixbuf_get_source (GdkPixbuf           *pixbuf,
+                   HDPvrTextureFormat   format,
+                   PvrTextureSource    *source)
 {
   guint width, height, bpp;
   guint compress_width, compress_height;
-  guchar *compressed = 0;
-  const guchar *pixels = 0;
-  const guchar *uncompressed = 0;
-  guchar *allocated = 0;
-  guint compressed_size = 0;
-
-  if (!file || !pixbuf)
-    return FALSE;
 
   width           = gdk_pixbuf_get_width (pixbuf);
   height          = gdk_pixbuf_get_height (pixbuf);
   bpp             = gdk_pixbuf_get_bits_per_sample (pixbuf) *
                     gdk_pixbuf_get_n_channels (pixbuf);
-  pixels          = gdk_pixbuf_get_pixels (pixbuf);
-  uncompressed    = pixels;
 
   /* GDK usually only returns 8 bit pixels. this is all we want to deal with */
   if (bpp != 32 && bpp != 24)
     return FALSE;
 
-  /* work out what size width + height we need */
-  compress_width = 4;
+  /* work out what size width + height we need. PVRTC2 blocks are 8 wide */
+  compress_width = format == HD_PVR_TEXTURE_FORMAT_PVRTC2 ? 8 : 4;
   compress_height = 4;
   while (compress_width < width)
     compress_width *= 2;
   while (compress_height < height)
     compress_height *= 2;
 
-  /* If we had to change something, we need to allocate another memory
-   * area and copy the data across */
-  if (bpp == 24 || compress_width!=width || compress_height!=height)
-    {
-      gint x, y;
-      guchar *uc;
-      const guchar *p;
-      uncompressed = uc = allocated = g_malloc(4*compress_width*compress_height);
-      p = pixels;
-      /* Copy, padding the right-hand edge with the last colour value, then the
-       * first. Poor-man's tiling */
-      if (bpp == 24)
-        {
-          /* for 24 bit we have to loop over everything as we need to pad
-           * it all out */
-          for (y=0;y<height;y++)
-            {
-              const guchar *line_start = p;
-              guint mid = (compress_width+width)/2;
-              for (x=0;x<width;x++)
-                {
-                  uc[0] = p[0];
-                  uc[1] = p[1];
-                  uc[2] = p[2];
-                  uc[3] = 255;
-                  uc += 4;
-                  p += 3;
-                }
-              for (x=width;x<mid;x++)
-                {
-                  uc[0] = p[-3];
-                  uc[1] = p[-2];
-                  uc[2] = p[-1];
-                  uc[3] = 255;
-                  uc += 4;
-                }
-              for (x=mid;x<compress_width;x++)
-                {
-                  uc[0] = line_start[0];
-                  uc[1] = line_start[1];
-                  uc[2] = line_start[2];
-                  uc[3] = 255;
-                  uc += 4;
-                }
-            }
-        }
+  /* The padding repeats the right-hand edge, then the left, and the
+   * same for the bottom. Poor-man's tiling */
+  pvr_texture_source_init (source,
+                           gdk_pixbuf_get_pixels (pixbuf),
+                           width, height,
+                           gdk_pixbuf_get_rowstride (pixbuf),
+                           bpp / 8);
+  source->padded_width = compress_width;
+  source->padded_height = compress_height;
+
+  return TRUE;
+}
+
+static guint
+pvr_format_from_format (HDPvrTextureFormat format)
+{
+  switch (format)
+    {
+    case HD_PVR_TEXTURE_FORMAT_PVRTC2:
+      return MGLPT_PVRTC2;
+    case HD_PVR_TEXTURE_FORMAT_ETC1:
+      return ETC_RGB_4BPP;
+    default:
+      return MGLPT_PVRTC4;
+    }
+}
+
+guint64
+_hd_pvr_texture_cache_key (GdkPixbuf          *pixbuf,
+                           HDPvrTextureFormat  format,
+                           gboolean            mipmaps,
+                           guint               version)
+{
+  PvrTextureSource source;
+
+  if (!pixbuf_get_source (pixbuf, format, &source))
+    return 0;
+
+  return texture_cache_key (&source, pvr_format_from_format (format),
+                            mipmaps, version);
+}
+
+typedef struct {
+  GCancellable           *cancellable;
+  PvrTextureProgressFunc  func;
+  gpointer                user_data;
+} SaveProgress;
+
+/* Passes progress on, and stops compressing once we're cancelled */
+static gboolean
+save_progress (guint    done,
+               guint    total,
+               gpointer user_data)
+{
+  SaveProgress *progress = user_data;
+
+  if (g_cancellable_is_cancelled (progress->cancellable))
+    return FALSE;
+
+  return !progress->func ||
+         progress->func (done, total, progress->user_data);
+}
+
+/* Compresses source in pvr_format, with progress (if it's given) being
+ * told how far it has got and able to stop it */
+static guchar *
+compress_source (const PvrTextureSource *source,
+                 guint                   pvr_format,
+                 SaveProgress           *progress,
+                 guint                  *compressed_size)
+{
+  guchar *compressed, *scratch;
+  gsize size, scratch_size;
+  gboolean ok;
+
+  if (!progress)
+    return pvr_texture_compress_source (source, pvr_format, 1, NULL,
+                                        compressed_size);
+
+  if (!pvr_texture_compress_sizes (pvr_format,
+                                   source->padded_width,
+                                   source->padded_height,
+                                   &size, &scratch_size))
+    return 0;
+
+  compressed = g_malloc (size);
+  scratch = g_malloc (scratch_size);
+  ok = pvr_texture_compress_source_into (source, pvr_format, 1, NULL,
+                                         compressed, size,
+                                         scratch, scratch_size,
+                                         save_progress, progress);
+  g_free (scratch);
+  if (!ok)
+    {
+      g_free (compressed);
+      return 0;
+    }
+
+  *compressed_size = size;
+  return compressed;
+}
+
+/* Writes compressed to file, into the batch if there is one and batch is
+ * set, and then adds it to cache (which may be NULL) */
+static gboolean
+write_texture (const gchar      *file,
+               guint             pvr_format,
+               const guchar     *compressed,
+               guint             compressed_size,
+               gint              width,
+               gint              height,
+               guint             mipmap_count,
+               gboolean          mipmaps,
+               gboolean          batch,
+               PvrTextureCache  *cache,
+               guint64           cache_key,
+               GError          **error)
+{
+  SaveBatch *save = batch ? save_batch_join () : NULL;
+  CacheInsert *insert = NULL;
+
+  if (!save)
+    {
+      gboolean ok;
+
+      if (mipmaps)
+        ok = pvr_texture_save_mipmaps_atomically (file, pvr_format,
+                                                  compressed, compressed_size,
+                                                  width, height,
+                                                  mipmap_count,
+                                                  error);
       else
+        ok = pvr_texture_save_atomically (file, pvr_format,
+                                          compressed, compressed_size,
+                                          width, height,
+                                          error);
+      if (!ok)
+        return FALSE;
+
+      /* the cache is only an optimisation, so don't fail if it's full */
+      if (cache)
+        pvr_texture_cache_insert (cache, cache_key, file, NULL);
+
+      return TRUE;
+    }
+
+  if (!pvr_texture_save_group_add (save->group, file, pvr_format,
+                                   compressed, compressed_size,
+                                   width, height,
+                                   mipmaps ? mipmap_count : 0,
+                                   error))
+    {
+      save_batch_leave (save, NULL);
+      return FALSE;
+    }
+
+  /* it can only go in the cache once it's in place */
+  if (cache)
+    {
+      insert = g_slice_new (CacheInsert);
+      insert->cache = pvr_texture_cache_ref (cache);
+      insert->key = cache_key;
+      insert->file = g_strdup (file);
+    }
+  save_batch_leave (save, insert);
+
+  return TRUE;
+}
+
+/* Saves pixbuf to file, as part of the batch if there is one and batch is
+ * set. If cancellable is cancelled part way through, stops and fails with
+ * G_IO_ERROR_CANCELLED. progress may be NULL */
+static gboolean
+save_pixbuf (const gchar             *file,
+             GdkPixbuf               *pixbuf,
+             HDPvrTextureFormat       format,
+             gboolean                 mipmaps,
+             gboolean                 batch,
+             GCancellable            *cancellable,
+             PvrTextureProgressFunc   progress_func,
+             gpointer                 progress_data,
+             GError                 **error)
+{
+  PvrTextureSource source;
+  SaveProgress progress = { cancellable, progress_func, progress_data };
+  SaveProgress *watch = NULL;
+  guchar *compressed = 0;
+  guint compressed_size = 0;
+  guint mipmap_count = 0;
+  guint pvr_format;
+  PvrTextureCache *cache;
+  guint64 cache_key = 0;
+  gboolean ok;
+
+  if (!file || !pixbuf)
+    return FALSE;
+
+  if (!pixbuf_get_source (pixbuf, format, &source))
+    return FALSE;
+
+  pvr_format = pvr_format_from_format (format);
+
+  /* if we've made exactly this texture before, just link to it. In a
+   * batch it has to wait for the batch to end like any other, so it's
+   * copied into the batch instead */
+  cache = texture_cache_get ();
+  if (cache)
+    {
+      cache_key = texture_cache_key (&source, pvr_format, mipmaps,
+                                     HD_PVR_TEXTURE_CACHE_VERSION);
+      if (batch && save_batch_is_active ())
         {
-          /* for 32 bit we just do memcpy's */
-          for (y=0;y<height;y++)
+          PvrTextureMap *map = pvr_texture_cache_lookup (cache, cache_key);
+
+          if (map)
             {
-              const guchar *line_start = p;
-              guint mid = (compress_width+width)/2;
-
-              memcpy(uc, p, width*4);
-              uc += width*4;
-              p += width*4;
-
-              for (x=width;x<mid;x++)
-                {
-                  memcpy(uc, &p[-4], 4);
-                  uc += 4;
-                }
-              for (x=mid;x<compress_width;x++)
-                {
-                  memcpy(uc, line_start, 4);
-                  uc += 4;
-                }
+              const PVR_TEXTURE_HEADER *head;
+              const guchar *data;
+              guint data_size;
+
+              head = pvr_texture_map_get_header (map);
+              data = pvr_texture_map_get_data (map, &data_size);
+              ok = write_texture (file, pvr_format, data, data_size,
+                                  head->dwWidth, head->dwHeight,
+                                  head->dwMipMapCount, mipmaps, TRUE,
+                                  NULL, 0, error);
+              pvr_texture_map_free (map);
+              pvr_texture_cache_unref (cache);
+              return ok;
             }
         }
-      /* Now pad the last few lines by copying the last line
-       * over and over */
-      guint mid = (compress_height+height)/2;
-      for (y=height;y<mid;y++)
-        {
-          memcpy(&allocated[compress_width*4*y],
-                 &allocated[compress_width*4*(height-1)],
-                 compress_width*4);
-        }
-      for (y=mid;y<compress_height;y++)
+      else if (pvr_texture_cache_link (cache, cache_key, file, NULL))
         {
-          memcpy(&allocated[compress_width*4*y],
-                 &allocated[0],
-                 compress_width*4);
+          pvr_texture_cache_unref (cache);
+          return TRUE;
         }
     }
 
-  /* now, compress the data */
-  compressed = pvr_texture_compress_pvrtc4(
-                        uncompressed, compress_width, compress_height,
-                        &compressed_size);
+  /* now, compress the data, straight out of the pixbuf */
+  if (cancellable || progress_func)
+    watch = &progress;
+  if (mipmaps)
+    compressed = pvr_texture_compress_mipmaps_source(
+                          &source, pvr_format, 0, NULL,
+                          watch ? save_progress : NULL, watch,
+                          &mipmap_count, &compressed_size);
+  else
+    compressed = compress_source (&source, pvr_format, watch,
+                                  &compressed_size);
 
-  /* free data if we created it above */
-  if (allocated)
-    g_free(allocated);
+  /* there's no point writing it if we've been cancelled meanwhile */
+  if (compressed && g_cancellable_is_cancelled (cancellable))
+    {
+      g_free (compressed);
+      compressed = 0;
+    }
 
+  if (!compressed)
+    {
+      if (!g_cancellable_set_error_if_cancelled (cancellable, error))
+        g_set_error (error,
+                     GDK_PIXBUF_ERROR,
+                     GDK_PIXBUF_ERROR_FAILED,
+                     "Could not compress to pvr texture.");
+      if (cache)
+        pvr_texture_cache_unref (cache);
+      return FALSE;
+    }
+
+  /* and finally write it out to a file! */
+  ok = write_texture (file, pvr_format,
+                      compressed, compressed_size,
+                      source.padded_width, source.padded_height,
+                      mipmap_count, mipmaps, batch,
+                      cache, cache_key,
+                      error);
+
+  if (cache)
+    pvr_texture_cache_unref (cache);
+  g_free (compressed);
+  return ok;
+}
+
+/* Save the given pixbuf as a PVRTC4 texture. PVRTC4 textures must be 2^n
+ * in width and height, so any texture not of these dimensions will be
+ * padded with black (zero alpha if alpha is used).
+ */
+gboolean
+hd_pvr_texture_save (const gchar  *file,
+                     GdkPixbuf    *pixbuf,
+                     GError      **error)
+{
+  return hd_pvr_texture_save_with_format (file, pixbuf,
+                                          HD_PVR_TEXTURE_FORMAT_PVRTC4,
+                                          error);
+}
+
+/* As hd_pvr_texture_save(), but lets the caller pick PVRTC2 where the
+ * loss of quality doesn't matter, to halve the size of the texture, or
+ * ETC1 for textures that are opaque anyway.
+ */
+gboolean
+hd_pvr_texture_save_with_format (const gchar         *file,
+                                 GdkPixbuf           *pixbuf,
+                                 HDPvrTextureFormat   format,
+                                 GError             **error)
+{
+  return save_pixbuf (file, pixbuf, format, FALSE, TRUE,
+                      NULL, NULL, NULL, error);
+}
+
+/* As hd_pvr_texture_save_with_format(), but also stores every mipmap
+ * level down to 1x1, for textures that are drawn scaled down (such as
+ * backgrounds in the task switcher). The file is a third bigger.
+ */
+gboolean
+hd_pvr_texture_save_with_mipmaps (const gchar         *file,
+                                  GdkPixbuf           *pixbuf,
+                                  HDPvrTextureFormat   format,
+                                  GError             **error)
+{
+  return save_pixbuf (file, pixbuf, format, TRUE, TRUE,
+                      NULL, NULL, NULL, error);
+}
+
+/* Saving in the background. Textures are compressed one per thread on a
+ * pool shared by everyone, with as many threads as there are CPUs, so
+ * that a burst of saves can't swamp the device */
+
+typedef struct {
+  gchar                 *file;
+  GdkPixbuf             *pixbuf;
+  HDPvrTextureFormat     format;
+  gboolean               mipmaps;
+  GFileProgressCallback  progress_callback;
+  gpointer               progress_data;
+  volatile gint          done;
+  volatile gint          total;
+  volatile gint          progress_pending;
+} SaveAsyncData;
+
+static void
+save_async_data_free (gpointer data)
+{
+  SaveAsyncData *save = data;
+
+  g_free (save->file);
+  g_object_unref (save->pixbuf);
+  g_slice_free (SaveAsyncData, save);
+}
+
+/* Runs in the caller's main context */
+static gboolean
+save_async_report_progress (gpointer data)
+{
+  GTask *task = data;
+  SaveAsyncData *save = g_task_get_task_data (task);
+
+  g_atomic_int_set (&save->progress_pending, 0);
+  save->progress_callback (g_atomic_int_get (&save->done),
+                           g_atomic_int_get (&save->total),
+                           save->progress_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Runs on a worker thread. Progress is passed on to the caller's main
+ * context, at most one report at a time so we don't flood it */
+static gboolean
+save_async_progress (guint    done,
+                     guint    total,
+                     gpointer data)
+{
+  GTask *task = data;
+  SaveAsyncData *save = g_task_get_task_data (task);
+
+  g_atomic_int_set (&save->done, done);
+  g_atomic_int_set (&save->total, total);
+
+  if (save->progress_callback &&
+      g_atomic_int_compare_and_exchange (&save->progress_pending, 0, 1))
+    {
+      GSource *source = g_idle_source_new ();
+
+      g_source_set_priority (source, G_PRIORITY_DEFAULT);
+      g_source_set_callback (source, save_async_report_progress,
+                             g_object_ref (task), g_object_unref);
+      g_source_attach (source, g_task_get_context (task));
+      g_source_unref (source);
+    }
+
+  return TRUE;
+}
+
+static void
+save_async_thread (gpointer data,
+                   gpointer user_data)
+{
+  GTask *task = data;
+  SaveAsyncData *save = g_task_get_task_data (task);
+  GError *error = NULL;
+
+  /* it may have been cancelled while it was queued */
+  if (g_task_return_error_if_cancelled (task))
+    {
+      g_object_unref (task);
+      return;
+    }
+
+  if (save_pixbuf (save->file, save->pixbuf,
+                   save->format, save->mipmaps, TRUE,
+                   g_task_get_cancellable (task),
+                   save_async_progress, task,
+                   &error))
+    g_task_return_boolean (task, TRUE);
+  else if (error)
+    g_task_return_error (task, error);
+  else
+    g_task_return_new_error (task,
+                             GDK_PIXBUF_ERROR,
+                             GDK_PIXBUF_ERROR_UNSUPPORTED_OPERATION,
+                             "Could not save %s as a pvr texture.",
+                             save->file);
+
+  g_object_unref (task);
+}
+
+static GThreadPool *
+save_pool_get (void)
+{
+  static gsize pool = 0;
+
+  if (g_once_init_enter (&pool))
+    g_once_init_leave (&pool,
+                       (gsize) g_thread_pool_new (save_async_thread, NULL,
+                                                  g_get_num_processors (),
+                                                  FALSE, NULL));
+
+  return (GThreadPool *) pool;
+}
+
+/**
+ * hd_pvr_texture_save_async:
+ * @file: where to save the texture
+ * @pixbuf: the image, which mustn't be changed until the save is done
+ * @format: the compressed format to use
+ * @mipmaps: whether to store mipmap levels too
+ * @cancellable: (allow-none): a #GCancellable, or %NULL
+ * @progress_callback: (allow-none): called in the thread-default main
+ *   context of the caller with the rows of blocks done so far and in
+ *   total, or %NULL
+ * @progress_data: data for @progress_callback
+ * @callback: called when the texture has been saved
+ * @user_data: data for @callback
+ *
+ * Saves @pixbuf as hd_pvr_texture_save_with_format() (or
+ * hd_pvr_texture_save_with_mipmaps()) would, but on a worker thread, so
+ * that the main loop keeps running. Cancelling @cancellable stops the
+ * compression at the end of the row of blocks it is on and leaves @file
+ * as it was. Call hd_pvr_texture_save_finish() from @callback to get
+ * the result.
+ */
+void
+hd_pvr_texture_save_async (const gchar            *file,
+                           GdkPixbuf              *pixbuf,
+                           HDPvrTextureFormat      format,
+                           gboolean                mipmaps,
+                           GCancellable           *cancellable,
+                           GFileProgressCallback   progress_callback,
+                           gpointer                progress_data,
+                           GAsyncReadyCallback     callback,
+                           gpointer                user_data)
+{
+  SaveAsyncData *save;
+  GTask *task;
+
+  g_return_if_fail (file != NULL);
+  g_return_if_fail (GDK_IS_PIXBUF (pixbuf));
+
+  save = g_slice_new0 (SaveAsyncData);
+  save->file = g_strdup (file);
+  save->pixbuf = g_object_ref (pixbuf);
+  save->format = format;
+  save->mipmaps = mipmaps;
+  save->progress_callback = progress_callback;
+  save->progress_data = progress_data;
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, hd_pvr_texture_save_async);
+  g_task_set_task_data (task, save, save_async_data_free);
+
+  /* the thread has the reference now */
+  g_thread_pool_push (save_pool_get (), task, NULL);
+}
+
+/**
+ * hd_pvr_texture_save_finish:
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for an error, or %NULL
+ *
+ * Finishes hd_pvr_texture_save_async(). If it was cancelled, fails
+ * with %G_IO_ERROR_CANCELLED.
+ *
+ * Returns: %TRUE if the texture was saved
+ */
+gboolean
+hd_pvr_texture_save_finish (GAsyncResult  *result,
+                            GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/* Adds the span start..end (clipped to size, the size of the pixbuf) to
+ * spans, along with the parts of the padding out to padded that are
+ * copied from it. Returns the number of spans */
+static guint
+damage_spans (gint  start,
+              gint  end,
+              gint  size,
+              gint  padded,
+              gint  spans[3][2])
+{
+  gint mid = (padded + size)/2;
+  guint n = 0;
+
+  start = MAX(start, 0);
+  end = MIN(end, size);
+  if (start >= end)
+    return 0;
+
+  spans[n][0] = start;
+  spans[n][1] = end;
+  n++;
+  /* the padding repeats the last line, then the first */
+  if (end == size && mid > size)
+    {
+      spans[n][0] = size;
+      spans[n][1] = mid;
+      n++;
+    }
+  if (start == 0 && padded > mid)
+    {
+      spans[n][0] = mid;
+      spans[n][1] = padded;
+      n++;
+    }
+
+  return n;
+}
+
+/* Updates a PVRTC4 texture previously saved from pixbuf with
+ * hd_pvr_texture_save() after the given rectangle of the pixbuf has
+ * changed. Only the blocks around the rectangle are compressed again, so
+ * this is much quicker than saving the whole texture for small changes.
+ * If file isn't a texture of the right size, it is saved from scratch.
+ * This always writes file straight away, even during a batch, as it has
+ * to read what is there.
+ */
+gboolean
+hd_pvr_texture_update (const gchar  *file,
+                       GdkPixbuf    *pixbuf,
+                       gint          x,
+                       gint          y,
+                       gint          width,
+                       gint          height,
+                       GError      **error)
+{
+  PvrTextureSource source;
+  guchar *compressed;
+  guint compressed_size;
+  PvrTextureMap *map;
+  const PVR_TEXTURE_HEADER *head;
+  gint spans_x[3][2], spans_y[3][2];
+  guint n_x, n_y, i, j;
+  gboolean ok;
+
+  if (!file || !pixbuf)
+    return FALSE;
+
+  map = pvr_texture_map_new (file, NULL);
+  if (!map)
+    return save_pixbuf (file, pixbuf, HD_PVR_TEXTURE_FORMAT_PVRTC4,
+                        FALSE, FALSE, NULL, NULL, NULL, error);
+
+  if (!pixbuf_get_source (pixbuf, HD_PVR_TEXTURE_FORMAT_PVRTC4, &source))
+    {
+      pvr_texture_map_free (map);
+      return FALSE;
+    }
+
+  /* it has to be what hd_pvr_texture_save() would have written */
+  head = pvr_texture_map_get_header (map);
+  compressed_size = source.padded_width*source.padded_height/2;
+  if (head->dwpfFlags != (MGLPT_PVRTC4 | PVR_FLAG_TWIDDLED | PVR_FLAG_ALPHA) ||
+      head->dwWidth != (guint)source.padded_width ||
+      head->dwHeight != (guint)source.padded_height ||
+      head->dwDataSize != compressed_size)
+    {
+      pvr_texture_map_free (map);
+      return save_pixbuf (file, pixbuf, HD_PVR_TEXTURE_FORMAT_PVRTC4,
+                          FALSE, FALSE, NULL, NULL, NULL, error);
+    }
+
+  compressed = g_malloc (compressed_size);
+  memcpy (compressed, pvr_texture_map_get_data (map, NULL), compressed_size);
+  pvr_texture_map_free (map);
+
+  n_x = damage_spans (x, x + width,
+                      source.width, source.padded_width, spans_x);
+  n_y = damage_spans (y, y + height,
+                      source.height, source.padded_height, spans_y);
+  for (j=0;j<n_y;j++)
+    for (i=0;i<n_x;i++)
+      pvr_texture_recompress_pvrtc4_region (&source, NULL,
+                                            compressed, compressed_size,
+                                            spans_x[i][0],
+                                            spans_y[j][0],
+                                            spans_x[i][1] - spans_x[i][0],
+                                            spans_y[j][1] - spans_y[j][0]);
+
+  ok = pvr_texture_save_atomically (file, MGLPT_PVRTC4,
+                                    compressed, compressed_size,
+                                    source.padded_width, source.padded_height,
+                                    error);
+  g_free (compressed);
+
+  return ok;
+}
+
+/* Bump this whenever the backgrounds made for the same image change */
+#define HD_PVR_TEXTURE_BACKGROUND_VERSION 1
+
+/* Saves pixbuf scaled and cropped to fill a view_width x view_height
+ * view, as part of the batch if there is one and batch is set */
+static gboolean
+save_view (const gchar  *file,
+           GdkPixbuf    *pixbuf,
+           gint          view_width,
+           gint          view_height,
+           gboolean      batch,
+           GError      **error)
+{
+  PvrTextureSource source;
+  guchar *compressed;
+  guint compressed_size;
+  gint padded_width, padded_height;
+  gboolean ok;
+
+  if (!file || !pixbuf)
+    return FALSE;
+
+  if (!pixbuf_get_source (pixbuf, HD_PVR_TEXTURE_FORMAT_PVRTC4, &source))
+    return FALSE;
+
+  compressed = pvr_texture_compress_view (&source, view_width, view_height,
+                                          0, NULL,
+                                          &padded_width, &padded_height,
+                                          &compressed_size);
   if (!compressed)
     {
       g_set_error (error,
@@ -174,18 +833,574 @@ hd_pvr_texture_save (const gchar  *file,
       return FALSE;
     }
 
-  /* and finally write it out to a file! */
-  if (!pvr_texture_save_pvrtc4_atomically (file,
-                                           compressed,
-                                           compressed_size,
-                                           compress_width,
-                                           compress_height,
-                                           error))
+  ok = write_texture (file, MGLPT_PVRTC4,
+                      compressed, compressed_size,
+                      padded_width, padded_height,
+                      0, FALSE, batch,
+                      NULL, 0,
+                      error);
+  g_free (compressed);
+
+  return ok;
+}
+
+/* Saves pixbuf as a PVRTC4 texture to fill a view_width x view_height
+ * view, such as the desktop: it is scaled to just cover the view,
+ * keeping its shape, and the rest cropped off both sides equally. That
+ * is all done a few rows at a time as it is compressed, so it needs
+ * little memory besides the pixbuf, however big that is. The texture is
+ * padded out to powers of 2 as hd_pvr_texture_save() does, with the view
+ * in the top left.
+ */
+gboolean
+hd_pvr_texture_save_view (const gchar  *file,
+                          GdkPixbuf    *pixbuf,
+                          gint          view_width,
+                          gint          view_height,
+                          GError      **error)
+{
+  return save_view (file, pixbuf, view_width, view_height, TRUE, error);
+}
+
+/* Removes the textures in dir made from other versions of the image
+ * whose textures are named after key, besides keep */
+static void
+remove_old_backgrounds (const gchar *dir,
+                        guint64      key,
+                        const gchar *keep)
+{
+  GDir *d;
+  const gchar *name;
+  gchar *prefix;
+
+  d = g_dir_open (dir, 0, NULL);
+  if (!d)
+    return;
+
+  prefix = g_strdup_printf ("%016" G_GINT64_MODIFIER "x", key);
+  while ((name = g_dir_read_name (d)))
+    if (g_str_has_prefix (name, prefix) &&
+        g_str_has_suffix (name, ".pvr") &&
+        strcmp (name, keep))
+      {
+        gchar *old = g_build_filename (dir, name, NULL);
+
+        g_unlink (old);
+        g_free (old);
+      }
+  g_free (prefix);
+  g_dir_close (d);
+}
+
+/* Returns the name of a texture made from the image in the file image
+ * with hd_pvr_texture_save_view(), to fill a view_width x view_height
+ * view. They are kept under the backgrounds directory, in a directory
+ * for each view size, and only made again once the image has changed.
+ * Free the name with g_free(). This is never part of a batch, as the
+ * texture has to be there when it returns.
+ */
+gchar *
+hd_pvr_texture_get_background (const gchar  *image,
+                               gint          view_width,
+                               gint          view_height,
+                               GError      **error)
+{
+  GStatBuf image_stat;
+  gchar *path, *dir, *name, *texture;
+  GdkPixbuf *pixbuf, *oriented;
+  guint64 key, file_id[4], version;
+
+  if (!image || view_width <= 0 || view_height <= 0)
+    return NULL;
+
+  if (g_stat (image, &image_stat) == -1)
     {
-      g_free (compressed);
+      g_set_error (error,
+                   G_FILE_ERROR,
+                   g_file_error_from_errno (errno),
+                   "Could not find %s",
+                   image);
+      return NULL;
+    }
+
+  /* one for each image, whatever it's called */
+  if (g_path_is_absolute (image))
+    path = g_strdup (image);
+  else
+    {
+      gchar *cwd = g_get_current_dir ();
+
+      path = g_build_filename (cwd, image, NULL);
+      g_free (cwd);
+    }
+  key = pvr_texture_hash ((const guchar*)path, strlen (path),
+                          HD_PVR_TEXTURE_BACKGROUND_VERSION);
+  g_free (path);
+
+  /* and for each version of it. An image that was replaced is a new
+   * file, and one written over in place has a new size or mtime, though
+   * not necessarily a later one */
+  file_id[0] = image_stat.st_dev;
+  file_id[1] = image_stat.st_ino;
+  file_id[2] = image_stat.st_size;
+  file_id[3] = image_stat.st_mtime;
+  version = pvr_texture_hash ((const guchar*)file_id, sizeof(file_id), key);
+
+  path = g_strdup_printf ("%dx%d", view_width, view_height);
+  dir = g_build_filename (HD_DESKTOP_BACKGROUNDS_PATH, path, NULL);
+  g_free (path);
+  name = g_strdup_printf ("%016" G_GINT64_MODIFIER "x-"
+                          "%016" G_GINT64_MODIFIER "x.pvr", key, version);
+  texture = g_build_filename (dir, name, NULL);
+
+  if (g_file_test (texture, G_FILE_TEST_IS_REGULAR))
+    {
+      g_free (name);
+      g_free (dir);
+      return texture;
+    }
+
+  pixbuf = gdk_pixbuf_new_from_file (image, error);
+  if (!pixbuf)
+    {
+      g_free (name);
+      g_free (dir);
+      g_free (texture);
+      return NULL;
+    }
+  /* photos are often stored on their side */
+  oriented = gdk_pixbuf_apply_embedded_orientation (pixbuf);
+  g_object_unref (pixbuf);
+
+  if (g_mkdir_with_parents (dir, 0755) == -1)
+    {
+      g_set_error (error,
+                   G_FILE_ERROR,
+                   g_file_error_from_errno (errno),
+                   "Could not create %s",
+                   dir);
+      g_object_unref (oriented);
+      g_free (name);
+      g_free (dir);
+      g_free (texture);
+      return NULL;
+    }
+
+  if (!save_view (texture, oriented, view_width, view_height, FALSE, error))
+    {
+      g_object_unref (oriented);
+      g_free (name);
+      g_free (dir);
+      g_free (texture);
+      return NULL;
+    }
+  g_object_unref (oriented);
+
+  /* the textures of what the image used to be won't be wanted again */
+  remove_old_backgrounds (dir, key, name);
+  g_free (name);
+  g_free (dir);
+
+  return texture;
+}
+
+/* Keeps a copy of every texture saved from now on in directory, indexed
+ * by a hash of its contents, so saving an identical pixbuf again (on a
+ * theme switch, say) just links to the copy instead of compressing it.
+ * The cache is kept to around max_size bytes by removing the least
+ * recently used textures. Pass a NULL directory to stop using the cache.
+ */
+gboolean
+hd_pvr_texture_set_cache (const gchar  *directory,
+                          guint64       max_size,
+                          GError      **error)
+{
+  PvrTextureCache *cache = NULL, *old;
+
+  if (directory)
+    {
+      cache = pvr_texture_cache_new (directory, max_size, error);
+      if (!cache)
+        return FALSE;
+    }
+
+  G_LOCK (texture_cache);
+  old = texture_cache;
+  texture_cache = cache;
+  G_UNLOCK (texture_cache);
+
+  if (old)
+    pvr_texture_cache_unref (old);
+
+  return TRUE;
+}
+
+/* Starts a batch: until hd_pvr_texture_end_batch(), textures saved with
+ * hd_pvr_texture_save() and friends (from any thread) are written without
+ * waiting for each one to reach the disk, and whatever was in their place
+ * stays there until the batch ends. This is much quicker for saving a lot
+ * of textures at once, as a theme switch does.
+ */
+void
+hd_pvr_texture_begin_batch (void)
+{
+  G_LOCK (save_batch);
+  if (!save_batch)
+    {
+      save_batch = g_slice_new0 (SaveBatch);
+      save_batch->group = pvr_texture_save_group_new ();
+    }
+  G_UNLOCK (save_batch);
+}
+
+/* Ends the batch started with hd_pvr_texture_begin_batch(): waits for any
+ * textures still being written into it, then for all of them to reach
+ * the disk, and then puts them in place. Saves that are still being
+ * compressed are written straight to their files once they're done.
+ * Fails if any of them couldn't be put in place, in which case some (or,
+ * if the disk couldn't be synced, none) of them are.
+ */
+gboolean
+hd_pvr_texture_end_batch (GError **error)
+{
+  SaveBatch *batch;
+  GSList *l;
+  gboolean ok;
+
+  G_LOCK (save_batch);
+  batch = save_batch;
+  save_batch = NULL;
+  while (batch && batch->n_writers)
+    g_cond_wait (&save_batch_drained, &G_LOCK_NAME (save_batch));
+  G_UNLOCK (save_batch);
+
+  if (!batch)
+    return TRUE;
+
+  ok = pvr_texture_save_group_commit (batch->group, error);
+  pvr_texture_save_group_free (batch->group);
+
+  for (l=batch->cache_inserts;l;l=l->next)
+    {
+      CacheInsert *insert = l->data;
+
+      /* anything that didn't make it just won't be found */
+      if (ok)
+        pvr_texture_cache_insert (insert->cache, insert->key, insert->file,
+                                  NULL);
+      pvr_texture_cache_unref (insert->cache);
+      g_free (insert->file);
+      g_slice_free (CacheInsert, insert);
+    }
+  g_slist_free (batch->cache_inserts);
+  g_slice_free (SaveBatch, batch);
+
+  return ok;
+}
+
+/* The biggest texture SGX can use */
+#define HD_PVR_TEXTURE_ATLAS_MAX_SIZE 2048
+
+typedef struct {
+  gchar                 *name;
+  GdkPixbuf             *pixbuf; /* NULL if the atlas was loaded */
+  HDPvrTextureAtlasItem  item;
+} AtlasEntry;
+
+struct _HDPvrTextureAtlas {
+  GPtrArray  *entries;  /* of AtlasEntry, in the order they were added */
+  GHashTable *by_name;  /* of the same, by name */
+};
+
+static void
+atlas_entry_free (gpointer data)
+{
+  AtlasEntry *entry = data;
+
+  g_free (entry->name);
+  if (entry->pixbuf)
+    g_object_unref (entry->pixbuf);
+  g_slice_free (AtlasEntry, entry);
+}
+
+static AtlasEntry *
+atlas_entry_add (HDPvrTextureAtlas *atlas,
+                 const gchar       *name)
+{
+  AtlasEntry *entry = g_hash_table_lookup (atlas->by_name, name);
+
+  if (entry)
+    return entry;
+
+  entry = g_slice_new0 (AtlasEntry);
+  entry->name = g_strdup (name);
+  g_ptr_array_add (atlas->entries, entry);
+  g_hash_table_insert (atlas->by_name, entry->name, entry);
+
+  return entry;
+}
+
+/* Sets the texture coordinates of item from where it is in a texture
+ * that's width x height */
+static void
+atlas_item_set_coords (HDPvrTextureAtlasItem *item,
+                       gint                   width,
+                       gint                   height)
+{
+  item->u1 = (gfloat) item->x / width;
+  item->v1 = (gfloat) item->y / height;
+  item->u2 = (gfloat) (item->x + item->width) / width;
+  item->v2 = (gfloat) (item->y + item->height) / height;
+}
+
+/* Where the items of the atlas saved as file are listed */
+static gchar *
+atlas_table_name (const gchar *file)
+{
+  return g_strconcat (file, ".atlas", NULL);
+}
+
+/* Creates an empty atlas, for images to be added to with
+ * hd_pvr_texture_atlas_add() and then saved with
+ * hd_pvr_texture_atlas_save(). Free it with hd_pvr_texture_atlas_free().
+ */
+HDPvrTextureAtlas *
+hd_pvr_texture_atlas_new (void)
+{
+  HDPvrTextureAtlas *atlas = g_slice_new (HDPvrTextureAtlas);
+
+  atlas->entries = g_ptr_array_new_with_free_func (atlas_entry_free);
+  atlas->by_name = g_hash_table_new (g_str_hash, g_str_equal);
+
+  return atlas;
+}
+
+/* Adds pixbuf to atlas, to be looked up by name (which mustn't have a
+ * newline in it) once the atlas is saved. Adding another pixbuf with
+ * the same name replaces it.
+ */
+void
+hd_pvr_texture_atlas_add (HDPvrTextureAtlas *atlas,
+                          const gchar       *name,
+                          GdkPixbuf         *pixbuf)
+{
+  AtlasEntry *entry;
+
+  g_return_if_fail (atlas != NULL);
+  g_return_if_fail (name != NULL && !strchr (name, '\n'));
+  g_return_if_fail (GDK_IS_PIXBUF (pixbuf));
+
+  entry = atlas_entry_add (atlas, name);
+  g_object_ref (pixbuf);
+  if (entry->pixbuf)
+    g_object_unref (entry->pixbuf);
+  entry->pixbuf = pixbuf;
+}
+
+/* Packs all the images added to atlas into one texture in format, as
+ * tightly as their gutters allow (see pvr_texture_compress_atlas()), and
+ * saves it as file. Where each of them went is saved alongside it, in
+ * file with ".atlas" on the end, for hd_pvr_texture_atlas_load(), and
+ * can also be looked up in atlas from now on. This is never part of a
+ * batch, as the texture has to be in place before the list of what is
+ * where in it.
+ */
+gboolean
+hd_pvr_texture_atlas_save (HDPvrTextureAtlas   *atlas,
+                           const gchar         *file,
+                           HDPvrTextureFormat   format,
+                           GError             **error)
+{
+  PvrTextureSource *items;
+  PvrTextureAtlasRect *rects;
+  GString *table;
+  guchar *compressed;
+  guint compressed_size, pvr_format, i;
+  gint width, height;
+  gchar *table_file;
+  gboolean ok;
+
+  g_return_val_if_fail (atlas != NULL, FALSE);
+  g_return_val_if_fail (file != NULL, FALSE);
+
+  if (!atlas->entries->len)
+    {
+      g_set_error (error,
+                   GDK_PIXBUF_ERROR,
+                   GDK_PIXBUF_ERROR_FAILED,
+                   "There are no images in the atlas.");
       return FALSE;
     }
 
+  items = g_new (PvrTextureSource, atlas->entries->len);
+  for (i=0;i<atlas->entries->len;i++)
+    {
+      AtlasEntry *entry = g_ptr_array_index (atlas->entries, i);
+
+      if (!entry->pixbuf ||
+          !pixbuf_get_source (entry->pixbuf, format, &items[i]))
+        {
+          g_set_error (error,
+                       GDK_PIXBUF_ERROR,
+                       GDK_PIXBUF_ERROR_UNKNOWN_TYPE,
+                       "Could not use %s in an atlas.",
+                       entry->name);
+          g_free (items);
+          return FALSE;
+        }
+    }
+
+  pvr_format = pvr_format_from_format (format);
+  rects = g_new (PvrTextureAtlasRect, atlas->entries->len);
+  compressed = pvr_texture_compress_atlas (items, atlas->entries->len,
+                                           pvr_format,
+                                           HD_PVR_TEXTURE_ATLAS_MAX_SIZE,
+                                           0, NULL, rects,
+                                           &width, &height,
+                                           &compressed_size);
+  g_free (items);
+  if (!compressed)
+    {
+      g_set_error (error,
+                   GDK_PIXBUF_ERROR,
+                   GDK_PIXBUF_ERROR_FAILED,
+                   "Could not fit the images in a %dx%d texture.",
+                   HD_PVR_TEXTURE_ATLAS_MAX_SIZE,
+                   HD_PVR_TEXTURE_ATLAS_MAX_SIZE);
+      g_free (rects);
+      return FALSE;
+    }
+
+  /* a line of "x<TAB>y<TAB>width<TAB>height<TAB>name" for each */
+  table = g_string_new (NULL);
+  for (i=0;i<atlas->entries->len;i++)
+    {
+      AtlasEntry *entry = g_ptr_array_index (atlas->entries, i);
+
+      entry->item.x = rects[i].x;
+      entry->item.y = rects[i].y;
+      entry->item.width = rects[i].width;
+      entry->item.height = rects[i].height;
+      atlas_item_set_coords (&entry->item, width, height);
+      g_string_append_printf (table, "%d\t%d\t%d\t%d\t%s\n",
+                              entry->item.x, entry->item.y,
+                              entry->item.width, entry->item.height,
+                              entry->name);
+    }
+  g_free (rects);
+
+  ok = write_texture (file, pvr_format,
+                      compressed, compressed_size,
+                      width, height,
+                      0, FALSE, FALSE,
+                      NULL, 0,
+                      error);
   g_free (compressed);
+
+  table_file = atlas_table_name (file);
+  ok = ok && g_file_set_contents (table_file, table->str, table->len, error);
+  g_free (table_file);
+  g_string_free (table, TRUE);
+
+  return ok;
+}
+
+/* Loads the list of what is where in the atlas texture file, saved by
+ * hd_pvr_texture_atlas_save(), for looking up with
+ * hd_pvr_texture_atlas_lookup(). Only the texture's header is read, to
+ * check that the list goes with it; the texture itself is left for the
+ * caller to load.
+ */
+HDPvrTextureAtlas *
+hd_pvr_texture_atlas_load (const gchar  *file,
+                           GError      **error)
+{
+  HDPvrTextureAtlas *atlas;
+  PVR_TEXTURE_HEADER header;
+  gchar *table_file, *contents, **lines;
+  guint i;
+
+  g_return_val_if_fail (file != NULL, NULL);
+
+  if (!pvr_texture_probe (file, &header, error))
+    return NULL;
+
+  table_file = atlas_table_name (file);
+  if (!g_file_get_contents (table_file, &contents, NULL, error))
+    {
+      g_free (table_file);
+      return NULL;
+    }
+
+  atlas = hd_pvr_texture_atlas_new ();
+  lines = g_strsplit (contents, "\n", -1);
+  g_free (contents);
+  for (i=0;lines[i];i++)
+    {
+      HDPvrTextureAtlasItem item;
+      AtlasEntry *entry;
+      gint name = 0;
+
+      if (!*lines[i])
+        continue;
+
+      if (sscanf (lines[i], "%d\t%d\t%d\t%d\t%n",
+                  &item.x, &item.y, &item.width, &item.height, &name) < 4 ||
+          !name || !lines[i][name] ||
+          item.x < 0 || item.y < 0 || item.width <= 0 || item.height <= 0 ||
+          item.width > (gint) header.dwWidth - item.x ||
+          item.height > (gint) header.dwHeight - item.y)
+        {
+          g_set_error (error,
+                       G_FILE_ERROR,
+                       G_FILE_ERROR_INVAL,
+                       "%s does not match %s",
+                       table_file, file);
+          g_strfreev (lines);
+          g_free (table_file);
+          hd_pvr_texture_atlas_free (atlas);
+          return NULL;
+        }
+
+      atlas_item_set_coords (&item, header.dwWidth, header.dwHeight);
+      entry = atlas_entry_add (atlas, lines[i] + name);
+      entry->item = item;
+    }
+  g_strfreev (lines);
+  g_free (table_file);
+
+  return atlas;
+}
+
+/* Gets where the image called name is in atlas, once the atlas has been
+ * saved or loaded. Returns FALSE if there isn't one.
+ */
+gboolean
+hd_pvr_texture_atlas_lookup (HDPvrTextureAtlas     *atlas,
+                             const gchar           *name,
+                             HDPvrTextureAtlasItem *item)
+{
+  AtlasEntry *entry;
+
+  g_return_val_if_fail (atlas != NULL, FALSE);
+  g_return_val_if_fail (name != NULL, FALSE);
+
+  entry = g_hash_table_lookup (atlas->by_name, name);
+  if (!entry || entry->item.width <= 0)
+    return FALSE;
+
+  if (item)
+    *item = entry->item;
   return TRUE;
 }
+
+void
+hd_pvr_texture_atlas_free (HDPvrTextureAtlas *atlas)
+{
+  if (!atlas)
+    return;
+
+  g_hash_table_destroy (atlas->by_name);
+  g_ptr_array_free (atlas->entries, TRUE);
+  g_slice_free (HDPvrTextureAtlas, atlas);
+}
@@ -23,13 +23,124 @@
 #define __HD_PVR_TEXTURE_H__
 
 #include <glib.h>
+#include <gio/gio.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 
 G_BEGIN_DECLS
 
-gboolean hd_pvr_texture_save (const gchar  *file,
-                              GdkPixbuf    *pixbuf,
-                              GError      **error);
+/**
+ * HDPvrTextureFormat:
+ * @HD_PVR_TEXTURE_FORMAT_PVRTC4: 4 bits per pixel
+ * @HD_PVR_TEXTURE_FORMAT_PVRTC2: 2 bits per pixel, for large textures
+ *   without much detail
+ * @HD_PVR_TEXTURE_FORMAT_ETC1: 4 bits per pixel, without alpha, for
+ *   opaque textures such as backgrounds
+ *
+ * The compressed formats hd_pvr_texture_save_with_format() can write.
+ */
+typedef enum
+{
+  HD_PVR_TEXTURE_FORMAT_PVRTC4,
+  HD_PVR_TEXTURE_FORMAT_PVRTC2,
+  HD_PVR_TEXTURE_FORMAT_ETC1
+} HDPvrTextureFormat;
+
+/**
+ * HDPvrTextureAtlas:
+ *
+ * Lots of small images (icons, say) packed into one texture, so they
+ * can be drawn with one texture bound instead of a texture each.
+ */
+typedef struct _HDPvrTextureAtlas HDPvrTextureAtlas;
+
+/**
+ * HDPvrTextureAtlasItem:
+ * @x: left of the image in the atlas texture, in pixels
+ * @y: top of the image in the atlas texture, in pixels
+ * @width: width of the image
+ * @height: height of the image
+ * @u1: left of the image, as a texture coordinate
+ * @v1: top of the image, as a texture coordinate
+ * @u2: right of the image, as a texture coordinate
+ * @v2: bottom of the image, as a texture coordinate
+ *
+ * Where an image is in an atlas.
+ */
+typedef struct
+{
+  gint   x;
+  gint   y;
+  gint   width;
+  gint   height;
+  gfloat u1;
+  gfloat v1;
+  gfloat u2;
+  gfloat v2;
+} HDPvrTextureAtlasItem;
+
+gboolean hd_pvr_texture_save             (const gchar         *file,
+                                          GdkPixbuf           *pixbuf,
+                                          GError             **error);
+gboolean hd_pvr_texture_save_with_format (const gchar         *file,
+                                          GdkPixbuf           *pixbuf,
+                                          HDPvrTextureFormat   format,
+                                          GError             **error);
+gboolean hd_pvr_texture_save_with_mipmaps (const gchar         *file,
+                                           GdkPixbuf           *pixbuf,
+                                           HDPvrTextureFormat   format,
+                                           GError             **error);
+
+void     hd_pvr_texture_save_async       (const gchar            *file,
+                                          GdkPixbuf              *pixbuf,
+                                          HDPvrTextureFormat      format,
+                                          gboolean                mipmaps,
+                                          GCancellable           *cancellable,
+                                          GFileProgressCallback   progress_callback,
+                                          gpointer                progress_data,
+                                          GAsyncReadyCallback     callback,
+                                          gpointer                user_data);
+gboolean hd_pvr_texture_save_finish      (GAsyncResult           *result,
+                                          GError                **error);
+
+gboolean hd_pvr_texture_update           (const gchar         *file,
+                                          GdkPixbuf           *pixbuf,
+                                          gint                 x,
+                                          gint                 y,
+                                          gint                 width,
+                                          gint                 height,
+                                          GError             **error);
+
+gboolean hd_pvr_texture_save_view        (const gchar         *file,
+                                          GdkPixbuf           *pixbuf,
+                                          gint                 view_width,
+                                          gint                 view_height,
+                                          GError             **error);
+gchar   *hd_pvr_texture_get_background   (const gchar         *image,
+                                          gint                 view_width,
+                                          gint                 view_height,
+                                          GError             **error);
+
+gboolean hd_pvr_texture_set_cache        (const gchar         *directory,
+                                          guint64              max_size,
+                                          GError             **error);
+
+void     hd_pvr_texture_begin_batch      (void);
+gboolean hd_pvr_texture_end_batch        (GError             **error);
+
+HDPvrTextureAtlas *hd_pvr_texture_atlas_new    (void);
+HDPvrTextureAtlas *hd_pvr_texture_atlas_load   (const gchar            *file,
+                                                GError                **error);
+void               hd_pvr_texture_atlas_add    (HDPvrTextureAtlas      *atlas,
+                                                const gchar            *name,
+                                                GdkPixbuf              *pixbuf);
+gboolean           hd_pvr_texture_atlas_save   (HDPvrTextureAtlas      *atlas,
+                                                const gchar            *file,
+                                                HDPvrTextureFormat      format,
+                                                GError                **error);
+gboolean           hd_pvr_texture_atlas_lookup (HDPvrTextureAtlas      *atlas,
+                                                const gchar            *name,
+                                                HDPvrTextureAtlasItem  *item);
+void               hd_pvr_texture_atlas_free   (HDPvrTextureAtlas      *atlas);
 
 G_END_DECLS
 
@@ -0,0 +1,345 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Packing lots of small images into one texture (an atlas), so they
+ * don't each get padded out to a power of 2 and need a texture of their
+ * own.
+ *
+ * Every image starts on a block boundary and is surrounded by a gutter
+ * one block wide, filled by stretching its edges out. A PVRTC pixel is
+ * decoded from the colours of the blocks around it, one block each way,
+ * so that way an image only ever gets colours from its own blocks and
+ * gutter, never from its neighbours. The gutter also covers GL's
+ * bilinear filtering at the edges.
+ *
+ * The boxes (image and gutter) are placed tallest first, each as low as
+ * it will go along the skyline of the boxes placed so far, in the
+ * smallest power of 2 sheet they all fit in.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "pvr-texture.h"
+#include "pvr-texture-private.h"
+
+#include <stdlib.h>
+
+/* A stretch of the top of the boxes placed so far: everything from x to
+ * x + width is filled up to y */
+typedef struct {
+  gint x;
+  gint y;
+  gint width;
+} SkylineSegment;
+
+/* An image to place, by the size of its box */
+typedef struct {
+  guint index;
+  gint  width;
+  gint  height;
+} AtlasBox;
+
+static gint
+atlas_box_compare (gconstpointer a,
+                   gconstpointer b)
+{
+  const AtlasBox *ba = a, *bb = b;
+
+  if (ba->height != bb->height)
+    return bb->height - ba->height;
+  if (ba->width != bb->width)
+    return bb->width - ba->width;
+  return (gint)ba->index - (gint)bb->index;
+}
+
+/* Places the n_boxes boxes in a sheet_width x sheet_height sheet, setting
+ * (x, y) in rects for each. Returns FALSE if they don't all fit */
+static gboolean
+atlas_pack (const AtlasBox      *boxes,
+            guint                n_boxes,
+            gint                 sheet_width,
+            gint                 sheet_height,
+            PvrTextureAtlasRect *rects)
+{
+  SkylineSegment *skyline;
+  guint n_segments = 1;
+  guint i, j, k;
+  gboolean ok = TRUE;
+
+  /* there are never more segments than there are boxes placed, plus 1 */
+  skyline = g_new (SkylineSegment, n_boxes + 1);
+  skyline[0].x = 0;
+  skyline[0].y = 0;
+  skyline[0].width = sheet_width;
+
+  for (i=0;i<n_boxes && ok;i++)
+    {
+      const AtlasBox *box = &boxes[i];
+      gint best_top = G_MAXINT, best_x = 0, best_y = 0;
+      guint best = n_segments;
+
+      /* the lowest place the box can sit with its left on a segment */
+      for (j=0;j<n_segments;j++)
+        {
+          gint x = skyline[j].x, y = 0, covered = 0;
+
+          if (x + box->width > sheet_width)
+            break;
+          for (k=j;covered < box->width;k++)
+            {
+              y = MAX(y, skyline[k].y);
+              covered += skyline[k].width;
+            }
+          if (y + box->height <= sheet_height && y + box->height < best_top)
+            {
+              best_top = y + box->height;
+              best_x = x;
+              best_y = y;
+              best = j;
+            }
+        }
+      if (best == n_segments)
+        {
+          ok = FALSE;
+          break;
+        }
+
+      rects[box->index].x = best_x;
+      rects[box->index].y = best_y;
+
+      /* the box's top is a new segment, and it hides what's under it */
+      memmove (&skyline[best + 1], &skyline[best],
+               sizeof(SkylineSegment) * (n_segments - best));
+      n_segments++;
+      skyline[best].x = best_x;
+      skyline[best].y = best_top;
+      skyline[best].width = box->width;
+      k = best + 1;
+      while (k < n_segments &&
+             skyline[k].x < best_x + box->width)
+        {
+          gint overlap = best_x + box->width - skyline[k].x;
+
+          if (overlap < skyline[k].width)
+            {
+              skyline[k].x += overlap;
+              skyline[k].width -= overlap;
+              break;
+            }
+          memmove (&skyline[k], &skyline[k + 1],
+                   sizeof(SkylineSegment) * (n_segments - k - 1));
+          n_segments--;
+        }
+
+      /* and neighbours at the same height are one segment */
+      for (k=0;k + 1 < n_segments;)
+        if (skyline[k].y == skyline[k + 1].y)
+          {
+            skyline[k].width += skyline[k + 1].width;
+            memmove (&skyline[k + 1], &skyline[k + 2],
+                     sizeof(SkylineSegment) * (n_segments - k - 2));
+            n_segments--;
+          }
+        else
+          k++;
+    }
+
+  g_free (skyline);
+  return ok;
+}
+
+/* Copies the image read from item into sheet (RGBA, sheet_width wide) at
+ * rect, and stretches its edges out to fill the rest of its box, which
+ * is box_width x box_height with the image gutter_x, gutter_y in */
+static void
+atlas_draw (guchar                    *sheet,
+            gint                       sheet_width,
+            const PvrTextureSource    *item,
+            const PvrTextureAtlasRect *rect,
+            gint                       box_width,
+            gint                       box_height,
+            gint                       gutter_x,
+            gint                       gutter_y)
+{
+  gint x, y;
+
+  for (y=0;y<box_height;y++)
+    {
+      gint source_y = CLAMP(y - gutter_y, 0, item->height - 1);
+      const guchar *line = &item->pixels[source_y * item->rowstride];
+      guchar *out = &sheet[((rect->y - gutter_y + y) * sheet_width +
+                            rect->x - gutter_x) * 4];
+
+      for (x=0;x<box_width;x++, out += 4)
+        {
+          gint source_x = CLAMP(x - gutter_x, 0, item->width - 1);
+          const guchar *in = &line[source_x * item->n_channels];
+
+          out[0] = in[0];
+          out[1] = in[1];
+          out[2] = in[2];
+          out[3] = item->n_channels == 4 ? in[3] : 255;
+        }
+    }
+}
+
+/**
+ * pvr_texture_compress_atlas:
+ *
+ * Packs the n_items images read from items (their padding is ignored)
+ * into one texture, no bigger than max_size in either direction, and
+ * compresses it in format with the given options (which may be NULL)
+ * on n_threads threads (one per CPU if 0). Where each image ended up
+ * is returned in rects, and the size of the texture in width and height.
+ *
+ * Each image is given a gutter of one block all round, so that it can
+ * be drawn from the texture without picking up any colour from the
+ * images next to it.
+ *
+ * Returns NULL if the images don't fit or the sizes don't make sense.
+ */
+guchar *
+pvr_texture_compress_atlas (const PvrTextureSource  *items,
+                            guint                    n_items,
+                            guint                    format,
+                            gint                     max_size,
+                            guint                    n_threads,
+                            const PvrTextureOptions *options,
+                            PvrTextureAtlasRect     *rects,
+                            gint                    *width,
+                            gint                    *height,
+                            guint                   *compressed_size)
+{
+  PvrTextureSource sheet_source;
+  AtlasBox *boxes;
+  guint min_width, min_height;
+  gint block_width, block_height, widest = 0, tallest = 0;
+  gint sheet_width, sheet_height;
+  guint64 area = 0;
+  guchar *sheet, *compressed = 0;
+  gboolean packed;
+  guint i;
+
+  g_return_val_if_fail (items != 0 && n_items > 0, 0);
+  g_return_val_if_fail (max_size > 0 && max_size <= 65536, 0);
+  g_return_val_if_fail (rects != 0, 0);
+  g_return_val_if_fail (width != 0 && height != 0, 0);
+  g_return_val_if_fail (compressed_size != 0, 0);
+
+  if (!pvr_texture_compress_sizes (format, 16, 16, NULL, NULL))
+    return 0;
+  block_width = format == MGLPT_PVRTC2 ? 8 : 4;
+  block_height = 4;
+
+  /* every box is a whole number of blocks, so they all start on one */
+  boxes = g_new (AtlasBox, n_items);
+  for (i=0;i<n_items;i++)
+    {
+      const PvrTextureSource *item = &items[i];
+
+      if (item->width <= 0 || item->height <= 0 ||
+          item->width > max_size || item->height > max_size ||
+          (item->n_channels != 3 && item->n_channels != 4))
+        {
+          g_free (boxes);
+          return 0;
+        }
+
+      boxes[i].index = i;
+      boxes[i].width = (item->width + block_width - 1) / block_width *
+                       block_width + 2*block_width;
+      boxes[i].height = (item->height + block_height - 1) / block_height *
+                        block_height + 2*block_height;
+      rects[i].width = item->width;
+      rects[i].height = item->height;
+      widest = MAX(widest, boxes[i].width);
+      tallest = MAX(tallest, boxes[i].height);
+      area += (guint64)boxes[i].width * boxes[i].height;
+    }
+  qsort (boxes, n_items, sizeof(AtlasBox), atlas_box_compare);
+
+  /* start from the smallest sheet that could hold them all, and grow it
+   * a side at a time until they fit */
+  _pvr_texture_min_size (format, &min_width, &min_height);
+  sheet_width = min_width;
+  sheet_height = min_height;
+  while (sheet_width < widest)
+    sheet_width *= 2;
+  while (sheet_height < tallest)
+    sheet_height *= 2;
+  while ((guint64)sheet_width * sheet_height < area)
+    {
+      if (sheet_width <= sheet_height)
+        sheet_width *= 2;
+      else
+        sheet_height *= 2;
+    }
+
+  packed = sheet_width <= max_size && sheet_height <= max_size;
+  while (packed &&
+         !atlas_pack (boxes, n_items, sheet_width, sheet_height, rects))
+    {
+      if (sheet_width <= sheet_height && sheet_width < max_size)
+        sheet_width *= 2;
+      else if (sheet_height < max_size)
+        sheet_height *= 2;
+      else if (sheet_width < max_size)
+        sheet_width *= 2;
+      else
+        packed = FALSE;
+    }
+  if (!packed)
+    {
+      g_free (boxes);
+      return 0;
+    }
+
+  /* rects are where the boxes are so far; move them in to the images */
+  sheet = g_malloc0 ((gsize)sheet_width * sheet_height * 4);
+  for (i=0;i<n_items;i++)
+    {
+      const AtlasBox *box = &boxes[i];
+      PvrTextureAtlasRect *rect = &rects[box->index];
+
+      rect->x += block_width;
+      rect->y += block_height;
+      atlas_draw (sheet, sheet_width, &items[box->index], rect,
+                  box->width, box->height, block_width, block_height);
+    }
+  g_free (boxes);
+
+  pvr_texture_source_init (&sheet_source, sheet,
+                           sheet_width, sheet_height, sheet_width * 4, 4);
+  compressed = pvr_texture_compress_source (&sheet_source, format,
+                                            n_threads, options,
+                                            compressed_size);
+  g_free (sheet);
+
+  if (compressed)
+    {
+      *width = sheet_width;
+      *height = sheet_height;
+    }
+  return compressed;
+}
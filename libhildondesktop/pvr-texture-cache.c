@@ -0,0 +1,435 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* A content-addressed cache of compressed textures.
+ *
+ * Entries are complete .pvr files in one directory, named after a 64 bit
+ * key that the caller makes by hashing the uncompressed data together
+ * with everything that affects the compressed output. A hit is hard
+ * linked to where the caller wants it (or copied, on file systems
+ * without hard links). Files are only ever replaced by renaming over
+ * them, so an entry can't change under the cache.
+ *
+ * Every hit touches the entry, and when the directory grows beyond its
+ * maximum size the entries that were used longest ago are removed.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "pvr-texture.h"
+
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utime.h>
+
+struct _PvrTextureCache {
+  gint     ref_count;
+  gchar   *directory;
+  guint64  max_size;
+};
+
+/* Only one thread at a time gets to trim the cache */
+G_LOCK_DEFINE_STATIC (trim);
+
+#define PRIME64_1 G_GUINT64_CONSTANT(0x9E3779B185EBCA87)
+#define PRIME64_2 G_GUINT64_CONSTANT(0xC2B2AE3D27D4EB4F)
+#define PRIME64_3 G_GUINT64_CONSTANT(0x165667B19E3779F9)
+#define PRIME64_4 G_GUINT64_CONSTANT(0x85EBCA77C2B2AE63)
+#define PRIME64_5 G_GUINT64_CONSTANT(0x27D4EB2F165667C5)
+
+static inline guint64
+rotl64 (guint64 x,
+        guint   r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline guint64
+read64 (const guchar *p)
+{
+  guint64 v;
+
+  memcpy (&v, p, sizeof(v));
+  return GUINT64_FROM_LE (v);
+}
+
+static inline guint64
+hash_round (guint64 acc,
+            guint64 input)
+{
+  acc += input * PRIME64_2;
+  acc = rotl64 (acc, 31);
+  return acc * PRIME64_1;
+}
+
+static inline guint64
+hash_merge (guint64 acc,
+            guint64 lane)
+{
+  acc ^= hash_round (0, lane);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+/**
+ * pvr_texture_hash:
+ *
+ * Returns a 64 bit hash of data, in the style of xxHash64: four
+ * independent lanes of multiply and rotate, so it runs at memory speed.
+ * Different seeds give unrelated hashes, so settings that affect the
+ * compressed output can be folded in through the seed.
+ */
+guint64
+pvr_texture_hash (const guchar *data,
+                  gsize         size,
+                  guint64       seed)
+{
+  const guchar *p = data, *end = data + size;
+  guint64 h;
+
+  if (size >= 32)
+    {
+      guint64 v1 = seed + PRIME64_1 + PRIME64_2;
+      guint64 v2 = seed + PRIME64_2;
+      guint64 v3 = seed;
+      guint64 v4 = seed - PRIME64_1;
+
+      do
+        {
+          v1 = hash_round (v1, read64 (p));
+          v2 = hash_round (v2, read64 (p + 8));
+          v3 = hash_round (v3, read64 (p + 16));
+          v4 = hash_round (v4, read64 (p + 24));
+          p += 32;
+        }
+      while (p + 32 <= end);
+
+      h = rotl64 (v1, 1) + rotl64 (v2, 7) + rotl64 (v3, 12) + rotl64 (v4, 18);
+      h = hash_merge (h, v1);
+      h = hash_merge (h, v2);
+      h = hash_merge (h, v3);
+      h = hash_merge (h, v4);
+    }
+  else
+    h = seed + PRIME64_5;
+
+  h += size;
+
+  for (;p + 8 <= end;p += 8)
+    {
+      h ^= hash_round (0, read64 (p));
+      h = rotl64 (h, 27) * PRIME64_1 + PRIME64_4;
+    }
+  for (;p < end;p++)
+    {
+      h ^= *p * PRIME64_5;
+      h = rotl64 (h, 11) * PRIME64_1;
+    }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+
+  return h;
+}
+
+/**
+ * pvr_texture_cache_new:
+ *
+ * Opens (creating it if need be) a cache of compressed textures in
+ * directory, which will be kept to around max_size bytes. Returns NULL
+ * and sets error if the directory can't be created.
+ */
+PvrTextureCache *
+pvr_texture_cache_new (const gchar  *directory,
+                       guint64       max_size,
+                       GError      **error)
+{
+  PvrTextureCache *cache;
+
+  g_return_val_if_fail (directory != NULL, NULL);
+
+  if (g_mkdir_with_parents (directory, 0755) == -1)
+    {
+      GFileError code = g_file_error_from_errno (errno);
+
+      g_set_error (error,
+                   G_FILE_ERROR,
+                   code,
+                   "Could not create texture cache %s",
+                   directory);
+      return NULL;
+    }
+
+  cache = g_slice_new (PvrTextureCache);
+  cache->ref_count = 1;
+  cache->directory = g_strdup (directory);
+  cache->max_size = max_size;
+
+  return cache;
+}
+
+PvrTextureCache *
+pvr_texture_cache_ref (PvrTextureCache *cache)
+{
+  g_return_val_if_fail (cache != NULL, NULL);
+
+  g_atomic_int_inc (&cache->ref_count);
+  return cache;
+}
+
+void
+pvr_texture_cache_unref (PvrTextureCache *cache)
+{
+  g_return_if_fail (cache != NULL);
+
+  if (g_atomic_int_dec_and_test (&cache->ref_count))
+    {
+      g_free (cache->directory);
+      g_slice_free (PvrTextureCache, cache);
+    }
+}
+
+static gchar *
+cache_entry_path (PvrTextureCache *cache,
+                  guint64          key)
+{
+  gchar name[32];
+
+  g_snprintf (name, sizeof(name), "%016" G_GINT64_MODIFIER "x.pvr", key);
+  return g_build_filename (cache->directory, name, NULL);
+}
+
+/* A name next to filename that nothing else will be using */
+static gchar *
+temporary_path (const gchar *filename)
+{
+  static gint counter = 0;
+
+  return g_strdup_printf ("%s.%d.%d.tmp",
+                          filename,
+                          (gint)getpid (),
+                          g_atomic_int_add (&counter, 1));
+}
+
+/* Makes dest the same file as src, replacing whatever was there
+ * atomically. Hard links if it can, otherwise copies */
+static gboolean
+link_atomically (const gchar  *src,
+                 const gchar  *dest,
+                 GError      **error)
+{
+  gchar *tmp = temporary_path (dest);
+  gchar *contents;
+  gsize length;
+  gboolean ok;
+
+  if (link (src, tmp) == 0)
+    {
+      if (g_rename (tmp, dest) == 0)
+        {
+          g_free (tmp);
+          return TRUE;
+        }
+
+      g_set_error (error,
+                   G_FILE_ERROR,
+                   g_file_error_from_errno (errno),
+                   "Could not rename %s to %s",
+                   tmp,
+                   dest);
+      g_unlink (tmp);
+      g_free (tmp);
+      return FALSE;
+    }
+  g_free (tmp);
+
+  /* different file systems, or no hard links at all */
+  if (!g_file_get_contents (src, &contents, &length, error))
+    return FALSE;
+  ok = g_file_set_contents (dest, contents, length, error);
+  g_free (contents);
+
+  return ok;
+}
+
+/**
+ * pvr_texture_cache_lookup:
+ *
+ * Returns the cached texture for key, mapped into memory, or NULL if
+ * there isn't one. The texture counts as used.
+ */
+PvrTextureMap *
+pvr_texture_cache_lookup (PvrTextureCache *cache,
+                          guint64          key)
+{
+  gchar *path;
+  PvrTextureMap *map;
+
+  g_return_val_if_fail (cache != NULL, NULL);
+
+  path = cache_entry_path (cache, key);
+  map = pvr_texture_map_new (path, NULL);
+  if (map)
+    utime (path, NULL);
+  g_free (path);
+
+  return map;
+}
+
+/**
+ * pvr_texture_cache_link:
+ *
+ * If there is a cached texture for key, makes filename a hard link to it
+ * (or a copy, if that's not possible) and returns TRUE. Returns FALSE if
+ * there isn't one, or sets error if there is but it couldn't be linked.
+ */
+gboolean
+pvr_texture_cache_link (PvrTextureCache  *cache,
+                        guint64           key,
+                        const gchar      *filename,
+                        GError          **error)
+{
+  gchar *path;
+  gboolean ok = FALSE;
+
+  g_return_val_if_fail (cache != NULL, FALSE);
+  g_return_val_if_fail (filename != NULL, FALSE);
+
+  path = cache_entry_path (cache, key);
+  /* touching it is also how we find out whether it's there */
+  if (utime (path, NULL) == 0)
+    ok = link_atomically (path, filename, error);
+  g_free (path);
+
+  return ok;
+}
+
+typedef struct {
+  gchar   *path;
+  time_t   mtime;
+  guint64  size;
+} CacheEntry;
+
+static gint
+cache_entry_compare (gconstpointer a,
+                     gconstpointer b)
+{
+  const CacheEntry *ea = a, *eb = b;
+
+  if (ea->mtime != eb->mtime)
+    return ea->mtime < eb->mtime ? -1 : 1;
+
+  return strcmp (ea->path, eb->path);
+}
+
+/* Removes the least recently used entries until the cache fits */
+static void
+cache_trim (PvrTextureCache *cache)
+{
+  GDir *dir;
+  const gchar *name;
+  GArray *entries;
+  guint64 total = 0;
+  guint i;
+
+  dir = g_dir_open (cache->directory, 0, NULL);
+  if (!dir)
+    return;
+
+  entries = g_array_new (FALSE, FALSE, sizeof(CacheEntry));
+  while ((name = g_dir_read_name (dir)))
+    {
+      CacheEntry entry;
+      struct stat st;
+
+      if (!g_str_has_suffix (name, ".pvr"))
+        continue;
+
+      entry.path = g_build_filename (cache->directory, name, NULL);
+      if (g_stat (entry.path, &st) == -1)
+        {
+          g_free (entry.path);
+          continue;
+        }
+      entry.mtime = st.st_mtime;
+      entry.size = st.st_size;
+      total += entry.size;
+      g_array_append_val (entries, entry);
+    }
+  g_dir_close (dir);
+
+  if (total > cache->max_size)
+    {
+      g_array_sort (entries, cache_entry_compare);
+      for (i=0;i<entries->len && total > cache->max_size;i++)
+        {
+          CacheEntry *entry = &g_array_index (entries, CacheEntry, i);
+
+          if (g_unlink (entry->path) == 0 || errno == ENOENT)
+            total -= entry->size;
+        }
+    }
+
+  for (i=0;i<entries->len;i++)
+    g_free (g_array_index (entries, CacheEntry, i).path);
+  g_array_free (entries, TRUE);
+}
+
+/**
+ * pvr_texture_cache_insert:
+ *
+ * Adds the texture in filename to the cache under key, as a hard link
+ * where possible so it takes no extra space, and then removes the least
+ * recently used entries if the cache has grown too big.
+ */
+gboolean
+pvr_texture_cache_insert (PvrTextureCache  *cache,
+                          guint64           key,
+                          const gchar      *filename,
+                          GError          **error)
+{
+  gchar *path;
+  gboolean ok;
+
+  g_return_val_if_fail (cache != NULL, FALSE);
+  g_return_val_if_fail (filename != NULL, FALSE);
+
+  path = cache_entry_path (cache, key);
+  ok = link_atomically (filename, path, error);
+  g_free (path);
+
+  if (ok && G_TRYLOCK (trim))
+    {
+      cache_trim (cache);
+      G_UNLOCK (trim);
+    }
+
+  return ok;
+}
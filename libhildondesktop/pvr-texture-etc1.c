@@ -0,0 +1,474 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* ETC1 compression + decompression, for opaque textures on GPUs that
+ * sample ETC1 more cheaply than PVRTC.
+ *
+ * Each 4x4 block is split into two 2x4 (or, flipped, 4x2) halves. Each
+ * half has a base colour and one of 8 tables of offsets, and every pixel
+ * picks one of the 4 offsets in its half's table, which is added to all
+ * three channels of the base colour. The base colours are either both
+ * 444, or 555 plus a 333 signed difference for the second one.
+ *
+ * Blocks are stored as big-endian 64 bit words, in rows (not twiddled).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "pvr-texture.h"
+#include "pvr-texture-private.h"
+
+#include <string.h>
+
+static const gint etc1_modifiers[8][2] = {
+  {  2,   8 }, {  5,  17 }, {  9,  29 }, { 13,  42 },
+  { 18,  60 }, { 24,  80 }, { 33, 106 }, { 47, 183 }
+};
+
+/* the offset picked by each 2 bit pixel index */
+static inline gint
+etc1_modifier (guint table,
+               guint index)
+{
+  gint modifier = etc1_modifiers[table][index & 1];
+
+  return (index & 2) ? -modifier : modifier;
+}
+
+static inline guchar
+clamp_channel (gint x)
+{
+  if (x<0) x=0;
+  if (x>255) x=255;
+  return x;
+}
+
+static inline gint
+expand_4 (gint q)
+{
+  return (q << 4) | q;
+}
+
+static inline gint
+expand_5 (gint q)
+{
+  return (q << 3) | (q >> 2);
+}
+
+static inline gint
+quantise_4 (gint v)
+{
+  return (v * 15 + 127) / 255;
+}
+
+static inline gint
+quantise_5 (gint v)
+{
+  return (v * 31 + 127) / 255;
+}
+
+/* One half of a block: its 8 pixels, and where they go */
+typedef struct {
+  Color pixels[8];
+  guint positions[8]; /* x*4 + y, the bit the index goes in */
+} SubBlock;
+
+/* The best encoding found for a sub block */
+typedef struct {
+  guint error;
+  guint table;
+  guint indices[8];
+} SubBlockFit;
+
+static void
+sub_blocks_init (const Color *block,
+                 guint        width,
+                 gboolean     flip,
+                 SubBlock    *sub)
+{
+  guint n[2] = { 0, 0 };
+  guint x, y;
+
+  for (y=0;y<4;y++)
+    for (x=0;x<4;x++)
+      {
+        guint half = flip ? (y >= 2) : (x >= 2);
+
+        sub[half].pixels[n[half]] = block[x + y*width];
+        sub[half].positions[n[half]] = x*4 + y;
+        n[half]++;
+      }
+}
+
+static void
+sub_block_average (const SubBlock *sub,
+                   gint           *average)
+{
+  gint sum[3] = { 0, 0, 0 };
+  guint i;
+
+  for (i=0;i<8;i++)
+    {
+      sum[0] += sub->pixels[i].red;
+      sum[1] += sub->pixels[i].green;
+      sum[2] += sub->pixels[i].blue;
+    }
+
+  for (i=0;i<3;i++)
+    average[i] = (sum[i] + 4) / 8;
+}
+
+/* Picks the best table and indices for the given (expanded) base
+ * colour, with the squared error in fit->error */
+static void
+sub_block_fit (const SubBlock *sub,
+               const gint     *base,
+               SubBlockFit    *fit)
+{
+  guint table, i, index;
+
+  fit->error = G_MAXUINT;
+
+  for (table=0;table<8;table++)
+    {
+      guint indices[8];
+      guint error = 0;
+
+      for (i=0;i<8 && error<fit->error;i++)
+        {
+          guint best_error = G_MAXUINT;
+
+          for (index=0;index<4;index++)
+            {
+              gint modifier = etc1_modifier (table, index);
+              gint dr = clamp_channel (base[0] + modifier) - sub->pixels[i].red;
+              gint dg = clamp_channel (base[1] + modifier) - sub->pixels[i].green;
+              gint db = clamp_channel (base[2] + modifier) - sub->pixels[i].blue;
+              guint e = dr*dr + dg*dg + db*db;
+
+              if (e < best_error)
+                {
+                  best_error = e;
+                  indices[i] = index;
+                }
+            }
+          error += best_error;
+        }
+
+      if (error < fit->error)
+        {
+          fit->error = error;
+          fit->table = table;
+          memcpy (fit->indices, indices, sizeof(indices));
+        }
+    }
+}
+
+/* Finds the best base colour near the quantised average for a sub block.
+ * bits is 4 or 5. When thorough, tries every colour within one step of
+ * the average in each channel, otherwise just the average. */
+static void
+sub_block_search (const SubBlock *sub,
+                  guint           bits,
+                  gboolean        thorough,
+                  gint           *quantised,
+                  SubBlockFit    *fit)
+{
+  gint average[3], centre[3], candidate[3], base[3];
+  gint max = (1 << bits) - 1;
+  gint range = thorough ? 1 : 0;
+  gint dr, dg, db, c;
+
+  sub_block_average (sub, average);
+  for (c=0;c<3;c++)
+    centre[c] = bits == 4 ? quantise_4 (average[c]) : quantise_5 (average[c]);
+
+  fit->error = G_MAXUINT;
+
+  for (dr=-range;dr<=range;dr++)
+    for (dg=-range;dg<=range;dg++)
+      for (db=-range;db<=range;db++)
+        {
+          SubBlockFit try;
+
+          candidate[0] = centre[0] + dr;
+          candidate[1] = centre[1] + dg;
+          candidate[2] = centre[2] + db;
+          if (candidate[0] < 0 || candidate[0] > max ||
+              candidate[1] < 0 || candidate[1] > max ||
+              candidate[2] < 0 || candidate[2] > max)
+            continue;
+
+          for (c=0;c<3;c++)
+            base[c] = bits == 4 ? expand_4 (candidate[c]) : expand_5 (candidate[c]);
+
+          sub_block_fit (sub, base, &try);
+          if (try.error < fit->error)
+            {
+              *fit = try;
+              memcpy (quantised, candidate, sizeof(candidate));
+            }
+        }
+}
+
+/* A complete encoding of one block */
+typedef struct {
+  guint error;
+  guint32 high, low;
+} BlockFit;
+
+static void
+block_fit_pack (BlockFit          *block,
+                const SubBlock    *sub,
+                const SubBlockFit *fit,
+                guint32            colours,
+                gboolean           differential,
+                gboolean           flip)
+{
+  guint half, i;
+
+  block->error = fit[0].error + fit[1].error;
+  block->high = colours |
+                (fit[0].table << 5) |
+                (fit[1].table << 2) |
+                (differential ? 2 : 0) |
+                (flip ? 1 : 0);
+  block->low = 0;
+
+  for (half=0;half<2;half++)
+    for (i=0;i<8;i++)
+      {
+        guint index = fit[half].indices[i];
+        guint position = sub[half].positions[i];
+
+        block->low |= (index & 1) << position;
+        block->low |= (index >> 1) << (position + 16);
+      }
+}
+
+static void
+encode_block (const Color *pixels,
+              guint        width,
+              gboolean     thorough,
+              guchar      *out)
+{
+  BlockFit best;
+  guint flip, i;
+
+  best.error = G_MAXUINT;
+  best.high = best.low = 0;
+
+  for (flip=0;flip<2;flip++)
+    {
+      SubBlock sub[2];
+      SubBlockFit fit[2], diff_fit[2];
+      gint q[2][3], dq[2][3];
+      gboolean can_diff;
+      BlockFit candidate;
+
+      sub_blocks_init (pixels, width, flip, sub);
+
+      /* 444 + 444 */
+      sub_block_search (&sub[0], 4, thorough, q[0], &fit[0]);
+      sub_block_search (&sub[1], 4, thorough, q[1], &fit[1]);
+      block_fit_pack (&candidate, sub, fit,
+                      (q[0][0] << 28) | (q[1][0] << 24) |
+                      (q[0][1] << 20) | (q[1][1] << 16) |
+                      (q[0][2] << 12) | (q[1][2] << 8),
+                      FALSE, flip);
+      if (candidate.error < best.error)
+        best = candidate;
+
+      /* 555 + 333 difference, if the two halves are close enough */
+      sub_block_search (&sub[0], 5, thorough, dq[0], &diff_fit[0]);
+      sub_block_search (&sub[1], 5, thorough, dq[1], &diff_fit[1]);
+      can_diff = TRUE;
+      for (i=0;i<3;i++)
+        if (dq[1][i] - dq[0][i] < -4 || dq[1][i] - dq[0][i] > 3)
+          can_diff = FALSE;
+      if (can_diff)
+        {
+          block_fit_pack (&candidate, sub, diff_fit,
+                          (dq[0][0] << 27) | (((dq[1][0] - dq[0][0]) & 7) << 24) |
+                          (dq[0][1] << 19) | (((dq[1][1] - dq[0][1]) & 7) << 16) |
+                          (dq[0][2] << 11) | (((dq[1][2] - dq[0][2]) & 7) << 8),
+                          TRUE, flip);
+          if (candidate.error < best.error)
+            best = candidate;
+        }
+    }
+
+  out[0] = best.high >> 24;
+  out[1] = best.high >> 16;
+  out[2] = best.high >> 8;
+  out[3] = best.high;
+  out[4] = best.low >> 24;
+  out[5] = best.low >> 16;
+  out[6] = best.low >> 8;
+  out[7] = best.low;
+}
+
+/**
+ * pvr_texture_compress_etc1:
+ *
+ * Takes an RGBA8888 bitmap and returns the data (and size) created after
+ * it has been compressed in the ETC1 format. Alpha is thrown away. The
+ * fast mode uses the average colour of each half block as its base
+ * colour; the thorough mode also tries every base colour one step away
+ * from it, which is many times slower but gives smoother gradients.
+ */
+guchar *pvr_texture_compress_etc1(
+                const guchar *uncompressed_data,
+                gint width,
+                gint height,
+                gboolean thorough,
+                guint *compressed_size)
+{
+  PvrTextureSource source;
+  guchar *compressed_data;
+  gsize size, scratch_size;
+
+  g_return_val_if_fail(compressed_size!=0, 0);
+  if (!pvr_texture_compress_sizes (ETC_RGB_4BPP, width, height,
+                                   &size, &scratch_size))
+    return 0;
+
+  pvr_texture_source_init (&source, uncompressed_data,
+                           width, height, width*4, 4);
+  compressed_data = g_malloc(size);
+  _pvr_texture_compress_etc1_into (&source, thorough, compressed_data, NULL);
+  *compressed_size = size;
+
+  return compressed_data;
+}
+
+/* ETC1 compression of the padded image read from source into
+ * compressed_data, whose size has already been checked. Each row of
+ * blocks is a step of progress, which may be NULL */
+void
+_pvr_texture_compress_etc1_into (const PvrTextureSource *source,
+                                 gboolean                thorough,
+                                 guchar                 *compressed_data,
+                                 PvrProgress            *progress)
+{
+  gint width = source->padded_width;
+  gint height = source->padded_height;
+  guchar *out = compressed_data;
+  gint x, y;
+
+  for (y=0;y<height;y+=4)
+    {
+      for (x=0;x<width;x+=4)
+        {
+          Color scratch[16];
+          const Color *block;
+          guint stride;
+
+          block = _pvr_texture_source_block (source, x, y, 4, 4,
+                                             scratch, &stride);
+          encode_block (block, stride, thorough, out);
+          out += 8;
+        }
+      if (!_pvr_progress_step (progress))
+        return;
+    }
+}
+
+/**
+ * pvr_texture_decompress_etc1:
+ *
+ * Returns an RGBA8888 bitmap (with alpha always 255) created from
+ * decompressing the given ETC1 data.
+ */
+guchar *pvr_texture_decompress_etc1(
+                const guchar *compressed_data,
+                gint width,
+                gint height)
+{
+  Color *uncompressed_data;
+  const guchar *in = compressed_data;
+  gint x, y;
+
+  if ((width&3) || (height&3) ||
+      !is_power_2(width) ||
+      !is_power_2(height))
+    return 0;
+
+  uncompressed_data = g_malloc(sizeof(Color)*width*height);
+
+  for (y=0;y<height;y+=4)
+    for (x=0;x<width;x+=4)
+      {
+        guint32 high = (in[0] << 24) | (in[1] << 16) | (in[2] << 8) | in[3];
+        guint32 low = (in[4] << 24) | (in[5] << 16) | (in[6] << 8) | in[7];
+        gboolean flip = high & 1;
+        gint base[2][3];
+        guint table[2];
+        guint bx, by, c;
+
+        if (high & 2)
+          {
+            for (c=0;c<3;c++)
+              {
+                gint q = (high >> (27 - c*8)) & 0x1F;
+                gint d = (high >> (24 - c*8)) & 7;
+
+                if (d & 4)
+                  d -= 8;
+                base[0][c] = expand_5 (q);
+                base[1][c] = expand_5 ((q + d) & 0x1F);
+              }
+          }
+        else
+          {
+            for (c=0;c<3;c++)
+              {
+                base[0][c] = expand_4 ((high >> (28 - c*8)) & 0xF);
+                base[1][c] = expand_4 ((high >> (24 - c*8)) & 0xF);
+              }
+          }
+        table[0] = (high >> 5) & 7;
+        table[1] = (high >> 2) & 7;
+
+        for (by=0;by<4;by++)
+          for (bx=0;bx<4;bx++)
+            {
+              guint half = flip ? (by >= 2) : (bx >= 2);
+              guint position = bx*4 + by;
+              guint index = ((low >> position) & 1) |
+                            (((low >> (position + 16)) & 1) << 1);
+              gint modifier = etc1_modifier (table[half], index);
+              Color *col = &uncompressed_data[x + bx + (y + by)*width];
+
+              col->red = clamp_channel (base[half][0] + modifier);
+              col->green = clamp_channel (base[half][1] + modifier);
+              col->blue = clamp_channel (base[half][2] + modifier);
+              col->alpha = 255;
+            }
+
+        in += 8;
+      }
+
+  return (guchar*)uncompressed_data;
+}
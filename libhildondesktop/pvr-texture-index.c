@@ -0,0 +1,414 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* An index of the .pvr files in a directory, so their sizes and formats
+ * can be known without opening every one of them.
+ *
+ * The headers are kept in a table in the directory itself, along with
+ * the size, modification time and inode each was read at. Loading the
+ * index reads that one file and stats the textures: one whose stat still
+ * matches is taken from the table, and only those that are new or have
+ * been replaced (which always gives a new inode, as textures are renamed
+ * into place) get their header read. Files that turn out not to be
+ * valid textures are kept in the table too, so they aren't read again
+ * every time. The table is written back if anything changed.
+ *
+ * The table is only a cache, so if it can't be read or written the index
+ * is made by reading the headers as if it wasn't there.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "pvr-texture.h"
+#include "pvr-texture-private.h"
+
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define INDEX_NAME ".pvr-index"
+#define INDEX_MAGIC ('P' | 'V'<<8 | 'R'<<16 | 'I'<<24)
+#define INDEX_VERSION 1
+
+/* The table is this, then n_records IndexRecords, then names_size bytes
+ * of nul terminated names. It's only read on the machine that wrote it,
+ * so it's in native byte order */
+typedef struct {
+  guint32 magic;
+  guint32 version;
+  guint32 n_records;
+  guint32 names_size;
+} IndexHeader;
+
+typedef struct {
+  PVR_TEXTURE_HEADER header;
+  guint32            name;  /* offset into the names */
+  guint32            flags;
+  guint64            size;
+  gint64             mtime;
+  guint64            inode;
+} IndexRecord;
+
+/* IndexRecord.flags: the file is not a valid texture */
+#define INDEX_RECORD_INVALID 1
+
+typedef struct {
+  PvrTextureIndexEntry entry;
+  guint64              inode;
+  gboolean             valid;
+} IndexEntry;
+
+struct _PvrTextureIndex {
+  GArray       *entries;  /* of IndexEntry, sorted by name */
+  GArray       *invalid;  /* IndexEntrys of the files that aren't textures */
+  GStringChunk *names;
+};
+
+static gint
+index_entry_compare (gconstpointer a,
+                     gconstpointer b)
+{
+  const IndexEntry *ea = a, *eb = b;
+
+  return strcmp (ea->entry.name, eb->entry.name);
+}
+
+static IndexEntry *
+index_entries_find (GArray      *entries,
+                    const gchar *name)
+{
+  guint low = 0, high = entries->len;
+
+  while (low < high)
+    {
+      guint mid = (low + high) / 2;
+      IndexEntry *entry = &g_array_index (entries, IndexEntry, mid);
+      gint cmp = strcmp (name, entry->entry.name);
+
+      if (!cmp)
+        return entry;
+      if (cmp < 0)
+        high = mid;
+      else
+        low = mid + 1;
+    }
+
+  return NULL;
+}
+
+/* Reads the table at path into entries, with their names in names.
+ * Anything that doesn't add up means the whole table is ignored */
+static void
+index_load (const gchar  *path,
+            GArray       *entries,
+            GStringChunk *names)
+{
+  IndexHeader head;
+  const IndexRecord *records;
+  const gchar *table_names;
+  gchar *contents;
+  gsize length;
+  guint i;
+
+  if (!g_file_get_contents (path, &contents, &length, NULL))
+    return;
+
+  if (length < sizeof(head))
+    goto out;
+  memcpy (&head, contents, sizeof(head));
+  if (head.magic != INDEX_MAGIC ||
+      head.version != INDEX_VERSION ||
+      head.n_records > (length - sizeof(head)) / sizeof(IndexRecord) ||
+      length != sizeof(head) + head.n_records * sizeof(IndexRecord) +
+                head.names_size ||
+      (head.names_size && contents[length - 1]))
+    goto out;
+
+  records = (const IndexRecord *)(contents + sizeof(head));
+  table_names = contents + sizeof(head) + head.n_records * sizeof(IndexRecord);
+  for (i=0;i<head.n_records;i++)
+    {
+      IndexRecord record;
+      IndexEntry entry;
+
+      memcpy (&record, &records[i], sizeof(record));
+      if (record.name >= head.names_size)
+        continue;
+      entry.valid = !(record.flags & INDEX_RECORD_INVALID);
+      /* a header that wouldn't pass now is as good as not there */
+      if (entry.valid &&
+          !_pvr_texture_header_check (&record.header, record.size))
+        continue;
+
+      entry.entry.name = g_string_chunk_insert (names,
+                                                table_names + record.name);
+      entry.entry.header = record.header;
+      entry.entry.size = record.size;
+      entry.entry.mtime = record.mtime;
+      entry.inode = record.inode;
+      g_array_append_val (entries, entry);
+    }
+  g_array_sort (entries, index_entry_compare);
+
+out:
+  g_free (contents);
+}
+
+static gboolean
+index_save (PvrTextureIndex  *index,
+            const gchar      *path,
+            GError          **error)
+{
+  IndexHeader head;
+  GString *names;
+  gchar *contents;
+  gsize records_size, length;
+  gboolean ok;
+  guint i, n_records;
+
+  n_records = index->entries->len + index->invalid->len;
+  names = g_string_new (NULL);
+  records_size = n_records * sizeof(IndexRecord);
+  contents = g_malloc (sizeof(head) + records_size);
+
+  for (i=0;i<n_records;i++)
+    {
+      IndexEntry *entry;
+      IndexRecord record;
+
+      if (i < index->entries->len)
+        entry = &g_array_index (index->entries, IndexEntry, i);
+      else
+        entry = &g_array_index (index->invalid, IndexEntry,
+                                i - index->entries->len);
+
+      memset (&record, 0, sizeof(record));
+      record.header = entry->entry.header;
+      record.name = names->len;
+      record.flags = entry->valid ? 0 : INDEX_RECORD_INVALID;
+      record.size = entry->entry.size;
+      record.mtime = entry->entry.mtime;
+      record.inode = entry->inode;
+      memcpy (contents + sizeof(head) + i*sizeof(record),
+              &record, sizeof(record));
+      g_string_append_len (names, entry->entry.name,
+                           strlen (entry->entry.name) + 1);
+    }
+
+  head.magic = INDEX_MAGIC;
+  head.version = INDEX_VERSION;
+  head.n_records = n_records;
+  head.names_size = names->len;
+  memcpy (contents, &head, sizeof(head));
+
+  length = sizeof(head) + records_size + names->len;
+  contents = g_realloc (contents, length);
+  memcpy (contents + sizeof(head) + records_size, names->str, names->len);
+
+  ok = g_file_set_contents (path, contents, length, error);
+
+  g_free (contents);
+  g_string_free (names, TRUE);
+  return ok;
+}
+
+/**
+ * pvr_texture_index_new:
+ *
+ * Makes an index of the valid .pvr files in directory (not its
+ * subdirectories), from the table kept there where it is up to date and
+ * by reading their headers with pvr_texture_probe() where it is not,
+ * and updates the table if need be. Files that aren't valid textures
+ * are left out of the index.
+ *
+ * Returns NULL and sets error if the directory can't be read.
+ */
+PvrTextureIndex *
+pvr_texture_index_new (const gchar  *directory,
+                       GError      **error)
+{
+  PvrTextureIndex *index;
+  GArray *old_entries;
+  GDir *dir;
+  const gchar *name;
+  gchar *path;
+  gboolean changed = FALSE;
+
+  g_return_val_if_fail (directory != NULL, NULL);
+
+  dir = g_dir_open (directory, 0, error);
+  if (!dir)
+    return NULL;
+
+  index = g_slice_new (PvrTextureIndex);
+  index->entries = g_array_new (FALSE, FALSE, sizeof(IndexEntry));
+  index->invalid = g_array_new (FALSE, FALSE, sizeof(IndexEntry));
+  index->names = g_string_chunk_new (1024);
+
+  path = g_build_filename (directory, INDEX_NAME, NULL);
+  old_entries = g_array_new (FALSE, FALSE, sizeof(IndexEntry));
+  index_load (path, old_entries, index->names);
+
+  while ((name = g_dir_read_name (dir)))
+    {
+      IndexEntry entry, *old;
+      gchar *filename;
+      struct stat st;
+
+      if (!g_str_has_suffix (name, ".pvr"))
+        continue;
+
+      filename = g_build_filename (directory, name, NULL);
+      if (g_stat (filename, &st) == -1 || !S_ISREG (st.st_mode))
+        {
+          g_free (filename);
+          continue;
+        }
+
+      old = index_entries_find (old_entries, name);
+      if (old &&
+          old->entry.size == (guint64)st.st_size &&
+          old->entry.mtime == (gint64)st.st_mtime &&
+          old->inode == (guint64)st.st_ino)
+        entry = *old;
+      else
+        {
+          changed = TRUE;
+          entry.valid = pvr_texture_probe (filename, &entry.entry.header,
+                                           NULL);
+          if (!entry.valid)
+            memset (&entry.entry.header, 0, sizeof(PVR_TEXTURE_HEADER));
+          entry.entry.name = g_string_chunk_insert (index->names, name);
+          entry.entry.size = st.st_size;
+          entry.entry.mtime = st.st_mtime;
+          entry.inode = st.st_ino;
+        }
+      g_array_append_val (entry.valid ? index->entries : index->invalid,
+                          entry);
+      g_free (filename);
+    }
+  g_dir_close (dir);
+
+  /* everything found was in the table, but was everything in the table
+   * found? */
+  if (index->entries->len + index->invalid->len != old_entries->len)
+    changed = TRUE;
+  g_array_free (old_entries, TRUE);
+
+  g_array_sort (index->entries, index_entry_compare);
+
+  /* a directory we can't write to just doesn't get a table */
+  if (changed)
+    index_save (index, path, NULL);
+  g_free (path);
+
+  return index;
+}
+
+/**
+ * pvr_texture_index_get_n_entries:
+ *
+ * Returns the number of textures in the index.
+ */
+guint
+pvr_texture_index_get_n_entries (PvrTextureIndex *index)
+{
+  g_return_val_if_fail (index != NULL, 0);
+
+  return index->entries->len;
+}
+
+/**
+ * pvr_texture_index_get_entry:
+ *
+ * Returns texture i of the index, in order of name. It is valid until
+ * the index is freed.
+ */
+const PvrTextureIndexEntry *
+pvr_texture_index_get_entry (PvrTextureIndex *index,
+                             guint            i)
+{
+  g_return_val_if_fail (index != NULL, NULL);
+  g_return_val_if_fail (i < index->entries->len, NULL);
+
+  return &g_array_index (index->entries, IndexEntry, i).entry;
+}
+
+/**
+ * pvr_texture_index_lookup:
+ *
+ * Returns the texture with the given file name (without the directory)
+ * or NULL if the index doesn't have it.
+ */
+const PvrTextureIndexEntry *
+pvr_texture_index_lookup (PvrTextureIndex *index,
+                          const gchar     *name)
+{
+  IndexEntry *entry;
+
+  g_return_val_if_fail (index != NULL, NULL);
+  g_return_val_if_fail (name != NULL, NULL);
+
+  entry = index_entries_find (index->entries, name);
+  return entry ? &entry->entry : NULL;
+}
+
+/**
+ * pvr_texture_index_get_data_size:
+ *
+ * Returns the size of the compressed data of all the textures in the
+ * index put together, mipmaps and all: the memory they would take up
+ * once loaded.
+ */
+guint64
+pvr_texture_index_get_data_size (PvrTextureIndex *index)
+{
+  guint64 total = 0;
+  guint i;
+
+  g_return_val_if_fail (index != NULL, 0);
+
+  for (i=0;i<index->entries->len;i++)
+    {
+      IndexEntry *entry = &g_array_index (index->entries, IndexEntry, i);
+
+      total += entry->entry.header.dwDataSize;
+    }
+
+  return total;
+}
+
+void
+pvr_texture_index_free (PvrTextureIndex *index)
+{
+  if (!index)
+    return;
+
+  g_array_free (index->entries, TRUE);
+  g_array_free (index->invalid, TRUE);
+  g_string_chunk_free (index->names);
+  g_slice_free (PvrTextureIndex, index);
+}
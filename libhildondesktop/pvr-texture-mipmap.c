@@ -0,0 +1,427 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Mipmap chains for compressed textures.
+ *
+ * Each level is a 2x2 box filter of the one above, done in linear light
+ * (and weighted by alpha) so that downscaled images don't get darker.
+ * Levels are handed to a thread pool to be compressed as soon as they
+ * have been made, so that the downsampling of the next level overlaps
+ * with the compression of the last one.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "pvr-texture.h"
+#include "pvr-texture-private.h"
+
+#include <math.h>
+
+static gfloat srgb_to_linear[256];
+/* the linear values half way between each sRGB value and the next */
+static gfloat srgb_thresholds[255];
+
+static void
+srgb_tables_init (void)
+{
+  static gsize initialised = 0;
+
+  if (g_once_init_enter (&initialised))
+    {
+      guint i;
+
+      for (i=0;i<256;i++)
+        {
+          gdouble c = i / 255.0;
+
+          if (c <= 0.04045)
+            srgb_to_linear[i] = c / 12.92;
+          else
+            srgb_to_linear[i] = pow ((c + 0.055) / 1.055, 2.4);
+        }
+      for (i=0;i<255;i++)
+        srgb_thresholds[i] = (srgb_to_linear[i] + srgb_to_linear[i+1]) / 2;
+
+      g_once_init_leave (&initialised, 1);
+    }
+}
+
+/* Returns the sRGB value whose linear value is nearest to linear */
+static inline guchar
+linear_to_srgb (gfloat linear)
+{
+  guint low = 0, high = 255;
+
+  while (low < high)
+    {
+      guint mid = (low + high) / 2;
+
+      if (linear > srgb_thresholds[mid])
+        low = mid + 1;
+      else
+        high = mid;
+    }
+
+  return low;
+}
+
+/* pvr_texture_downsample() of the padded image read from source */
+static guchar *
+downsample_source (const PvrTextureSource *source)
+{
+  gint width = source->padded_width;
+  gint height = source->padded_height;
+  gint out_width = MAX(width/2, 1);
+  gint out_height = MAX(height/2, 1);
+  gint step_x = width / out_width;
+  gint step_y = height / out_height;
+  gint samples = step_x * step_y;
+  guchar *out_data, *out;
+  gint x, y;
+
+  srgb_tables_init ();
+
+  out = out_data = g_malloc(out_width*out_height*4);
+
+  for (y=0;y<out_height;y++)
+    for (x=0;x<out_width;x++)
+      {
+        gfloat sum[3] = { 0, 0, 0 };
+        gfloat weighted[3] = { 0, 0, 0 };
+        guint alpha = 0;
+        Color scratch[4];
+        const Color *block;
+        guint stride;
+        gint sx, sy, c;
+
+        block = _pvr_texture_source_block (source, x*step_x, y*step_y,
+                                           step_x, step_y, scratch, &stride);
+        for (sy=0;sy<step_y;sy++)
+          for (sx=0;sx<step_x;sx++)
+            {
+              const guchar *in = (const guchar*)&block[sx + sy*stride];
+
+              for (c=0;c<3;c++)
+                {
+                  sum[c] += srgb_to_linear[in[c]];
+                  weighted[c] += srgb_to_linear[in[c]] * in[3];
+                }
+              alpha += in[3];
+            }
+
+        for (c=0;c<3;c++)
+          out[c] = linear_to_srgb (alpha ? weighted[c] / alpha :
+                                           sum[c] / samples);
+        out[3] = (alpha + samples/2) / samples;
+        out += 4;
+      }
+
+  return out_data;
+}
+
+/**
+ * pvr_texture_downsample:
+ *
+ * Takes an RGBA8888 bitmap and returns one half the size in each
+ * direction (but at least 1 pixel), where each pixel is the average of
+ * the 2x2 (or 2x1) pixels above it in linear light. Colours are
+ * weighted by their alpha, so transparent pixels don't bleed into the
+ * edges of opaque ones.
+ */
+guchar *pvr_texture_downsample(
+                const guchar *data,
+                gint width,
+                gint height)
+{
+  PvrTextureSource source;
+
+  g_return_val_if_fail (width > 0 && height > 0, NULL);
+
+  pvr_texture_source_init (&source, data, width, height, width*4, 4);
+  return downsample_source (&source);
+}
+
+typedef struct {
+  guint             format;
+  guint             n_threads;
+  const PvrTextureOptions *options;
+  PvrProgress      *progress;
+  PvrTextureSource  source;
+  guchar           *pixels;     /* owned by source if set, freed once
+                                 * compressed */
+  guchar           *out;        /* where in the chain it goes */
+  gsize             out_size;
+} MipmapLevel;
+
+static void
+mipmap_level_compress (gpointer data,
+                       gpointer user_data)
+{
+  MipmapLevel *level = data;
+  guchar *scratch;
+  gsize scratch_size = 0;
+
+  /* straight into its place in the chain */
+  pvr_texture_compress_sizes (level->format,
+                              level->source.padded_width,
+                              level->source.padded_height,
+                              NULL, &scratch_size);
+  scratch = g_malloc (scratch_size);
+  _pvr_texture_compress_into (&level->source, level->format,
+                              level->n_threads, level->options,
+                              level->out, scratch,
+                              level->progress);
+
+  g_free (scratch);
+  g_free (level->pixels);
+  level->pixels = NULL;
+}
+
+/* A copy of the width x height RGBA pixels (g_memdup() is deprecated, and
+ * g_memdup2() is newer than the GLib we need) */
+static guchar *
+mipmap_pixels_copy (const guchar *pixels,
+                    gint          width,
+                    gint          height)
+{
+  gsize size = (gsize)width * height * 4;
+  guchar *copy = g_malloc (size);
+
+  memcpy (copy, pixels, size);
+  return copy;
+}
+
+/* Returns the pixels of a level, tiled out to at least the minimum size
+ * the format can store. Takes ownership of pixels */
+static guchar *
+mipmap_level_pad (guchar *pixels,
+                  gint    width,
+                  gint    height,
+                  gint    padded_width,
+                  gint    padded_height)
+{
+  guint32 *padded;
+  const guint32 *in = (const guint32*)pixels;
+  gint x, y;
+
+  if (width == padded_width && height == padded_height)
+    return pixels;
+
+  padded = g_malloc(padded_width*padded_height*4);
+  for (y=0;y<padded_height;y++)
+    for (x=0;x<padded_width;x++)
+      padded[x + y*padded_width] = in[(x % width) + (y % height)*width];
+
+  g_free (pixels);
+  return (guchar*)padded;
+}
+
+/* Makes level read from pixels, which it takes ownership of */
+static void
+mipmap_level_set_pixels (MipmapLevel *level,
+                         guchar      *pixels,
+                         gint         width,
+                         gint         height,
+                         gint         padded_width,
+                         gint         padded_height)
+{
+  level->pixels = mipmap_level_pad (pixels, width, height,
+                                    padded_width, padded_height);
+  pvr_texture_source_init (&level->source, level->pixels,
+                           padded_width, padded_height, padded_width*4, 4);
+}
+
+/**
+ * pvr_texture_compress_mipmaps:
+ *
+ * Takes an RGBA8888 bitmap and returns it, and every mipmap level below
+ * it down to 1x1, compressed in format (MGLPT_PVRTC4, MGLPT_PVRTC2 or
+ * ETC_RGB_4BPP) one after the other, ready for
+ * pvr_texture_save_mipmaps_atomically(). The number of levels below the
+ * top one is returned in mipmap_count.
+ *
+ * Levels are compressed on n_threads threads (one per CPU if 0). The
+ * output doesn't depend on the number of threads.
+ */
+guchar *pvr_texture_compress_mipmaps(
+                const guchar *uncompressed_data,
+                gint width,
+                gint height,
+                guint format,
+                guint n_threads,
+                guint *mipmap_count,
+                guint *compressed_size)
+{
+  PvrTextureSource source;
+
+  pvr_texture_source_init (&source, uncompressed_data,
+                           width, height, width*4, 4);
+  return pvr_texture_compress_mipmaps_source (&source, format, n_threads,
+                                              NULL, NULL, NULL,
+                                              mipmap_count, compressed_size);
+}
+
+/**
+ * pvr_texture_compress_mipmaps_source:
+ *
+ * As pvr_texture_compress_mipmaps(), but for the padded image read from
+ * source. The top level is compressed straight from source. Progress is
+ * as for pvr_texture_compress_source_into(), counting the rows of every
+ * level, and if it stops the compression NULL is returned. options (which
+ * may be NULL) apply to every level.
+ */
+guchar *pvr_texture_compress_mipmaps_source(
+                const PvrTextureSource *source,
+                guint format,
+                guint n_threads,
+                const PvrTextureOptions *options,
+                PvrTextureProgressFunc progress,
+                gpointer user_data,
+                guint *mipmap_count,
+                guint *compressed_size)
+{
+  PvrProgress counter;
+  gint width = source->padded_width;
+  gint height = source->padded_height;
+  GThreadPool *pool;
+  MipmapLevel *levels;
+  guchar *compressed_data, *out;
+  guchar *previous = NULL;
+  guint min_width, min_height;
+  guint n_levels, i;
+  gsize total = 0;
+
+  g_return_val_if_fail(compressed_size!=0, 0);
+  g_return_val_if_fail(mipmap_count!=0, 0);
+  if (!_pvr_texture_surface_size (format, 4, 4) ||
+      !is_power_2(width) ||
+      !is_power_2(height))
+    return 0;
+
+  if (n_threads == 0)
+    n_threads = g_get_num_processors ();
+
+  _pvr_texture_min_size (format, &min_width, &min_height);
+  n_levels = log_2 (MAX(width, height)) + 1;
+  levels = g_new0 (MipmapLevel, n_levels);
+
+  counter.func = progress;
+  counter.user_data = user_data;
+  counter.total = 0;
+  counter.done = 0;
+  counter.stopped = 0;
+  for (i=0;i<n_levels;i++)
+    {
+      levels[i].format = format;
+      levels[i].n_threads = 1;
+      levels[i].options = options;
+      levels[i].progress = &counter;
+      levels[i].out_size = _pvr_texture_level_size (format, width, height, i);
+      counter.total += _pvr_texture_compress_steps (
+                                   format,
+                                   MAX((guint)(width >> i), min_width),
+                                   MAX((guint)(height >> i), min_height));
+      total += levels[i].out_size;
+    }
+
+  out = compressed_data = g_malloc(total);
+  for (i=0;i<n_levels;i++)
+    {
+      levels[i].out = out;
+      out += levels[i].out_size;
+    }
+
+  pool = g_thread_pool_new (mipmap_level_compress, NULL,
+                            n_threads, FALSE, NULL);
+
+  /* The top level is most of the work. PVRTC4 can split it up itself, so
+   * leave it until the end and give it all the threads; anything else
+   * goes first so it overlaps with making the rest of the chain. It's
+   * compressed straight from source unless it's too small for format */
+  if ((guint)width >= min_width && (guint)height >= min_height)
+    levels[0].source = *source;
+  else
+    mipmap_level_set_pixels (&levels[0], _pvr_texture_source_copy (source),
+                             width, height,
+                             MAX((guint)width, min_width),
+                             MAX((guint)height, min_height));
+  if (format == MGLPT_PVRTC4)
+    levels[0].n_threads = n_threads;
+  else
+    g_thread_pool_push (pool, &levels[0], NULL);
+
+  for (i=1;i<n_levels && !_pvr_progress_stopped (&counter);i++)
+    {
+      gint level_width = MAX(width >> i, 1);
+      gint level_height = MAX(height >> i, 1);
+      guchar *pixels;
+
+      if (previous)
+        {
+          gint previous_width = MAX(width >> (i-1), 1);
+          gint previous_height = MAX(height >> (i-1), 1);
+          PvrTextureSource previous_source;
+
+          pvr_texture_source_init (&previous_source, previous,
+                                   previous_width, previous_height,
+                                   previous_width*4, 4);
+          pixels = downsample_source (&previous_source);
+          g_free (previous);
+        }
+      else
+        pixels = downsample_source (source);
+
+      /* keep an unpadded copy to make the next level from */
+      previous = i+1 < n_levels ?
+                 mipmap_pixels_copy (pixels, level_width, level_height) : NULL;
+
+      mipmap_level_set_pixels (&levels[i], pixels,
+                               level_width, level_height,
+                               MAX((guint)level_width, min_width),
+                               MAX((guint)level_height, min_height));
+      g_thread_pool_push (pool, &levels[i], NULL);
+    }
+
+  if (format == MGLPT_PVRTC4)
+    mipmap_level_compress (&levels[0], NULL);
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  /* the loop stops early if we are told to stop, so clear up what it
+   * didn't get to */
+  g_free (previous);
+  for (i=0;i<n_levels;i++)
+    g_free (levels[i].pixels);
+  g_free (levels);
+
+  if (counter.stopped)
+    {
+      g_free (compressed_data);
+      return 0;
+    }
+
+  *mipmap_count = n_levels - 1;
+  *compressed_size = total;
+  return compressed_data;
+}
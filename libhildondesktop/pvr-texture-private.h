@@ -0,0 +1,326 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef PVRTEXTUREPRIVATE_H_
+#define PVRTEXTUREPRIVATE_H_
+/* internals shared between the PVRTC encoder/decoder and its kernels */
+
+#include <glib.h>
+#include <string.h>
+
+#include "pvr-texture.h"
+
+typedef struct Color {
+  guchar red;
+  guchar green;
+  guchar blue;
+  guchar alpha;
+} Color;
+
+static inline gboolean
+is_power_2(int a)
+{
+  return !(a & (a - 1)) && a;
+}
+
+static inline guint32
+log_2(guint v)
+{
+  guint32 r; // result of log2(v) will go here
+  guint32 shift;
+
+  r =     (v > 0xFFFF) << 4; v >>= r;
+  shift = (v > 0xFF  ) << 3; v >>= shift; r |= shift;
+  shift = (v > 0xF   ) << 2; v >>= shift; r |= shift;
+  shift = (v > 0x3   ) << 1; v >>= shift; r |= shift;
+                                          r |= (v >> 1);
+  return r;
+}
+
+/* The 4 colours each of the 16 pixels of a block could be given: the low
+ * and high colours interpolated between the 4 blocks around where the
+ * pixel is, and the points 3/8 and 5/8 of the way between them. They are
+ * worked out once per block, a channel at a time, so colour c of pixel
+ * (x, y) is channel[red/green/blue/alpha][c][x + y*4]. flat has a bit set
+ * for every pixel whose 4 surrounding blocks all have the same low and
+ * high colour, which always get 0 (see block_flat_mask()) */
+typedef struct {
+  guint8  channel[4][4][16];
+  guint32 flat;
+} PvrBlockEndpoints;
+
+/* Fills in ends for one block. low and high point at the top-left of the
+ * 3x3 neighbourhood of (already quantised) block colours surrounding the
+ * block, in arrays that are block_stride entries wide.
+ *
+ * Every implementation must give exactly what the C one does, which does
+ * the same arithmetic as interpolating with color_interp().
+ */
+typedef void (*PvrBlockEndpointsFunc) (const Color       *low,
+                                       const Color       *high,
+                                       guint              block_stride,
+                                       PvrBlockEndpoints *ends);
+
+/* Works out the 2 bit modulation value of all 16 pixels of one block and
+ * returns them packed as the low word of a PVRTC4 block.
+ *
+ * block points at the top-left pixel of the block in an image that is
+ * width pixels wide, and ends holds the colours each of them can be
+ * given, from _pvr_texture_block_endpoints(). Each pixel gets the
+ * nearest one, so all that's left to do is measure distances.
+ *
+ * Every implementation must return exactly what the C one does, or
+ * textures that are already cached would change.
+ */
+typedef guint32 (*PvrEncodeModulationFunc) (const Color             *block,
+                                            guint                    width,
+                                            const PvrBlockEndpoints *ends);
+
+/* PvrBlockEndpoints.flat for a block: each quarter of it interpolates
+ * between the same 4 blocks, and if they all have the same colours we
+ * don't care what its pixels choose */
+static inline guint32
+block_flat_mask (const Color *low,
+                 const Color *high,
+                 guint        block_stride)
+{
+  guint32 flat = 0;
+  guint q;
+
+  for (q=0;q<4;q++)
+    {
+      guint offs = (q&1) + (q>>1)*block_stride;
+      guint32 l00, l01, l10, l11, h00, h01, h10, h11;
+
+      memcpy (&l00, &low[offs], sizeof (guint32));
+      memcpy (&l01, &low[offs+1], sizeof (guint32));
+      memcpy (&l10, &low[offs+block_stride], sizeof (guint32));
+      memcpy (&l11, &low[offs+block_stride+1], sizeof (guint32));
+      memcpy (&h00, &high[offs], sizeof (guint32));
+      memcpy (&h01, &high[offs+1], sizeof (guint32));
+      memcpy (&h10, &high[offs+block_stride], sizeof (guint32));
+      memcpy (&h11, &high[offs+block_stride+1], sizeof (guint32));
+
+      if (l00 == l01 && l10 == l11 && l10 == l00 &&
+          h00 == h01 && h10 == h11 && h10 == h00 &&
+          l00 == h00)
+        flat |= 0x33 << ((q&1)*2 + (q>>1)*8);
+    }
+
+  return flat;
+}
+
+/* Decodes the 16 pixels of one block, given its modulation word and
+ * whether it uses the punch-through alpha mode, into out, which is
+ * out_stride pixels wide. low and high point at the top-left of the 3x3
+ * neighbourhood of block colours surrounding the block, in arrays that
+ * are block_stride entries wide. */
+typedef void (*PvrDecodeBlockFunc) (guint32      modulation,
+                                    gboolean     alpha_mode,
+                                    const Color *low,
+                                    const Color *high,
+                                    guint        block_stride,
+                                    Color       *out,
+                                    guint        out_stride);
+
+/* Counts the steps of a compression as they are done, from whichever
+ * thread does them, and stops it part way through if func asks. func
+ * may be NULL */
+typedef struct {
+  PvrTextureProgressFunc  func;
+  gpointer                user_data;
+  guint                   total;
+  volatile gint           done;
+  volatile gint           stopped;
+} PvrProgress;
+
+static inline gboolean
+_pvr_progress_stopped (PvrProgress *progress)
+{
+  return progress && g_atomic_int_get (&progress->stopped);
+}
+
+/* Counts one step. Returns FALSE if the work should stop */
+static inline gboolean
+_pvr_progress_step (PvrProgress *progress)
+{
+  guint done;
+
+  if (!progress)
+    return TRUE;
+  if (g_atomic_int_get (&progress->stopped))
+    return FALSE;
+
+  done = g_atomic_int_add (&progress->done, 1) + 1;
+  if (progress->func &&
+      !progress->func (done, progress->total, progress->user_data))
+    {
+      g_atomic_int_set (&progress->stopped, 1);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Where the pixel at i in an image size pixels across, padded out to
+ * padded, comes from */
+static inline guint
+_pvr_texture_source_coord (guint i,
+                           guint size,
+                           guint padded)
+{
+  if (i < size)
+    return i;
+  if (i < (padded + size)/2)
+    return size - 1;
+  return 0;
+}
+
+/* pvr-texture-source.c */
+void    _pvr_texture_source_gather       (const PvrTextureSource *source,
+                                          guint                   x,
+                                          guint                   y,
+                                          guint                   width,
+                                          guint                   height,
+                                          Color                  *out);
+guchar *_pvr_texture_source_copy         (const PvrTextureSource *source);
+guint   _pvr_texture_compress_steps      (guint                   format,
+                                          gint                    width,
+                                          gint                    height);
+void    _pvr_texture_compress_into       (const PvrTextureSource *source,
+                                          guint                   format,
+                                          guint                   n_threads,
+                                          const PvrTextureOptions *options,
+                                          guchar                 *compressed_data,
+                                          guchar                 *scratch,
+                                          PvrProgress            *progress);
+
+/* Returns the width x height pixels of source at (x, y), which may be
+ * in the padding, as RGBA with rows *stride pixels apart. That's
+ * straight out of the source where it can be, otherwise they are
+ * gathered into scratch, which must have room for them all */
+static inline const Color *
+_pvr_texture_source_block (const PvrTextureSource *source,
+                           guint                   x,
+                           guint                   y,
+                           guint                   width,
+                           guint                   height,
+                           Color                  *scratch,
+                           guint                  *stride)
+{
+  if (source->n_channels == 4 &&
+      !(source->rowstride & 3) &&
+      x + width <= (guint)source->width &&
+      y + height <= (guint)source->height)
+    {
+      *stride = source->rowstride / 4;
+      return (const Color*)&source->pixels[y*source->rowstride + x*4];
+    }
+
+  _pvr_texture_source_gather (source, x, y, width, height, scratch);
+  *stride = width;
+  return scratch;
+}
+
+typedef enum {
+  PVR_SIMD_NONE = 0,
+  PVR_SIMD_SSE2,
+  PVR_SIMD_AVX2,
+  PVR_SIMD_NEON
+} PvrSimdLevel;
+
+typedef struct {
+  PvrSimdLevel             level;
+  const gchar             *name;
+  PvrBlockEndpointsFunc    block_endpoints;
+  PvrEncodeModulationFunc  encode_modulation;
+  PvrDecodeBlockFunc       decode_block;
+} PvrKernels;
+
+/* pvr-texture.c */
+void    _pvr_texture_block_endpoints     (const Color             *low,
+                                          const Color             *high,
+                                          guint                    block_stride,
+                                          PvrBlockEndpoints       *ends);
+guint32 _pvr_texture_encode_modulation_c (const Color             *block,
+                                          guint                    width,
+                                          const PvrBlockEndpoints *ends);
+void    _pvr_texture_decode_block_c      (guint32      modulation,
+                                          gboolean     alpha_mode,
+                                          const Color *low,
+                                          const Color *high,
+                                          guint        block_stride,
+                                          Color       *out,
+                                          guint        out_stride);
+gsize   _pvr_texture_surface_size        (guint        format,
+                                          guint        width,
+                                          guint        height);
+void    _pvr_texture_min_size            (guint        format,
+                                          guint       *width,
+                                          guint       *height);
+gsize   _pvr_texture_level_size          (guint        format,
+                                          guint        width,
+                                          guint        height,
+                                          guint        level);
+gboolean _pvr_texture_header_check       (PVR_TEXTURE_HEADER *head,
+                                          guint64             length);
+
+gsize   _pvr_texture_compress_scratch_size (guint                   width_block,
+                                            guint                   height_block);
+void    _pvr_texture_compress_pvrtc4_into  (const PvrTextureSource *source,
+                                            guint                   n_threads,
+                                            const PvrTextureOptions *options,
+                                            guchar                 *compressed_data,
+                                            guchar                 *scratch,
+                                            PvrProgress            *progress);
+void    _pvr_texture_compress_pvrtc2_into  (const PvrTextureSource *source,
+                                            const PvrTextureOptions *options,
+                                            guchar                 *compressed_data,
+                                            guchar                 *scratch,
+                                            PvrProgress            *progress);
+
+/* pvr-texture-etc1.c */
+void    _pvr_texture_compress_etc1_into    (const PvrTextureSource *source,
+                                            gboolean                thorough,
+                                            guchar                 *compressed_data,
+                                            PvrProgress            *progress);
+
+/* pvr-texture-twiddle.c */
+void    _pvr_texture_twiddle_init          (PvrTextureTwiddle      *twiddle,
+                                            guint                   width_block,
+                                            guint                   height_block,
+                                            guint32                *tables);
+
+/* The number of block (x, y), which must be inside the texture */
+static inline guint32
+_pvr_texture_twiddle_block (const PvrTextureTwiddle *twiddle,
+                            guint                    x,
+                            guint                    y)
+{
+  return twiddle->columns[x] | twiddle->rows[y];
+}
+
+/* pvr-texture-simd.c */
+const PvrKernels *_pvr_texture_kernels_get    (void);
+const PvrKernels *_pvr_texture_kernels_lookup (PvrSimdLevel level);
+
+#endif /*PVRTEXTUREPRIVATE_H_*/
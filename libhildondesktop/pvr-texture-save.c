@@ -0,0 +1,619 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Writing .pvr files so that anyone reading them only ever sees the old
+ * file or the complete new one, even after a crash.
+ *
+ * The header and data go out in one writev() to a file with no name
+ * (O_TMPFILE) where the kernel supports it, or a temporary one next to
+ * the texture otherwise. Only once the data is on disk is the file
+ * linked in where the texture goes, or renamed over it if there is one
+ * there already. Nothing is left behind if any of that fails.
+ *
+ * Syncing every file on its own is most of the time it takes to save
+ * a lot of small textures, so they can also be saved into a
+ * PvrTextureSaveGroup, which syncs each file system once for all of
+ * them and only then renames them into place.
+ */
+
+#define _GNU_SOURCE /* O_TMPFILE, linkat() and syncfs() */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "pvr-texture.h"
+
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* A file written to a temporary name, waiting to be renamed over
+ * filename */
+typedef struct {
+  gchar *tmp_name;
+  gchar *filename;
+} PendingSave;
+
+/* A descriptor of some file on each file system the group wrote to, for
+ * syncfs() */
+typedef struct {
+  dev_t device;
+  gint  fd;
+} GroupFilesystem;
+
+struct _PvrTextureSaveGroup {
+  GMutex  lock;
+  GArray *pending;      /* of PendingSave */
+  GArray *filesystems;  /* of GroupFilesystem */
+};
+
+static void
+set_error_from_errno (GError      **error,
+                      gint          saved_errno,
+                      const gchar  *format,
+                      const gchar  *filename)
+{
+  g_set_error (error,
+               G_FILE_ERROR,
+               g_file_error_from_errno (saved_errno),
+               format,
+               filename);
+}
+
+/* Writes all of iov, however many goes it takes */
+static gboolean
+write_all (gint          fd,
+           struct iovec *iov,
+           gint          n_iov)
+{
+  while (n_iov > 0)
+    {
+      gssize written = writev (fd, iov, n_iov);
+
+      if (written == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          return FALSE;
+        }
+      if (written == 0)
+        {
+          errno = EIO;
+          return FALSE;
+        }
+
+      while (n_iov > 0 && (gsize)written >= iov->iov_len)
+        {
+          written -= iov->iov_len;
+          iov++;
+          n_iov--;
+        }
+      if (n_iov > 0)
+        {
+          iov->iov_base = (guchar*)iov->iov_base + written;
+          iov->iov_len -= written;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Opens a new file to write the contents of filename to. If unnamed is
+ * set and the file system can make one without a name, *tmp_name is set
+ * to NULL, otherwise it is the file's temporary name. Returns -1 with
+ * errno set if neither could be made */
+static gint
+open_temp (const gchar  *filename,
+           gboolean      unnamed,
+           gchar       **tmp_name)
+{
+  gint fd;
+
+#ifdef O_TMPFILE
+  if (unnamed)
+    {
+      gchar *dir = g_path_get_dirname (filename);
+
+      fd = open (dir, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600);
+      g_free (dir);
+      if (fd != -1)
+        {
+          *tmp_name = NULL;
+          return fd;
+        }
+      /* otherwise the kernel or file system can't do it */
+    }
+#endif
+
+  *tmp_name = g_strdup_printf ("%sXXXXXX", filename);
+  fd = g_mkstemp (*tmp_name);
+  if (fd == -1)
+    {
+      gint saved_errno = errno;
+
+      g_free (*tmp_name);
+      *tmp_name = NULL;
+      errno = saved_errno;
+    }
+
+  return fd;
+}
+
+#ifdef O_TMPFILE
+/* Gives the unnamed file open as fd the name name */
+static gboolean
+link_temp (gint         fd,
+           const gchar *name)
+{
+  gchar path[32];
+
+  g_snprintf (path, sizeof (path), "/proc/self/fd/%d", fd);
+  return linkat (AT_FDCWD, path, AT_FDCWD, name, AT_SYMLINK_FOLLOW) == 0;
+}
+
+/* Gives the unnamed file open as fd a temporary name next to filename,
+ * and returns it */
+static gchar *
+link_temp_unique (gint         fd,
+                  const gchar *filename)
+{
+  static const gchar letters[] =
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+  gchar *name = g_strdup_printf ("%sXXXXXX", filename);
+  gchar *suffix = name + strlen (name) - 6;
+  guint tries, i;
+
+  for (tries=0;tries<100;tries++)
+    {
+      for (i=0;i<6;i++)
+        suffix[i] = letters[g_random_int_range (0, sizeof (letters) - 1)];
+      if (link_temp (fd, name))
+        return name;
+      if (errno != EEXIST)
+        break;
+    }
+
+  g_free (name);
+  return NULL;
+}
+#endif
+
+/* Remembers a descriptor on the file system of fd, unless the group
+ * already has one */
+static gboolean
+group_add_filesystem (PvrTextureSaveGroup *group,
+                      gint                 fd)
+{
+  GroupFilesystem fs;
+  struct stat st;
+  guint i;
+
+  if (fstat (fd, &st) == -1)
+    return FALSE;
+
+  for (i=0;i<group->filesystems->len;i++)
+    if (g_array_index (group->filesystems, GroupFilesystem, i).device ==
+        st.st_dev)
+      return TRUE;
+
+  fs.device = st.st_dev;
+  fs.fd = dup (fd);
+  if (fs.fd == -1)
+    return FALSE;
+  g_array_append_val (group->filesystems, fs);
+
+  return TRUE;
+}
+
+/* Writes the header and data to a new file, and once it is safely on
+ * disk puts it where filename is. In a group, it is only written, and
+ * the group sees to the rest */
+static gboolean
+save_atomically (const gchar          *filename,
+                 guint                 format,
+                 const guchar         *data,
+                 guint                 data_size,
+                 gint                  width,
+                 gint                  height,
+                 gboolean              mipmapped,
+                 guint                 mipmap_count,
+                 PvrTextureSaveGroup  *group,
+                 GError              **error)
+{
+  PVR_TEXTURE_HEADER head;
+  struct iovec iov[2];
+  gchar *tmp_name = NULL;
+  gboolean unnamed = TRUE;
+  gboolean in_place = FALSE;
+  gint fd;
+
+  /* Head */
+  head.dwHeaderSize = sizeof(PVR_TEXTURE_HEADER);     /* size of the structure */
+  head.dwHeight = height;         /* height of surface to be created */
+  head.dwWidth = width;          /* width of input surface */
+  head.dwMipMapCount = mipmap_count;    /* number of MIP-map levels requested */
+  /* ETC1 is stored in rows and has no alpha */
+  if (format == ETC_RGB_4BPP)
+    head.dwpfFlags = format;
+  else
+    head.dwpfFlags = format | PVR_FLAG_TWIDDLED | PVR_FLAG_ALPHA;        /* pixel format flags */
+  if (mipmapped)
+    head.dwpfFlags |= PVR_FLAG_MIPMAP;
+  head.dwDataSize = data_size;       /* Size of the compress data */
+  head.dwBitCount = format == MGLPT_PVRTC2 ? 2 : 4;       /* number of bits per pixel */
+  head.dwRBitMask = 0;       /* mask for red bit */
+  head.dwGBitMask = 0;       /* mask for green bits */
+  head.dwBBitMask = 0;       /* mask for blue bits */
+  head.dwAlphaBitMask = format == ETC_RGB_4BPP ? 0 : 1;   /* mask for alpha channel */
+  head.dwPVR = PVR_TEXTURE_MAGIC; /* should be 'P' 'V' 'R' '!' */
+  head.dwNumSurfs = 1;       /* number of slices for volume textures or skyboxes */
+
+#ifdef O_TMPFILE
+retry:
+#endif
+  fd = open_temp (filename, unnamed, &tmp_name);
+  if (fd == -1)
+    {
+      set_error_from_errno (error, errno,
+                            "Could not open template file for %s",
+                            filename);
+      return FALSE;
+    }
+
+  iov[0].iov_base = &head;
+  iov[0].iov_len = sizeof(PVR_TEXTURE_HEADER);
+  iov[1].iov_base = (guchar*)data;
+  iov[1].iov_len = data_size;
+  if (!write_all (fd, iov, 2))
+    {
+      set_error_from_errno (error, errno, "Could not write %s", filename);
+      goto fail;
+    }
+
+  if (!group && fdatasync (fd) == -1)
+    {
+      set_error_from_errno (error, errno, "Could not sync %s", filename);
+      goto fail;
+    }
+
+#ifdef O_TMPFILE
+  if (!tmp_name)
+    {
+      /* straight in place if there's nothing there yet, otherwise it
+       * needs a name to be renamed from */
+      if (!group && link_temp (fd, filename))
+        in_place = TRUE;
+      else if (!(tmp_name = link_temp_unique (fd, filename)))
+        {
+          /* most likely there's no /proc, so start again with a name */
+          close (fd);
+          unnamed = FALSE;
+          goto retry;
+        }
+    }
+#endif
+
+  if (group)
+    {
+      g_mutex_lock (&group->lock);
+      if (!group_add_filesystem (group, fd))
+        {
+          g_mutex_unlock (&group->lock);
+          set_error_from_errno (error, errno, "Could not sync %s", filename);
+          goto fail;
+        }
+      g_mutex_unlock (&group->lock);
+    }
+
+  if (close (fd) == -1)
+    {
+      fd = -1;
+      set_error_from_errno (error, errno, "Could not close %s", filename);
+      goto fail;
+    }
+  fd = -1;
+
+  if (group)
+    {
+      PendingSave save = { tmp_name, g_strdup (filename) };
+
+      g_mutex_lock (&group->lock);
+      g_array_append_val (group->pending, save);
+      g_mutex_unlock (&group->lock);
+      return TRUE;
+    }
+
+  if (!in_place && g_rename (tmp_name, filename) == -1)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error,
+                   G_FILE_ERROR,
+                   g_file_error_from_errno (saved_errno),
+                   "Could not rename %s to %s",
+                   tmp_name,
+                   filename);
+      goto fail;
+    }
+
+  g_free (tmp_name);
+  return TRUE;
+
+fail:
+  if (fd != -1)
+    close (fd);
+  if (tmp_name)
+    {
+      g_unlink (tmp_name);
+      g_free (tmp_name);
+    }
+  return FALSE;
+}
+
+/**
+ * pvr_texture_save_atomically:
+ *
+ * Writes already compressed data in the given format (MGLPT_PVRTC4,
+ * MGLPT_PVRTC2 or ETC_RGB_4BPP) to filename, replacing any existing file
+ * atomically.
+ */
+gboolean
+pvr_texture_save_atomically (const gchar   *filename,
+                             guint          format,
+                             const guchar  *data,
+                             guint          data_size,
+                             gint           width,
+                             gint           height,
+                             GError       **error)
+{
+  return save_atomically (filename, format,
+                          data, data_size,
+                          width, height,
+                          FALSE, 0,
+                          NULL, error);
+}
+
+/**
+ * pvr_texture_save_mipmaps_atomically:
+ *
+ * As pvr_texture_save_atomically(), but data holds the top level followed
+ * by mipmap_count smaller levels, as returned by
+ * pvr_texture_compress_mipmaps().
+ */
+gboolean
+pvr_texture_save_mipmaps_atomically (const gchar   *filename,
+                                     guint          format,
+                                     const guchar  *data,
+                                     guint          data_size,
+                                     gint           width,
+                                     gint           height,
+                                     guint          mipmap_count,
+                                     GError       **error)
+{
+  return save_atomically (filename, format,
+                          data, data_size,
+                          width, height,
+                          TRUE, mipmap_count,
+                          NULL, error);
+}
+
+gboolean
+pvr_texture_save_pvrtc4_atomically (const gchar   *filename,
+                                    const guchar  *data,
+                                    guint          data_size,
+                                    gint           width,
+                                    gint           height,
+                                    GError       **error)
+{
+  return pvr_texture_save_atomically (filename, MGLPT_PVRTC4,
+                                      data, data_size,
+                                      width, height,
+                                      error);
+}
+
+/**
+ * pvr_texture_save_group_new:
+ *
+ * Makes a group for saving a lot of textures at once. Free with
+ * pvr_texture_save_group_free().
+ */
+PvrTextureSaveGroup *
+pvr_texture_save_group_new (void)
+{
+  PvrTextureSaveGroup *group = g_slice_new (PvrTextureSaveGroup);
+
+  g_mutex_init (&group->lock);
+  group->pending = g_array_new (FALSE, FALSE, sizeof (PendingSave));
+  group->filesystems = g_array_new (FALSE, FALSE, sizeof (GroupFilesystem));
+
+  return group;
+}
+
+/**
+ * pvr_texture_save_group_add:
+ *
+ * Writes a texture as pvr_texture_save_mipmaps_atomically() does (or as
+ * pvr_texture_save_atomically() does, if mipmap_count is 0), but without
+ * waiting for it to reach the disk. Whatever was at filename stays there
+ * until the group is committed. Can be called from any thread.
+ */
+gboolean
+pvr_texture_save_group_add (PvrTextureSaveGroup  *group,
+                            const gchar          *filename,
+                            guint                 format,
+                            const guchar         *data,
+                            guint                 data_size,
+                            gint                  width,
+                            gint                  height,
+                            guint                 mipmap_count,
+                            GError              **error)
+{
+  g_return_val_if_fail (group != NULL, FALSE);
+
+  return save_atomically (filename, format,
+                          data, data_size,
+                          width, height,
+                          mipmap_count > 0, mipmap_count,
+                          group, error);
+}
+
+/* Flushes every file system in filesystems to disk */
+static gboolean
+sync_filesystems (GArray  *filesystems,
+                  GError **error)
+{
+#ifdef HAVE_SYNCFS
+  guint i;
+
+  for (i=0;i<filesystems->len;i++)
+    if (syncfs (g_array_index (filesystems, GroupFilesystem, i).fd) == -1)
+      {
+        set_error_from_errno (error, errno, "Could not sync %s",
+                              "saved textures");
+        return FALSE;
+      }
+#else
+  if (filesystems->len)
+    sync ();
+#endif
+
+  return TRUE;
+}
+
+/* Closes and empties filesystems */
+static void
+close_filesystems (GArray *filesystems)
+{
+  guint i;
+
+  for (i=0;i<filesystems->len;i++)
+    close (g_array_index (filesystems, GroupFilesystem, i).fd);
+  g_array_set_size (filesystems, 0);
+}
+
+/* Removes the temporary files of pending and empties it */
+static void
+discard_pending (GArray *pending)
+{
+  guint i;
+
+  for (i=0;i<pending->len;i++)
+    {
+      PendingSave *save = &g_array_index (pending, PendingSave, i);
+
+      g_unlink (save->tmp_name);
+      g_free (save->tmp_name);
+      g_free (save->filename);
+    }
+  g_array_set_size (pending, 0);
+}
+
+/**
+ * pvr_texture_save_group_commit:
+ *
+ * Waits for every texture added to group to reach the disk, with one
+ * sync of each file system they are on, and then puts them all in place
+ * and syncs again. Once it returns, they are all there and will stay
+ * there. If a texture can't be put in place the rest still are, and the
+ * first error is returned. If they can't be synced, none of them are.
+ *
+ * The group is then empty, and can be used again.
+ */
+gboolean
+pvr_texture_save_group_commit (PvrTextureSaveGroup  *group,
+                               GError              **error)
+{
+  GArray *pending, *filesystems;
+  gboolean ok;
+  guint i;
+
+  g_return_val_if_fail (group != NULL, FALSE);
+
+  g_mutex_lock (&group->lock);
+  pending = group->pending;
+  filesystems = group->filesystems;
+  group->pending = g_array_new (FALSE, FALSE, sizeof (PendingSave));
+  group->filesystems = g_array_new (FALSE, FALSE, sizeof (GroupFilesystem));
+  g_mutex_unlock (&group->lock);
+
+  ok = sync_filesystems (filesystems, error);
+  if (!ok)
+    discard_pending (pending);
+
+  for (i=0;i<pending->len;i++)
+    {
+      PendingSave *save = &g_array_index (pending, PendingSave, i);
+
+      if (g_rename (save->tmp_name, save->filename) == -1)
+        {
+          gint saved_errno = errno;
+
+          if (ok)
+            g_set_error (error,
+                         G_FILE_ERROR,
+                         g_file_error_from_errno (saved_errno),
+                         "Could not rename %s to %s",
+                         save->tmp_name,
+                         save->filename);
+          ok = FALSE;
+          g_unlink (save->tmp_name);
+        }
+      g_free (save->tmp_name);
+      g_free (save->filename);
+    }
+
+  /* and the renames themselves */
+  if (pending->len && !sync_filesystems (filesystems, ok ? error : NULL))
+    ok = FALSE;
+
+  close_filesystems (filesystems);
+  g_array_free (filesystems, TRUE);
+  g_array_free (pending, TRUE);
+
+  return ok;
+}
+
+/**
+ * pvr_texture_save_group_free:
+ *
+ * Frees group, throwing away any textures added since it was last
+ * committed.
+ */
+void
+pvr_texture_save_group_free (PvrTextureSaveGroup *group)
+{
+  if (!group)
+    return;
+
+  discard_pending (group->pending);
+  close_filesystems (group->filesystems);
+  g_array_free (group->pending, TRUE);
+  g_array_free (group->filesystems, TRUE);
+  g_mutex_clear (&group->lock);
+  g_slice_free (PvrTextureSaveGroup, group);
+}
@@ -0,0 +1,657 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* SIMD versions of the PVRTC4 modulation search and block decoder,
+ * picked at runtime */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "pvr-texture-private.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON_KERNELS 1
+#include <arm_neon.h>
+#endif
+
+#if HAVE_X86_KERNELS | HAVE_NEON_KERNELS
+/* Weights for the spatial interpolation, indexed by how far (0..3) the
+ * pixel is between two block centres. color_interp() copies src1 when the
+ * amount is 0 instead of scaling it by 255/256, so that case gets a weight
+ * of 256 here: (a * 256) >> 8 == a, and 255 * 256 still fits in 16 bits */
+static const guint16 interp_weight_src1[4] = { 256, 191, 127, 63 };
+static const guint16 interp_weight_src2[4] = {   0,  64, 128, 192 };
+
+/* Weights of the low and high colour for each modulation value when
+ * decoding, the normal mode first and then the punch-through alpha mode.
+ * 0 and 3 are copies of low and high, see above for why they're 256 */
+static const guint16 modulation_weight_low[8] = {
+  256, 159,  95,   0,
+  256, 127, 127,   0
+};
+static const guint16 modulation_weight_high[8] = {
+    0,  96, 160, 256,
+    0, 128, 128, 256
+};
+
+/* Spreads the 16 bits of mask out to the even bits of a word, where the
+ * low bits of the 2 bit codes of the 16 pixels go */
+static inline guint32
+spread_bits (guint32 mask)
+{
+  mask = (mask | (mask << 8)) & 0x00FF00FF;
+  mask = (mask | (mask << 4)) & 0x0F0F0F0F;
+  mask = (mask | (mask << 2)) & 0x33333333;
+  mask = (mask | (mask << 1)) & 0x55555555;
+  return mask;
+}
+
+/* Packs the modulation word from masks of which pixels' codes have their
+ * low and high bits set, leaving the flat pixels at 0 */
+static inline guint32
+pack_modulation (guint32                  bit0,
+                 guint32                  bit1,
+                 const PvrBlockEndpoints *ends)
+{
+  return spread_bits (bit0 & ~ends->flat) |
+         (spread_bits (bit1 & ~ends->flat) << 1);
+}
+
+static inline guint32
+color_to_word (const Color *col)
+{
+  guint32 word;
+
+  memcpy (&word, col, sizeof (guint32));
+  return word;
+}
+#endif
+
+#if HAVE_X86_KERNELS
+/* Each pixel is handled as one vector of 8 16 bit lanes: the RGBA of the
+ * low colour followed by the RGBA of the high colour, so both sets of
+ * endpoints are interpolated at once */
+
+__attribute__((target("sse2")))
+static inline __m128i
+load_endpoints_sse2 (const Color *low,
+                     const Color *high)
+{
+  return _mm_unpacklo_epi8 (
+            _mm_unpacklo_epi32 (_mm_cvtsi32_si128 (color_to_word (low)),
+                                _mm_cvtsi32_si128 (color_to_word (high))),
+            _mm_setzero_si128 ());
+}
+
+__attribute__((target("sse2")))
+static inline __m128i
+interp_sse2 (__m128i a,
+             __m128i b,
+             guint   amt)
+{
+  return _mm_srli_epi16 (
+            _mm_add_epi16 (
+                _mm_mullo_epi16 (a, _mm_set1_epi16 (interp_weight_src1[amt])),
+                _mm_mullo_epi16 (b, _mm_set1_epi16 (interp_weight_src2[amt]))),
+            8);
+}
+
+/* Works out the 4 colours of each pixel a pixel at a time, as the RGBA of
+ * each in 16 bit lanes, and then transposes them into channels */
+__attribute__((target("sse2")))
+static void
+block_endpoints_sse2 (const Color       *low,
+                      const Color       *high,
+                      guint              block_stride,
+                      PvrBlockEndpoints *ends)
+{
+  const __m128i mid_weight_low = _mm_setr_epi16 (159, 159, 159, 159,
+                                                 95, 95, 95, 95);
+  const __m128i mid_weight_high = _mm_setr_epi16 (96, 96, 96, 96,
+                                                  160, 160, 160, 160);
+  __m128i rows[3][4], pixels[16];
+  guint r, x, y, round, i;
+
+  /* each row of the neighbourhood interpolated across, for each column
+   * of pixels */
+  for (r=0;r<3;r++)
+    {
+      const Color *l = &low[r*block_stride];
+      const Color *h = &high[r*block_stride];
+      __m128i c0 = load_endpoints_sse2 (&l[0], &h[0]);
+      __m128i c1 = load_endpoints_sse2 (&l[1], &h[1]);
+      __m128i c2 = load_endpoints_sse2 (&l[2], &h[2]);
+
+      rows[r][0] = interp_sse2 (c0, c1, 2);
+      rows[r][1] = interp_sse2 (c0, c1, 3);
+      rows[r][2] = c1;
+      rows[r][3] = interp_sse2 (c1, c2, 1);
+    }
+
+  /* then down, giving the low and high colour of each pixel, and from
+   * them the 3/8 and 5/8 points. Packed as the 16 bytes low, 3/8, 5/8,
+   * high */
+  for (y=0;y<4;y++)
+    for (x=0;x<4;x++)
+      {
+        __m128i ends_lh, mid;
+
+        ends_lh = interp_sse2 (rows[(y+2)>>2][x], rows[((y+2)>>2) + 1][x],
+                               (y+2)&3);
+        mid = _mm_srli_epi16 (
+                _mm_add_epi16 (
+                    _mm_mullo_epi16 (_mm_unpacklo_epi64 (ends_lh, ends_lh),
+                                     mid_weight_low),
+                    _mm_mullo_epi16 (_mm_unpackhi_epi64 (ends_lh, ends_lh),
+                                     mid_weight_high)),
+                8);
+        pixels[x + y*4] = _mm_shuffle_epi32 (_mm_packus_epi16 (ends_lh, mid),
+                                             _MM_SHUFFLE (1, 3, 2, 0));
+      }
+
+  /* Transpose the 16x16 bytes. Each round moves the top bit of the pixel
+   * index to the bottom of the byte index, and the top bit of that to
+   * the bottom of the pixel index; after 4 they have swapped over */
+  for (round=0;round<4;round++)
+    {
+      __m128i shuffled[16];
+
+      for (i=0;i<8;i++)
+        {
+          shuffled[2*i] = _mm_unpacklo_epi8 (pixels[i], pixels[i+8]);
+          shuffled[2*i+1] = _mm_unpackhi_epi8 (pixels[i], pixels[i+8]);
+        }
+      memcpy (pixels, shuffled, sizeof (pixels));
+    }
+
+  /* pixels[k*4 + c] is now channel c of colour k */
+  for (i=0;i<16;i++)
+    _mm_storeu_si128 ((__m128i *) ends->channel[i&3][i>>2], pixels[i]);
+
+  ends->flat = block_flat_mask (low, high, block_stride);
+}
+
+/* Transposes the 16 RGBA pixels of a block into one vector of 16 bytes
+ * per channel, in the same order as PvrBlockEndpoints */
+__attribute__((target("sse2")))
+static inline void
+load_block_sse2 (const Color *block,
+                 guint        width,
+                 __m128i      channel[4])
+{
+  const __m128i mask = _mm_set1_epi32 (0xFF);
+  __m128i row[4];
+  guint c;
+
+  for (c=0;c<4;c++)
+    row[c] = _mm_loadu_si128 ((const __m128i *) &block[c*width]);
+
+  for (c=0;c<4;c++)
+    {
+      __m128i shift = _mm_cvtsi32_si128 (c*8);
+
+      channel[c] = _mm_packus_epi16 (
+          _mm_packs_epi32 (_mm_and_si128 (_mm_srl_epi32 (row[0], shift), mask),
+                           _mm_and_si128 (_mm_srl_epi32 (row[1], shift), mask)),
+          _mm_packs_epi32 (_mm_and_si128 (_mm_srl_epi32 (row[2], shift), mask),
+                           _mm_and_si128 (_mm_srl_epi32 (row[3], shift), mask)));
+    }
+}
+
+__attribute__((target("sse2")))
+static inline __m128i
+absdiff_sse2 (__m128i a,
+              __m128i b)
+{
+  return _mm_or_si128 (_mm_subs_epu16 (a, b), _mm_subs_epu16 (b, a));
+}
+
+/* Gives the codes of 8 pixels from their distances to the 4 colours,
+ * with the same tie-breaking as find_best(), as masks of the low and high
+ * bits in 16 bit lanes */
+__attribute__((target("sse2")))
+static inline void
+pick_best_sse2 (const __m128i  diff[4],
+                __m128i       *bit0,
+                __m128i       *bit1)
+{
+  __m128i c0, c1, c2, c3;
+
+  c0 = _mm_and_si128 (_mm_and_si128 (_mm_cmplt_epi16 (diff[0], diff[1]),
+                                     _mm_cmplt_epi16 (diff[0], diff[2])),
+                      _mm_cmplt_epi16 (diff[0], diff[3]));
+  c1 = _mm_andnot_si128 (c0,
+                         _mm_and_si128 (_mm_cmplt_epi16 (diff[1], diff[2]),
+                                        _mm_cmplt_epi16 (diff[1], diff[3])));
+  c2 = _mm_andnot_si128 (_mm_or_si128 (c0, c1),
+                         _mm_cmplt_epi16 (diff[2], diff[3]));
+  c3 = _mm_andnot_si128 (_mm_or_si128 (_mm_or_si128 (c0, c1), c2),
+                         _mm_set1_epi16 (-1));
+  *bit0 = _mm_or_si128 (c1, c3);
+  *bit1 = _mm_or_si128 (c2, c3);
+}
+
+/* The 16 pixels are done as two halves of 8, with each channel in 16 bit
+ * lanes so the distances can't overflow */
+__attribute__((target("sse2")))
+static guint32
+encode_modulation_sse2 (const Color             *block,
+                        guint                    width,
+                        const PvrBlockEndpoints *ends)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i pixels[4], bit0[2], bit1[2];
+  guint half, c, k;
+
+  load_block_sse2 (block, width, pixels);
+
+  for (half=0;half<2;half++)
+    {
+      __m128i diff[4];
+
+      for (k=0;k<4;k++)
+        {
+          diff[k] = zero;
+          for (c=0;c<4;c++)
+            {
+              __m128i col = _mm_loadu_si128 (
+                  (const __m128i *) ends->channel[c][k]);
+              __m128i p = pixels[c];
+
+              if (half)
+                {
+                  col = _mm_unpackhi_epi8 (col, zero);
+                  p = _mm_unpackhi_epi8 (p, zero);
+                }
+              else
+                {
+                  col = _mm_unpacklo_epi8 (col, zero);
+                  p = _mm_unpacklo_epi8 (p, zero);
+                }
+              diff[k] = _mm_add_epi16 (diff[k], absdiff_sse2 (p, col));
+            }
+        }
+      pick_best_sse2 (diff, &bit0[half], &bit1[half]);
+    }
+
+  return pack_modulation (
+      _mm_movemask_epi8 (_mm_packs_epi16 (bit0[0], bit0[1])),
+      _mm_movemask_epi8 (_mm_packs_epi16 (bit1[0], bit1[1])),
+      ends);
+}
+
+__attribute__((target("sse2")))
+static void
+decode_block_sse2 (guint32      pixel_bits_word,
+                   gboolean     block_alpha_mode,
+                   const Color *low,
+                   const Color *high,
+                   guint        block_stride,
+                   Color       *out,
+                   guint        out_stride)
+{
+  guint mode = block_alpha_mode ? 4 : 0;
+  guint qx, qy, bx, by;
+
+  for (qy=0;qy<2;qy++)
+    for (qx=0;qx<2;qx++)
+      {
+        const Color *l = &low[qx + qy*block_stride];
+        const Color *h = &high[qx + qy*block_stride];
+        __m128i c00, c01, c10, c11;
+
+        c00 = load_endpoints_sse2 (&l[0], &h[0]);
+        c01 = load_endpoints_sse2 (&l[1], &h[1]);
+        c10 = load_endpoints_sse2 (&l[block_stride], &h[block_stride]);
+        c11 = load_endpoints_sse2 (&l[block_stride+1], &h[block_stride+1]);
+
+        for (by=qy*2;by<qy*2+2;by++)
+          for (bx=qx*2;bx<qx*2+2;bx++)
+            {
+              guint pixel_bits = (pixel_bits_word >> (2 * (bx + by*4))) & 3;
+              guint32 word;
+              __m128i ends, col;
+
+              ends = interp_sse2 (interp_sse2 (c00, c01, (bx+2)&3),
+                                  interp_sse2 (c10, c11, (bx+2)&3),
+                                  (by+2)&3);
+              col = _mm_srli_epi16 (
+                      _mm_add_epi16 (
+                          _mm_mullo_epi16 (
+                              ends,
+                              _mm_set1_epi16 (modulation_weight_low[mode + pixel_bits])),
+                          _mm_mullo_epi16 (
+                              _mm_unpackhi_epi64 (ends, ends),
+                              _mm_set1_epi16 (modulation_weight_high[mode + pixel_bits]))),
+                      8);
+              word = _mm_cvtsi128_si32 (_mm_packus_epi16 (col, col));
+
+              memcpy (&out[bx + by*out_stride], &word, sizeof (guint32));
+              if (block_alpha_mode && pixel_bits == 2)
+                out[bx + by*out_stride].alpha = 0;
+            }
+      }
+}
+
+/* As the SSE2 version, but with all 16 pixels in one vector */
+
+__attribute__((target("avx2")))
+static inline __m256i
+absdiff_avx2 (__m256i a,
+              __m256i b)
+{
+  return _mm256_or_si256 (_mm256_subs_epu16 (a, b), _mm256_subs_epu16 (b, a));
+}
+
+/* the 16 bit lane masks packed down to one bit per pixel */
+__attribute__((target("avx2")))
+static inline guint32
+movemask_avx2 (__m256i mask)
+{
+  return _mm_movemask_epi8 (
+            _mm_packs_epi16 (_mm256_castsi256_si128 (mask),
+                             _mm256_extracti128_si256 (mask, 1)));
+}
+
+__attribute__((target("avx2")))
+static guint32
+encode_modulation_avx2 (const Color             *block,
+                        guint                    width,
+                        const PvrBlockEndpoints *ends)
+{
+  __m128i channel[4];
+  __m256i pixels[4], diff[4], c0, c1, c2, c3;
+  guint c, k;
+
+  load_block_sse2 (block, width, channel);
+  for (c=0;c<4;c++)
+    pixels[c] = _mm256_cvtepu8_epi16 (channel[c]);
+
+  for (k=0;k<4;k++)
+    {
+      diff[k] = _mm256_setzero_si256 ();
+      for (c=0;c<4;c++)
+        diff[k] = _mm256_add_epi16 (
+            diff[k],
+            absdiff_avx2 (pixels[c],
+                          _mm256_cvtepu8_epi16 (_mm_loadu_si128 (
+                              (const __m128i *) ends->channel[c][k]))));
+    }
+
+  c0 = _mm256_and_si256 (_mm256_and_si256 (_mm256_cmpgt_epi16 (diff[1], diff[0]),
+                                           _mm256_cmpgt_epi16 (diff[2], diff[0])),
+                         _mm256_cmpgt_epi16 (diff[3], diff[0]));
+  c1 = _mm256_andnot_si256 (c0,
+                            _mm256_and_si256 (_mm256_cmpgt_epi16 (diff[2], diff[1]),
+                                              _mm256_cmpgt_epi16 (diff[3], diff[1])));
+  c2 = _mm256_andnot_si256 (_mm256_or_si256 (c0, c1),
+                            _mm256_cmpgt_epi16 (diff[3], diff[2]));
+  c3 = _mm256_andnot_si256 (_mm256_or_si256 (_mm256_or_si256 (c0, c1), c2),
+                            _mm256_set1_epi16 (-1));
+
+  return pack_modulation (movemask_avx2 (_mm256_or_si256 (c1, c3)),
+                          movemask_avx2 (_mm256_or_si256 (c2, c3)),
+                          ends);
+}
+#endif
+
+#if HAVE_NEON_KERNELS
+static inline uint16x8_t
+load_endpoints_neon (const Color *low,
+                     const Color *high)
+{
+  return vmovl_u8 (vcreate_u8 ((guint64) color_to_word (low) |
+                               ((guint64) color_to_word (high) << 32)));
+}
+
+static inline uint16x8_t
+interp_neon (uint16x8_t a,
+             uint16x8_t b,
+             guint      amt)
+{
+  return vshrq_n_u16 (vmlaq_u16 (vmulq_u16 (a,
+                                            vdupq_n_u16 (interp_weight_src1[amt])),
+                                 b,
+                                 vdupq_n_u16 (interp_weight_src2[amt])),
+                      8);
+}
+
+/* one bit per byte of mask, like _mm_movemask_epi8() */
+static inline guint32
+movemask_neon (uint8x16_t mask)
+{
+  static const guint8 bits[16] = {
+    1, 2, 4, 8, 16, 32, 64, 128,
+    1, 2, 4, 8, 16, 32, 64, 128
+  };
+  uint8x16_t masked = vandq_u8 (mask, vld1q_u8 (bits));
+  uint8x8_t sum;
+
+  sum = vpadd_u8 (vget_low_u8 (masked), vget_high_u8 (masked));
+  sum = vpadd_u8 (sum, sum);
+  sum = vpadd_u8 (sum, sum);
+  return vget_lane_u8 (sum, 0) | (vget_lane_u8 (sum, 1) << 8);
+}
+
+/* The 16 pixels are split into channels by vld4q_u8(), and the distances
+ * worked out in 16 bit lanes 8 pixels at a time */
+static guint32
+encode_modulation_neon (const Color             *block,
+                        guint                    width,
+                        const PvrBlockEndpoints *ends)
+{
+  Color rows[16];
+  uint8x16x4_t pixels;
+  uint16x8_t diff[4][2];
+  uint8x16_t c0, c1, c2, c3;
+  guint c, k, half;
+
+  if (width != 4)
+    {
+      for (c=0;c<4;c++)
+        memcpy (&rows[c*4], &block[c*width], 4 * sizeof (Color));
+      block = rows;
+    }
+  pixels = vld4q_u8 ((const guint8 *) block);
+
+  for (k=0;k<4;k++)
+    {
+      uint8x16_t col = vld1q_u8 (ends->channel[0][k]);
+
+      diff[k][0] = vabdl_u8 (vget_low_u8 (pixels.val[0]), vget_low_u8 (col));
+      diff[k][1] = vabdl_u8 (vget_high_u8 (pixels.val[0]), vget_high_u8 (col));
+      for (c=1;c<4;c++)
+        {
+          col = vld1q_u8 (ends->channel[c][k]);
+          diff[k][0] = vabal_u8 (diff[k][0], vget_low_u8 (pixels.val[c]),
+                                 vget_low_u8 (col));
+          diff[k][1] = vabal_u8 (diff[k][1], vget_high_u8 (pixels.val[c]),
+                                 vget_high_u8 (col));
+        }
+    }
+
+  /* same tie-breaking as find_best() */
+  for (half=0;half<2;half++)
+    {
+      uint16x8_t m0, m1, m2;
+
+      m0 = vandq_u16 (vandq_u16 (vcltq_u16 (diff[0][half], diff[1][half]),
+                                 vcltq_u16 (diff[0][half], diff[2][half])),
+                      vcltq_u16 (diff[0][half], diff[3][half]));
+      m1 = vbicq_u16 (vandq_u16 (vcltq_u16 (diff[1][half], diff[2][half]),
+                                 vcltq_u16 (diff[1][half], diff[3][half])),
+                      m0);
+      m2 = vbicq_u16 (vcltq_u16 (diff[2][half], diff[3][half]),
+                      vorrq_u16 (m0, m1));
+      diff[0][half] = m0;
+      diff[1][half] = m1;
+      diff[2][half] = m2;
+    }
+  c0 = vcombine_u8 (vmovn_u16 (diff[0][0]), vmovn_u16 (diff[0][1]));
+  c1 = vcombine_u8 (vmovn_u16 (diff[1][0]), vmovn_u16 (diff[1][1]));
+  c2 = vcombine_u8 (vmovn_u16 (diff[2][0]), vmovn_u16 (diff[2][1]));
+  c3 = vmvnq_u8 (vorrq_u8 (vorrq_u8 (c0, c1), c2));
+
+  return pack_modulation (movemask_neon (vorrq_u8 (c1, c3)),
+                          movemask_neon (vorrq_u8 (c2, c3)),
+                          ends);
+}
+
+static void
+decode_block_neon (guint32      pixel_bits_word,
+                   gboolean     block_alpha_mode,
+                   const Color *low,
+                   const Color *high,
+                   guint        block_stride,
+                   Color       *out,
+                   guint        out_stride)
+{
+  guint mode = block_alpha_mode ? 4 : 0;
+  guint qx, qy, bx, by;
+
+  for (qy=0;qy<2;qy++)
+    for (qx=0;qx<2;qx++)
+      {
+        const Color *l = &low[qx + qy*block_stride];
+        const Color *h = &high[qx + qy*block_stride];
+        uint16x8_t c00, c01, c10, c11;
+
+        c00 = load_endpoints_neon (&l[0], &h[0]);
+        c01 = load_endpoints_neon (&l[1], &h[1]);
+        c10 = load_endpoints_neon (&l[block_stride], &h[block_stride]);
+        c11 = load_endpoints_neon (&l[block_stride+1], &h[block_stride+1]);
+
+        for (by=qy*2;by<qy*2+2;by++)
+          for (bx=qx*2;bx<qx*2+2;bx++)
+            {
+              guint pixel_bits = (pixel_bits_word >> (2 * (bx + by*4))) & 3;
+              guint32 word;
+              uint16x8_t ends;
+              uint16x4_t col;
+
+              ends = interp_neon (interp_neon (c00, c01, (bx+2)&3),
+                                  interp_neon (c10, c11, (bx+2)&3),
+                                  (by+2)&3);
+              col = vshr_n_u16 (
+                      vmla_u16 (
+                          vmul_u16 (vget_low_u16 (ends),
+                                    vdup_n_u16 (modulation_weight_low[mode + pixel_bits])),
+                          vget_high_u16 (ends),
+                          vdup_n_u16 (modulation_weight_high[mode + pixel_bits])),
+                      8);
+              word = vget_lane_u32 (
+                       vreinterpret_u32_u8 (vmovn_u16 (vcombine_u16 (col, col))),
+                       0);
+
+              memcpy (&out[bx + by*out_stride], &word, sizeof (guint32));
+              if (block_alpha_mode && pixel_bits == 2)
+                out[bx + by*out_stride].alpha = 0;
+            }
+      }
+}
+#endif
+
+static const PvrKernels kernels_c = {
+  PVR_SIMD_NONE, "c",
+  _pvr_texture_block_endpoints,
+  _pvr_texture_encode_modulation_c,
+  _pvr_texture_decode_block_c
+};
+#if HAVE_X86_KERNELS
+static const PvrKernels kernels_sse2 = {
+  PVR_SIMD_SSE2, "sse2",
+  block_endpoints_sse2,
+  encode_modulation_sse2,
+  decode_block_sse2
+};
+static const PvrKernels kernels_avx2 = {
+  PVR_SIMD_AVX2, "avx2",
+  block_endpoints_sse2,
+  encode_modulation_avx2,
+  decode_block_sse2
+};
+#endif
+#if HAVE_NEON_KERNELS
+static const PvrKernels kernels_neon = {
+  PVR_SIMD_NEON, "neon",
+  _pvr_texture_block_endpoints,
+  encode_modulation_neon,
+  decode_block_neon
+};
+#endif
+
+/* Returns the kernels for the given instruction set, or NULL if they
+ * weren't built in or the CPU we're running on can't use them */
+const PvrKernels *
+_pvr_texture_kernels_lookup (PvrSimdLevel level)
+{
+  switch (level)
+    {
+    case PVR_SIMD_NONE:
+      return &kernels_c;
+#if HAVE_X86_KERNELS
+    case PVR_SIMD_SSE2:
+      __builtin_cpu_init ();
+      return __builtin_cpu_supports ("sse2") ? &kernels_sse2 : NULL;
+    case PVR_SIMD_AVX2:
+      __builtin_cpu_init ();
+      return __builtin_cpu_supports ("avx2") ? &kernels_avx2 : NULL;
+#endif
+#if HAVE_NEON_KERNELS
+    case PVR_SIMD_NEON:
+      return &kernels_neon;
+#endif
+    default:
+      return NULL;
+    }
+}
+
+/* Returns the fastest kernels this CPU can run */
+const PvrKernels *
+_pvr_texture_kernels_get (void)
+{
+  static gsize kernels = 0;
+
+  if (g_once_init_enter (&kernels))
+    {
+      static const PvrSimdLevel preferred[] = {
+        PVR_SIMD_AVX2, PVR_SIMD_NEON, PVR_SIMD_SSE2, PVR_SIMD_NONE
+      };
+      const PvrKernels *best = NULL;
+      guint i;
+
+      for (i = 0; !best; i++)
+        best = _pvr_texture_kernels_lookup (preferred[i]);
+
+      g_once_init_leave (&kernels, (gsize) best);
+    }
+
+  return (const PvrKernels *) kernels;
+}
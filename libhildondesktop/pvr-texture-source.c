@@ -0,0 +1,303 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Reading the pixels to be compressed straight out of the caller's
+ * buffer (usually a GdkPixbuf), whatever its row stride and whether or
+ * not it has alpha, and making up the padding out to a power of 2 as the
+ * encoders ask for it. That way no padded RGBA copy of the whole image
+ * ever has to be made.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "pvr-texture.h"
+#include "pvr-texture-private.h"
+
+/**
+ * pvr_texture_source_init:
+ *
+ * Fills in source to read the given pixels, with no padding.
+ */
+void
+pvr_texture_source_init (PvrTextureSource *source,
+                         const guchar     *pixels,
+                         gint              width,
+                         gint              height,
+                         gint              rowstride,
+                         gint              n_channels)
+{
+  source->pixels = pixels;
+  source->width = width;
+  source->height = height;
+  source->rowstride = rowstride;
+  source->n_channels = n_channels;
+  source->padded_width = width;
+  source->padded_height = height;
+}
+
+/* Copies the width x height pixels at (x, y) in the padded image to out
+ * as RGBA, in rows width pixels long */
+void
+_pvr_texture_source_gather (const PvrTextureSource *source,
+                            guint                   x,
+                            guint                   y,
+                            guint                   width,
+                            guint                   height,
+                            Color                  *out)
+{
+  guint n_channels = source->n_channels;
+  guint i, j;
+
+  for (j=0;j<height;j++)
+    {
+      const guchar *line = &source->pixels[
+            _pvr_texture_source_coord (y + j, source->height,
+                                       source->padded_height) *
+            source->rowstride];
+
+      for (i=0;i<width;i++)
+        {
+          guint sx = _pvr_texture_source_coord (x + i, source->width,
+                                                source->padded_width);
+          const guchar *p = &line[sx * n_channels];
+
+          out->red = p[0];
+          out->green = p[1];
+          out->blue = p[2];
+          out->alpha = n_channels == 4 ? p[3] : 255;
+          out++;
+        }
+    }
+}
+
+/* Returns the whole padded image as RGBA, for the few places that need
+ * one in memory. Free with g_free() */
+guchar *
+_pvr_texture_source_copy (const PvrTextureSource *source)
+{
+  Color *copy = g_new (Color, source->padded_width*source->padded_height);
+
+  _pvr_texture_source_gather (source, 0, 0,
+                              source->padded_width, source->padded_height,
+                              copy);
+  return (guchar*)copy;
+}
+
+/**
+ * pvr_texture_source_hash:
+ *
+ * Returns pvr_texture_hash() of the rows of source, not counting the
+ * padding or anything between the end of one row and the start of the
+ * next. The sizes and number of channels aren't included, so fold them
+ * into seed if they matter.
+ */
+guint64
+pvr_texture_source_hash (const PvrTextureSource *source,
+                         guint64                 seed)
+{
+  gsize row_size = (gsize)source->width * source->n_channels;
+  gint y;
+
+  /* a row at a time, so the stride makes no difference to the hash */
+  for (y=0;y<source->height;y++)
+    seed = pvr_texture_hash (&source->pixels[y*source->rowstride],
+                             row_size, seed);
+
+  return seed;
+}
+
+/**
+ * pvr_texture_compress_sizes:
+ *
+ * Works out how many bytes a width x height texture takes up once
+ * compressed in format (MGLPT_PVRTC4, MGLPT_PVRTC2 or ETC_RGB_4BPP), and
+ * how many bytes of scratch space compressing it needs, for
+ * pvr_texture_compress_source_into(). Returns FALSE if the size can't be
+ * compressed in format.
+ */
+gboolean
+pvr_texture_compress_sizes (guint  format,
+                            gint   width,
+                            gint   height,
+                            gsize *compressed_size,
+                            gsize *scratch_size)
+{
+  guint block_width = format == MGLPT_PVRTC2 ? 8 : 4;
+
+  /* must be a multiple of the block size + Power of 2 in each direction */
+  if (!_pvr_texture_surface_size (format, 4, 4) ||
+      (width % block_width) || (height&3) ||
+      !is_power_2(width) ||
+      !is_power_2(height))
+    return FALSE;
+
+  if (compressed_size)
+    *compressed_size = _pvr_texture_surface_size (format, width, height);
+  if (scratch_size)
+    *scratch_size = format == ETC_RGB_4BPP ? 0 :
+                    _pvr_texture_compress_scratch_size (width / block_width,
+                                                        height / 4);
+
+  return TRUE;
+}
+
+/* The number of steps of progress compressing a width x height texture
+ * in format takes: a pass over each row of blocks for the endpoints and
+ * another for the modulation for PVRTC, one for ETC1 */
+guint
+_pvr_texture_compress_steps (guint format,
+                             gint  width,
+                             gint  height)
+{
+  return format == ETC_RGB_4BPP ? height/4 : 2 * (height/4);
+}
+
+/* Compresses source into buffers that have already been checked */
+void
+_pvr_texture_compress_into (const PvrTextureSource *source,
+                            guint                   format,
+                            guint                   n_threads,
+                            const PvrTextureOptions *options,
+                            guchar                 *compressed_data,
+                            guchar                 *scratch,
+                            PvrProgress            *progress)
+{
+  switch (format)
+    {
+    case MGLPT_PVRTC4:
+      _pvr_texture_compress_pvrtc4_into (source, n_threads, options,
+                                         compressed_data, scratch,
+                                         progress);
+      break;
+    case MGLPT_PVRTC2:
+      _pvr_texture_compress_pvrtc2_into (source, options,
+                                         compressed_data, scratch,
+                                         progress);
+      break;
+    case ETC_RGB_4BPP:
+      _pvr_texture_compress_etc1_into (source, FALSE, compressed_data,
+                                       progress);
+      break;
+    }
+}
+
+/**
+ * pvr_texture_compress_source_into:
+ *
+ * As pvr_texture_compress_source(), but writes the compressed data into
+ * compressed_data and uses scratch for its working, both of which
+ * must be at least the sizes pvr_texture_compress_sizes() gives for the
+ * padded size of source. They can be anywhere, such as a mapped file or
+ * a buffer that is used over and over. Unless PVRTC4 is spread over more
+ * than one thread, nothing at all is allocated.
+ *
+ * If progress isn't NULL it is called after each row of blocks, and
+ * compression stops if it returns FALSE.
+ *
+ * Returns FALSE if the sizes are wrong or progress stopped it.
+ */
+gboolean
+pvr_texture_compress_source_into (const PvrTextureSource *source,
+                                  guint                   format,
+                                  guint                   n_threads,
+                                  const PvrTextureOptions *options,
+                                  guchar                 *compressed_data,
+                                  gsize                   compressed_size,
+                                  guchar                 *scratch,
+                                  gsize                   scratch_size,
+                                  PvrTextureProgressFunc  progress,
+                                  gpointer                user_data)
+{
+  PvrProgress counter;
+  gsize needed_size, needed_scratch;
+
+  g_return_val_if_fail(source!=0, FALSE);
+  g_return_val_if_fail(source->n_channels==3 || source->n_channels==4, FALSE);
+
+  if (!pvr_texture_compress_sizes (format,
+                                   source->padded_width,
+                                   source->padded_height,
+                                   &needed_size, &needed_scratch) ||
+      compressed_size < needed_size ||
+      scratch_size < needed_scratch)
+    return FALSE;
+
+  if (!progress)
+    {
+      _pvr_texture_compress_into (source, format, n_threads, options,
+                                  compressed_data, scratch, NULL);
+      return TRUE;
+    }
+
+  counter.func = progress;
+  counter.user_data = user_data;
+  counter.total = _pvr_texture_compress_steps (format,
+                                               source->padded_width,
+                                               source->padded_height);
+  counter.done = 0;
+  counter.stopped = 0;
+  _pvr_texture_compress_into (source, format, n_threads, options,
+                              compressed_data, scratch, &counter);
+
+  return !counter.stopped;
+}
+
+/**
+ * pvr_texture_compress_source:
+ *
+ * Compresses the padded_width x padded_height image read from source in
+ * format (MGLPT_PVRTC4, MGLPT_PVRTC2 or ETC_RGB_4BPP, using the fast
+ * encoder) and returns the data and its size, without making a copy of
+ * the pixels first. PVRTC4 is compressed on n_threads threads (one per
+ * CPU if 0). options may be NULL for the defaults. Returns NULL if the
+ * padded size can't be compressed in format.
+ */
+guchar *pvr_texture_compress_source(
+                const PvrTextureSource *source,
+                guint format,
+                guint n_threads,
+                const PvrTextureOptions *options,
+                guint *compressed_size)
+{
+  guchar *compressed_data, *scratch;
+  gsize size, scratch_size;
+
+  g_return_val_if_fail(source!=0, 0);
+  g_return_val_if_fail(compressed_size!=0, 0);
+
+  if (!pvr_texture_compress_sizes (format,
+                                   source->padded_width,
+                                   source->padded_height,
+                                   &size, &scratch_size))
+    return 0;
+
+  compressed_data = g_malloc(size);
+  scratch = g_malloc(scratch_size);
+  _pvr_texture_compress_into (source, format, n_threads, options,
+                              compressed_data, scratch, NULL);
+  g_free(scratch);
+
+  *compressed_size = size;
+  return compressed_data;
+}
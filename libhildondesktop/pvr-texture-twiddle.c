@@ -0,0 +1,160 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Finding blocks in twiddled PVRTC data.
+ *
+ * PVR stores the blocks of a texture in a Morton pattern to get some
+ * spatial locality: the bits of the block's x are spread out to the odd
+ * positions of its number and the bits of y to the even ones. If the
+ * texture isn't square the larger coordinate runs out of bits of the
+ * other to interleave with, and the rest of its bits go on the top.
+ *
+ * None of the bits of x end up in the same place as any of y, so the
+ * number of a block is just the bits x gives it OR'd with the bits y
+ * does. Those are worked out once for every column and row, after which
+ * finding a block is two lookups.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "pvr-texture.h"
+#include "pvr-texture-private.h"
+
+/* Spreads the low 16 bits of v out to the even bits of a word */
+static inline guint32
+spread_bits (guint32 v)
+{
+  v = (v | (v << 8)) & 0x00FF00FF;
+  v = (v | (v << 4)) & 0x0F0F0F0F;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
+/* Fills in twiddle for width_block x height_block blocks (powers of 2),
+ * with its tables in tables, which must have room for
+ * width_block + height_block entries */
+void
+_pvr_texture_twiddle_init (PvrTextureTwiddle *twiddle,
+                           guint              width_block,
+                           guint              height_block,
+                           guint32           *tables)
+{
+  guint32 morton_mask = 0xFFFFFFFF;
+  guint xshift = 0, yshift = 0;
+  guint32 xmask = 0, ymask = 0;
+  guint i;
+
+  /* only as many bits as the smaller side has are interleaved */
+  if (width_block > height_block)
+    {
+      morton_mask = (height_block*height_block)-1;
+      xshift = log_2(height_block);
+      xmask = ~morton_mask;
+    }
+  else if (width_block < height_block)
+    {
+      morton_mask = (width_block*width_block)-1;
+      yshift = log_2(width_block);
+      ymask = ~morton_mask;
+    }
+
+  twiddle->width_block = width_block;
+  twiddle->height_block = height_block;
+  twiddle->columns = tables;
+  twiddle->rows = tables + width_block;
+
+  for (i=0;i<width_block;i++)
+    twiddle->columns[i] = ((spread_bits (i) << 1) & morton_mask) |
+                          ((i << xshift) & xmask);
+  for (i=0;i<height_block;i++)
+    twiddle->rows[i] = (spread_bits (i) & morton_mask) |
+                       ((i << yshift) & ymask);
+}
+
+/**
+ * pvr_texture_twiddle_new:
+ *
+ * Works out where every block of a width x height texture in format
+ * (MGLPT_PVRTC4 or MGLPT_PVRTC2) is stored, for
+ * pvr_texture_twiddle_block(). Returns NULL if the size can't be stored
+ * in format. Free with pvr_texture_twiddle_free().
+ */
+PvrTextureTwiddle *
+pvr_texture_twiddle_new (guint format,
+                         gint  width,
+                         gint  height)
+{
+  PvrTextureTwiddle *twiddle;
+  guint block_width;
+  guint width_block, height_block;
+
+  if (format != MGLPT_PVRTC4 && format != MGLPT_PVRTC2)
+    return NULL;
+  block_width = format == MGLPT_PVRTC2 ? 8 : 4;
+  if (width < (gint)block_width || height < 4 ||
+      !is_power_2(width) ||
+      !is_power_2(height))
+    return NULL;
+
+  width_block = width / block_width;
+  height_block = height / 4;
+
+  /* the tables go straight after the structure */
+  twiddle = g_malloc (sizeof (PvrTextureTwiddle) +
+                      sizeof (guint32) * (width_block + height_block));
+  _pvr_texture_twiddle_init (twiddle, width_block, height_block,
+                             (guint32*)(twiddle + 1));
+
+  return twiddle;
+}
+
+/**
+ * pvr_texture_twiddle_block:
+ *
+ * Returns the number of block (x, y) in the data, counting from 0. Its
+ * 8 bytes start 8 times that many bytes in. Loops over a lot of blocks
+ * can OR columns[x] and rows[y] together themselves.
+ */
+guint32
+pvr_texture_twiddle_block (const PvrTextureTwiddle *twiddle,
+                           guint                    x,
+                           guint                    y)
+{
+  g_return_val_if_fail (x < twiddle->width_block, 0);
+  g_return_val_if_fail (y < twiddle->height_block, 0);
+
+  return _pvr_texture_twiddle_block (twiddle, x, y);
+}
+
+/**
+ * pvr_texture_twiddle_free:
+ *
+ * Frees twiddle, which may be NULL.
+ */
+void
+pvr_texture_twiddle_free (PvrTextureTwiddle *twiddle)
+{
+  g_free (twiddle);
+}
@@ -0,0 +1,312 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Making a texture to fill a view (the screen, for a background) out of
+ * an image of any size, such as a photo.
+ *
+ * The image is scaled to just cover the view, keeping its shape, and
+ * whatever hangs over the edges is cropped off equally on both sides.
+ * Each row of that is made from the source as the encoder asks for it,
+ * and compressed a few rows of blocks at a time, so the scaled, cropped
+ * and padded image never exists as a whole.
+ *
+ * Scaling down averages every source pixel under each output pixel,
+ * scaling up blends the nearest two in each direction, both weighted by
+ * alpha.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "pvr-texture.h"
+#include "pvr-texture-private.h"
+
+#include <math.h>
+
+/* The source pixels (first to first + n) that make up one output pixel
+ * along one axis, and their weights, starting at weight */
+typedef struct {
+  guint first;
+  guint n;
+  guint weight;
+} Span;
+
+typedef struct {
+  Span   *spans;
+  gfloat *weights;
+} Axis;
+
+typedef struct {
+  const PvrTextureSource *source;
+  Axis    x_axis, y_axis;
+  guint   view_width;
+  guint   x_first, x_end; /* the source columns any of the view uses */
+  gfloat *sums;           /* a row of those columns, alpha-weighted RGBA */
+} ViewScaler;
+
+/* Works out which of the size source pixels along an axis make up each
+ * of the view output pixels, with the image scaled by scale and offset
+ * output pixels cropped off the start */
+static void
+axis_init (Axis    *axis,
+           guint    size,
+           guint    view,
+           gdouble  scale,
+           gdouble  offset)
+{
+  guint max_n = scale < 1.0 ? (guint)ceil (1.0/scale) + 1 : 1;
+  guint i, j, n_weights = 0;
+
+  axis->spans = g_new(Span, view);
+  axis->weights = g_new(gfloat, view * MAX(max_n, 2));
+
+  for (i=0;i<view;i++)
+    {
+      Span *span = &axis->spans[i];
+      gfloat *weights = &axis->weights[n_weights];
+
+      span->weight = n_weights;
+      if (scale < 1.0)
+        {
+          /* every source pixel under this one, by how much of it is */
+          gdouble start = (i + offset) / scale;
+          gdouble end = (i + 1 + offset) / scale;
+          guint last;
+
+          start = CLAMP(start, 0.0, size);
+          end = CLAMP(end, start, size);
+          span->first = MIN((guint)start, size - 1);
+          last = MIN((guint)ceil (end), size);
+          span->n = MAX(last, span->first + 1) - span->first;
+          span->n = MIN(span->n, max_n);
+          for (j=0;j<span->n;j++)
+            {
+              gdouble left = MAX(start, span->first + j);
+              gdouble right = MIN(end, span->first + j + 1.0);
+
+              weights[j] = right > left ? right - left : 0;
+            }
+          /* so that the weights add up to 1 */
+          if (end <= start)
+            weights[0] = 1.0;
+          else
+            {
+              gfloat total = 0;
+
+              for (j=0;j<span->n;j++)
+                total += weights[j];
+              for (j=0;j<span->n;j++)
+                weights[j] /= total;
+            }
+        }
+      else
+        {
+          /* the nearest two, by how close their centres are */
+          gdouble centre = (i + 0.5 + offset) / scale - 0.5;
+          gint low = (gint)floor (centre);
+          gfloat fraction = centre - low;
+
+          if (low < 0)
+            {
+              span->first = 0;
+              span->n = 1;
+              weights[0] = 1.0;
+            }
+          else if (low >= (gint)size - 1)
+            {
+              span->first = size - 1;
+              span->n = 1;
+              weights[0] = 1.0;
+            }
+          else
+            {
+              span->first = low;
+              span->n = 2;
+              weights[0] = 1.0 - fraction;
+              weights[1] = fraction;
+            }
+        }
+      n_weights += span->n;
+    }
+}
+
+static void
+axis_free (Axis *axis)
+{
+  g_free (axis->spans);
+  g_free (axis->weights);
+}
+
+/* Makes row y of the view, for pvr_texture_compress_pvrtc4_rows() */
+static gboolean
+view_scaler_row (guint    y,
+                 guchar  *pixels,
+                 gpointer user_data)
+{
+  ViewScaler *scaler = user_data;
+  const PvrTextureSource *source = scaler->source;
+  const Span *span_y = &scaler->y_axis.spans[y];
+  const gfloat *weights_y = &scaler->y_axis.weights[span_y->weight];
+  guint n_channels = source->n_channels;
+  guint columns = scaler->x_end - scaler->x_first;
+  gfloat *sums = scaler->sums;
+  guint i, j, x;
+
+  /* first down, adding up the source rows under this one */
+  memset (sums, 0, sizeof(gfloat)*4*columns);
+  for (j=0;j<span_y->n;j++)
+    {
+      const guchar *line = &source->pixels[(span_y->first + j) *
+                                           source->rowstride +
+                                           scaler->x_first * n_channels];
+      gfloat weight = weights_y[j];
+
+      if (n_channels == 3)
+        for (x=0;x<columns;x++, line += 3)
+          {
+            gfloat w = weight * 255;
+
+            sums[x*4+0] += w * line[0];
+            sums[x*4+1] += w * line[1];
+            sums[x*4+2] += w * line[2];
+            sums[x*4+3] += w;
+          }
+      else
+        for (x=0;x<columns;x++, line += 4)
+          {
+            gfloat w = weight * line[3];
+
+            sums[x*4+0] += w * line[0];
+            sums[x*4+1] += w * line[1];
+            sums[x*4+2] += w * line[2];
+            sums[x*4+3] += w;
+          }
+    }
+
+  /* and then across */
+  for (x=0;x<scaler->view_width;x++)
+    {
+      const Span *span_x = &scaler->x_axis.spans[x];
+      const gfloat *weights_x = &scaler->x_axis.weights[span_x->weight];
+      const gfloat *in = &sums[(span_x->first - scaler->x_first)*4];
+      gfloat red = 0, green = 0, blue = 0, alpha = 0;
+
+      for (i=0;i<span_x->n;i++, in += 4)
+        {
+          red += weights_x[i] * in[0];
+          green += weights_x[i] * in[1];
+          blue += weights_x[i] * in[2];
+          alpha += weights_x[i] * in[3];
+        }
+
+      if (alpha > 0)
+        {
+          pixels[0] = MIN(red / alpha + 0.5f, 255.0f);
+          pixels[1] = MIN(green / alpha + 0.5f, 255.0f);
+          pixels[2] = MIN(blue / alpha + 0.5f, 255.0f);
+        }
+      else
+        pixels[0] = pixels[1] = pixels[2] = 0;
+      pixels[3] = MIN(alpha + 0.5f, 255.0f);
+      pixels += 4;
+    }
+
+  return TRUE;
+}
+
+/**
+ * pvr_texture_compress_view:
+ *
+ * Compresses the image read from source (its padding is ignored) to
+ * PVRTC4, scaled to cover a view_width x view_height view and cropped to
+ * it, then padded out to powers of 2, which are returned in
+ * padded_width and padded_height. The scaled image is made a row at a
+ * time as the encoder needs it, on the calling thread, and compressed on
+ * n_threads threads (one per CPU if 0) with the given options (which may
+ * be NULL). So the memory used besides the source is little more than
+ * the compressed texture. Returns NULL if the sizes don't make sense.
+ */
+guchar *
+pvr_texture_compress_view (const PvrTextureSource  *source,
+                           gint                     view_width,
+                           gint                     view_height,
+                           guint                    n_threads,
+                           const PvrTextureOptions *options,
+                           gint                    *padded_width,
+                           gint                    *padded_height,
+                           guint                   *compressed_size)
+{
+  ViewScaler scaler;
+  gdouble scale;
+  gint width, height;
+  gsize size;
+  guchar *compressed_data;
+
+  g_return_val_if_fail(source!=0, 0);
+  g_return_val_if_fail(source->n_channels==3 || source->n_channels==4, 0);
+  g_return_val_if_fail(padded_width!=0 && padded_height!=0, 0);
+  g_return_val_if_fail(compressed_size!=0, 0);
+
+  if (source->width <= 0 || source->height <= 0 ||
+      view_width <= 0 || view_height <= 0 ||
+      view_width > 65536 || view_height > 65536)
+    return 0;
+
+  width = 4;
+  height = 4;
+  while (width < view_width)
+    width *= 2;
+  while (height < view_height)
+    height *= 2;
+  if (!pvr_texture_compress_sizes (MGLPT_PVRTC4, width, height, &size, NULL))
+    return 0;
+
+  /* just big enough to cover the view */
+  scale = MAX((gdouble)view_width / source->width,
+              (gdouble)view_height / source->height);
+  scaler.source = source;
+  scaler.view_width = view_width;
+  axis_init (&scaler.x_axis, source->width, view_width, scale,
+             (source->width * scale - view_width) / 2);
+  axis_init (&scaler.y_axis, source->height, view_height, scale,
+             (source->height * scale - view_height) / 2);
+  scaler.x_first = scaler.x_axis.spans[0].first;
+  scaler.x_end = scaler.x_axis.spans[view_width - 1].first +
+                 scaler.x_axis.spans[view_width - 1].n;
+  scaler.sums = g_new(gfloat, 4*(scaler.x_end - scaler.x_first));
+
+  compressed_data = g_malloc(size);
+  pvr_texture_compress_pvrtc4_rows (view_width, view_height, width, height,
+                                    n_threads, options,
+                                    view_scaler_row, &scaler,
+                                    compressed_data, size);
+
+  axis_free (&scaler.x_axis);
+  axis_free (&scaler.y_axis);
+  g_free (scaler.sums);
+
+  *padded_width = width;
+  *padded_height = height;
+  *compressed_size = size;
+  return compressed_data;
+}
@@ -23,18 +23,18 @@
  */
 
 #include "pvr-texture.h"
+#include "pvr-texture-private.h"
 
 #include <glib/gstdio.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 #include <unistd.h>
 
-#define RAND_BLOCK 0 /* apply random noise to blocks */
-#define DITHER_BLOCK 0 /* error-diffusion dither blocks */
-#define DITHER_PIXEL 1 /* error-diffusion dither pixels */
-
 #if USE_GL
 /* These are defined in GLES2/gl2ext + gl2extimg, but we want them available
  * so we can compile without the SGX/Imagination libraries */
@@ -45,13 +45,6 @@
 #define GL_ETC1_RGB8_OES                                         0x8D64
 #endif
 
-typedef struct Color {
-  guchar red;
-  guchar green;
-  guchar blue;
-  guchar alpha;
-} Color;
-
 static inline void
 color_interp     (Color       *dest,
                   const Color *src1,
@@ -97,7 +90,6 @@ color_diff       (const Color *src1,
         abs((gint)src1->alpha - (gint)src2->alpha);
 }
 
-#if DITHER_BLOCK | DITHER_PIXEL
 static inline void
 error_add       (Color *dst,
                  const gint *error,
@@ -131,18 +123,6 @@ error_update    (gint *error,
   error[2] += src1->blue - src2->blue;
   error[3] += src1->alpha - src2->alpha;
 }
-#endif
-
-static inline gboolean
-color_equal      (const Color *src1,
-                  const Color *src2)
-{
-  return
-        src1->red == src2->red &&
-        src1->green == src2->green &&
-        src1->blue == src2->blue &&
-        src1->alpha == src2->alpha;
-}
 
 /*
  * pvr_texture_save_pvrtc4:
@@ -172,7 +152,7 @@ gboolean pvr_texture_save_pvrtc4(
     head.dwGBitMask = 0;       /* mask for green bits */
     head.dwBBitMask = 0;       /* mask for blue bits */
     head.dwAlphaBitMask = 1;   /* mask for alpha channel */
-    head.dwPVR = 'P' | 'V'<<8 | 'R'<<16 | '!'<<24; /* should be 'P' 'V' 'R' '!' */
+    head.dwPVR = PVR_TEXTURE_MAGIC; /* should be 'P' 'V' 'R' '!' */
     head.dwNumSurfs = 1;       /* number of slices for volume textures or skyboxes */
 
     /* load file */
@@ -193,116 +173,348 @@ gboolean pvr_texture_save_pvrtc4(
     return TRUE;
 }
 
-gboolean
-pvr_texture_save_pvrtc4_atomically (const gchar   *filename,
-                                    const guchar  *data,
-                                    guint          data_size,
-                                    gint           width,
-                                    gint           height,
-                                    GError       **error)
-{
-  gchar *tmpl;
-  gint fd;
-  PVR_TEXTURE_HEADER head;
-
-  /* Head */
-  head.dwHeaderSize = sizeof(PVR_TEXTURE_HEADER);     /* size of the structure */
-  head.dwHeight = height;         /* height of surface to be created */
-  head.dwWidth = width;          /* width of input surface */
-  head.dwMipMapCount = 0;    /* number of MIP-map levels requested */
-  head.dwpfFlags = MGLPT_PVRTC4 | PVR_FLAG_TWIDDLED | PVR_FLAG_ALPHA;        /* pixel format flags */
-  head.dwDataSize = data_size;       /* Size of the compress data */
-  head.dwBitCount = 4;       /* number of bits per pixel */
-  head.dwRBitMask = 0;       /* mask for red bit */
-  head.dwGBitMask = 0;       /* mask for green bits */
-  head.dwBBitMask = 0;       /* mask for blue bits */
-  head.dwAlphaBitMask = 1;   /* mask for alpha channel */
-  head.dwPVR = 'P' | 'V'<<8 | 'R'<<16 | '!'<<24; /* should be 'P' 'V' 'R' '!' */
-  head.dwNumSurfs = 1;       /* number of slices for volume textures or skyboxes */
-
-  tmpl = g_strdup_printf ("%sXXXXXX", filename);
-  fd = mkstemp (tmpl);
-  if (fd == -1)
+/* Anything bigger than this in a header is garbage */
+#define MAX_TEXTURE_SIZE 65536
+
+struct _PvrTextureMap {
+  GMappedFile        *file;
+  PVR_TEXTURE_HEADER  header;
+  const guchar       *data;
+};
+
+/* Returns the number of bytes a single surface of the given format and
+ * size takes up, or 0 if we don't know the format */
+gsize
+_pvr_texture_surface_size (guint format,
+                           guint width,
+                           guint height)
+{
+  switch (format)
     {
-      GFileError code = g_file_error_from_errno (errno);
-
-      g_set_error (error,
-                   G_FILE_ERROR,
-                   code,
-                   "Could not open template file for %s",
-                   filename);
-      g_free (tmpl);
-      return FALSE;
+    case MGLPT_PVRTC4:
+    case ETC_RGB_4BPP:
+      /* 4 bits per pixel, or 64 bits per block */
+      return (gsize)width * height / 2;
+    case MGLPT_PVRTC2:
+      return (gsize)width * height / 4;
+    default:
+      return 0;
     }
+}
 
-  if (write(fd, &head, sizeof(PVR_TEXTURE_HEADER)) == -1)
+/* Gets the smallest surface the given format can store. Mipmap levels
+ * smaller than this are stored (tiled) at this size, as GL expects */
+void
+_pvr_texture_min_size (guint  format,
+                       guint *width,
+                       guint *height)
+{
+  switch (format)
     {
-      GFileError code = g_file_error_from_errno (errno);
-
-      g_set_error (error,
-                   G_FILE_ERROR,
-                   code,
-                   "Could not write header to %s",
-                   tmpl);
-      g_free (tmpl);
-      return FALSE;
+    case MGLPT_PVRTC4:
+      *width = 8;
+      *height = 8;
+      break;
+    case MGLPT_PVRTC2:
+      *width = 16;
+      *height = 8;
+      break;
+    default:
+      *width = 4;
+      *height = 4;
+      break;
     }
+}
 
-  if (write(fd, data, data_size) == -1)
-    {
-      GFileError code = g_file_error_from_errno (errno);
+/* Returns the number of bytes mipmap level level of a texture that is
+ * width x height takes up in a file, or 0 if we don't know the format */
+gsize
+_pvr_texture_level_size (guint format,
+                         guint width,
+                         guint height,
+                         guint level)
+{
+  guint min_width, min_height;
 
-      g_set_error (error,
-                   G_FILE_ERROR,
-                   code,
-                   "Could not write header to %s",
-                   tmpl);
-      g_free (tmpl);
-      return FALSE;
-    }
+  _pvr_texture_min_size (format, &min_width, &min_height);
 
-  if (fdatasync (fd) == -1)
-    {
-      GFileError code = g_file_error_from_errno (errno);
+  return _pvr_texture_surface_size (format,
+                                    MAX(width >> level, min_width),
+                                    MAX(height >> level, min_height));
+}
 
-      g_set_error (error,
-                   G_FILE_ERROR,
-                   code,
-                   "Could not sync %s",
-                   tmpl);
-      g_free (tmpl);
-      return FALSE;
-    }
+/* The flags we know what to do with; anything else (cube maps, volumes,
+ * other pixel formats' extras) means a layout we would read wrongly */
+#define PVR_FLAG_KNOWN (PVR_FLAG_FORMAT_MASK | PVR_FLAG_MIPMAP | \
+                        PVR_FLAG_TWIDDLED | PVR_FLAG_ALPHA)
 
-  if (close (fd) == -1)
+/* Checks that head, read from the start of a file length bytes long,
+ * describes a texture we can use, and clears dwMipMapCount if it says
+ * there are no mipmaps */
+gboolean
+_pvr_texture_header_check (PVR_TEXTURE_HEADER *head,
+                          guint64             length)
+{
+  gsize surface_size;
+  guint format;
+
+  if (length < sizeof(PVR_TEXTURE_HEADER) ||
+      head->dwHeaderSize != sizeof(PVR_TEXTURE_HEADER) ||
+      head->dwPVR != PVR_TEXTURE_MAGIC ||
+      head->dwDataSize > length - sizeof(PVR_TEXTURE_HEADER) ||
+      (head->dwpfFlags & ~PVR_FLAG_KNOWN))
+    return FALSE;
+
+  /* whatever the format, the data must hold at least the top level */
+  if (head->dwWidth > MAX_TEXTURE_SIZE ||
+      head->dwHeight > MAX_TEXTURE_SIZE ||
+      !is_power_2 (head->dwWidth) ||
+      !is_power_2 (head->dwHeight))
+    return FALSE;
+  format = head->dwpfFlags & PVR_FLAG_FORMAT_MASK;
+  if (head->dwpfFlags & PVR_FLAG_MIPMAP)
     {
-      GFileError code = g_file_error_from_errno (errno);
-
-      g_set_error (error,
-                   G_FILE_ERROR,
-                   code,
-                   "Could not close %s",
-                   tmpl);
-      g_free (tmpl);
-      return FALSE;
+      guint level;
+
+      /* and if it says it has mipmaps, all of them */
+      if (head->dwMipMapCount > log_2 (MAX(head->dwWidth, head->dwHeight)))
+        return FALSE;
+      surface_size = 0;
+      for (level=0;level<=head->dwMipMapCount;level++)
+        surface_size += _pvr_texture_level_size (format,
+                                                 head->dwWidth,
+                                                 head->dwHeight,
+                                                 level);
     }
-
-  if (rename (tmpl, filename) == -1)
+  else
     {
-      GFileError code = g_file_error_from_errno (errno);
+      head->dwMipMapCount = 0;
+      surface_size = _pvr_texture_surface_size (format,
+                                                head->dwWidth,
+                                                head->dwHeight);
+    }
+
+  return surface_size && head->dwDataSize >= surface_size;
+}
+
+/**
+ * pvr_texture_probe:
+ *
+ * Reads just the header of the given .pvr file into header, and checks
+ * it the same way pvr_texture_map_new() does, against the size of the
+ * file. That's one read of 52 bytes, so it's cheap enough to do for a
+ * whole directory of textures to find out their sizes and formats.
+ *
+ * Returns FALSE and sets error if the file can't be read or is not a
+ * PVR texture we understand.
+ */
+gboolean
+pvr_texture_probe (const gchar         *filename,
+                   PVR_TEXTURE_HEADER  *header,
+                   GError             **error)
+{
+  struct stat st;
+  ssize_t n;
+  int fd;
+
+  g_return_val_if_fail (filename != NULL, FALSE);
+  g_return_val_if_fail (header != NULL, FALSE);
+
+  fd = g_open (filename, O_RDONLY, 0);
+  if (fd == -1)
+    goto error;
 
+  if (fstat (fd, &st) == -1)
+    goto error;
+
+  do
+    n = pread (fd, header, sizeof(PVR_TEXTURE_HEADER), 0);
+  while (n == -1 && errno == EINTR);
+  if (n == -1)
+    goto error;
+  close (fd);
+
+  if ((gsize)n < sizeof(PVR_TEXTURE_HEADER) ||
+      !_pvr_texture_header_check (header, st.st_size))
+    {
       g_set_error (error,
                    G_FILE_ERROR,
-                   code,
-                   "Could not rename %s to %s",
-                   tmpl,
+                   G_FILE_ERROR_INVAL,
+                   "%s is not a valid PVR texture",
                    filename);
-      g_free (tmpl);
       return FALSE;
     }
 
-  g_free (tmpl);
   return TRUE;
+
+error:
+  {
+    int saved_errno = errno;
+
+    if (fd != -1)
+      close (fd);
+    g_set_error (error,
+                 G_FILE_ERROR,
+                 g_file_error_from_errno (saved_errno),
+                 "Could not read %s: %s",
+                 filename,
+                 g_strerror (saved_errno));
+    return FALSE;
+  }
+}
+
+/**
+ * pvr_texture_map_new:
+ *
+ * Maps the given .pvr file into memory and checks that its header makes
+ * sense. The compressed data can then be used directly from the mapping
+ * with pvr_texture_map_get_data(), without being copied, and the pages
+ * are shared with anything else that has the file open.
+ *
+ * Returns NULL and sets error if the file can't be mapped or is not a
+ * PVR texture we understand.
+ */
+PvrTextureMap *
+pvr_texture_map_new (const gchar  *filename,
+                     GError      **error)
+{
+  PvrTextureMap *map;
+  GMappedFile *file;
+  const guchar *contents;
+  gsize length;
+
+  g_return_val_if_fail (filename != NULL, NULL);
+
+  file = g_mapped_file_new (filename, FALSE, error);
+  if (!file)
+    return NULL;
+
+  contents = (const guchar *)g_mapped_file_get_contents (file);
+  length = g_mapped_file_get_length (file);
+
+  map = g_slice_new (PvrTextureMap);
+  map->file = file;
+
+  if (!contents || length < sizeof(PVR_TEXTURE_HEADER))
+    goto invalid;
+
+  memcpy (&map->header, contents, sizeof(PVR_TEXTURE_HEADER));
+  if (!_pvr_texture_header_check (&map->header, length))
+    goto invalid;
+
+  map->data = contents + sizeof(PVR_TEXTURE_HEADER);
+  return map;
+
+invalid:
+  g_set_error (error,
+               G_FILE_ERROR,
+               G_FILE_ERROR_INVAL,
+               "%s is not a valid PVR texture",
+               filename);
+  pvr_texture_map_free (map);
+  return NULL;
+}
+
+/**
+ * pvr_texture_map_get_header:
+ *
+ * Returns the (validated) header of a mapped texture.
+ */
+const PVR_TEXTURE_HEADER *
+pvr_texture_map_get_header (PvrTextureMap *map)
+{
+  g_return_val_if_fail (map != NULL, NULL);
+
+  return &map->header;
+}
+
+/**
+ * pvr_texture_map_get_data:
+ *
+ * Returns a read-only pointer to the compressed data of a mapped
+ * texture, and its size in data_size. It is valid until the map is
+ * freed, and can be passed straight to glCompressedTexImage2D() or
+ * pvr_texture_decompress_pvrtc4().
+ */
+const guchar *
+pvr_texture_map_get_data (PvrTextureMap *map,
+                          guint         *data_size)
+{
+  g_return_val_if_fail (map != NULL, NULL);
+
+  if (data_size)
+    *data_size = map->header.dwDataSize;
+
+  return map->data;
+}
+
+/**
+ * pvr_texture_map_get_level:
+ *
+ * Returns a read-only pointer to one mipmap level of a mapped texture
+ * (level 0 being the top one), and its size in pixels and bytes, or NULL
+ * if the texture doesn't have that many levels. Levels smaller than the
+ * format can store are tiled out to its minimum size, so width and height
+ * are the size of the data rather than of the level.
+ */
+const guchar *
+pvr_texture_map_get_level (PvrTextureMap *map,
+                           guint          level,
+                           guint         *width,
+                           guint         *height,
+                           guint         *data_size)
+{
+  const PVR_TEXTURE_HEADER *head;
+  guint format, min_width, min_height, i;
+  gsize offset = 0;
+
+  g_return_val_if_fail (map != NULL, NULL);
+
+  head = &map->header;
+  if (level > head->dwMipMapCount)
+    return NULL;
+
+  /* a texture without mipmaps can be any size it likes */
+  if (!(head->dwpfFlags & PVR_FLAG_MIPMAP))
+    {
+      if (width)
+        *width = head->dwWidth;
+      if (height)
+        *height = head->dwHeight;
+      return pvr_texture_map_get_data (map, data_size);
+    }
+
+  format = head->dwpfFlags & PVR_FLAG_FORMAT_MASK;
+  for (i=0;i<level;i++)
+    offset += _pvr_texture_level_size (format,
+                                       head->dwWidth, head->dwHeight, i);
+
+  _pvr_texture_min_size (format, &min_width, &min_height);
+  if (width)
+    *width = MAX(MAX(head->dwWidth >> level, 1), min_width);
+  if (height)
+    *height = MAX(MAX(head->dwHeight >> level, 1), min_height);
+  if (data_size)
+    *data_size = _pvr_texture_level_size (format,
+                                          head->dwWidth, head->dwHeight,
+                                          level);
+
+  return map->data + offset;
+}
+
+/**
+ * pvr_texture_map_free:
+ *
+ * Unmaps the texture. Any pointers into its data become invalid.
+ */
+void
+pvr_texture_map_free (PvrTextureMap *map)
+{
+  if (!map)
+    return;
+
+  g_mapped_file_unref (map->file);
+  g_slice_free (PvrTextureMap, map);
 }
 
 #define SETMIN(result, col) { \
@@ -318,64 +530,151 @@ pvr_texture_save_pvrtc4_atomically (const gchar   *filename,
         if ((result).alpha < (col).alpha) (result).alpha = (col).alpha; \
 }
 
-inline static guchar find_best(
-                Color pixel_col,
-                Color *low,
-                Color *high,
-                guint block_stride,
-                guint x_interp,
-                guint y_interp)
+/* Weights of the two blocks a pixel is between, by how far (0..3) it is
+ * from the first one's centre, as color_interp() uses them: it copies the
+ * first colour for 0 instead of scaling it by 255/256, hence the 256 */
+static const guint interp_weight_a[4] = { 256, 191, 127, 63 };
+static const guint interp_weight_b[4] = {   0,  64, 128, 192 };
+
+/* A colour with its channels spread out into 16 bit lanes, so all 4 can be
+ * interpolated with one multiply each: the weights never add up to more
+ * than 256, so no lane can carry into the next */
+static inline guint64
+color_spread (const Color *col)
 {
-  Color tmpa, tmpb;
-  guchar amtx, amty;
-  Color cl, ch, clm, chm;
-  guint diff[4];
-
-  /* special case - if everything is equal then we don't care what we choose
-   * and we can skip a load of calculation */
-  if (color_equal(&low[0], &low[1]) &&
-      color_equal(&low[block_stride], &low[block_stride+1]) &&
-      color_equal(&low[block_stride], &low[0]) &&
-      color_equal(&high[0], &high[1]) &&
-      color_equal(&high[block_stride], &high[block_stride+1]) &&
-      color_equal(&high[block_stride], &high[0]) &&
-      color_equal(&low[0], &high[0]))
-    return 0;
+  return col->red | (col->green << 16) |
+         ((guint64)col->blue << 32) | ((guint64)col->alpha << 48);
+}
 
-  /* interpolate our colours spatially */
+static inline guint64
+spread_interp (guint64 a,
+               guint64 b,
+               guint   weight_a,
+               guint   weight_b)
+{
+  return ((a*weight_a + b*weight_b) >> 8) &
+         G_GUINT64_CONSTANT(0x00FF00FF00FF00FF);
+}
 
-  amtx = x_interp * 64;
-  amty = y_interp * 64;
+static inline void
+spread_store (PvrBlockEndpoints *ends,
+              guint              c,
+              guint              i,
+              guint64            col)
+{
+  ends->channel[0][c][i] = col;
+  ends->channel[1][c][i] = col >> 16;
+  ends->channel[2][c][i] = col >> 32;
+  ends->channel[3][c][i] = col >> 48;
+}
 
-  color_interp(&tmpa, &low[0], &low[1], amtx);
-  color_interp(&tmpb, &low[block_stride], &low[block_stride+1], amtx);
-  color_interp(&cl, &tmpa, &tmpb, amty);
+/* The C version of PvrBlockEndpointsFunc. The blocks the pixels
+ * interpolate between swap halfway through the block, hence the crazy
+ * offset stuff. Each row of the 3x3 neighbourhood is interpolated across
+ * once for all 4 columns of pixels, and then each pixel down between the
+ * two rows around it */
+void
+_pvr_texture_block_endpoints (const Color       *low,
+                              const Color       *high,
+                              guint              block_stride,
+                              PvrBlockEndpoints *ends)
+{
+  guint64 rows[2][3][4]; /* [low/high][row][x] */
+  guint r, x, y;
+
+  for (r=0;r<3;r++)
+    for (x=0;x<4;x++)
+      {
+        guint offs = ((x+2)>>2) + r*block_stride;
+        guint wa = interp_weight_a[(x+2)&3];
+        guint wb = interp_weight_b[(x+2)&3];
+
+        rows[0][r][x] = spread_interp (color_spread (&low[offs]),
+                                       color_spread (&low[offs+1]), wa, wb);
+        rows[1][r][x] = spread_interp (color_spread (&high[offs]),
+                                       color_spread (&high[offs+1]), wa, wb);
+      }
 
-  color_interp(&tmpa, &high[0], &high[1], amtx);
-  color_interp(&tmpb, &high[block_stride], &high[block_stride+1], amtx);
-  color_interp(&ch, &tmpa, &tmpb, amty);
+  for (y=0;y<4;y++)
+    {
+      guint r0 = (y+2)>>2;
+      guint wa = interp_weight_a[(y+2)&3];
+      guint wb = interp_weight_b[(y+2)&3];
 
-  /* interpolate for the mid-colours */
-  color_interp(&clm, &cl, &ch, 96); /* 3/8 */
-  color_interp(&chm, &cl, &ch, 160); /* 5/8 */
+      for (x=0;x<4;x++)
+        {
+          guint64 cl = spread_interp (rows[0][r0][x], rows[0][r0+1][x],
+                                      wa, wb);
+          guint64 ch = spread_interp (rows[1][r0][x], rows[1][r0+1][x],
+                                      wa, wb);
+
+          spread_store (ends, 0, x + y*4, cl);
+          spread_store (ends, 1, x + y*4, spread_interp (cl, ch, 159, 96));
+          spread_store (ends, 2, x + y*4, spread_interp (cl, ch, 95, 160));
+          spread_store (ends, 3, x + y*4, ch);
+        }
+    }
 
-  /* work out differences */
-  diff[0] = color_diff(&pixel_col, &cl);
-  diff[1] = color_diff(&pixel_col, &clm);
-  diff[2] = color_diff(&pixel_col, &chm);
-  diff[3] = color_diff(&pixel_col, &ch);
+  ends->flat = block_flat_mask (low, high, block_stride);
+}
 
-  /* work out which one is smaller */
-  if (diff[0] < diff[1] && diff[0] < diff[2] && diff[0] < diff[3])
+/* which of the 4 colours is nearest, given the distance to each */
+inline static guchar find_best(
+                guint diff0,
+                guint diff1,
+                guint diff2,
+                guint diff3)
+{
+  if (diff0 < diff1 && diff0 < diff2 && diff0 < diff3)
     return 0;
-  if (diff[1] < diff[2] && diff[1] < diff[3])
+  if (diff1 < diff2 && diff1 < diff3)
     return 1;
-  if (diff[2] < diff[3])
+  if (diff2 < diff3)
     return 2;
   return 3;
 }
 
-inline static guint color_to_pvr_color( Color *col )
+/* The plain C modulation search, used when the CPU has nothing better
+ * and as the reference the SIMD kernels have to match bit for bit. It
+ * works a channel at a time over all 16 pixels, like they do */
+guint32
+_pvr_texture_encode_modulation_c (const Color             *block,
+                                  guint                    width,
+                                  const PvrBlockEndpoints *ends)
+{
+  guint8 pixels[4][16];
+  guint16 diff[4][16];
+  guint32 pixel_low_word = 0;
+  guint c, k, i;
+
+  for (i=0;i<16;i++)
+    {
+      const Color *col = &block[(i&3) + (i>>2)*width];
+
+      pixels[0][i] = col->red;
+      pixels[1][i] = col->green;
+      pixels[2][i] = col->blue;
+      pixels[3][i] = col->alpha;
+    }
+
+  for (k=0;k<4;k++)
+    {
+      for (i=0;i<16;i++)
+        diff[k][i] = 0;
+      for (c=0;c<4;c++)
+        for (i=0;i<16;i++)
+          diff[k][i] += abs((gint)pixels[c][i] - ends->channel[c][k][i]);
+    }
+
+  for (i=16;i-->0;)
+    pixel_low_word = (pixel_low_word << 2) |
+      (ends->flat & (1 << i) ? 0 :
+       find_best(diff[0][i], diff[1][i], diff[2][i], diff[3][i]));
+
+  return pixel_low_word;
+}
+
+inline static guint color_to_pvr_color( const Color *col )
 {
   /* 16 bit colour, if top bit is 1 it's 555, otherwise
    * it's 3444 */
@@ -396,15 +695,23 @@ inline static guint color_to_pvr_color( Color *col )
     }
 }
 
-#if RAND_BLOCK
 inline static guchar clamp(gint x) {
   if (x<0) x=0;
   if (x>255) x=255;
   return x;
 }
-#endif
 
-inline static void nearest_pvr_color( Color *col, gboolean use_max ) {
+/* The threshold (out of 16) at which nearest_pvr_color() rounds a colour
+ * between two it can store, for the undithered rounding */
+#define THRESHOLD_NONE 8
+
+/* Moves c by threshold/16 of the step between the values that can be
+ * stored, less half a step, so THRESHOLD_NONE leaves it alone */
+#define DITHER_CHANNEL(c, step, threshold) \
+        (c) = clamp((gint)(c) + (gint)((threshold)*(step))/16 - (step)/2)
+
+inline static void nearest_pvr_color( Color *col, gboolean use_max,
+                                      guint threshold ) {
   if (col->alpha >= 224)
     {
       if (use_max) {
@@ -412,11 +719,11 @@ inline static void nearest_pvr_color( Color *col, gboolean use_max ) {
         col->green = MIN(col->green + 7, 255);
         col->blue = MIN(col->blue + 7, 255);
       }
-#if RAND_BLOCK
-      col->red = clamp((gint)col->red + (rand()&7) - 4);
-      col->green = clamp((gint)col->green + (rand()&7) - 4);
-      col->blue = clamp((gint)col->blue + (rand()&7) - 4);
-#endif
+      if (threshold != THRESHOLD_NONE) {
+        DITHER_CHANNEL(col->red, 8, threshold);
+        DITHER_CHANNEL(col->green, 8, threshold);
+        DITHER_CHANNEL(col->blue, 8, threshold);
+      }
       col->alpha = 0xFF;
       col->red   = (col->red & 0xF8) | (col->red >> 5);
       col->green = (col->green & 0xF8) | (col->green >> 5);
@@ -430,12 +737,12 @@ inline static void nearest_pvr_color( Color *col, gboolean use_max ) {
         col->green = MIN(col->green + 15, 255);
         col->blue = MIN(col->blue + 15, 255);
       }
-#if RAND_BLOCK
-      col->alpha = clamp((gint)col->alpha + (rand()&31) - 16);
-      col->red = clamp((gint)col->red + (rand()&15) - 8);
-      col->green = clamp((gint)col->green + (rand()&15) - 8);
-      col->blue = clamp((gint)col->blue + (rand()&15) - 8);
-#endif
+      if (threshold != THRESHOLD_NONE) {
+        DITHER_CHANNEL(col->alpha, 32, threshold);
+        DITHER_CHANNEL(col->red, 16, threshold);
+        DITHER_CHANNEL(col->green, 16, threshold);
+        DITHER_CHANNEL(col->blue, 16, threshold);
+      }
       col->alpha = (col->alpha & 0xE0) | (col->alpha >> 3);
       col->red   = (col->red & 0xF0) | (col->red >> 4);
       col->green = (col->green & 0xF0) | (col->green >> 4);
@@ -464,277 +771,1255 @@ inline static Color pvr_color_to_color( guint32 col )
   return result;
 }
 
-static inline gboolean
-is_power_2(int a)
+
+/* Everything the two compression passes share, so that they can be run
+ * over bands of block rows on several threads. The source and endpoint
+ * arrays may only hold some of the rows, starting at block row window:
+ * the pixels of block row y start at row (y - window)*4 of source, and
+ * its endpoints are in row y + 1 - window of col_low and col_high */
+typedef struct {
+  const PvrTextureSource *source;
+  guint width_block, height_block, block_stride;
+  gint window;
+  Color *col_low, *col_high;
+  guint32 *out_data;
+  PvrTextureTwiddle twiddle;
+  const PvrKernels *kernels;
+  PvrTextureDither dither;
+  PvrTextureQuality quality;
+  PvrProgress *progress;
+} CompressJob;
+
+/* A range of block rows to be worked on by one thread */
+typedef struct {
+  gpointer job;
+  guint y_start, y_end;
+} Band;
+
+/* work out the minimum and maximum colour values of one block */
+static inline void
+block_endpoints (const Color *block,
+                 gint         width,
+                 Color       *clow,
+                 Color       *chigh)
 {
-  return !(a & (a - 1)) && a;
+  const Color *blockline;
+
+  /* We now don't include the very edges in what we use
+   * for our blocks, as this helps make the block values
+   * we get a little more 'rounded'
+   */
+  *clow = block[1];
+  *chigh = block[1];
+  SETMIN(*clow, block[2]);
+  SETMAX(*chigh, block[2]);
+  blockline = &block[width*1];
+  SETMIN(*clow, blockline[0]);
+  SETMAX(*chigh, blockline[0]);
+  SETMIN(*clow, blockline[1]);
+  SETMAX(*chigh, blockline[1]);
+  SETMIN(*clow, blockline[2]);
+  SETMAX(*chigh, blockline[2]);
+  SETMIN(*clow, blockline[3]);
+  SETMAX(*chigh, blockline[3]);
+  blockline = &block[width*2];
+  SETMIN(*clow, blockline[0]);
+  SETMAX(*chigh, blockline[0]);
+  SETMIN(*clow, blockline[1]);
+  SETMAX(*chigh, blockline[1]);
+  SETMIN(*clow, blockline[2]);
+  SETMAX(*chigh, blockline[2]);
+  SETMIN(*clow, blockline[3]);
+  SETMAX(*chigh, blockline[3]);
+  blockline = &block[width*3];
+  SETMIN(*clow, blockline[1]);
+  SETMAX(*chigh, blockline[1]);
+  SETMIN(*clow, blockline[2]);
+  SETMAX(*chigh, blockline[2]);
 }
 
-static inline guint32
-log_2(guint v)
+/* Error of a whole block (the sum of the differences of every channel of
+ * its 16 pixels) low enough that refine_endpoints() doesn't go on */
+#define REFINE_GOOD_ENOUGH 32
+#define REFINE_ITERATIONS 4
+
+/* Weights of the high colour in the 4 modulation values, in 8ths */
+static const gint refine_weight[4] = { 0, 3, 5, 8 };
+
+/* Gives each pixel of block the nearest of the 4 colours between low and
+ * high (as 8 bit values in each channel), writing its index to index,
+ * and returns the error of the whole block */
+static guint
+refine_assign (const gint   pixels[4][16],
+               const gint   low[4],
+               const gint   high[4],
+               guint        index[16])
 {
-  guint32 r; // result of log2(v) will go here
-  guint32 shift;
+  gint palette[4][4];
+  guint error = 0;
+  guint c, k, i;
 
-  r =     (v > 0xFFFF) << 4; v >>= r;
-  shift = (v > 0xFF  ) << 3; v >>= shift; r |= shift;
-  shift = (v > 0xF   ) << 2; v >>= shift; r |= shift;
-  shift = (v > 0x3   ) << 1; v >>= shift; r |= shift;
-                                          r |= (v >> 1);
-  return r;
-}
+  for (k=0;k<4;k++)
+    for (c=0;c<4;c++)
+      palette[k][c] = ((8 - refine_weight[k])*low[c] +
+                       refine_weight[k]*high[c] + 4) / 8;
 
+  for (i=0;i<16;i++)
+    {
+      guint diff[4];
+
+      for (k=0;k<4;k++)
+        {
+          diff[k] = 0;
+          for (c=0;c<4;c++)
+            diff[k] += abs(pixels[c][i] - palette[k][c]);
+        }
+      index[i] = find_best(diff[0], diff[1], diff[2], diff[3]);
+      error += diff[index[i]];
+    }
+
+  return error;
+}
 
-/* calculate the masks needed to access the morton-ordered image.
- * Values must be a power of 2 */
-static void _calculate_access_masks( gint width, gint height,
-      guint32 *morton_mask,
-      guint32 *xshift, guint32 *xmask,
-      guint32 *yshift, guint32 *ymask)
+/* Moves the colours block_endpoints() picked for block to the least
+ * squares fit of its pixels, given which of the 4 modulation values each
+ * pixel is nearest, and repeats that until the block is close enough or
+ * doesn't get any better. This treats the block as if its neighbours had
+ * the same colours, which is as much as is known at this point */
+static void
+refine_endpoints (const Color *block,
+                  gint         width,
+                  Color       *clow,
+                  Color       *chigh)
 {
-  *xshift = 0;
-  *yshift = 0;
-  *xmask = 0;
-  *ymask = 0;
-  *morton_mask = 0xFFFFFFFF;
-  if (width == height)
+  gint pixels[4][16];
+  gint low[4], high[4];
+  guint index[16];
+  guint best, error, n, c, i;
+
+  for (i=0;i<16;i++)
     {
-      return;
+      const Color *col = &block[(i&3) + (i>>2)*width];
+
+      pixels[0][i] = col->red;
+      pixels[1][i] = col->green;
+      pixels[2][i] = col->blue;
+      pixels[3][i] = col->alpha;
     }
-  if (width > height)
+  low[0] = clow->red; low[1] = clow->green;
+  low[2] = clow->blue; low[3] = clow->alpha;
+  high[0] = chigh->red; high[1] = chigh->green;
+  high[2] = chigh->blue; high[3] = chigh->alpha;
+
+  best = refine_assign (pixels, low, high, index);
+  for (n=0;n<REFINE_ITERATIONS && best >= REFINE_GOOD_ENOUGH;n++)
     {
-      *morton_mask = (height*height)-1;
-      *xshift = log_2(height);
-      *xmask = 0xFFFFFFFF & ~*morton_mask;
-    }
-  else
-    { // width < height
-      *morton_mask = (width*width)-1;
-      *yshift = log_2(width);
-      *ymask = 0xFFFFFFFF & ~*morton_mask;
+      gint new_low[4], new_high[4];
+      gint64 aa = 0, ab = 0, bb = 0, det;
+      guint new_index[16];
+
+      /* the normal equations of minimising the sum over the pixels of
+       * ((8-w)*low + w*high - 8*pixel)^2, for each channel */
+      for (i=0;i<16;i++)
+        {
+          gint w = refine_weight[index[i]];
+
+          aa += (8-w)*(8-w);
+          ab += (8-w)*w;
+          bb += w*w;
+        }
+      det = aa*bb - ab*ab;
+      if (det == 0)
+        break; /* every pixel has the same weight */
+
+      for (c=0;c<4;c++)
+        {
+          gint64 pa = 0, pb = 0;
+
+          for (i=0;i<16;i++)
+            {
+              gint w = refine_weight[index[i]];
+
+              pa += (8-w)*pixels[c][i];
+              pb += w*pixels[c][i];
+            }
+          new_low[c] = CLAMP((8*(bb*pa - ab*pb) + det/2) / det, 0, 255);
+          new_high[c] = CLAMP((8*(aa*pb - ab*pa) + det/2) / det, 0, 255);
+        }
+
+      error = refine_assign (pixels, new_low, new_high, new_index);
+      if (error >= best)
+        break;
+      best = error;
+      memcpy (low, new_low, sizeof(low));
+      memcpy (high, new_high, sizeof(high));
+      memcpy (index, new_index, sizeof(index));
     }
+
+  clow->red = low[0]; clow->green = low[1];
+  clow->blue = low[2]; clow->alpha = low[3];
+  chigh->red = high[0]; chigh->green = high[1];
+  chigh->blue = high[2]; chigh->alpha = high[3];
 }
 
-/**
- * pvr_texture_compress_pvrtc4:
- *
- * Takes an RGBA8888 bitmap and returns the data (and size) created
- * after it has been compressed in the PVRTC4 format.
- *
- * Since: 0.8.2-maemo
- */
-guchar *pvr_texture_compress_pvrtc4(
-                const guchar *uncompressed_data,
-                gint width,
-                gint height,
-                guint *compressed_size)
+/* 4x4 Bayer matrix, for the ordered dither */
+static const guchar bayer_threshold[16] = {
+   0,  8,  2, 10,
+  12,  4, 14,  6,
+   3, 11,  1,  9,
+  15,  7, 13,  5
+};
+
+/* Where the error diffusion has got to */
+typedef struct {
+  PvrTextureDither dither;
+  gint error_low[4];
+  gint error_high[4];
+} EndpointRounding;
+
+static inline void
+endpoint_rounding_init (EndpointRounding *rounding,
+                        PvrTextureDither  dither)
 {
-  guchar *compressed_data = 0;
-  guint width_block, height_block, block_stride;
-  Color *col_low, *col_high;
-#if DITHER_BLOCK
-  gint error_low[4] = {0,0,0,0};
-  gint error_high[4] = {0,0,0,0};
-#endif
-#if DITHER_PIXEL
-  gint error_pixel[4] = {0,0,0,0};
-#endif
-  gint x,y;
-  guint32 *out_data;
-  guint32 morton_mask, xshift, xmask, yshift, ymask;
+  memset (rounding, 0, sizeof (EndpointRounding));
+  rounding->dither = dither;
+}
 
-  g_return_val_if_fail(compressed_size!=0, 0);
-  /* must be a multiple of 4 + Power of 2 in each direction */
-  if ((width&3) || (height&3) ||
-      !is_power_2(width) ||
-      !is_power_2(height))
-    return 0;
+/* Rounds the colours of block (x, y) to the nearest ones PVRTC can store,
+ * in place. Blocks must be done in raster order for the error diffusion */
+static inline void
+round_endpoints (EndpointRounding *rounding,
+                 guint             x,
+                 guint             y,
+                 Color            *clow,
+                 Color            *chigh)
+{
+  Color low, high;
 
-  width_block = width / 4;
-  block_stride = width_block+2;
-  height_block = height / 4;
-  _calculate_access_masks(width_block, height_block,
-      &morton_mask, &xshift, &xmask, &yshift, &ymask);
-  /* 4 bits per pixel, or 64 bits per block*/
-  *compressed_size = width_block*height_block*sizeof(guint32)*2;
-  compressed_data = g_malloc(*compressed_size);
-  /* but we make our block colour list one bigger all the way around
-   * and copy the colours so we don't need to do bounds checking */
-  col_low = g_malloc(sizeof(Color)*block_stride*(height_block+2));
-  col_high = g_malloc(sizeof(Color)*block_stride*(height_block+2));
+  switch (rounding->dither)
+    {
+    case PVR_TEXTURE_DITHER_DIFFUSION:
+      /* add our current error, round, and carry on the difference */
+      low = *clow;
+      high = *chigh;
+      error_add(clow, rounding->error_low, &low);
+      error_add(chigh, rounding->error_high, &high);
+      nearest_pvr_color(clow, FALSE, THRESHOLD_NONE);
+      nearest_pvr_color(chigh, TRUE, THRESHOLD_NONE);
+      error_update(rounding->error_low, &low, clow);
+      error_update(rounding->error_high, &high, chigh);
+      break;
+    case PVR_TEXTURE_DITHER_ORDERED:
+      /* offset the high colour's pattern so the two don't move together */
+      nearest_pvr_color(clow, FALSE,
+                        bayer_threshold[(x&3) + (y&3)*4]);
+      nearest_pvr_color(chigh, TRUE,
+                        bayer_threshold[((x+2)&3) + ((y+2)&3)*4]);
+      break;
+    default:
+      nearest_pvr_color(clow, FALSE, THRESHOLD_NONE);
+      nearest_pvr_color(chigh, TRUE, THRESHOLD_NONE);
+      break;
+    }
+}
 
-  /* work out maximum and minimum colour values for each block */
-  for (y=0;y<height_block;y++)
+/* Works out the colours of block (x, y), whose pixels start at block.
+ * Beyond the fast tier they are kept as the decoder will see them,
+ * rather than with the bottom bits of each channel filled in, so the
+ * modulation is picked knowing exactly what it gives */
+static inline void
+pick_endpoints (const CompressJob *job,
+                EndpointRounding  *rounding,
+                guint              x,
+                guint              y,
+                const Color       *block,
+                gint               width,
+                Color             *clow,
+                Color             *chigh)
+{
+  block_endpoints (block, width, clow, chigh);
+  if (job->quality == PVR_TEXTURE_QUALITY_BEST)
+    refine_endpoints (block, width, clow, chigh);
+  /* crop to the nearest color */
+  round_endpoints (rounding, x, y, clow, chigh);
+  if (job->quality != PVR_TEXTURE_QUALITY_FAST)
     {
-      guint block_offs = (y+1)*block_stride;
+      /* the low colour loses its last bit to the modulation mode */
+      *clow = pvr_color_to_color (color_to_pvr_color (clow) & 0xFFFE);
+      *chigh = pvr_color_to_color (color_to_pvr_color (chigh));
+    }
+}
+
+/* work out maximum and minimum colour values for each block in rows
+ * y_start to y_end, carrying on the error diffusion in rounding */
+static void
+compress_endpoint_rows (CompressJob      *job,
+                        EndpointRounding *rounding,
+                        guint             y_start,
+                        guint             y_end)
+{
+  guint width_block = job->width_block;
+  guint block_stride = job->block_stride;
+  Color *col_low = job->col_low;
+  Color *col_high = job->col_high;
+  guint x,y;
+
+  for (y=y_start;y<y_end;y++)
+    {
+      guint block_offs = ((gint)y + 1 - job->window)*block_stride;
+      guint source_y = ((gint)y - job->window)*4;
       for (x=0;x<width_block;x++)
         {
-          Color clow, chigh, clow_dither, chigh_dither;
-          Color *block;
-          Color *blockline;
-
-          /* We now don't include the very edges in what we use
-           * for our blocks, as this helps make the block values
-           * we get a little more 'rounded'
-           */
-          block = (Color*)&uncompressed_data[(x + y*width) * 16];
-          clow = block[1];
-          chigh = block[1];
-          SETMIN(clow, block[2]);
-          SETMAX(chigh, block[2]);
-          blockline = &block[width*1];
-          SETMIN(clow, blockline[0]);
-          SETMAX(chigh, blockline[0]);
-          SETMIN(clow, blockline[1]);
-          SETMAX(chigh, blockline[1]);
-          SETMIN(clow, blockline[2]);
-          SETMAX(chigh, blockline[2]);
-          SETMIN(clow, blockline[3]);
-          SETMAX(chigh, blockline[3]);
-          blockline = &block[width*2];
-          SETMIN(clow, blockline[0]);
-          SETMAX(chigh, blockline[0]);
-          SETMIN(clow, blockline[1]);
-          SETMAX(chigh, blockline[1]);
-          SETMIN(clow, blockline[2]);
-          SETMAX(chigh, blockline[2]);
-          SETMIN(clow, blockline[3]);
-          SETMAX(chigh, blockline[3]);
-          blockline = &block[width*3];
-          SETMIN(clow, blockline[1]);
-          SETMAX(chigh, blockline[1]);
-          SETMIN(clow, blockline[2]);
-          SETMAX(chigh, blockline[2]);
-          /* add our current error */
-#if DITHER_BLOCK
-          error_add(&clow_dither, error_low, &clow);
-          error_add(&chigh_dither, error_high, &chigh);
-#else
-          clow_dither = clow;
-          chigh_dither = chigh;
-#endif
-          /* crop to the nearest color */
-          nearest_pvr_color(&clow_dither, FALSE);
-          nearest_pvr_color(&chigh_dither, TRUE);
-          col_low[1+x+block_offs] = clow_dither;
-          col_high[1+x+block_offs] = chigh_dither;
-          /* update errors */
-#if DITHER_BLOCK
-          error_update(error_low, &clow, &clow_dither);
-          error_update(error_high, &chigh, &chigh_dither);
-#endif
+          Color scratch[16];
+          const Color *block;
+          guint stride;
+
+          block = _pvr_texture_source_block (job->source, x*4, source_y,
+                                             4, 4, scratch, &stride);
+          pick_endpoints (job, rounding, x, y, block, stride,
+                          &col_low[1+x+block_offs],
+                          &col_high[1+x+block_offs]);
         }
       /* copy beginning and end */
       col_low[block_offs] = col_low[block_offs+1];
       col_low[block_offs+width_block+1] = col_low[block_offs+width_block];
       col_high[block_offs] = col_high[block_offs+1];
       col_high[block_offs+width_block+1] = col_high[block_offs+width_block];
+      if (!_pvr_progress_step (job->progress))
+        return;
     }
-  /* copy top and bottom of our block so we get repeats */
-  memcpy((void*)&col_low[0],
-         (void*)&col_low[block_stride],
+}
+
+/* As compress_endpoint_rows(). Any error diffusion starts again from zero
+ * at y_start, so for the same output it has to be done in one go */
+static void
+compress_endpoints (CompressJob *job,
+                    guint        y_start,
+                    guint        y_end)
+{
+  EndpointRounding rounding;
+
+  endpoint_rounding_init (&rounding, job->dither);
+  compress_endpoint_rows (job, &rounding, y_start, y_end);
+}
+
+/* copy top and bottom of our block so we get repeats. Needs all the
+ * endpoints to be done */
+static void
+compress_endpoint_edges (CompressJob *job)
+{
+  guint block_stride = job->block_stride;
+  guint height_block = job->height_block;
+
+  memcpy((void*)&job->col_low[0],
+         (void*)&job->col_low[block_stride],
                 sizeof(Color)*block_stride);
-  memcpy((void*)&col_high[0],
-         (void*)&col_high[block_stride],
+  memcpy((void*)&job->col_high[0],
+         (void*)&job->col_high[block_stride],
                 sizeof(Color)*block_stride);
-  memcpy((void*)&col_low[block_stride*(height_block+1)],
-         (void*)&col_low[block_stride*height_block],
+  memcpy((void*)&job->col_low[block_stride*(height_block+1)],
+         (void*)&job->col_low[block_stride*height_block],
                 sizeof(Color)*block_stride);
-  memcpy((void*)&col_high[block_stride*(height_block+1)],
-         (void*)&col_high[block_stride*height_block],
+  memcpy((void*)&job->col_high[block_stride*(height_block+1)],
+         (void*)&job->col_high[block_stride*height_block],
                 sizeof(Color)*block_stride);
+}
 
-  /* now assemble each block */
-  out_data = (guint32*)compressed_data;
-  for (y=0;y<height_block;y++)
-    {
-      gint my; /* for morton numbers later */
-      my = (y | (y << 8)) & 0x00FF00FF;
-      my = (my | (my << 4)) & 0x0F0F0F0F;
-      my = (my | (my << 2)) & 0x33333333;
-      my = (my | (my << 1)) & 0x55555555;
-      for (x=0;x<width_block;x++)
-        {
-          Color *block;
-          gint offs = x + y*block_stride;
-          guint32 pixel_high_word = 0;
-          guint32 pixel_low_word = 0;
-          guint col_a, col_b;
-          gint bx,by;
-          gint mx, mz; /* for morton numbers later */
-
-          /* now work out what every pixel should be... */
-          block = (Color*)&uncompressed_data
-                        [(x + y*width) * 4 * sizeof(guint32)];
-          /* find_best interpolates our two sets of colours to where they should
-           * be (the blocks we get colour from swap halfway through the block
-           * hence the crazy offset stuff. It then figures out which one of the
-           * 4 values for the pixel works best */
-          for (by=3;by>=0;by--)
-            for (bx=3;bx>=0;bx--)
-              {
-                Color pixel_col = block[bx + by*width];
-#if DITHER_PIXEL
-                Color pixel_col_dither;
-#endif
-                gint boffs = offs + ((bx+2)>>2) + (((by+2)>>2) * block_stride);
-#if DITHER_PIXEL
-                error_add(&pixel_col_dither, error_pixel, &pixel_col);
-#endif
-                pixel_low_word = (pixel_low_word << 2) |
-                          find_best(
-#if DITHER_PIXEL
-                                  pixel_col_dither,
-#else
-                                  pixel_col,
-#endif
-                                  &col_low[boffs],
-                                  &col_high[boffs],
-                                  block_stride,
-                                  (bx+2)&3,
-                                  (by+2)&3);
-#if DITHER_PIXEL
-                error_update(error_pixel, &pixel_col, &pixel_col_dither);
-#endif
-              }
-           /* pack our two colours */
-           col_a = color_to_pvr_color(&col_low[offs+1+block_stride]);
-           col_b = color_to_pvr_color(&col_high[offs+1+block_stride]);
-           /* and finally pack into a block */
-           /* last bit is the modulation mode, but we're cheating and
-            * just going for the easy 0, 3/8, 5/8, 1 one */
-           pixel_high_word = (col_b << 16) | (col_a & 0xFFFE);
-
-           /* PVR Stores images in a Morton arrangement to get some spatial
-            * locality
-            *
-            * Interleave lower 16 bits of x and y, so the bits of x
-            * are in the even positions and bits from y in the odd;
-            * z gets the resulting 32-bit Morton Number. */
-           mx = (x | (x << 8)) & 0x00FF00FF;
-           mx = (mx | (mx << 4)) & 0x0F0F0F0F;
-           mx = (mx | (mx << 2)) & 0x33333333;
-           mx = (mx | (mx << 1)) & 0x55555555;
-           mz = (my | (mx << 1)) & morton_mask;
-           mz |= (x << xshift) & xmask;
-           mz |= (y << yshift) & ymask;
-           mz = mz << 1;
-
-           /* write data out */
-           out_data[mz  ] = pixel_low_word;
-           out_data[mz+1] = pixel_high_word;
+/* The colours the punch-through modulation gives each pixel, from the
+ * ones the usual modulation does: the low and high colours are the same,
+ * and both of the middle ones are half way, the second one transparent */
+static void
+punch_through_endpoints (const PvrBlockEndpoints *ends,
+                         PvrBlockEndpoints       *punch)
+{
+  guint c, i;
+
+  for (c=0;c<4;c++)
+    for (i=0;i<16;i++)
+      {
+        guint half = (ends->channel[c][0][i]*127 +
+                      ends->channel[c][3][i]*128) >> 8;
+
+        punch->channel[c][0][i] = ends->channel[c][0][i];
+        punch->channel[c][1][i] = half;
+        punch->channel[c][2][i] = c == 3 ? 0 : half;
+        punch->channel[c][3][i] = ends->channel[c][3][i];
       }
+  /* the middle values differ even where the colours are flat */
+  punch->flat = 0;
+}
+
+/* How far the pixels of block are from what modulation gives them */
+static guint
+modulation_error (const Color             *block,
+                  guint                    width,
+                  const PvrBlockEndpoints *ends,
+                  guint32                  modulation)
+{
+  guint error = 0;
+  guint i;
+
+  for (i=0;i<16;i++)
+    {
+      const Color *col = &block[(i&3) + (i>>2)*width];
+      guint k = (modulation >> (i*2)) & 3;
+
+      error += abs((gint)col->red - ends->channel[0][k][i]) +
+               abs((gint)col->green - ends->channel[1][k][i]) +
+               abs((gint)col->blue - ends->channel[2][k][i]) +
+               abs((gint)col->alpha - ends->channel[3][k][i]);
     }
 
-  g_free(col_low);
-  g_free(col_high);
-  return compressed_data;
+  return error;
 }
 
-/**
- * pvr_texture_decompress_pvrtc4:
- *
- * Returns an RGBA8888 bitmap created from decompressing the given compressed
+/* assemble block (x, y), given the top-left of the 3x3 neighbourhood of
+ * block colours around it in arrays block_stride entries wide */
+static inline void
+compress_block (CompressJob *job,
+                guint32      x,
+                guint32      y,
+                const Color *col_low,
+                const Color *col_high,
+                guint        block_stride)
+{
+  Color scratch[16];
+  const Color *block;
+  guint stride;
+  PvrBlockEndpoints ends;
+  guint32 pixel_high_word = 0;
+  guint32 pixel_low_word = 0;
+  guint col_a, col_b;
+  guint alpha_mode = 0;
+  guint32 mz;
+
+  /* now work out what every pixel should be... */
+  block = _pvr_texture_source_block (job->source,
+                                     x*4, ((gint)y - job->window)*4, 4, 4,
+                                     scratch, &stride);
+  job->kernels->block_endpoints (col_low, col_high, block_stride, &ends);
+  pixel_low_word = job->kernels->encode_modulation (block, stride, &ends);
+  /* see if the punch-through modulation does any better */
+  if (job->quality != PVR_TEXTURE_QUALITY_FAST)
+    {
+      PvrBlockEndpoints punch;
+      guint32 punch_word;
+
+      punch_through_endpoints (&ends, &punch);
+      punch_word = job->kernels->encode_modulation (block, stride, &punch);
+      if (modulation_error (block, stride, &punch, punch_word) <
+          modulation_error (block, stride, &ends, pixel_low_word))
+        {
+          pixel_low_word = punch_word;
+          alpha_mode = 1;
+        }
+    }
+  /* pack our two colours */
+  col_a = color_to_pvr_color(&col_low[1+block_stride]);
+  col_b = color_to_pvr_color(&col_high[1+block_stride]);
+  /* and finally pack into a block. The last bit is the modulation mode:
+   * 0, 3/8, 5/8, 1 or punch-through */
+  pixel_high_word = (col_b << 16) | (col_a & 0xFFFE) | alpha_mode;
+
+  /* PVR Stores images in a Morton arrangement to get some spatial
+   * locality */
+  mz = _pvr_texture_twiddle_block (&job->twiddle, x, y) << 1;
+
+  /* write data out */
+  job->out_data[mz  ] = pixel_low_word;
+  job->out_data[mz+1] = pixel_high_word;
+}
+
+/* now assemble each block in rows y_start to y_end */
+static void
+compress_blocks (CompressJob *job,
+                 guint        y_start,
+                 guint        y_end)
+{
+  guint block_stride = job->block_stride;
+  Color *col_low = job->col_low;
+  Color *col_high = job->col_high;
+  guint x,y;
+
+  for (y=y_start;y<y_end;y++)
+    {
+      guint offs = ((gint)y - job->window)*block_stride;
+
+      for (x=0;x<job->width_block;x++)
+        compress_block (job, x, y,
+                        &col_low[x + offs],
+                        &col_high[x + offs],
+                        block_stride);
+      if (!_pvr_progress_step (job->progress))
+        return;
+    }
+}
+
+static void
+compress_endpoints_band (gpointer data,
+                         gpointer user_data)
+{
+  Band *band = data;
+
+  compress_endpoints (band->job, band->y_start, band->y_end);
+}
+
+static void
+compress_blocks_band (gpointer data,
+                      gpointer user_data)
+{
+  Band *band = data;
+
+  compress_blocks (band->job, band->y_start, band->y_end);
+}
+
+/* Shares rows y_start to y_end out between the bands as evenly as they
+ * go. There may be more bands than rows, leaving some empty */
+static void
+bands_span (Band  *bands,
+            guint  n_bands,
+            guint  y_start,
+            guint  y_end)
+{
+  guint i;
+
+  for (i=0;i<n_bands;i++)
+    {
+      bands[i].y_start = y_start + i * (y_end - y_start) / n_bands;
+      bands[i].y_end = y_start + (i+1) * (y_end - y_start) / n_bands;
+    }
+}
+
+/* Splits height_block rows into one band per thread (one thread per CPU
+ * if n_threads is 0). The split only depends on n_threads */
+static Band *
+bands_new (gpointer  job,
+           guint     height_block,
+           guint     n_threads,
+           guint    *n_bands)
+{
+  Band *bands;
+  guint i;
+
+  if (n_threads == 0)
+    n_threads = g_get_num_processors ();
+  *n_bands = MAX(1, MIN(n_threads, height_block));
+  bands = g_new(Band, *n_bands);
+  for (i=0;i<*n_bands;i++)
+    bands[i].job = job;
+  bands_span (bands, *n_bands, 0, height_block);
+
+  return bands;
+}
+
+/* Runs func over every band, the first one on the calling thread, and
+ * returns once they have all finished */
+static void
+run_bands (GFunc  func,
+           Band  *bands,
+           guint  n_bands)
+{
+  GThreadPool *pool = NULL;
+  guint i;
+
+  if (n_bands > 1)
+    pool = g_thread_pool_new (func, NULL, n_bands - 1, FALSE, NULL);
+
+  for (i=1;i<n_bands;i++)
+    {
+      if (pool)
+        g_thread_pool_push (pool, &bands[i], NULL);
+      else
+        func (&bands[i], NULL);
+    }
+
+  func (&bands[0], NULL);
+
+  if (pool)
+    g_thread_pool_free (pool, FALSE, TRUE);
+}
+
+/**
+ * pvr_texture_compress_pvrtc4_parallel:
+ *
+ * Like pvr_texture_compress_pvrtc4(), but splits the work into bands of
+ * block rows and compresses them on n_threads threads (or one per CPU if
+ * n_threads is 0). The output is the same whatever the number of
+ * threads.
+ */
+guchar *pvr_texture_compress_pvrtc4_parallel(
+                const guchar *uncompressed_data,
+                gint width,
+                gint height,
+                guint n_threads,
+                guint *compressed_size)
+{
+  PvrTextureSource source;
+
+  g_return_val_if_fail(compressed_size!=0, 0);
+
+  pvr_texture_source_init (&source, uncompressed_data,
+                           width, height, width*4, 4);
+  return pvr_texture_compress_source (&source, MGLPT_PVRTC4, n_threads,
+                                      NULL, compressed_size);
+}
+
+/* Bytes of scratch space (for the endpoint colours) PVRTC compression
+ * needs, for width_block x height_block blocks */
+gsize
+_pvr_texture_compress_scratch_size (guint width_block,
+                                    guint height_block)
+{
+  /* our block colour lists are one bigger all the way around, and we
+   * copy the colours so we don't need to do bounds checking. The
+   * twiddle tables go after them */
+  return 2 * sizeof(Color) * (width_block+2) * (height_block+2) +
+         sizeof(guint32) * (width_block + height_block);
+}
+
+/* PVRTC4 compression of the padded image read from source into
+ * compressed_data, with the endpoints in scratch. The sizes have already
+ * been checked. With one thread nothing is allocated. Each pass over a
+ * row of blocks is a step of progress, which may be NULL */
+void
+_pvr_texture_compress_pvrtc4_into (const PvrTextureSource *source,
+                                   guint                   n_threads,
+                                   const PvrTextureOptions *options,
+                                   guchar                 *compressed_data,
+                                   guchar                 *scratch,
+                                   PvrProgress            *progress)
+{
+  CompressJob job;
+  Band band, *bands;
+  guint n_bands;
+
+  job.source = source;
+  job.dither = options ? options->dither : PVR_TEXTURE_DITHER_NONE;
+  job.quality = options ? options->quality : PVR_TEXTURE_QUALITY_FAST;
+  job.progress = progress;
+  job.width_block = source->padded_width / 4;
+  job.block_stride = job.width_block+2;
+  job.height_block = source->padded_height / 4;
+  job.window = 0;
+  job.kernels = _pvr_texture_kernels_get ();
+  job.out_data = (guint32*)compressed_data;
+  job.col_low = (Color*)scratch;
+  job.col_high = job.col_low + job.block_stride*(job.height_block+2);
+  _pvr_texture_twiddle_init (&job.twiddle, job.width_block, job.height_block,
+      (guint32*)(job.col_high + job.block_stride*(job.height_block+2)));
+
+  if (n_threads == 1)
+    {
+      band.job = &job;
+      band.y_start = 0;
+      band.y_end = job.height_block;
+      bands = &band;
+      n_bands = 1;
+    }
+  else
+    bands = bands_new (&job, job.height_block, n_threads, &n_bands);
+
+  /* the blocks pass reads the endpoints of the rows either side of each
+   * band, so all of them have to be done first. Error diffusion runs
+   * through the whole texture, so that's done on this thread */
+  if (job.dither == PVR_TEXTURE_DITHER_DIFFUSION)
+    compress_endpoints (&job, 0, job.height_block);
+  else
+    run_bands (compress_endpoints_band, bands, n_bands);
+  if (!_pvr_progress_stopped (progress))
+    {
+      compress_endpoint_edges (&job);
+      run_bands (compress_blocks_band, bands, n_bands);
+    }
+
+  if (bands != &band)
+    g_free(bands);
+}
+
+/**
+ * pvr_texture_compress_pvrtc4:
+ *
+ * Takes an RGBA8888 bitmap and returns the data (and size) created
+ * after it has been compressed in the PVRTC4 format.
+ *
+ * Since: 0.8.2-maemo
+ */
+guchar *pvr_texture_compress_pvrtc4(
+                const guchar *uncompressed_data,
+                gint width,
+                gint height,
+                guint *compressed_size)
+{
+  return pvr_texture_compress_pvrtc4_parallel(uncompressed_data,
+                                              width, height,
+                                              1,
+                                              compressed_size);
+}
+
+/* Block rows pvr_texture_compress_pvrtc4_rows() reads in at a time, for
+ * each thread */
+#define STREAM_ROWS_PER_THREAD 4
+
+/* Where pvr_texture_compress_pvrtc4_rows() is up to reading the image */
+typedef struct {
+  PvrTextureRowFunc  func;
+  gpointer           user_data;
+  guint              width, height;
+  guint              padded_width, padded_height;
+  Color             *first, *last;
+} RowReader;
+
+/* Fills in row y of the padded image, as _pvr_texture_source_gather()
+ * would. Rows must be asked for in order, and those in the padding are
+ * copies of the first and last rows of the image */
+static gboolean
+row_reader_read (RowReader *reader,
+                 guint      y,
+                 Color     *row)
+{
+  guint sy = _pvr_texture_source_coord (y, reader->height,
+                                        reader->padded_height);
+  guint x;
+
+  if (sy != y)
+    {
+      memcpy (row, sy ? reader->last : reader->first,
+              sizeof(Color)*reader->padded_width);
+      return TRUE;
+    }
+
+  if (!reader->func (y, (guchar*)row, reader->user_data))
+    return FALSE;
+  for (x=reader->width;x<reader->padded_width;x++)
+    row[x] = row[_pvr_texture_source_coord (x, reader->width,
+                                            reader->padded_width)];
+
+  if (y == 0)
+    memcpy (reader->first, row, sizeof(Color)*reader->padded_width);
+  if (y == reader->height - 1)
+    memcpy (reader->last, row, sizeof(Color)*reader->padded_width);
+
+  return TRUE;
+}
+
+/**
+ * pvr_texture_compress_pvrtc4_rows:
+ *
+ * Compresses a width x height image to PVRTC4 as its rows are made,
+ * rather than from pixels that are all in memory. func is called for
+ * each row in turn to write its width RGBA pixels, and can stop the
+ * compression by returning FALSE. The image is padded out to
+ * padded_width x padded_height, just as a PvrTextureSource is. Only a
+ * few rows of blocks for each of the n_threads threads (one per CPU if 0)
+ * are kept at once, so big textures can be made without ever holding
+ * the whole image.
+ *
+ * The data written to compressed_data is the same as
+ * pvr_texture_compress_source_into() gives for the same image and
+ * options (which may be NULL). Returns FALSE if the sizes are wrong, or
+ * func stopped it.
+ */
+gboolean
+pvr_texture_compress_pvrtc4_rows (gint                     width,
+                                  gint                     height,
+                                  gint                     padded_width,
+                                  gint                     padded_height,
+                                  guint                    n_threads,
+                                  const PvrTextureOptions *options,
+                                  PvrTextureRowFunc        func,
+                                  gpointer                 user_data,
+                                  guchar                  *compressed_data,
+                                  gsize                    compressed_size)
+{
+  PvrTextureSource window;
+  RowReader reader;
+  CompressJob job;
+  EndpointRounding rounding;
+  Band *bands;
+  Color *pixels;
+  guint32 *tables;
+  gsize needed_size;
+  guint n_bands, band_rows, rows, y0, y;
+  gboolean ok = TRUE;
+
+  g_return_val_if_fail(func!=0, FALSE);
+
+  if (width <= 0 || height <= 0 ||
+      width > padded_width || height > padded_height ||
+      !pvr_texture_compress_sizes (MGLPT_PVRTC4, padded_width, padded_height,
+                                   &needed_size, NULL) ||
+      compressed_size < needed_size)
+    return FALSE;
+
+  if (n_threads == 0)
+    n_threads = g_get_num_processors ();
+
+  job.dither = options ? options->dither : PVR_TEXTURE_DITHER_NONE;
+  job.quality = options ? options->quality : PVR_TEXTURE_QUALITY_FAST;
+  job.progress = NULL;
+  job.width_block = padded_width / 4;
+  job.block_stride = job.width_block+2;
+  job.height_block = padded_height / 4;
+  job.kernels = _pvr_texture_kernels_get ();
+  job.out_data = (guint32*)compressed_data;
+  tables = g_new(guint32, job.width_block + job.height_block);
+  _pvr_texture_twiddle_init (&job.twiddle, job.width_block, job.height_block,
+                             tables);
+
+  /* The pixels of the last row of the band before, then of the rows
+   * being read in, and the endpoints of the two rows before them and of
+   * those being read in. The blocks of a row can be assembled once the
+   * endpoints of the row after it are done, so each band of rows is
+   * assembled one row behind the one being read */
+  band_rows = MIN(n_threads * STREAM_ROWS_PER_THREAD, job.height_block);
+  pixels = g_new(Color, (band_rows + 1)*4*padded_width);
+  job.col_low = g_new(Color, (band_rows + 2)*job.block_stride);
+  job.col_high = g_new(Color, (band_rows + 2)*job.block_stride);
+  pvr_texture_source_init (&window, (const guchar*)pixels,
+                           padded_width, (band_rows + 1)*4,
+                           padded_width*4, 4);
+  job.source = &window;
+
+  reader.func = func;
+  reader.user_data = user_data;
+  reader.width = width;
+  reader.height = height;
+  reader.padded_width = padded_width;
+  reader.padded_height = padded_height;
+  reader.first = g_new(Color, padded_width);
+  reader.last = g_new(Color, padded_width);
+
+  bands = bands_new (&job, band_rows, n_threads, &n_bands);
+  endpoint_rounding_init (&rounding, job.dither);
+
+  for (y0=0;y0<job.height_block;y0+=rows)
+    {
+      rows = MIN(band_rows, job.height_block - y0);
+      job.window = (gint)y0 - 1;
+
+      for (y=0;y<rows*4 && ok;y++)
+        ok = row_reader_read (&reader, y0*4 + y,
+                              &pixels[(4 + y)*padded_width]);
+      if (!ok)
+        break;
+
+      /* error diffusion carries on from the band before */
+      if (job.dither == PVR_TEXTURE_DITHER_DIFFUSION)
+        compress_endpoint_rows (&job, &rounding, y0, y0 + rows);
+      else
+        {
+          bands_span (bands, n_bands, y0, y0 + rows);
+          run_bands (compress_endpoints_band, bands, n_bands);
+        }
+
+      /* the row above the top one is a copy of it */
+      if (y0 == 0)
+        {
+          memcpy (&job.col_low[job.block_stride],
+                  &job.col_low[2*job.block_stride],
+                  sizeof(Color)*job.block_stride);
+          memcpy (&job.col_high[job.block_stride],
+                  &job.col_high[2*job.block_stride],
+                  sizeof(Color)*job.block_stride);
+        }
+
+      bands_span (bands, n_bands, y0 ? y0 - 1 : 0, y0 + rows - 1);
+      run_bands (compress_blocks_band, bands, n_bands);
+
+      /* keep the last row of pixels and the last two of endpoints for
+       * the next band */
+      memcpy (pixels, &pixels[rows*4*padded_width],
+              sizeof(Color)*4*padded_width);
+      memmove (job.col_low, &job.col_low[rows*job.block_stride],
+               sizeof(Color)*2*job.block_stride);
+      memmove (job.col_high, &job.col_high[rows*job.block_stride],
+               sizeof(Color)*2*job.block_stride);
+    }
+
+  /* and the bottom row, with the row below it a copy of it */
+  if (ok)
+    {
+      job.window = job.height_block - 1;
+      memcpy (&job.col_low[2*job.block_stride],
+              &job.col_low[job.block_stride],
+              sizeof(Color)*job.block_stride);
+      memcpy (&job.col_high[2*job.block_stride],
+              &job.col_high[job.block_stride],
+              sizeof(Color)*job.block_stride);
+      compress_blocks (&job, job.height_block - 1, job.height_block);
+    }
+
+  g_free(bands);
+  g_free(reader.first);
+  g_free(reader.last);
+  g_free(job.col_low);
+  g_free(job.col_high);
+  g_free(pixels);
+  g_free(tables);
+
+  return ok;
+}
+
+/**
+ * pvr_texture_recompress_pvrtc4_region:
+ *
+ * Brings PVRTC4 data that was compressed from an older version of
+ * source up to date, in place, after the pixels in the given
+ * rectangle have changed. Only the blocks touching the rectangle, and
+ * the ring of blocks around them (which blend in their colours), are
+ * encoded again, so the cost depends on the size of the rectangle rather
+ * than of the texture. The result is the same as compressing the whole
+ * texture again with the same options (which may be NULL).
+ *
+ * Returns FALSE if the sizes don't make sense, or the options ask for
+ * error diffusion, which can't be redone for part of the texture.
+ */
+gboolean pvr_texture_recompress_pvrtc4_region(
+                const PvrTextureSource *source,
+                const PvrTextureOptions *options,
+                guchar *compressed_data,
+                guint compressed_size,
+                gint x,
+                gint y,
+                gint region_width,
+                gint region_height)
+{
+  gint width = source->padded_width;
+  gint height = source->padded_height;
+  CompressJob job;
+  EndpointRounding rounding;
+  guint32 *tables;
+  gint x_start, y_start, x_end, y_end; /* blocks to encode */
+  gint window_x, window_y, window_stride, window_height;
+  gint bx, by;
+
+  if ((width&3) || (height&3) ||
+      !is_power_2(width) ||
+      !is_power_2(height) ||
+      compressed_size != (guint)(width/4)*(height/4)*8)
+    return FALSE;
+
+  job.dither = options ? options->dither : PVR_TEXTURE_DITHER_NONE;
+  job.quality = options ? options->quality : PVR_TEXTURE_QUALITY_FAST;
+  if (job.dither == PVR_TEXTURE_DITHER_DIFFUSION)
+    return FALSE;
+
+  /* clip to the texture */
+  if (x < 0)
+    {
+      region_width += x;
+      x = 0;
+    }
+  if (y < 0)
+    {
+      region_height += y;
+      y = 0;
+    }
+  region_width = MIN(region_width, width - x);
+  region_height = MIN(region_height, height - y);
+  if (region_width <= 0 || region_height <= 0)
+    return TRUE;
+
+  job.source = source;
+  job.progress = NULL;
+  job.width_block = width / 4;
+  job.height_block = height / 4;
+  job.window = 0;
+  job.kernels = _pvr_texture_kernels_get ();
+  job.out_data = (guint32*)compressed_data;
+  tables = g_new(guint32, job.width_block + job.height_block);
+  _pvr_texture_twiddle_init (&job.twiddle, job.width_block, job.height_block,
+                             tables);
+
+  /* the damaged blocks, and the ones either side of them */
+  x_start = MAX(x/4 - 1, 0);
+  y_start = MAX(y/4 - 1, 0);
+  x_end = MIN((x + region_width + 3)/4 + 1, (gint)job.width_block);
+  y_end = MIN((y + region_height + 3)/4 + 1, (gint)job.height_block);
+
+  /* and the colours of those blocks and the ones either side of them,
+   * repeating the edges just like compress_endpoint_edges(). Without
+   * error diffusion each block's colours only depend on where it is, so
+   * they come out just as compress_endpoints() made them */
+  window_x = x_start - 1;
+  window_y = y_start - 1;
+  window_stride = x_end - x_start + 2;
+  window_height = y_end - y_start + 2;
+  job.block_stride = window_stride;
+  job.col_low = g_new(Color, window_stride*window_height);
+  job.col_high = g_new(Color, window_stride*window_height);
+  endpoint_rounding_init (&rounding, job.dither);
+
+  for (by=0;by<window_height;by++)
+    for (bx=0;bx<window_stride;bx++)
+      {
+        gint sx = CLAMP(window_x + bx, 0, (gint)job.width_block - 1);
+        gint sy = CLAMP(window_y + by, 0, (gint)job.height_block - 1);
+        Color *clow = &job.col_low[bx + by*window_stride];
+        Color *chigh = &job.col_high[bx + by*window_stride];
+        Color scratch[16];
+        const Color *block;
+        guint stride;
+
+        block = _pvr_texture_source_block (source, sx*4, sy*4, 4, 4,
+                                           scratch, &stride);
+        pick_endpoints (&job, &rounding, sx, sy, block, stride,
+                        clow, chigh);
+      }
+
+  for (by=y_start;by<y_end;by++)
+    for (bx=x_start;bx<x_end;bx++)
+      {
+        gint offs = (bx - x_start) + (by - y_start)*window_stride;
+
+        compress_block (&job, bx, by,
+                        &job.col_low[offs],
+                        &job.col_high[offs],
+                        window_stride);
+      }
+
+  g_free(job.col_low);
+  g_free(job.col_high);
+  g_free(tables);
+  return TRUE;
+}
+
+/* The plain C block decoder. Writes the 16 pixels of one block to out,
+ * which is out_stride pixels wide. low and high are as for
+ * PvrBlockEndpointsFunc */
+void
+_pvr_texture_decode_block_c (guint32      pixel_bits_word,
+                             gboolean     block_alpha_mode,
+                             const Color *low,
+                             const Color *high,
+                             guint        block_stride,
+                             Color       *out,
+                             guint        out_stride)
+{
+  gint bx,by;
+
+  for (by=0;by<4;by++)
+    for (bx=0;bx<4;bx++)
+      {
+        Color tmpa, tmpb, cl, ch, col;
+        gint boffs = ((bx+2)>>2) + (((by+2)>>2) * block_stride);
+        gint pixel_bits;
+        gint amtx, amty;
+
+        amtx = ((bx+2)&3) * 64;
+        amty = ((by+2)&3) * 64;
+        pixel_bits = pixel_bits_word&3;
+        pixel_bits_word = pixel_bits_word >> 2;
+
+        color_interp(&tmpa, &low[boffs],
+                        &low[boffs+1], amtx);
+        color_interp(&tmpb, &low[boffs+block_stride],
+                        &low[boffs+block_stride+1], amtx);
+        color_interp(&cl, &tmpa, &tmpb, amty);
+
+        color_interp(&tmpa, &high[boffs],
+                        &high[boffs+1], amtx);
+        color_interp(&tmpb, &high[boffs+block_stride],
+                        &high[boffs+block_stride+1], amtx);
+        color_interp(&ch, &tmpa, &tmpb, amty);
+
+        if (block_alpha_mode)
+          {
+            if (pixel_bits==0)
+              col = cl;
+            else if (pixel_bits==1)
+              color_interp(&col, &cl, &ch, 128);
+            else if (pixel_bits==2) {
+              color_interp(&col, &cl, &ch, 128);
+              col.alpha = 0;
+            } else col = ch;
+          }
+        else
+          {
+            if (pixel_bits==0)
+              col = cl;
+            else if (pixel_bits==1)
+              color_interp(&col, &cl, &ch, 96);
+            else if (pixel_bits==2) {
+              color_interp(&col, &cl, &ch, 160);
+            } else col = ch;
+          }
+        out[bx + by*out_stride] = col;
+      }
+}
+
+typedef struct {
+  const guint32 *compressed_datal;
+  gint width;
+  guint width_block, height_block, block_stride;
+  Color *col_low, *col_high;
+  Color *uncompressed_data;
+  PvrTextureTwiddle twiddle;
+  const PvrKernels *kernels;
+} DecompressJob;
+
+/* The two words of block (x, y) of data */
+static inline const guint32 *
+twiddled_block (const guint32           *data,
+                const PvrTextureTwiddle *twiddle,
+                guint                    x,
+                guint                    y)
+{
+  return &data[_pvr_texture_twiddle_block (twiddle, x, y) << 1];
+}
+
+/* unpack the colours of every block in rows y_start to y_end */
+static void
+decompress_endpoints (DecompressJob *job,
+                      guint          y_start,
+                      guint          y_end)
+{
+  Color *col_low = job->col_low;
+  Color *col_high = job->col_high;
+  guint width_block = job->width_block;
+  guint x,y;
+
+  for (y=y_start;y<y_end;y++)
+    {
+      guint offs = y*job->block_stride + job->block_stride;
+
+      for (x=0;x<width_block;x++)
+        {
+          guint32 pixel_col_word =
+            twiddled_block (job->compressed_datal, &job->twiddle, x, y)[1];
+
+          col_high[offs+x+1] = pvr_color_to_color(pixel_col_word >> 16);
+          col_low[offs+x+1] = pvr_color_to_color(pixel_col_word & 0xFFFE);
+        }
+
+      col_low[offs] = col_low[offs+1];
+      col_low[offs+width_block+1] = col_low[offs+width_block];
+      col_high[offs] = col_high[offs+1];
+      col_high[offs+width_block+1] = col_high[offs+width_block];
+    }
+}
+
+/* copy top and bottom of our block so we get repeats */
+static void
+decompress_endpoint_edges (DecompressJob *job)
+{
+  guint block_stride = job->block_stride;
+  guint height_block = job->height_block;
+
+  memcpy(&job->col_low[0], &job->col_low[block_stride],
+              sizeof(Color)*block_stride);
+  memcpy(&job->col_high[0], &job->col_high[block_stride],
+              sizeof(Color)*block_stride);
+  memcpy(&job->col_low[block_stride*(height_block+1)],
+         &job->col_low[block_stride*height_block],
+              sizeof(Color)*block_stride);
+  memcpy(&job->col_high[block_stride*(height_block+1)],
+         &job->col_high[block_stride*height_block],
+              sizeof(Color)*block_stride);
+}
+
+/* decode every pixel of the blocks in rows y_start to y_end, reading the
+ * modulation bits straight out of the twiddled data */
+static void
+decompress_blocks (DecompressJob *job,
+                   guint          y_start,
+                   guint          y_end)
+{
+  guint x,y;
+
+  for (y=y_start;y<y_end;y++)
+    {
+      for (x=0;x<job->width_block;x++)
+        {
+          const guint32 *words =
+            twiddled_block (job->compressed_datal, &job->twiddle, x, y);
+          guint offs = x + y*job->block_stride;
+
+          job->kernels->decode_block (words[0],
+                                      words[1] & 1,
+                                      &job->col_low[offs],
+                                      &job->col_high[offs],
+                                      job->block_stride,
+                                      &job->uncompressed_data
+                                        [(x*4) + (y*job->width*4)],
+                                      job->width);
+        }
+    }
+}
+
+static void
+decompress_endpoints_band (gpointer data,
+                           gpointer user_data)
+{
+  Band *band = data;
+
+  decompress_endpoints (band->job, band->y_start, band->y_end);
+}
+
+static void
+decompress_blocks_band (gpointer data,
+                        gpointer user_data)
+{
+  Band *band = data;
+
+  decompress_blocks (band->job, band->y_start, band->y_end);
+}
+
+/**
+ * pvr_texture_decompress_pvrtc4_parallel:
+ *
+ * Like pvr_texture_decompress_pvrtc4(), but decodes bands of block rows
+ * on n_threads threads (or one per CPU if n_threads is 0).
+ */
+guchar *pvr_texture_decompress_pvrtc4_parallel(
+                const guchar *compressed_data,
+                gint width,
+                gint height,
+                guint n_threads)
+{
+  DecompressJob job;
+  guint32 *tables;
+  Band *bands;
+  guint n_bands;
+
+  /* must be a multiple of 4 + Power of 2 in each direction */
+  if ((width&3) || (height&3) ||
+      !is_power_2(width) ||
+      !is_power_2(height))
+    return 0;
+
+  job.compressed_datal = (const guint32*)compressed_data;
+  job.width = width;
+  job.width_block = width / 4;
+  job.block_stride = job.width_block+2;
+  job.height_block = height / 4;
+  job.kernels = _pvr_texture_kernels_get ();
+  tables = g_new(guint32, job.width_block + job.height_block);
+  _pvr_texture_twiddle_init (&job.twiddle, job.width_block, job.height_block,
+                             tables);
+  job.uncompressed_data = g_malloc(sizeof(Color)*width*height);
+  /* but we make our block colour list one bigger all the way around
+   * and copy the colours so we don't need to do bounds checking */
+  job.col_low = g_malloc(sizeof(Color)*job.block_stride*(job.height_block+2));
+  job.col_high = g_malloc(sizeof(Color)*job.block_stride*(job.height_block+2));
+
+  bands = bands_new (&job, job.height_block, n_threads, &n_bands);
+
+  run_bands (decompress_endpoints_band, bands, n_bands);
+  decompress_endpoint_edges (&job);
+  run_bands (decompress_blocks_band, bands, n_bands);
+
+  g_free(bands);
+  g_free(job.col_low);
+  g_free(job.col_high);
+  g_free(tables);
+  return (guchar*)job.uncompressed_data;
+}
+
+/**
+ * pvr_texture_decompress_pvrtc4:
+ *
+ * Returns an RGBA8888 bitmap created from decompressing the given compressed
  * data that was in PVRTC4 format...
  *
  * Since: 0.8.2-maemo
@@ -744,150 +2029,523 @@ guchar *pvr_texture_decompress_pvrtc4(
                 gint width,
                 gint height)
 {
-  Color *uncompressed_data = 0;
-  guint32 *compressed_datal = (guint32*)compressed_data;
-  guint32 *arranged_data = 0; /* data after it has been rearranged */
-  gint width_block, height_block, block_stride;
-  Color *col_low, *col_high;
-  gint x,y;
-  guint32 morton_mask, xshift, xmask, yshift, ymask;
+  return pvr_texture_decompress_pvrtc4_parallel(compressed_data,
+                                                width, height, 1);
+}
+
+/* The modulation weights (out of 256) of the high colour for each 2 bit
+ * code, in the normal and the punch-through alpha modes. Code 2 in the
+ * alpha mode is also fully transparent */
+static const guint modulation_weight[2][4] = {
+  { 0, 96, 160, 256 },
+  { 0, 128, 128, 256 }
+};
+
+/* the number of bits set in bits */
+static inline guint
+count_bits (guint32 bits)
+{
+  bits = bits - ((bits >> 1) & 0x55555555);
+  bits = (bits & 0x33333333) + ((bits >> 2) & 0x33333333);
+  bits = (bits + (bits >> 4)) & 0x0F0F0F0F;
+  return (bits * 0x01010101) >> 24;
+}
+
+/* The average of the 16 pixels of a block, worked out from its own
+ * colours and modulation without interpolating between blocks. Around
+ * the middle of the block that is what the interpolation comes to
+ * anyway, so at 1/4 scale and below it's indistinguishable */
+static inline Color
+decompress_block_average (const guint32 *words)
+{
+  Color low = pvr_color_to_color(words[1] & 0xFFFE);
+  Color high = pvr_color_to_color(words[1] >> 16);
+  const guint *w = modulation_weight[words[1] & 1];
+  guint32 low_bits = words[0] & 0x55555555;
+  guint32 high_bits = (words[0] >> 1) & 0x55555555;
+  /* how many pixels have each code */
+  guint n1 = count_bits (low_bits & ~high_bits);
+  guint n2 = count_bits (high_bits & ~low_bits);
+  guint n3 = count_bits (low_bits & high_bits);
+  guint weight = n1*w[1] + n2*w[2] + n3*w[3];
+  guint alpha_weight = weight, opaque = 16;
+  Color col;
+
+  if (words[1] & 1)
+    {
+      alpha_weight -= n2*w[2];
+      opaque -= n2;
+    }
+
+  /* weights are now out of 16*256 */
+  col.red = (low.red*(4096-weight) + high.red*weight + 2048) >> 12;
+  col.green = (low.green*(4096-weight) + high.green*weight + 2048) >> 12;
+  col.blue = (low.blue*(4096-weight) + high.blue*weight + 2048) >> 12;
+  col.alpha = (low.alpha*(opaque*256-alpha_weight) +
+               high.alpha*alpha_weight + 2048) >> 12;
+  return col;
+}
+
+/* Writes the average of the scale x scale squares of block, which is
+ * 4 pixels wide, from (x, y) to (x_end, y_end) to out */
+static inline void
+decompress_block_scaled (const Color *block,
+                         guint        x,
+                         guint        y,
+                         guint        x_end,
+                         guint        y_end,
+                         guint        scale,
+                         Color       *out,
+                         guint        out_stride)
+{
+  guint i, j;
+
+  for (j=y;j<y_end;j+=scale)
+    for (i=x;i<x_end;i+=scale)
+      {
+        Color *dest = &out[(i-x)/scale + (j-y)/scale*out_stride];
+
+        if (scale==1)
+          *dest = block[i + j*4];
+        else
+          {
+            const Color *a = &block[i + j*4];
+            const Color *b = &block[i + (j+1)*4];
+
+            dest->red = (a[0].red + a[1].red + b[0].red + b[1].red + 2) >> 2;
+            dest->green =
+              (a[0].green + a[1].green + b[0].green + b[1].green + 2) >> 2;
+            dest->blue =
+              (a[0].blue + a[1].blue + b[0].blue + b[1].blue + 2) >> 2;
+            dest->alpha =
+              (a[0].alpha + a[1].alpha + b[0].alpha + b[1].alpha + 2) >> 2;
+          }
+      }
+}
+
+/**
+ * pvr_texture_decompress_pvrtc4_region:
+ *
+ * Decodes just the region_width x region_height pixels at (x, y) of a
+ * PVRTC4 texture, shrunk by scale (1, 2, 4 or 8), and returns them as an
+ * RGBA8888 bitmap region_width/scale x region_height/scale pixels big.
+ * Only the blocks under the region (and, at scales 1 and 2, the ring of
+ * blocks around it whose colours are blended in) are read, so it is a
+ * lot cheaper than pvr_texture_decompress_pvrtc4() for previews.
+ *
+ * At scale 1 the pixels are exactly those pvr_texture_decompress_pvrtc4()
+ * gives, and at 2 they are averaged in pairs of pairs. At 4 and 8 each
+ * block is only reduced to the average of its own two colours, weighted
+ * by its modulation, and at 8 those are averaged in turn.
+ *
+ * Returns NULL if the texture size is not a power of 2, or the region
+ * is not inside the texture or on a multiple of scale.
+ */
+guchar *pvr_texture_decompress_pvrtc4_region(
+                const guchar *compressed_data,
+                gint width,
+                gint height,
+                gint x,
+                gint y,
+                gint region_width,
+                gint region_height,
+                guint scale)
+{
+  DecompressJob job;
+  guint32 *tables;
+  Color *out;
+  guint out_width, out_height;
+  guint bx_start, by_start, bx_end, by_end;
+  guint bx, by;
+
   /* must be a multiple of 4 + Power of 2 in each direction */
   if ((width&3) || (height&3) ||
       !is_power_2(width) ||
       !is_power_2(height))
     return 0;
+  /* (written so that nothing can overflow) */
+  if ((scale!=1 && scale!=2 && scale!=4 && scale!=8) ||
+      x<0 || y<0 || region_width<=0 || region_height<=0 ||
+      region_width>width || region_height>height ||
+      x>width-region_width || y>height-region_height ||
+      (x|y|region_width|region_height) & (scale-1))
+    return 0;
 
-  width_block = width / 4;
-  block_stride = width_block+2;
-  height_block = height / 4;
-  _calculate_access_masks(width_block, height_block,
-      &morton_mask, &xshift, &xmask, &yshift, &ymask);
-  /* 4 bits per pixel, or 64 bits per block*/
-  uncompressed_data = g_malloc(sizeof(Color)*width*height);
-  arranged_data = (guint32*)g_malloc(sizeof(guint32)*2*width_block*height_block);
-  /* but we make our block colour list one bigger all the way around
-   * and copy the colours so we don't need to do bounds checking */
-  col_low = g_malloc(sizeof(Color)*block_stride*(height_block+2));
-  col_high = g_malloc(sizeof(Color)*block_stride*(height_block+2));
+  job.compressed_datal = (const guint32*)compressed_data;
+  job.width_block = width / 4;
+  job.height_block = height / 4;
+  tables = g_new(guint32, job.width_block + job.height_block);
+  _pvr_texture_twiddle_init (&job.twiddle, job.width_block, job.height_block,
+                             tables);
+
+  out_width = region_width / scale;
+  out_height = region_height / scale;
+  out = g_malloc(sizeof(Color)*out_width*out_height);
 
-  /* re-arrange data and  */
-  for (y=0;y<height_block;y++)
+  bx_start = x / 4;
+  by_start = y / 4;
+  bx_end = (x + region_width + 3) / 4;
+  by_end = (y + region_height + 3) / 4;
+
+  if (scale >= 4)
     {
-      /* space out Y bits ready for Morton pattern */
-      gint my;
-      gint offs = y*block_stride + block_stride;
-      my = (y | (y << 8)) & 0x00FF00FF;
-      my = (my | (my << 4)) & 0x0F0F0F0F;
-      my = (my | (my << 2)) & 0x33333333;
-      my = (my | (my << 1)) & 0x55555555;
+      /* one block per output pixel at 1/4, 2x2 at 1/8 */
+      guint step = scale / 4;
+      guint n = step * step;
+
+      for (by=by_start;by<by_end;by+=step)
+        for (bx=bx_start;bx<bx_end;bx+=step)
+          {
+            guint r = 0, g = 0, b = 0, a = 0;
+            guint i, j;
+            Color *dest = &out[(bx-bx_start)/step +
+                               (by-by_start)/step*out_width];
+
+            for (j=by;j<by+step;j++)
+              for (i=bx;i<bx+step;i++)
+                {
+                  Color col = decompress_block_average (
+                    twiddled_block (job.compressed_datal, &job.twiddle, i, j));
+
+                  r += col.red;
+                  g += col.green;
+                  b += col.blue;
+                  a += col.alpha;
+                }
+            dest->red = (r + n/2) / n;
+            dest->green = (g + n/2) / n;
+            dest->blue = (b + n/2) / n;
+            dest->alpha = (a + n/2) / n;
+          }
+
+      g_free(tables);
+      return (guchar*)out;
+    }
 
-      for (x=0;x<width_block;x++)
+  /* Unpack the colours of the blocks under the region and the ones
+   * around them, repeating the edge blocks of the texture like
+   * decompress_endpoint_edges() does */
+  job.block_stride = (bx_end - bx_start) + 2;
+  job.col_low = g_malloc(sizeof(Color)*job.block_stride*
+                         (by_end - by_start + 2));
+  job.col_high = g_malloc(sizeof(Color)*job.block_stride*
+                          (by_end - by_start + 2));
+  job.kernels = _pvr_texture_kernels_get ();
+
+  for (by=0;by<by_end-by_start+2;by++)
+    {
+      guint sy = CLAMP((gint)(by_start + by) - 1, 0,
+                       (gint)job.height_block - 1);
+      for (bx=0;bx<job.block_stride;bx++)
         {
-          guint32 pixel_col_word = 0;
-          gint mx, mz; /* for morton numbers later */
-
-          /* PVR Stores images in Morton pattern to get some spatial
-          * locality
-          *
-          * Interleave lower 16 bits of x and y, so the bits of x
-          * are in the even positions and bits from y in the odd;
-          * z gets the resulting 32-bit Morton Number. */
-          mx = (x | (x << 8)) & 0x00FF00FF;
-          mx = (mx | (mx << 4)) & 0x0F0F0F0F;
-          mx = (mx | (mx << 2)) & 0x33333333;
-          mx = (mx | (mx << 1)) & 0x55555555;
-          mz = (my | (mx << 1)) & morton_mask;
-          mz |= (x << xshift) & xmask;
-          mz |= (y << yshift) & ymask;
-          mz = mz << 1;
-
-          arranged_data[(x+(y*width_block))*2  ] = compressed_datal[mz  ];
-          arranged_data[(x+(y*width_block))*2+1] = compressed_datal[mz+1];
-          pixel_col_word = compressed_datal[mz+1];
+          guint sx = CLAMP((gint)(bx_start + bx) - 1, 0,
+                           (gint)job.width_block - 1);
+          guint32 pixel_col_word =
+            twiddled_block (job.compressed_datal, &job.twiddle, sx, sy)[1];
+          guint offs = bx + by*job.block_stride;
+
+          job.col_high[offs] = pvr_color_to_color(pixel_col_word >> 16);
+          job.col_low[offs] = pvr_color_to_color(pixel_col_word & 0xFFFE);
+        }
+    }
 
-          col_high[offs+x+1] = pvr_color_to_color(pixel_col_word >> 16);
-          col_low[offs+x+1] = pvr_color_to_color(pixel_col_word & 0xFFFE);
+  for (by=by_start;by<by_end;by++)
+    {
+      /* the part of this block's rows inside the region */
+      guint y0 = MAX((gint)(by*4), y) - by*4;
+      guint y1 = MIN((gint)(by*4 + 4), y + region_height) - by*4;
+
+      for (bx=bx_start;bx<bx_end;bx++)
+        {
+          const guint32 *words =
+            twiddled_block (job.compressed_datal, &job.twiddle, bx, by);
+          guint offs = (bx-bx_start) + (by-by_start)*job.block_stride;
+          guint x0 = MAX((gint)(bx*4), x) - bx*4;
+          guint x1 = MIN((gint)(bx*4 + 4), x + region_width) - bx*4;
+          Color *dest = &out[(bx*4 + x0 - x)/scale +
+                             (by*4 + y0 - y)/scale*out_width];
+          Color block[16];
+
+          /* whole blocks at full size can go straight in */
+          if (scale==1 && x1-x0==4 && y1-y0==4)
+            {
+              job.kernels->decode_block (words[0],
+                                         words[1] & 1,
+                                         &job.col_low[offs],
+                                         &job.col_high[offs],
+                                         job.block_stride,
+                                         dest, out_width);
+              continue;
+            }
+
+          job.kernels->decode_block (words[0],
+                                     words[1] & 1,
+                                     &job.col_low[offs],
+                                     &job.col_high[offs],
+                                     job.block_stride,
+                                     block, 4);
+          decompress_block_scaled (block, x0, y0, x1, y1, scale,
+                                   dest, out_width);
         }
+    }
 
-        col_low[offs] = col_low[offs+1];
-        col_low[offs+block_stride+1] = col_low[offs+block_stride];
-        col_high[offs] = col_high[offs+1];
-        col_high[offs+block_stride+1] = col_high[offs+block_stride];
-      }
-    /* copy top and bottom of our block so we get repeats */
-    memcpy(&col_low[0], &col_low[block_stride],
-                sizeof(Color)*block_stride);
-    memcpy(&col_high[0], &col_high[block_stride],
-                sizeof(Color)*block_stride);
-    memcpy(&col_low[block_stride*(height_block+1)],
-           &col_low[block_stride*height_block],
-                sizeof(Color)*block_stride);
-    memcpy(&col_high[block_stride*(height_block+1)],
-           &col_high[block_stride*height_block],
-                sizeof(Color)*block_stride);
+  g_free(job.col_low);
+  g_free(job.col_high);
+  g_free(tables);
+  return (guchar*)out;
+}
+
+/* PVRTC2 uses 8x4 pixel blocks with the same 64 bit layout as PVRTC4: a
+ * word of modulation bits, then the two colours. We only write (and read)
+ * the direct modulation mode, where each pixel has one bit that picks
+ * either the low or the high colour. The colours are interpolated between
+ * block centres just like PVRTC4, but in eighths horizontally. */
 
-    for (y=0;y<height_block;y++)
+static inline void
+interp_endpoints_pvrtc2 (const Color *col,
+                         guint        block_stride,
+                         gint         bx,
+                         gint         by,
+                         Color       *dest)
+{
+  Color tmpa, tmpb;
+  gint boffs = ((bx+4)>>3) + (((by+2)>>2) * block_stride);
+  gint amtx = ((bx+4)&7) * 32;
+  gint amty = ((by+2)&3) * 64;
+
+  color_interp(&tmpa, &col[boffs], &col[boffs+1], amtx);
+  color_interp(&tmpb, &col[boffs+block_stride],
+                  &col[boffs+block_stride+1], amtx);
+  color_interp(dest, &tmpa, &tmpb, amty);
+}
+
+static void
+compress_endpoints_pvrtc2 (CompressJob *job,
+                           guint        y_start,
+                           guint        y_end)
+{
+  guint width_block = job->width_block;
+  guint block_stride = job->block_stride;
+  Color *col_low = job->col_low;
+  Color *col_high = job->col_high;
+  EndpointRounding rounding;
+  guint x,y;
+
+  endpoint_rounding_init (&rounding, job->dither);
+  for (y=y_start;y<y_end;y++)
+    {
+      guint block_offs = (y+1)*block_stride;
       for (x=0;x<width_block;x++)
         {
+          Color clow, chigh;
+          Color scratch[32];
+          const Color *block;
+          guint width;
           gint bx,by;
+
+          /* as for PVRTC4, leave out the corners */
+          block = _pvr_texture_source_block (job->source, x*8, y*4, 8, 4,
+                                             scratch, &width);
+          clow = block[1];
+          chigh = block[1];
+          for (by=0;by<4;by++)
+            for (bx=0;bx<8;bx++)
+              {
+                if ((by==0 || by==3) && (bx==0 || bx==7))
+                  continue;
+                SETMIN(clow, block[bx + by*width]);
+                SETMAX(chigh, block[bx + by*width]);
+              }
+          round_endpoints (&rounding, x, y, &clow, &chigh);
+          col_low[1+x+block_offs] = clow;
+          col_high[1+x+block_offs] = chigh;
+        }
+      /* copy beginning and end */
+      col_low[block_offs] = col_low[block_offs+1];
+      col_low[block_offs+width_block+1] = col_low[block_offs+width_block];
+      col_high[block_offs] = col_high[block_offs+1];
+      col_high[block_offs+width_block+1] = col_high[block_offs+width_block];
+      if (!_pvr_progress_step (job->progress))
+        return;
+    }
+}
+
+static void
+compress_blocks_pvrtc2 (CompressJob *job,
+                        guint        y_start,
+                        guint        y_end)
+{
+  guint block_stride = job->block_stride;
+  guint x,y;
+
+  for (y=y_start;y<y_end;y++)
+    {
+      for (x=0;x<job->width_block;x++)
+        {
+          Color scratch[32];
+          const Color *block;
+          guint width;
           gint offs = x + y*block_stride;
-          guint32 pixel_bits_word = arranged_data[(x+(y*width_block))*2];
-          guint32 pixel_col_word  = arranged_data[(x+(y*width_block))*2 + 1];
-          gboolean block_alpha_mode = pixel_col_word&1;
-          /* now work out what every pixel in this block should be... */
+          guint32 pixel_bits_word = 0;
+          guint col_a, col_b;
+          gint bx,by;
+          guint32 mz;
+
+          block = _pvr_texture_source_block (job->source, x*8, y*4, 8, 4,
+                                             scratch, &width);
           for (by=0;by<4;by++)
-            for (bx=0;bx<4;bx++)
+            for (bx=0;bx<8;bx++)
               {
-                Color tmpa, tmpb, cl, ch, col;
-                gint boffs = offs + ((bx+2)>>2) + (((by+2)>>2) * block_stride);
-                gint pixel_bits;
-                gint amtx, amty;
-
-                amtx = ((bx+2)&3) * 64;
-                amty = ((by+2)&3) * 64;
-                pixel_bits = pixel_bits_word&3;
-                pixel_bits_word = pixel_bits_word >> 2;
-
-                color_interp(&tmpa, &col_low[boffs],
-                                &col_low[boffs+1], amtx);
-                color_interp(&tmpb, &col_low[boffs+block_stride],
-                                &col_low[boffs+block_stride+1], amtx);
-                color_interp(&cl, &tmpa, &tmpb, amty);
-
-                color_interp(&tmpa, &col_high[boffs],
-                                &col_high[boffs+1], amtx);
-                color_interp(&tmpb, &col_high[boffs+block_stride],
-                                &col_high[boffs+block_stride+1], amtx);
-                color_interp(&ch, &tmpa, &tmpb, amty);
-
-                if (block_alpha_mode)
-                  {
-                    if (pixel_bits==0)
-                      col = cl;
-                    else if (pixel_bits==1)
-                      color_interp(&col, &cl, &ch, 128);
-                    else if (pixel_bits==2) {
-                      color_interp(&col, &cl, &ch, 128);
-                      col.alpha = 0;
-                    } else col = ch;
-                  }
-                else
-                  {
-                    if (pixel_bits==0)
-                      col = cl;
-                    else if (pixel_bits==1)
-                      color_interp(&col, &cl, &ch, 96);
-                    else if (pixel_bits==2) {
-                      color_interp(&col, &cl, &ch, 160);
-                    } else col = ch;
-                  }
-              uncompressed_data[(x*4) + (y*width*4) + bx + (by*width)]
-                = col;
-            }
-      }
+                const Color *pixel_col = &block[bx + by*width];
+                Color cl, ch;
+
+                interp_endpoints_pvrtc2 (&job->col_low[offs], block_stride,
+                                         bx, by, &cl);
+                interp_endpoints_pvrtc2 (&job->col_high[offs], block_stride,
+                                         bx, by, &ch);
+                if (color_diff(pixel_col, &ch) < color_diff(pixel_col, &cl))
+                  pixel_bits_word |= 1u << (bx + by*8);
+              }
+
+          col_a = color_to_pvr_color(&job->col_low[offs+1+block_stride]);
+          col_b = color_to_pvr_color(&job->col_high[offs+1+block_stride]);
+
+          /* block coordinates are twiddled the same way as for PVRTC4 */
+          mz = _pvr_texture_twiddle_block (&job->twiddle, x, y) << 1;
+
+          job->out_data[mz  ] = pixel_bits_word;
+          job->out_data[mz+1] = (col_b << 16) | (col_a & 0xFFFE);
+        }
+      if (!_pvr_progress_step (job->progress))
+        return;
+    }
+}
+
+/**
+ * pvr_texture_compress_pvrtc2:
+ *
+ * Takes an RGBA8888 bitmap and returns the data (and size) created
+ * after it has been compressed in the PVRTC2 format. Width must be a
+ * power of 2 of at least 8, height a power of 2 of at least 4.
+ */
+guchar *pvr_texture_compress_pvrtc2(
+                const guchar *uncompressed_data,
+                gint width,
+                gint height,
+                guint *compressed_size)
+{
+  PvrTextureSource source;
+
+  g_return_val_if_fail(compressed_size!=0, 0);
+
+  pvr_texture_source_init (&source, uncompressed_data,
+                           width, height, width*4, 4);
+  return pvr_texture_compress_source (&source, MGLPT_PVRTC2, 1, NULL,
+                                      compressed_size);
+}
+
+/* As _pvr_texture_compress_pvrtc4_into(), for PVRTC2 */
+void
+_pvr_texture_compress_pvrtc2_into (const PvrTextureSource *source,
+                                   const PvrTextureOptions *options,
+                                   guchar                 *compressed_data,
+                                   guchar                 *scratch,
+                                   PvrProgress            *progress)
+{
+  CompressJob job;
+
+  job.source = source;
+  job.progress = progress;
+  job.width_block = source->padded_width / 8;
+  job.block_stride = job.width_block+2;
+  job.height_block = source->padded_height / 4;
+  job.kernels = NULL;
+  job.dither = options ? options->dither : PVR_TEXTURE_DITHER_NONE;
+  job.quality = PVR_TEXTURE_QUALITY_FAST; /* the only one PVRTC2 has */
+  job.out_data = (guint32*)compressed_data;
+  job.col_low = (Color*)scratch;
+  job.col_high = job.col_low + job.block_stride*(job.height_block+2);
+  _pvr_texture_twiddle_init (&job.twiddle, job.width_block, job.height_block,
+      (guint32*)(job.col_high + job.block_stride*(job.height_block+2)));
+
+  compress_endpoints_pvrtc2 (&job, 0, job.height_block);
+  if (_pvr_progress_stopped (progress))
+    return;
+  compress_endpoint_edges (&job);
+  compress_blocks_pvrtc2 (&job, 0, job.height_block);
+}
+
+static void
+decompress_blocks_pvrtc2 (DecompressJob *job,
+                          guint          y_start,
+                          guint          y_end)
+{
+  guint x,y;
+
+  for (y=y_start;y<y_end;y++)
+    {
+      for (x=0;x<job->width_block;x++)
+        {
+          guint32 pixel_bits_word =
+            twiddled_block (job->compressed_datal, &job->twiddle, x, y)[0];
+          guint offs = x + y*job->block_stride;
+          Color *out = &job->uncompressed_data[(x*8) + (y*job->width*4)];
+          gint bx,by;
+
+          for (by=0;by<4;by++)
+            for (bx=0;bx<8;bx++)
+              {
+                const Color *col = job->col_low;
+
+                if (pixel_bits_word & (1u << (bx + by*8)))
+                  col = job->col_high;
+                interp_endpoints_pvrtc2 (&col[offs], job->block_stride,
+                                         bx, by, &out[bx + by*job->width]);
+              }
+        }
+    }
+}
+
+/**
+ * pvr_texture_decompress_pvrtc2:
+ *
+ * Returns an RGBA8888 bitmap created from decompressing the given
+ * compressed data that was in PVRTC2 format. Only the direct modulation
+ * mode written by pvr_texture_compress_pvrtc2() is understood; blocks
+ * using the interpolated mode are decoded as if they were direct.
+ */
+guchar *pvr_texture_decompress_pvrtc2(
+                const guchar *compressed_data,
+                gint width,
+                gint height)
+{
+  DecompressJob job;
+  guint32 *tables;
+
+  if ((width&7) || (height&3) ||
+      !is_power_2(width) ||
+      !is_power_2(height))
+    return 0;
 
-  g_free(col_low);
-  g_free(col_high);
-  g_free(arranged_data);
-  return (guchar*)uncompressed_data;
+  job.compressed_datal = (const guint32*)compressed_data;
+  job.width = width;
+  job.width_block = width / 8;
+  job.block_stride = job.width_block+2;
+  job.height_block = height / 4;
+  job.kernels = NULL;
+  tables = g_new(guint32, job.width_block + job.height_block);
+  _pvr_texture_twiddle_init (&job.twiddle, job.width_block, job.height_block,
+                             tables);
+  job.uncompressed_data = g_malloc(sizeof(Color)*width*height);
+  job.col_low = g_malloc(sizeof(Color)*job.block_stride*(job.height_block+2));
+  job.col_high = g_malloc(sizeof(Color)*job.block_stride*(job.height_block+2));
+
+  decompress_endpoints (&job, 0, job.height_block);
+  decompress_endpoint_edges (&job);
+  decompress_blocks_pvrtc2 (&job, 0, job.height_block);
+
+  g_free(job.col_low);
+  g_free(job.col_high);
+  g_free(tables);
+  return (guchar*)job.uncompressed_data;
 }
@@ -24,7 +24,8 @@
 
 #ifndef PVRTEXTURE_H_
 #define PVRTEXTURE_H_
-/* handles compression + decompression of PVRTC4 texture files */
+/* handles compression + decompression of PVRTC4, PVRTC2 and ETC1 texture
+ * files */
 
 #include <glib.h>
 
@@ -49,9 +50,130 @@ typedef struct PVR_TEXTURE_HEADER_TAG {
 #define MGLPT_PVRTC2 (0x18)
 #define MGLPT_PVRTC4 (0x19)
 #define ETC_RGB_4BPP (0x36)
+#define PVR_FLAG_FORMAT_MASK (0x000000FF)
+#define PVR_FLAG_MIPMAP   (0x00000100)
 #define PVR_FLAG_TWIDDLED (0x00000200)
 #define PVR_FLAG_ALPHA    (0x00008000)
 
+/* Contents of PVR_TEXTURE_HEADER.dwPVR */
+#define PVR_TEXTURE_MAGIC ('P' | 'V'<<8 | 'R'<<16 | '!'<<24)
+
+/* A read-only mapping of a .pvr file */
+typedef struct _PvrTextureMap PvrTextureMap;
+
+/* A directory of compressed textures, indexed by a hash of their source */
+typedef struct _PvrTextureCache PvrTextureCache;
+
+/* What the .pvr files in a directory are, from a table kept there */
+typedef struct _PvrTextureIndex PvrTextureIndex;
+
+typedef struct {
+  const gchar        *name;    /* of the file, within the directory */
+  PVR_TEXTURE_HEADER  header;  /* checked, as by pvr_texture_probe() */
+  guint64             size;    /* of the file */
+  gint64              mtime;   /* of the file */
+} PvrTextureIndexEntry;
+
+/* Textures saved together, with one sync of the disk for all of them */
+typedef struct _PvrTextureSaveGroup PvrTextureSaveGroup;
+
+/* Where the blocks of a twiddled PVRTC texture width_block x height_block
+ * blocks in size are stored: block (x, y) is block number
+ * columns[x] | rows[y] */
+typedef struct {
+  guint    width_block;
+  guint    height_block;
+  guint32 *columns;
+  guint32 *rows;
+} PvrTextureTwiddle;
+
+/* Pixels to be compressed, read in place: width x height 8 bit RGB
+ * (n_channels 3, with alpha 255) or RGBA (n_channels 4) pixels in rows
+ * rowstride bytes apart. They are compressed as if they were padded out
+ * to padded_width x padded_height by repeating the last column (or row)
+ * half way, and then the first one, so the texture tiles smoothly */
+typedef struct {
+  const guchar *pixels;
+  gint          width;
+  gint          height;
+  gint          rowstride;
+  gint          n_channels;
+  gint          padded_width;
+  gint          padded_height;
+} PvrTextureSource;
+
+/* How the two colours picked for each PVRTC block are rounded to the
+ * 15 (or 12, with alpha) bits they are stored in:
+ *
+ * PVR_TEXTURE_DITHER_NONE: rounded by themselves, which can leave bands
+ * in smooth gradients.
+ *
+ * PVR_TEXTURE_DITHER_DIFFUSION: the rounding error of each block is
+ * carried on to the next, across the rows and down the texture. This
+ * depends on every block before it, so picking the colours can't be
+ * spread over threads, and a region can't be compressed again by itself.
+ *
+ * PVR_TEXTURE_DITHER_ORDERED: rounded by a 4x4 Bayer pattern of
+ * thresholds laid over the blocks. That only depends on where the block
+ * is, so it works on any number of threads.
+ */
+typedef enum {
+  PVR_TEXTURE_DITHER_NONE,
+  PVR_TEXTURE_DITHER_DIFFUSION,
+  PVR_TEXTURE_DITHER_ORDERED
+} PvrTextureDither;
+
+/* How hard the PVRTC4 encoder looks for the best encoding of each block.
+ * PVRTC2 and ETC1 are always compressed as for PVR_TEXTURE_QUALITY_FAST:
+ *
+ * PVR_TEXTURE_QUALITY_FAST: the colours are the range of each block's
+ * pixels, and every block uses the 0, 3/8, 5/8, 1 modulation. This is
+ * what the encoder has always done.
+ *
+ * PVR_TEXTURE_QUALITY_NORMAL: the modulation is picked for the colours
+ * exactly as they are stored, and each block also tries the punch-through
+ * modulation (0, 1/2, 1/2 transparent, 1), keeping whichever is closer.
+ * Around twice as slow, and about 2dB better.
+ *
+ * PVR_TEXTURE_QUALITY_BEST: as NORMAL, and the colours of each block are
+ * refined by least squares until it is close enough or stops getting
+ * better. Around 4 to 5 times as slow as FAST, and another 0.5dB better.
+ */
+typedef enum {
+  PVR_TEXTURE_QUALITY_FAST,
+  PVR_TEXTURE_QUALITY_NORMAL,
+  PVR_TEXTURE_QUALITY_BEST
+} PvrTextureQuality;
+
+/* How to compress a texture. Passing NULL, or a structure that is all
+ * zero, gives the defaults */
+typedef struct {
+  PvrTextureDither  dither;
+  PvrTextureQuality quality;
+} PvrTextureOptions;
+
+/* Called as a texture is compressed, possibly from other threads, with
+ * how many of the total steps (rows of blocks) are done. Return FALSE to
+ * stop the compression */
+typedef gboolean (*PvrTextureProgressFunc) (guint    done,
+                                            guint    total,
+                                            gpointer user_data);
+
+/* Called by pvr_texture_compress_pvrtc4_rows() for each row y of the
+ * image in turn, to write its pixels to pixels as RGBA. Return FALSE to
+ * stop the compression */
+typedef gboolean (*PvrTextureRowFunc) (guint    y,
+                                       guchar  *pixels,
+                                       gpointer user_data);
+
+/* Where an image was put in an atlas, by pvr_texture_compress_atlas() */
+typedef struct {
+  gint x;
+  gint y;
+  gint width;
+  gint height;
+} PvrTextureAtlasRect;
+
 gboolean pvr_texture_save_pvrtc4(
                         const gchar *filename,
                         const guchar *data,
@@ -64,15 +186,267 @@ guchar *pvr_texture_compress_pvrtc4(
                 gint height,
                 guint *compressed_size);
 
+guchar *pvr_texture_compress_pvrtc4_parallel(
+                const guchar *uncompressed_data,
+                gint width,
+                gint height,
+                guint n_threads,
+                guint *compressed_size);
+
+gboolean pvr_texture_recompress_pvrtc4_region(
+                const PvrTextureSource *source,
+                const PvrTextureOptions *options,
+                guchar *compressed_data,
+                guint compressed_size,
+                gint x,
+                gint y,
+                gint region_width,
+                gint region_height);
+
+gboolean pvr_texture_compress_pvrtc4_rows(
+                gint width,
+                gint height,
+                gint padded_width,
+                gint padded_height,
+                guint n_threads,
+                const PvrTextureOptions *options,
+                PvrTextureRowFunc func,
+                gpointer user_data,
+                guchar *compressed_data,
+                gsize compressed_size);
+
+guchar *pvr_texture_compress_view(
+                const PvrTextureSource *source,
+                gint view_width,
+                gint view_height,
+                guint n_threads,
+                const PvrTextureOptions *options,
+                gint *padded_width,
+                gint *padded_height,
+                guint *compressed_size);
+
+guchar *pvr_texture_compress_atlas(
+                const PvrTextureSource *items,
+                guint n_items,
+                guint format,
+                gint max_size,
+                guint n_threads,
+                const PvrTextureOptions *options,
+                PvrTextureAtlasRect *rects,
+                gint *width,
+                gint *height,
+                guint *compressed_size);
+
 guchar *pvr_texture_decompress_pvrtc4(
                 const guchar *compressed_data,
                 gint width,
                 gint height);
 
+guchar *pvr_texture_decompress_pvrtc4_parallel(
+                const guchar *compressed_data,
+                gint width,
+                gint height,
+                guint n_threads);
+
+guchar *pvr_texture_decompress_pvrtc4_region(
+                const guchar *compressed_data,
+                gint width,
+                gint height,
+                gint x,
+                gint y,
+                gint region_width,
+                gint region_height,
+                guint scale);
+
+guchar *pvr_texture_compress_pvrtc2(
+                const guchar *uncompressed_data,
+                gint width,
+                gint height,
+                guint *compressed_size);
+
+guchar *pvr_texture_decompress_pvrtc2(
+                const guchar *compressed_data,
+                gint width,
+                gint height);
+
+guchar *pvr_texture_compress_etc1(
+                const guchar *uncompressed_data,
+                gint width,
+                gint height,
+                gboolean thorough,
+                guint *compressed_size);
+
+guchar *pvr_texture_decompress_etc1(
+                const guchar *compressed_data,
+                gint width,
+                gint height);
+
+guchar *pvr_texture_downsample(
+                const guchar *data,
+                gint width,
+                gint height);
+
+guchar *pvr_texture_compress_mipmaps(
+                const guchar *uncompressed_data,
+                gint width,
+                gint height,
+                guint format,
+                guint n_threads,
+                guint *mipmap_count,
+                guint *compressed_size);
+
+void pvr_texture_source_init (PvrTextureSource *source,
+                              const guchar     *pixels,
+                              gint              width,
+                              gint              height,
+                              gint              rowstride,
+                              gint              n_channels);
+
+guint64 pvr_texture_source_hash (const PvrTextureSource *source,
+                                 guint64                 seed);
+
+gboolean pvr_texture_compress_sizes (guint  format,
+                                     gint   width,
+                                     gint   height,
+                                     gsize *compressed_size,
+                                     gsize *scratch_size);
+
+gboolean pvr_texture_compress_source_into (const PvrTextureSource *source,
+                                           guint                   format,
+                                           guint                   n_threads,
+                                           const PvrTextureOptions *options,
+                                           guchar                 *compressed_data,
+                                           gsize                   compressed_size,
+                                           guchar                 *scratch,
+                                           gsize                   scratch_size,
+                                           PvrTextureProgressFunc  progress,
+                                           gpointer                user_data);
+
+guchar *pvr_texture_compress_source(
+                const PvrTextureSource *source,
+                guint format,
+                guint n_threads,
+                const PvrTextureOptions *options,
+                guint *compressed_size);
+
+guchar *pvr_texture_compress_mipmaps_source(
+                const PvrTextureSource *source,
+                guint format,
+                guint n_threads,
+                const PvrTextureOptions *options,
+                PvrTextureProgressFunc progress,
+                gpointer user_data,
+                guint *mipmap_count,
+                guint *compressed_size);
+
+gboolean pvr_texture_save_atomically (const gchar   *filename,
+                                      guint          format,
+                                      const guchar  *data,
+                                      guint          data_size,
+                                      gint           width,
+                                      gint           height,
+                                      GError       **error);
+
+gboolean pvr_texture_save_mipmaps_atomically (const gchar   *filename,
+                                              guint          format,
+                                              const guchar  *data,
+                                              guint          data_size,
+                                              gint           width,
+                                              gint           height,
+                                              guint          mipmap_count,
+                                              GError       **error);
+
 gboolean pvr_texture_save_pvrtc4_atomically (const gchar   *filename,
                                              const guchar  *data,
                                              guint          data_size,
                                              gint           width,
                                              gint           height,
                                              GError       **error);
+
+PvrTextureSaveGroup *pvr_texture_save_group_new (void);
+
+gboolean pvr_texture_save_group_add (PvrTextureSaveGroup  *group,
+                                     const gchar          *filename,
+                                     guint                 format,
+                                     const guchar         *data,
+                                     guint                 data_size,
+                                     gint                  width,
+                                     gint                  height,
+                                     guint                 mipmap_count,
+                                     GError              **error);
+
+gboolean pvr_texture_save_group_commit (PvrTextureSaveGroup  *group,
+                                        GError              **error);
+
+void pvr_texture_save_group_free (PvrTextureSaveGroup *group);
+
+gboolean pvr_texture_probe (const gchar         *filename,
+                            PVR_TEXTURE_HEADER  *header,
+                            GError             **error);
+
+PvrTextureMap *pvr_texture_map_new (const gchar  *filename,
+                                    GError      **error);
+
+const PVR_TEXTURE_HEADER *pvr_texture_map_get_header (PvrTextureMap *map);
+
+const guchar *pvr_texture_map_get_data (PvrTextureMap *map,
+                                        guint         *data_size);
+
+const guchar *pvr_texture_map_get_level (PvrTextureMap *map,
+                                         guint          level,
+                                         guint         *width,
+                                         guint         *height,
+                                         guint         *data_size);
+
+void pvr_texture_map_free (PvrTextureMap *map);
+
+PvrTextureTwiddle *pvr_texture_twiddle_new (guint format,
+                                            gint  width,
+                                            gint  height);
+
+guint32 pvr_texture_twiddle_block (const PvrTextureTwiddle *twiddle,
+                                   guint                    x,
+                                   guint                    y);
+
+void pvr_texture_twiddle_free (PvrTextureTwiddle *twiddle);
+
+guint64 pvr_texture_hash (const guchar *data,
+                          gsize         size,
+                          guint64       seed);
+
+PvrTextureCache *pvr_texture_cache_new (const gchar  *directory,
+                                        guint64       max_size,
+                                        GError      **error);
+
+PvrTextureCache *pvr_texture_cache_ref (PvrTextureCache *cache);
+
+void pvr_texture_cache_unref (PvrTextureCache *cache);
+
+PvrTextureMap *pvr_texture_cache_lookup (PvrTextureCache *cache,
+                                         guint64          key);
+
+gboolean pvr_texture_cache_link (PvrTextureCache  *cache,
+                                 guint64           key,
+                                 const gchar      *filename,
+                                 GError          **error);
+
+gboolean pvr_texture_cache_insert (PvrTextureCache  *cache,
+                                   guint64           key,
+                                   const gchar      *filename,
+                                   GError          **error);
+
+PvrTextureIndex *pvr_texture_index_new (const gchar  *directory,
+                                        GError      **error);
+
+guint pvr_texture_index_get_n_entries (PvrTextureIndex *index);
+
+const PvrTextureIndexEntry *pvr_texture_index_get_entry (PvrTextureIndex *index,
+                                                         guint            i);
+
+const PvrTextureIndexEntry *pvr_texture_index_lookup (PvrTextureIndex *index,
+                                                      const gchar     *name);
+
+guint64 pvr_texture_index_get_data_size (PvrTextureIndex *index);
+
+void pvr_texture_index_free (PvrTextureIndex *index);
 #endif /*PVRTEXTURE_H_*/
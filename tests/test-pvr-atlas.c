@@ -0,0 +1,327 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* An atlas saved with hd_pvr_texture_atlas_save() and loaded back with
+ * hd_pvr_texture_atlas_load() has to put every image somewhere of its
+ * own inside the texture, with texture coordinates to match, and a list
+ * that doesn't go with the texture has to be turned down.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hd-pvr-texture.h"
+#include "pvr-texture.h"
+
+static gchar *tmp_dir = NULL;
+
+typedef struct {
+  const gchar *name;
+  gint         width;
+  gint         height;
+} AtlasImage;
+
+/* Icons, mostly, with a few odd shapes */
+static const AtlasImage images[] =
+{
+  { "icon-a",      18, 18 },
+  { "icon-b",      18, 18 },
+  { "icon-c",      18, 18 },
+  { "icon-d",      18, 18 },
+  { "button",      64, 64 },
+  { "bar",        100,  8 },
+  { "column",       6, 90 },
+  { "dot",          1,  1 },
+  { "square",      32, 32 },
+  { "odd",         29, 13 },
+};
+
+/* A solid colour for each image, so we can tell them apart */
+static void
+image_color (guint i, guchar color[3])
+{
+  color[0] = 40 + (i * 97) % 200;
+  color[1] = 40 + (i * 53) % 200;
+  color[2] = 40 + (i * 151) % 200;
+}
+
+static GdkPixbuf *
+pixbuf_new_solid (gint width, gint height, const guchar color[3])
+{
+  GdkPixbuf *pixbuf;
+  guchar *pixels;
+  gint rowstride, x, y;
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8, width, height);
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+
+  for (y=0;y<height;y++)
+    for (x=0;x<width;x++)
+      {
+        guchar *p = pixels + y*rowstride + x*4;
+        p[0] = color[0];
+        p[1] = color[1];
+        p[2] = color[2];
+        p[3] = 255;
+      }
+
+  return pixbuf;
+}
+
+/* Saves the images as an atlas in file, in format */
+static void
+atlas_save (const gchar *file, HDPvrTextureFormat format)
+{
+  HDPvrTextureAtlas *atlas = hd_pvr_texture_atlas_new ();
+  GError *error = NULL;
+  guint i;
+
+  for (i=0;i<G_N_ELEMENTS(images);i++)
+    {
+      GdkPixbuf *pixbuf;
+      guchar color[3];
+
+      image_color (i, color);
+      pixbuf = pixbuf_new_solid (images[i].width, images[i].height, color);
+      hd_pvr_texture_atlas_add (atlas, images[i].name, pixbuf);
+      g_object_unref (pixbuf);
+    }
+
+  g_assert (hd_pvr_texture_atlas_save (atlas, file, format, &error));
+  g_assert_no_error (error);
+  hd_pvr_texture_atlas_free (atlas);
+}
+
+static void
+file_remove (const gchar *file)
+{
+  gchar *table_file = g_strconcat (file, ".atlas", NULL);
+
+  g_unlink (file);
+  g_unlink (table_file);
+  g_free (table_file);
+}
+
+static void
+check_round_trip (HDPvrTextureFormat format, guint pvr_format)
+{
+  gchar *file = g_build_filename (tmp_dir, "atlas.pvr", NULL);
+  HDPvrTextureAtlasItem items[G_N_ELEMENTS(images)];
+  HDPvrTextureAtlas *atlas;
+  PvrTextureMap *map;
+  const PVR_TEXTURE_HEADER *head;
+  const guchar *data;
+  guchar *decoded;
+  gint sheet_width, sheet_height;
+  guint size, i, j;
+  GError *error = NULL;
+
+  atlas_save (file, format);
+
+  map = pvr_texture_map_new (file, &error);
+  g_assert_no_error (error);
+  head = pvr_texture_map_get_header (map);
+  g_assert_cmpuint (head->dwpfFlags & PVR_FLAG_FORMAT_MASK, ==, pvr_format);
+  sheet_width = head->dwWidth;
+  sheet_height = head->dwHeight;
+
+  atlas = hd_pvr_texture_atlas_load (file, &error);
+  g_assert_no_error (error);
+  g_assert (atlas != NULL);
+
+  for (i=0;i<G_N_ELEMENTS(images);i++)
+    {
+      HDPvrTextureAtlasItem *item = &items[i];
+
+      g_assert (hd_pvr_texture_atlas_lookup (atlas, images[i].name, item));
+      g_assert_cmpint (item->width, ==, images[i].width);
+      g_assert_cmpint (item->height, ==, images[i].height);
+
+      /* inside the sheet */
+      g_assert_cmpint (item->x, >=, 0);
+      g_assert_cmpint (item->y, >=, 0);
+      g_assert_cmpint (item->x + item->width, <=, sheet_width);
+      g_assert_cmpint (item->y + item->height, <=, sheet_height);
+
+      /* with coordinates to match */
+      g_assert_cmpfloat (item->u1, ==, (gfloat) item->x / sheet_width);
+      g_assert_cmpfloat (item->v1, ==, (gfloat) item->y / sheet_height);
+      g_assert_cmpfloat (item->u2, ==,
+                         (gfloat) (item->x + item->width) / sheet_width);
+      g_assert_cmpfloat (item->v2, ==,
+                         (gfloat) (item->y + item->height) / sheet_height);
+
+      /* and nobody else's space */
+      for (j=0;j<i;j++)
+        {
+          HDPvrTextureAtlasItem *other = &items[j];
+
+          if (item->x < other->x + other->width &&
+              other->x < item->x + item->width &&
+              item->y < other->y + other->height &&
+              other->y < item->y + item->height)
+            g_error ("%s at %d,%d %dx%d overlaps %s at %d,%d %dx%d",
+                     images[i].name, item->x, item->y,
+                     item->width, item->height,
+                     images[j].name, other->x, other->y,
+                     other->width, other->height);
+        }
+    }
+  g_assert (!hd_pvr_texture_atlas_lookup (atlas, "missing", NULL));
+  hd_pvr_texture_atlas_free (atlas);
+
+  /* each image really is where it says, going by the middle of it */
+  data = pvr_texture_map_get_data (map, &size);
+  if (pvr_format == ETC_RGB_4BPP)
+    decoded = pvr_texture_decompress_etc1 (data, sheet_width, sheet_height);
+  else
+    decoded = pvr_texture_decompress_pvrtc4 (data, sheet_width, sheet_height);
+  g_assert (decoded != NULL);
+  for (i=0;i<G_N_ELEMENTS(images);i++)
+    {
+      gint x = items[i].x + items[i].width/2;
+      gint y = items[i].y + items[i].height/2;
+      const guchar *p = &decoded[(x + y*sheet_width)*4];
+      guchar color[3];
+      gint c;
+
+      image_color (i, color);
+      for (c=0;c<3;c++)
+        if (abs (p[c] - color[c]) > 16)
+          g_error ("%s: found %d,%d,%d at %d,%d, not %d,%d,%d",
+                   images[i].name, p[0], p[1], p[2], x, y,
+                   color[0], color[1], color[2]);
+    }
+  g_free (decoded);
+  pvr_texture_map_free (map);
+
+  file_remove (file);
+  g_free (file);
+}
+
+static void
+test_atlas_pvrtc4 (void)
+{
+  check_round_trip (HD_PVR_TEXTURE_FORMAT_PVRTC4, MGLPT_PVRTC4);
+}
+
+static void
+test_atlas_etc1 (void)
+{
+  check_round_trip (HD_PVR_TEXTURE_FORMAT_ETC1, ETC_RGB_4BPP);
+}
+
+/* A list that doesn't fit the texture it's next to is turned down */
+static void
+test_atlas_mismatch (void)
+{
+  static const gchar *tables[] = {
+    /* off the right and the bottom */
+    "0\t0\t4\t4\tfine\n%d\t0\t8\t8\tright\n",
+    "0\t0\t4\t4\tfine\n0\t%d\t8\t8\tbottom\n",
+    /* so far off that adding the size on overflows */
+    "0\t0\t4\t4\tfine\n2147483600\t0\t100\t4\tfar\n",
+    "0\t0\t4\t4\tfine\n0\t2147483600\t4\t100\tfar\n",
+    "0\t0\t2147483647\t4\thuge\n",
+    /* negative, empty and nameless */
+    "-4\t0\t4\t4\tneg\n",
+    "0\t0\t0\t4\tempty\n",
+    "0\t0\t4\t4\t\n",
+    "0\t0\t4\tnonsense\n",
+  };
+  gchar *file = g_build_filename (tmp_dir, "atlas.pvr", NULL);
+  gchar *table_file = g_strconcat (file, ".atlas", NULL);
+  HDPvrTextureAtlas *atlas;
+  PVR_TEXTURE_HEADER head;
+  GError *error = NULL;
+  guint i;
+
+  atlas_save (file, HD_PVR_TEXTURE_FORMAT_PVRTC4);
+  g_assert (pvr_texture_probe (file, &head, &error));
+  g_assert_no_error (error);
+
+  for (i=0;i<G_N_ELEMENTS(tables);i++)
+    {
+      gchar *table;
+
+      /* just past the edge */
+      table = g_strdup_printf (tables[i],
+                               (gint) (i ? head.dwHeight : head.dwWidth) - 4);
+      g_file_set_contents (table_file, table, -1, &error);
+      g_assert_no_error (error);
+
+      atlas = hd_pvr_texture_atlas_load (file, &error);
+      if (atlas)
+        g_error ("accepted \"%s\" for a %ux%u texture",
+                 table, head.dwWidth, head.dwHeight);
+      g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL);
+      g_clear_error (&error);
+      g_free (table);
+    }
+
+  /* right up to the edge is fine though */
+  {
+    gchar *table = g_strdup_printf ("%d\t%d\t4\t4\tcorner\n",
+                                    (gint) head.dwWidth - 4,
+                                    (gint) head.dwHeight - 4);
+
+    g_file_set_contents (table_file, table, -1, &error);
+    g_assert_no_error (error);
+    atlas = hd_pvr_texture_atlas_load (file, &error);
+    g_assert_no_error (error);
+    g_assert (hd_pvr_texture_atlas_lookup (atlas, "corner", NULL));
+    hd_pvr_texture_atlas_free (atlas);
+    g_free (table);
+  }
+
+  file_remove (file);
+  g_free (table_file);
+  g_free (file);
+}
+
+int
+main (int argc, char **argv)
+{
+  GError *error = NULL;
+  int result;
+
+#if !GLIB_CHECK_VERSION(2,35,0)
+  g_type_init ();
+#endif
+  g_test_init (&argc, &argv, NULL);
+
+  tmp_dir = g_dir_make_tmp ("test-pvr-atlas-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  g_test_add_func ("/pvr-texture/atlas/pvrtc4", test_atlas_pvrtc4);
+  g_test_add_func ("/pvr-texture/atlas/etc1", test_atlas_etc1);
+  g_test_add_func ("/pvr-texture/atlas/mismatch", test_atlas_mismatch);
+
+  result = g_test_run ();
+
+  g_rmdir (tmp_dir);
+  g_free (tmp_dir);
+
+  return result;
+}
@@ -0,0 +1,414 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* A texture served from the cache has to be exactly the one that would
+ * have been written without it, anything that changes what would be
+ * written has to miss, and the cache has to stay within its size by
+ * dropping what was used longest ago.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <utime.h>
+
+#include "hd-pvr-texture.h"
+#include "hd-pvr-texture-private.h"
+#include "pvr-texture.h"
+
+static gchar *tmp_dir = NULL;
+
+static GdkPixbuf *
+pixbuf_new_pattern (gint width, gint height, gint seed)
+{
+  GdkPixbuf *pixbuf;
+  guchar *pixels;
+  gint rowstride, x, y;
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8, width, height);
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+
+  for (y=0;y<height;y++)
+    for (x=0;x<width;x++)
+      {
+        guchar *p = pixels + y*rowstride + x*4;
+        p[0] = x*255 / width + seed;
+        p[1] = y*255 / height;
+        p[2] = ((x/5 + y/7) & 1) ? 200 : 30;
+        p[3] = (x + y) & 16 ? 255 : 128;
+      }
+
+  return pixbuf;
+}
+
+static gchar *
+file_get_contents (const gchar *file, gsize *length)
+{
+  gchar *contents = NULL;
+  GError *error = NULL;
+
+  g_file_get_contents (file, &contents, length, &error);
+  g_assert_no_error (error);
+
+  return contents;
+}
+
+static void
+assert_same_file (const gchar *a, const gchar *b)
+{
+  gchar *a_contents, *b_contents;
+  gsize a_length, b_length;
+
+  a_contents = file_get_contents (a, &a_length);
+  b_contents = file_get_contents (b, &b_length);
+  g_assert_cmpuint (a_length, ==, b_length);
+  g_assert (memcmp (a_contents, b_contents, a_length) == 0);
+  g_free (a_contents);
+  g_free (b_contents);
+}
+
+static gchar *
+cache_entry_path (const gchar *cache_dir, guint64 key)
+{
+  gchar name[32];
+
+  g_snprintf (name, sizeof(name), "%016" G_GINT64_MODIFIER "x.pvr", key);
+  return g_build_filename (cache_dir, name, NULL);
+}
+
+static gboolean
+cache_has (const gchar *cache_dir, guint64 key)
+{
+  gchar *path = cache_entry_path (cache_dir, key);
+  gboolean found = g_file_test (path, G_FILE_TEST_IS_REGULAR);
+
+  g_free (path);
+  return found;
+}
+
+static guint
+dir_count (const gchar *directory)
+{
+  GDir *dir = g_dir_open (directory, 0, NULL);
+  guint n = 0;
+
+  g_assert (dir != NULL);
+  while (g_dir_read_name (dir))
+    n++;
+  g_dir_close (dir);
+
+  return n;
+}
+
+static void
+dir_remove (const gchar *directory)
+{
+  GDir *dir = g_dir_open (directory, 0, NULL);
+  const gchar *name;
+
+  if (!dir)
+    return;
+  while ((name = g_dir_read_name (dir)))
+    {
+      gchar *path = g_build_filename (directory, name, NULL);
+
+      g_unlink (path);
+      g_free (path);
+    }
+  g_dir_close (dir);
+  g_rmdir (directory);
+}
+
+/* A hit has to give the same bytes as saving without the cache */
+static void
+test_cache_hit (void)
+{
+  gchar *cache_dir = g_build_filename (tmp_dir, "cache", NULL);
+  gchar *uncached = g_build_filename (tmp_dir, "uncached.pvr", NULL);
+  gchar *first = g_build_filename (tmp_dir, "first.pvr", NULL);
+  gchar *hit = g_build_filename (tmp_dir, "hit.pvr", NULL);
+  GdkPixbuf *pixbuf = pixbuf_new_pattern (100, 60, 0);
+  guint64 key;
+  gchar *entry;
+  GError *error = NULL;
+
+  g_assert (hd_pvr_texture_save (uncached, pixbuf, &error));
+  g_assert_no_error (error);
+
+  g_assert (hd_pvr_texture_set_cache (cache_dir, 64 << 20, &error));
+  g_assert_no_error (error);
+
+  key = _hd_pvr_texture_cache_key (pixbuf, HD_PVR_TEXTURE_FORMAT_PVRTC4,
+                                   FALSE, HD_PVR_TEXTURE_CACHE_VERSION);
+  g_assert (!cache_has (cache_dir, key));
+
+  g_assert (hd_pvr_texture_save (first, pixbuf, &error));
+  g_assert_no_error (error);
+  g_assert (cache_has (cache_dir, key));
+  g_assert_cmpuint (dir_count (cache_dir), ==, 1);
+
+  /* make sure the next one can only have come from the cache */
+  entry = cache_entry_path (cache_dir, key);
+  g_unlink (first);
+  g_assert (hd_pvr_texture_save (hit, pixbuf, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (dir_count (cache_dir), ==, 1);
+
+  assert_same_file (uncached, entry);
+  assert_same_file (uncached, hit);
+
+  g_assert (hd_pvr_texture_set_cache (NULL, 0, &error));
+  g_unlink (uncached);
+  g_unlink (hit);
+  dir_remove (cache_dir);
+  g_object_unref (pixbuf);
+  g_free (entry);
+  g_free (hit);
+  g_free (first);
+  g_free (uncached);
+  g_free (cache_dir);
+}
+
+/* Anything that changes the file written has to change the key */
+static void
+test_cache_miss (void)
+{
+  gchar *cache_dir = g_build_filename (tmp_dir, "cache", NULL);
+  gchar *file = g_build_filename (tmp_dir, "texture.pvr", NULL);
+  GdkPixbuf *pixbuf = pixbuf_new_pattern (64, 64, 0);
+  GdkPixbuf *other = pixbuf_new_pattern (64, 64, 1);
+  PvrTextureCache *cache;
+  guint64 key, old_key;
+  GError *error = NULL;
+
+  g_assert (hd_pvr_texture_set_cache (cache_dir, 64 << 20, &error));
+  g_assert_no_error (error);
+
+  g_assert (hd_pvr_texture_save (file, pixbuf, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (dir_count (cache_dir), ==, 1);
+
+  /* each of these is a miss, and so a new entry */
+  g_assert (hd_pvr_texture_save_with_format (file, pixbuf,
+                                             HD_PVR_TEXTURE_FORMAT_ETC1,
+                                             &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (dir_count (cache_dir), ==, 2);
+  g_assert (hd_pvr_texture_save_with_mipmaps (file, pixbuf,
+                                              HD_PVR_TEXTURE_FORMAT_PVRTC4,
+                                              &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (dir_count (cache_dir), ==, 3);
+  g_assert (hd_pvr_texture_save (file, other, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (dir_count (cache_dir), ==, 4);
+
+  /* and saving any of them again is a hit */
+  g_assert (hd_pvr_texture_save (file, pixbuf, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (dir_count (cache_dir), ==, 4);
+
+  /* what an older version of the library cached mustn't be used */
+  key = _hd_pvr_texture_cache_key (pixbuf, HD_PVR_TEXTURE_FORMAT_PVRTC4,
+                                   FALSE, HD_PVR_TEXTURE_CACHE_VERSION);
+  old_key = _hd_pvr_texture_cache_key (pixbuf, HD_PVR_TEXTURE_FORMAT_PVRTC4,
+                                       FALSE,
+                                       HD_PVR_TEXTURE_CACHE_VERSION - 1);
+  g_assert (key != old_key);
+  g_assert (cache_has (cache_dir, key));
+  g_assert (!cache_has (cache_dir, old_key));
+
+  cache = pvr_texture_cache_new (cache_dir, 64 << 20, &error);
+  g_assert_no_error (error);
+  g_assert (pvr_texture_cache_link (cache, key, file, &error));
+  g_assert_no_error (error);
+  g_assert (!pvr_texture_cache_link (cache, old_key, file, &error));
+  g_assert_no_error (error);
+  pvr_texture_cache_unref (cache);
+
+  g_assert (hd_pvr_texture_set_cache (NULL, 0, &error));
+  g_unlink (file);
+  dir_remove (cache_dir);
+  g_object_unref (other);
+  g_object_unref (pixbuf);
+  g_free (file);
+  g_free (cache_dir);
+}
+
+/* In a batch a hit has to wait for the batch to end, like a miss would */
+static void
+test_cache_batch (void)
+{
+  static const gchar old_contents[] = "not replaced yet";
+  gchar *cache_dir = g_build_filename (tmp_dir, "cache", NULL);
+  gchar *first = g_build_filename (tmp_dir, "first.pvr", NULL);
+  gchar *file = g_build_filename (tmp_dir, "texture.pvr", NULL);
+  GdkPixbuf *pixbuf = pixbuf_new_pattern (64, 32, 0);
+  gchar *contents;
+  gsize length;
+  GError *error = NULL;
+
+  g_assert (hd_pvr_texture_set_cache (cache_dir, 64 << 20, &error));
+  g_assert_no_error (error);
+  g_assert (hd_pvr_texture_save (first, pixbuf, &error));
+  g_assert_no_error (error);
+
+  g_file_set_contents (file, old_contents, sizeof (old_contents), &error);
+  g_assert_no_error (error);
+
+  hd_pvr_texture_begin_batch ();
+  g_assert (hd_pvr_texture_save (file, pixbuf, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (dir_count (cache_dir), ==, 1);
+
+  contents = file_get_contents (file, &length);
+  g_assert_cmpuint (length, ==, sizeof (old_contents));
+  g_assert (memcmp (contents, old_contents, length) == 0);
+  g_free (contents);
+
+  g_assert (hd_pvr_texture_end_batch (&error));
+  g_assert_no_error (error);
+  assert_same_file (first, file);
+
+  g_assert (hd_pvr_texture_set_cache (NULL, 0, &error));
+  g_unlink (first);
+  g_unlink (file);
+  dir_remove (cache_dir);
+  g_object_unref (pixbuf);
+  g_free (file);
+  g_free (first);
+  g_free (cache_dir);
+}
+
+/* Gives the cache entry for key the given modification time */
+static void
+cache_entry_set_time (const gchar *cache_dir, guint64 key, time_t time)
+{
+  gchar *path = cache_entry_path (cache_dir, key);
+  struct utimbuf times;
+
+  times.actime = time;
+  times.modtime = time;
+  g_assert_cmpint (utime (path, &times), ==, 0);
+  g_free (path);
+}
+
+/* Once the cache is over its size, the entries used longest ago go */
+static void
+test_cache_trim (void)
+{
+  gchar *cache_dir = g_build_filename (tmp_dir, "cache", NULL);
+  gchar *files[5];
+  PvrTextureCache *cache;
+  PvrTextureMap *map;
+  time_t now = time (NULL);
+  struct stat st;
+  guint64 key;
+  gint i;
+  GError *error = NULL;
+
+  /* separate textures of the same size, so sizes add up simply */
+  for (i=0;i<5;i++)
+    {
+      GdkPixbuf *pixbuf = pixbuf_new_pattern (32, 32, i);
+
+      files[i] = g_strdup_printf ("%s/texture%d.pvr", tmp_dir, i);
+      g_assert (hd_pvr_texture_save (files[i], pixbuf, &error));
+      g_assert_no_error (error);
+      g_object_unref (pixbuf);
+    }
+  g_assert_cmpint (g_stat (files[0], &st), ==, 0);
+
+  cache = pvr_texture_cache_new (cache_dir, 3 * st.st_size, &error);
+  g_assert_no_error (error);
+
+  /* 1, 2 and 3 go in, each used more recently than the last */
+  for (key=1;key<=3;key++)
+    {
+      g_assert (pvr_texture_cache_insert (cache, key, files[key - 1],
+                                          &error));
+      g_assert_no_error (error);
+      cache_entry_set_time (cache_dir, key, now - 1000 + key * 100);
+    }
+  g_assert_cmpuint (dir_count (cache_dir), ==, 3);
+
+  /* using 1 makes 2 the oldest, so 4 pushes 2 out */
+  map = pvr_texture_cache_lookup (cache, 1);
+  g_assert (map != NULL);
+  pvr_texture_map_free (map);
+  g_assert (pvr_texture_cache_insert (cache, 4, files[3], &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (dir_count (cache_dir), ==, 3);
+  g_assert (cache_has (cache_dir, 1));
+  g_assert (!cache_has (cache_dir, 2));
+  g_assert (cache_has (cache_dir, 3));
+  g_assert (cache_has (cache_dir, 4));
+
+  /* and then 3 is the oldest */
+  cache_entry_set_time (cache_dir, 4, now - 10);
+  g_assert (pvr_texture_cache_insert (cache, 5, files[4], &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (dir_count (cache_dir), ==, 3);
+  g_assert (!cache_has (cache_dir, 3));
+  g_assert (cache_has (cache_dir, 1));
+  g_assert (cache_has (cache_dir, 4));
+  g_assert (cache_has (cache_dir, 5));
+
+  pvr_texture_cache_unref (cache);
+  dir_remove (cache_dir);
+  for (i=0;i<5;i++)
+    {
+      g_unlink (files[i]);
+      g_free (files[i]);
+    }
+  g_free (cache_dir);
+}
+
+int
+main (int argc, char **argv)
+{
+  GError *error = NULL;
+  int result;
+
+#if !GLIB_CHECK_VERSION(2,35,0)
+  g_type_init ();
+#endif
+  g_test_init (&argc, &argv, NULL);
+
+  tmp_dir = g_dir_make_tmp ("test-pvr-cache-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  g_test_add_func ("/pvr-texture/cache/hit", test_cache_hit);
+  g_test_add_func ("/pvr-texture/cache/miss", test_cache_miss);
+  g_test_add_func ("/pvr-texture/cache/batch", test_cache_batch);
+  g_test_add_func ("/pvr-texture/cache/trim", test_cache_trim);
+
+  result = g_test_run ();
+
+  g_rmdir (tmp_dir);
+  g_free (tmp_dir);
+
+  return result;
+}
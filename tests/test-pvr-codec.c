@@ -0,0 +1,635 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Every way the library has of compressing and decoding PVRTC4 must give
+ * exactly what the original scalar code does, which is kept frozen in
+ * pvr-texture-reference.c. This checks the SIMD kernels against the C
+ * ones, and then whole textures from each path against the reference.
+ */
+
+#include <glib.h>
+#include <math.h>
+#include <string.h>
+
+#include "pvr-texture.h"
+#include "pvr-texture-private.h"
+#include "pvr-texture-reference.h"
+
+/* The kinds of image that tend to find the differences */
+typedef enum {
+  IMAGE_RANDOM,
+  IMAGE_GRADIENT,
+  IMAGE_SOLID,
+  IMAGE_ALPHA_EDGE,
+  N_IMAGES
+} ImageKind;
+
+static const gchar *image_names[N_IMAGES] = {
+  "random", "gradient", "solid", "alpha-edge"
+};
+
+/* Textures are checked in every power of 2 shape from 4 up to this on a
+ * side. The biggest ones are only done with -m slow, as the reference
+ * encoder takes a while over them */
+#define MAX_SIZE 2048
+#define MAX_QUICK_AREA (2048*512)
+
+/* How close decoding at 1/4 and 1/8 has to come to shrinking the whole
+ * decoded texture. The worst today is a little over 22 dB, on small
+ * textures with sharp alpha edges */
+#define SCALED_PSNR_FLOOR 20.0
+
+/* Fills in width x height RGBA pixels of the given kind. The same seed
+ * always gives the same image */
+static guchar *
+image_new (ImageKind kind, gint width, gint height, guint32 seed)
+{
+  GRand *rand = g_rand_new_with_seed (seed);
+  guchar *pixels = g_malloc ((gsize)width * height * 4);
+  guint32 base = g_rand_int (rand);
+  gint x, y;
+
+  for (y=0;y<height;y++)
+    for (x=0;x<width;x++)
+      {
+        guchar *p = pixels + ((gsize)y*width + x)*4;
+
+        switch (kind)
+          {
+          case IMAGE_RANDOM:
+            p[0] = g_rand_int (rand);
+            p[1] = g_rand_int (rand);
+            p[2] = g_rand_int (rand);
+            p[3] = g_rand_int (rand);
+            break;
+          case IMAGE_GRADIENT:
+            p[0] = x*255 / MAX(width-1, 1);
+            p[1] = y*255 / MAX(height-1, 1);
+            p[2] = (x + y + base) & 255;
+            p[3] = 255;
+            break;
+          case IMAGE_SOLID:
+            p[0] = base;
+            p[1] = base >> 8;
+            p[2] = base >> 16;
+            p[3] = 255;
+            break;
+          default:
+            /* colour that mostly changes slowly, with alpha that is all
+             * or nothing along diagonal edges */
+            p[0] = g_rand_int (rand);
+            p[1] = p[0];
+            p[2] = 200;
+            p[3] = (x*3 + y*5) % 37 < 18 ? 0 : 255;
+            break;
+          }
+      }
+
+  g_rand_free (rand);
+  return pixels;
+}
+
+/* Calls func for each kind of image in every shape to be tested */
+static void
+foreach_shape (gint min_size,
+               void (*func) (ImageKind kind, gint width, gint height))
+{
+  ImageKind kind;
+  gint width, height;
+
+  for (kind=0;kind<N_IMAGES;kind++)
+    for (width=min_size;width<=MAX_SIZE;width*=2)
+      for (height=min_size;height<=MAX_SIZE;height*=2)
+        {
+          if (width*height > MAX_QUICK_AREA && !g_test_slow ())
+            continue;
+          func (kind, width, height);
+        }
+}
+
+static void
+assert_same (const guchar *expected,
+             const guchar *got,
+             gsize         size,
+             const gchar  *what,
+             ImageKind     kind,
+             gint          width,
+             gint          height)
+{
+  if (!got || memcmp (expected, got, size))
+    g_error ("%s differs from the reference for %s %dx%d",
+             what, image_names[kind], width, height);
+}
+
+/* Fills a 3x3 neighbourhood or a block of colours for the kernel tests */
+static void
+colors_fill (Color *colors, guint n, ImageKind kind, GRand *rand)
+{
+  guint32 base = g_rand_int (rand);
+  gint step = g_rand_int_range (rand, -16, 17);
+  guint i, c;
+
+  for (i=0;i<n;i++)
+    {
+      guchar *col = (guchar *) &colors[i];
+
+      for (c=0;c<4;c++)
+        switch (kind)
+          {
+          case IMAGE_RANDOM:
+            col[c] = g_rand_int (rand);
+            break;
+          case IMAGE_GRADIENT:
+            col[c] = CLAMP((gint)((base >> c*6) & 0xff) + (gint)i*step,
+                           0, 255);
+            break;
+          case IMAGE_SOLID:
+            col[c] = base >> c*6;
+            break;
+          default:
+            col[c] = c == 3 ? (g_rand_int (rand) & 1) * 255 :
+                              g_rand_int (rand);
+            break;
+          }
+    }
+}
+
+/* Each SIMD kernel this CPU can run must do exactly what the C one does */
+static void
+test_kernels (void)
+{
+  const PvrKernels *c = _pvr_texture_kernels_lookup (PVR_SIMD_NONE);
+  PvrSimdLevel level;
+
+  g_assert (c != NULL);
+
+  for (level=PVR_SIMD_SSE2;level<=PVR_SIMD_NEON;level++)
+    {
+      const PvrKernels *kernels = _pvr_texture_kernels_lookup (level);
+      GRand *rand;
+      guint round;
+
+      if (!kernels)
+        continue;
+
+      rand = g_rand_new_with_seed (level);
+      for (round=0;round<20000;round++)
+        {
+          ImageKind kind = round % N_IMAGES;
+          Color low[9], high[9], block[32], out_c[32], out_k[32];
+          PvrBlockEndpoints ends_c, ends_k;
+          guint width = round & 4 ? 8 : 4;
+          guint32 modulation;
+          gboolean alpha_mode;
+
+          colors_fill (low, 9, kind, rand);
+          colors_fill (high, 9, kind, rand);
+          colors_fill (block, 32, kind, rand);
+
+          memset (&ends_c, 0, sizeof (ends_c));
+          memset (&ends_k, 0, sizeof (ends_k));
+          c->block_endpoints (low, high, 3, &ends_c);
+          kernels->block_endpoints (low, high, 3, &ends_k);
+          if (memcmp (&ends_c, &ends_k, sizeof (ends_c)))
+            g_error ("%s endpoints differ for %s colours",
+                     kernels->name, image_names[kind]);
+
+          if (c->encode_modulation (block, width, &ends_c) !=
+              kernels->encode_modulation (block, width, &ends_c))
+            g_error ("%s modulation differs for %s colours",
+                     kernels->name, image_names[kind]);
+
+          /* only 4 pixels of each row get written */
+          memset (out_c, 0, sizeof (out_c));
+          memset (out_k, 0, sizeof (out_k));
+          modulation = g_rand_int (rand);
+          for (alpha_mode=FALSE;alpha_mode<=TRUE;alpha_mode++)
+            {
+              c->decode_block (modulation, alpha_mode, low, high, 3,
+                               out_c, width);
+              kernels->decode_block (modulation, alpha_mode, low, high, 3,
+                                     out_k, width);
+              if (memcmp (out_c, out_k, width*4*sizeof (Color)))
+                g_error ("%s decoding differs for %s colours",
+                         kernels->name, image_names[kind]);
+            }
+        }
+      g_rand_free (rand);
+    }
+}
+
+static void
+check_compress (ImageKind kind, gint width, gint height)
+{
+  guchar *pixels = image_new (kind, width, height, width ^ (height << 12));
+  guchar *expected, *got, *decoded, *expected_decoded;
+  guint expected_size, size;
+
+  expected = pvr_texture_reference_compress_pvrtc4 (pixels, width, height,
+                                                    &expected_size);
+
+  got = pvr_texture_compress_pvrtc4 (pixels, width, height, &size);
+  g_assert_cmpuint (size, ==, expected_size);
+  assert_same (expected, got, size, "compression", kind, width, height);
+  g_free (got);
+
+  /* and decoding what the reference wrote */
+  expected_decoded = pvr_texture_reference_decompress_pvrtc4 (expected,
+                                                              width, height);
+  decoded = pvr_texture_decompress_pvrtc4 (expected, width, height);
+  assert_same (expected_decoded, decoded, (gsize)width*height*4,
+               "decoding", kind, width, height);
+
+  g_free (decoded);
+  g_free (expected_decoded);
+  g_free (expected);
+  g_free (pixels);
+}
+
+static void
+test_compress (void)
+{
+  foreach_shape (4, check_compress);
+}
+
+/* Threads, sources and compressing into the caller's memory */
+static void
+check_compress_parallel (ImageKind kind, gint width, gint height)
+{
+  static const guint threads[] = { 0, 1, 3 };
+  guchar *pixels = image_new (kind, width, height, width + height);
+  guchar *expected, *got, *scratch;
+  guint expected_size, size, i;
+  gsize compressed_size, scratch_size;
+  PvrTextureSource source;
+
+  expected = pvr_texture_reference_compress_pvrtc4 (pixels, width, height,
+                                                    &expected_size);
+  pvr_texture_source_init (&source, pixels, width, height, width*4, 4);
+  g_assert (pvr_texture_compress_sizes (MGLPT_PVRTC4, width, height,
+                                        &compressed_size, &scratch_size));
+  g_assert_cmpuint (compressed_size, ==, expected_size);
+
+  for (i=0;i<G_N_ELEMENTS (threads);i++)
+    {
+      got = pvr_texture_compress_pvrtc4_parallel (pixels, width, height,
+                                                  threads[i], &size);
+      assert_same (expected, got, expected_size,
+                   "threaded compression", kind, width, height);
+      g_free (got);
+
+      got = pvr_texture_compress_source (&source, MGLPT_PVRTC4, threads[i],
+                                         NULL, &size);
+      assert_same (expected, got, expected_size,
+                   "compression from a source", kind, width, height);
+      g_free (got);
+
+      /* with a guard byte to make sure nothing is written past the end */
+      got = g_malloc (compressed_size + 1);
+      scratch = g_malloc (scratch_size + 1);
+      got[compressed_size] = 0xcd;
+      g_assert (pvr_texture_compress_source_into (&source, MGLPT_PVRTC4,
+                                                  threads[i], NULL,
+                                                  got, compressed_size,
+                                                  scratch, scratch_size,
+                                                  NULL, NULL));
+      assert_same (expected, got, expected_size,
+                   "compression into memory", kind, width, height);
+      g_assert_cmpuint (got[compressed_size], ==, 0xcd);
+      g_free (scratch);
+      g_free (got);
+    }
+
+  g_free (expected);
+  g_free (pixels);
+}
+
+static void
+test_compress_parallel (void)
+{
+  foreach_shape (4, check_compress_parallel);
+}
+
+typedef struct {
+  const guchar *pixels;
+  gint          width;
+  guint         next;
+} RowsData;
+
+static gboolean
+rows_get (guint y, guchar *pixels, gpointer user_data)
+{
+  RowsData *data = user_data;
+
+  /* they have to be asked for in order, once each */
+  g_assert_cmpuint (y, ==, data->next);
+  data->next++;
+
+  memcpy (pixels, data->pixels + (gsize)y*data->width*4, data->width*4);
+  return TRUE;
+}
+
+/* Streaming the rows in bands, on any number of threads */
+static void
+check_compress_rows (ImageKind kind, gint width, gint height)
+{
+  static const guint threads[] = { 1, 2, 3, 0 };
+  guchar *pixels = image_new (kind, width, height, width * height);
+  guchar *expected, *got;
+  guint expected_size, i;
+
+  expected = pvr_texture_reference_compress_pvrtc4 (pixels, width, height,
+                                                    &expected_size);
+
+  for (i=0;i<G_N_ELEMENTS (threads);i++)
+    {
+      RowsData data = { pixels, width, 0 };
+
+      got = g_malloc (expected_size);
+      g_assert (pvr_texture_compress_pvrtc4_rows (width, height,
+                                                  width, height,
+                                                  threads[i], NULL,
+                                                  rows_get, &data,
+                                                  got, expected_size));
+      g_assert_cmpuint (data.next, ==, height);
+      assert_same (expected, got, expected_size,
+                   "compression by rows", kind, width, height);
+      g_free (got);
+    }
+
+  g_free (expected);
+  g_free (pixels);
+}
+
+static void
+test_compress_rows (void)
+{
+  foreach_shape (4, check_compress_rows);
+}
+
+/* Damaging part of an image and compressing just that region again has
+ * to come out the same as compressing the whole image again */
+static void
+check_recompress_region (ImageKind kind, gint width, gint height)
+{
+  GRand *rand = g_rand_new_with_seed (width * 31 + height);
+  guchar *pixels = image_new (kind, width, height, width - height);
+  PvrTextureSource source;
+  guchar *compressed, *expected;
+  guint size, expected_size, round;
+
+  compressed = pvr_texture_compress_pvrtc4 (pixels, width, height, &size);
+  pvr_texture_source_init (&source, pixels, width, height, width*4, 4);
+
+  for (round=0;round<3;round++)
+    {
+      gint x = g_rand_int_range (rand, 0, width);
+      gint y = g_rand_int_range (rand, 0, height);
+      gint region_width = g_rand_int_range (rand, 1, MIN(width - x, 64) + 1);
+      gint region_height = g_rand_int_range (rand, 1, MIN(height - y, 64) + 1);
+      gint i, j;
+
+      for (j=y;j<y+region_height;j++)
+        for (i=x;i<x+region_width;i++)
+          {
+            guchar *p = pixels + ((gsize)j*width + i)*4;
+
+            p[0] = g_rand_int (rand);
+            p[1] = g_rand_int (rand);
+            p[2] = 255 - p[2];
+          }
+
+      g_assert (pvr_texture_recompress_pvrtc4_region (&source, NULL,
+                                                      compressed, size,
+                                                      x, y,
+                                                      region_width,
+                                                      region_height));
+      expected = pvr_texture_reference_compress_pvrtc4 (pixels,
+                                                        width, height,
+                                                        &expected_size);
+      assert_same (expected, compressed, expected_size,
+                   "recompressing a region", kind, width, height);
+      g_free (expected);
+    }
+
+  g_free (compressed);
+  g_free (pixels);
+  g_rand_free (rand);
+}
+
+static void
+test_recompress_region (void)
+{
+  foreach_shape (4, check_recompress_region);
+}
+
+/* The region_width x region_height pixels at (x, y) of a width pixel
+ * wide image, each scale x scale square averaged into one pixel */
+static guchar *
+box_average (const guchar *pixels,
+             gint          width,
+             gint          x,
+             gint          y,
+             gint          region_width,
+             gint          region_height,
+             gint          scale)
+{
+  gint out_width = region_width / scale, out_height = region_height / scale;
+  gint n = scale * scale;
+  guchar *out = g_malloc ((gsize)out_width * out_height * 4);
+  gint i, j, u, v, c;
+
+  for (j=0;j<out_height;j++)
+    for (i=0;i<out_width;i++)
+      for (c=0;c<4;c++)
+        {
+          guint sum = 0;
+
+          for (v=0;v<scale;v++)
+            for (u=0;u<scale;u++)
+              sum += pixels[((gsize)(y + j*scale + v)*width +
+                             x + i*scale + u)*4 + c];
+          out[((gsize)j*out_width + i)*4 + c] = (sum + n/2) / n;
+        }
+
+  return out;
+}
+
+/* PSNR over all four channels */
+static gdouble
+psnr (const guchar *a, const guchar *b, gsize n_pixels)
+{
+  gdouble error = 0;
+  gsize i;
+
+  for (i=0;i<n_pixels*4;i++)
+    {
+      gdouble d = (gdouble)a[i] - b[i];
+
+      error += d*d;
+    }
+
+  if (error == 0)
+    return 99.0;
+
+  return 10 * log10 (255.0*255.0 * n_pixels * 4 / error);
+}
+
+/* Decodes the region at (x, y) at each scale, and checks it against the
+ * reference decoding of the whole texture, shrunk the same way. At 2 that
+ * has to be exact. At 4 and 8 blocks are only averaged from their own
+ * colours, which comes out a little different wherever the interpolation
+ * between blocks doesn't cancel out, so those only have to be close */
+static void
+check_decompress_scaled (const guchar *compressed,
+                         const guchar *expected,
+                         ImageKind     kind,
+                         gint          width,
+                         gint          height,
+                         gint          x,
+                         gint          y,
+                         gint          region_width,
+                         gint          region_height)
+{
+  gint scale;
+
+  for (scale=2;scale<=8;scale*=2)
+    {
+      gint sx = x & ~(scale-1), sy = y & ~(scale-1);
+      gint sw = region_width & ~(scale-1), sh = region_height & ~(scale-1);
+      guchar *got, *shrunk;
+      gsize n_pixels;
+
+      if (sw == 0 || sh == 0)
+        continue;
+
+      got = pvr_texture_decompress_pvrtc4_region (compressed, width, height,
+                                                  sx, sy, sw, sh, scale);
+      g_assert (got != NULL);
+      shrunk = box_average (expected, width, sx, sy, sw, sh, scale);
+      n_pixels = (gsize)(sw/scale) * (sh/scale);
+
+      if (scale == 2)
+        {
+          if (memcmp (got, shrunk, n_pixels*4))
+            g_error ("decoding %dx%d at %d,%d at 1/2 differs from the "
+                     "reference for %s %dx%d", sw, sh, sx, sy,
+                     image_names[kind], width, height);
+        }
+      else
+        {
+          gdouble quality = psnr (got, shrunk, n_pixels);
+
+          if (quality < SCALED_PSNR_FLOOR)
+            g_error ("decoding %dx%d at %d,%d at 1/%d is only %.2f dB from "
+                     "the reference for %s %dx%d", sw, sh, sx, sy, scale,
+                     quality, image_names[kind], width, height);
+        }
+
+      g_free (shrunk);
+      g_free (got);
+    }
+}
+
+/* Decoding on threads, and decoding regions at every scale */
+static void
+check_decompress (ImageKind kind, gint width, gint height)
+{
+  static const guint threads[] = { 0, 1, 2, 5 };
+  GRand *rand = g_rand_new_with_seed (width * 7 + height);
+  guchar *pixels = image_new (kind, width, height, height);
+  guchar *compressed, *expected, *got;
+  guint size, i, round;
+
+  compressed = pvr_texture_reference_compress_pvrtc4 (pixels, width, height,
+                                                      &size);
+  expected = pvr_texture_reference_decompress_pvrtc4 (compressed,
+                                                      width, height);
+
+  for (i=0;i<G_N_ELEMENTS (threads);i++)
+    {
+      got = pvr_texture_decompress_pvrtc4_parallel (compressed, width, height,
+                                                    threads[i]);
+      assert_same (expected, got, (gsize)width*height*4,
+                   "threaded decoding", kind, width, height);
+      g_free (got);
+    }
+
+  got = pvr_texture_decompress_pvrtc4_region (compressed, width, height,
+                                              0, 0, width, height, 1);
+  assert_same (expected, got, (gsize)width*height*4,
+               "decoding the whole region", kind, width, height);
+  g_free (got);
+  check_decompress_scaled (compressed, expected, kind, width, height,
+                           0, 0, width, height);
+
+  for (round=0;round<4;round++)
+    {
+      gint x = g_rand_int_range (rand, 0, width);
+      gint y = g_rand_int_range (rand, 0, height);
+      gint region_width = g_rand_int_range (rand, 1, width - x + 1);
+      gint region_height = g_rand_int_range (rand, 1, height - y + 1);
+      gint j;
+
+      got = pvr_texture_decompress_pvrtc4_region (compressed, width, height,
+                                                  x, y,
+                                                  region_width, region_height,
+                                                  1);
+      g_assert (got != NULL);
+      for (j=0;j<region_height;j++)
+        if (memcmp (got + (gsize)j*region_width*4,
+                    expected + ((gsize)(y+j)*width + x)*4,
+                    region_width*4))
+          g_error ("decoding %dx%d at %d,%d differs from the reference "
+                   "for %s %dx%d", region_width, region_height, x, y,
+                   image_names[kind], width, height);
+      g_free (got);
+
+      check_decompress_scaled (compressed, expected, kind, width, height,
+                               x, y, region_width, region_height);
+    }
+
+  g_free (expected);
+  g_free (compressed);
+  g_free (pixels);
+  g_rand_free (rand);
+}
+
+static void
+test_decompress (void)
+{
+  foreach_shape (4, check_decompress);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/pvr-texture/kernels", test_kernels);
+  g_test_add_func ("/pvr-texture/compress", test_compress);
+  g_test_add_func ("/pvr-texture/compress/parallel", test_compress_parallel);
+  g_test_add_func ("/pvr-texture/compress/rows", test_compress_rows);
+  g_test_add_func ("/pvr-texture/recompress-region", test_recompress_region);
+  g_test_add_func ("/pvr-texture/decompress", test_decompress);
+
+  return g_test_run ();
+}
@@ -0,0 +1,301 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Textures come from files anyone could have written, so the header
+ * parsing and the decoders have to cope with anything. This saves real
+ * textures, damages them in all sorts of ways and makes sure whatever
+ * still gets accepted can be decoded, and that the decoders turn down
+ * what they can't handle rather than reading or writing out of bounds.
+ * Everything is seeded, so a failure always happens the same way.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+#include "pvr-texture.h"
+
+static const guint formats[] = { MGLPT_PVRTC4, MGLPT_PVRTC2, ETC_RGB_4BPP };
+
+static gchar *tmp_dir = NULL;
+
+static guchar *
+decompress (guint format, const guchar *data, gint width, gint height)
+{
+  switch (format)
+    {
+    case MGLPT_PVRTC4:
+      return pvr_texture_decompress_pvrtc4 (data, width, height);
+    case MGLPT_PVRTC2:
+      return pvr_texture_decompress_pvrtc2 (data, width, height);
+    default:
+      return pvr_texture_decompress_etc1 (data, width, height);
+    }
+}
+
+/* Mostly small numbers, but often the ones that find overflows */
+static gint32
+wild_int (GRand *rand)
+{
+  static const gint32 values[] = {
+    0, 1, -1, 2, 3, 4, 7, 8, 16, 4096, 65536, 65537,
+    G_MAXINT32, G_MININT32, G_MAXINT32 - 3, 1 << 30
+  };
+
+  if (g_rand_int_range (rand, 0, 3))
+    return g_rand_int_range (rand, -8, 56);
+  return values[g_rand_int_range (rand, 0, G_N_ELEMENTS (values))];
+}
+
+/* Saves a random texture, possibly with mipmaps, and returns the file */
+static gchar *
+texture_new (GRand *rand, gsize *length)
+{
+  guint format = formats[g_rand_int_range (rand, 0, 3)];
+  gint width = 8 << g_rand_int_range (rand, 0, 5);
+  gint height = 8 << g_rand_int_range (rand, 0, 5);
+  gchar *file = g_build_filename (tmp_dir, "texture.pvr", NULL);
+  gchar *contents = NULL;
+  guchar *pixels, *compressed;
+  guint size, mipmap_count = 0;
+  gint i;
+  GError *error = NULL;
+
+  if (format == MGLPT_PVRTC2)
+    width = MAX(width, 16);
+
+  pixels = g_malloc (width * height * 4);
+  for (i=0;i<width*height*4;i++)
+    pixels[i] = g_rand_int (rand);
+
+  if (g_rand_boolean (rand))
+    {
+      compressed = pvr_texture_compress_mipmaps (pixels, width, height,
+                                                 format, 1,
+                                                 &mipmap_count, &size);
+      g_assert (compressed != NULL);
+      pvr_texture_save_mipmaps_atomically (file, format, compressed, size,
+                                           width, height, mipmap_count,
+                                           &error);
+    }
+  else
+    {
+      PvrTextureSource source;
+
+      pvr_texture_source_init (&source, pixels, width, height, width*4, 4);
+      compressed = pvr_texture_compress_source (&source, format, 1, NULL,
+                                                &size);
+      g_assert (compressed != NULL);
+      pvr_texture_save_atomically (file, format, compressed, size,
+                                   width, height, &error);
+    }
+  g_assert_no_error (error);
+
+  g_file_get_contents (file, &contents, length, &error);
+  g_assert_no_error (error);
+
+  g_unlink (file);
+  g_free (file);
+  g_free (compressed);
+  g_free (pixels);
+
+  return contents;
+}
+
+/* Damages a texture file in one of a few ways */
+static void
+texture_damage (GRand *rand, gchar *contents, gsize *length)
+{
+  gint n;
+
+  switch (g_rand_int_range (rand, 0, 4))
+    {
+    case 0:
+      /* flip some bits of the header */
+      for (n=g_rand_int_range (rand, 1, 5);n>0;n--)
+        contents[g_rand_int_range (rand, 0, sizeof (PVR_TEXTURE_HEADER))] ^=
+          1 << g_rand_int_range (rand, 0, 8);
+      break;
+    case 1:
+      {
+        /* replace one field of the header */
+        gint32 value = wild_int (rand);
+
+        memcpy (contents + 4*g_rand_int_range (rand, 0, 13), &value, 4);
+      }
+      break;
+    case 2:
+      *length = g_rand_int_range (rand, 0, *length + 1);
+      break;
+    default:
+      /* scribble anywhere */
+      for (n=g_rand_int_range (rand, 1, 17);n>0;n--)
+        contents[g_rand_int_range (rand, 0, *length)] = g_rand_int (rand);
+      break;
+    }
+}
+
+/* Everything about a texture that was accepted has to be usable */
+static void
+check_map (PvrTextureMap *map, GRand *rand)
+{
+  const PVR_TEXTURE_HEADER *head = pvr_texture_map_get_header (map);
+  guint format = head->dwpfFlags & PVR_FLAG_FORMAT_MASK;
+  guint level;
+
+  for (level=0;level<=head->dwMipMapCount;level++)
+    {
+      guint width, height, size;
+      const guchar *data;
+      guchar *decoded, *region;
+      gint i;
+
+      data = pvr_texture_map_get_level (map, level, &width, &height, &size);
+      g_assert (data != NULL);
+
+      decoded = decompress (format, data, width, height);
+      if (format != MGLPT_PVRTC4)
+        {
+          g_free (decoded);
+          continue;
+        }
+
+      /* nonsense regions have to be turned down, not decoded */
+      for (i=0;i<8;i++)
+        g_free (pvr_texture_decompress_pvrtc4_region (data, width, height,
+                                                      wild_int (rand),
+                                                      wild_int (rand),
+                                                      wild_int (rand),
+                                                      wild_int (rand),
+                                                      1u << g_rand_int_range (rand, 0, 5)));
+
+      region = pvr_texture_decompress_pvrtc4_region (data, width, height,
+                                                     0, 0, width, height, 1);
+      g_assert (decoded != NULL);
+      g_assert (region != NULL);
+      g_assert (memcmp (decoded, region, width*height*4) == 0);
+      g_free (region);
+      g_free (decoded);
+    }
+}
+
+/* Damaged files have to be either turned down, or accepted by both the
+ * probe and the map in the same way */
+static void
+test_fuzz_headers (void)
+{
+  GRand *rand = g_rand_new_with_seed (7);
+  gchar *file = g_build_filename (tmp_dir, "damaged.pvr", NULL);
+  gint round;
+
+  for (round=0;round<2000;round++)
+    {
+      PVR_TEXTURE_HEADER probed_head;
+      PvrTextureMap *map;
+      gboolean probed;
+      gchar *contents;
+      gsize length = 0;
+      GError *error = NULL;
+
+      contents = texture_new (rand, &length);
+      texture_damage (rand, contents, &length);
+      g_file_set_contents (file, contents, length, &error);
+      g_assert_no_error (error);
+      g_free (contents);
+
+      probed = pvr_texture_probe (file, &probed_head, NULL);
+      map = pvr_texture_map_new (file, NULL);
+      if (!!map != !!probed)
+        g_error ("round %d: the probe %s the texture but the map %s it",
+                 round, probed ? "accepted" : "turned down",
+                 map ? "accepted" : "turned down");
+      if (!map)
+        continue;
+
+      g_assert (memcmp (pvr_texture_map_get_header (map), &probed_head,
+                        sizeof (probed_head)) == 0);
+      check_map (map, rand);
+      pvr_texture_map_free (map);
+    }
+
+  g_unlink (file);
+  g_free (file);
+  g_rand_free (rand);
+}
+
+/* Any data at all is a valid texture of a size the format can store, and
+ * other sizes have to be turned down */
+static void
+test_fuzz_payloads (void)
+{
+  GRand *rand = g_rand_new_with_seed (11);
+  gint round;
+
+  for (round=0;round<300;round++)
+    {
+      guint format = formats[round % 3];
+      gint width = 4 << g_rand_int_range (rand, 0, 7);
+      gint height = 4 << g_rand_int_range (rand, 0, 7);
+      guchar *data, *decoded;
+      gint i;
+
+      if (format == MGLPT_PVRTC2)
+        width = MAX(width, 8);
+
+      data = g_malloc (width * height);
+      for (i=0;i<width*height;i++)
+        data[i] = g_rand_int (rand);
+
+      decoded = decompress (format, data, width, height);
+      g_assert (decoded != NULL);
+      g_free (decoded);
+
+      g_assert (decompress (format, data, width * 3, height) == NULL);
+      g_assert (decompress (format, data, -width, height) == NULL);
+      g_assert (decompress (format, data, width, 0) == NULL);
+
+      g_free (data);
+    }
+
+  g_rand_free (rand);
+}
+
+int
+main (int argc, char **argv)
+{
+  GError *error = NULL;
+  int result;
+
+  g_test_init (&argc, &argv, NULL);
+
+  tmp_dir = g_dir_make_tmp ("test-pvr-fuzz-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  g_test_add_func ("/pvr-texture/fuzz/headers", test_fuzz_headers);
+  g_test_add_func ("/pvr-texture/fuzz/payloads", test_fuzz_payloads);
+
+  result = g_test_run ();
+
+  g_rmdir (tmp_dir);
+  g_free (tmp_dir);
+
+  return result;
+}
@@ -0,0 +1,356 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* The table pvr_texture_index_new() keeps in the directory is only a
+ * cache: whatever state it is in, the index has to describe the files
+ * that are there now, and only the ones that are valid textures.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+#include "pvr-texture.h"
+
+static gchar *tmp_dir = NULL;
+
+static gchar *
+path_in (const gchar *dir, const gchar *name)
+{
+  return g_build_filename (dir, name, NULL);
+}
+
+/* Saves a width x height texture in format as name in dir */
+static void
+texture_save (const gchar *dir,
+              const gchar *name,
+              guint        format,
+              gint         width,
+              gint         height)
+{
+  gchar *file = path_in (dir, name);
+  guchar *pixels, *compressed;
+  guint size;
+  gint i;
+  GError *error = NULL;
+
+  pixels = g_malloc (width * height * 4);
+  for (i=0;i<width*height*4;i++)
+    pixels[i] = i * 7;
+
+  if (format == ETC_RGB_4BPP)
+    compressed = pvr_texture_compress_etc1 (pixels, width, height, FALSE,
+                                            &size);
+  else
+    compressed = pvr_texture_compress_pvrtc4 (pixels, width, height, &size);
+  g_assert (compressed != NULL);
+  g_assert (pvr_texture_save_atomically (file, format, compressed, size,
+                                         width, height, &error));
+  g_assert_no_error (error);
+
+  g_free (compressed);
+  g_free (pixels);
+  g_free (file);
+}
+
+static void
+file_save (const gchar *dir,
+           const gchar *name,
+           const gchar *contents,
+           gsize        length)
+{
+  gchar *file = path_in (dir, name);
+  GError *error = NULL;
+
+  g_file_set_contents (file, contents, length, &error);
+  g_assert_no_error (error);
+  g_free (file);
+}
+
+static void
+file_remove (const gchar *dir, const gchar *name)
+{
+  gchar *file = path_in (dir, name);
+
+  g_unlink (file);
+  g_free (file);
+}
+
+static gchar *
+dir_new (const gchar *name)
+{
+  gchar *dir = path_in (tmp_dir, name);
+
+  g_assert_cmpint (g_mkdir (dir, 0755), ==, 0);
+  return dir;
+}
+
+static void
+dir_remove (gchar *directory)
+{
+  GDir *dir = g_dir_open (directory, 0, NULL);
+  const gchar *name;
+
+  g_assert (dir != NULL);
+  while ((name = g_dir_read_name (dir)))
+    file_remove (directory, name);
+  g_dir_close (dir);
+  g_rmdir (directory);
+  g_free (directory);
+}
+
+static PvrTextureIndex *
+index_new (const gchar *dir)
+{
+  PvrTextureIndex *index;
+  GError *error = NULL;
+
+  index = pvr_texture_index_new (dir, &error);
+  g_assert_no_error (error);
+  g_assert (index != NULL);
+
+  return index;
+}
+
+/* Checks that index has the texture name, of the given size and format */
+static void
+assert_texture (PvrTextureIndex *index,
+                const gchar     *name,
+                guint            format,
+                gint             width,
+                gint             height)
+{
+  const PvrTextureIndexEntry *entry;
+
+  entry = pvr_texture_index_lookup (index, name);
+  g_assert (entry != NULL);
+  g_assert_cmpstr (entry->name, ==, name);
+  g_assert_cmpuint (entry->header.dwpfFlags & PVR_FLAG_FORMAT_MASK, ==,
+                    format);
+  g_assert_cmpuint (entry->header.dwWidth, ==, width);
+  g_assert_cmpuint (entry->header.dwHeight, ==, height);
+}
+
+/* Files that aren't textures stay out, whether they've just been found
+ * or were known about from the table */
+static void
+test_index_invalid (void)
+{
+  static const gchar junk[] = "this is not a texture at all";
+  gchar *dir = dir_new ("invalid");
+  PvrTextureIndex *index;
+  gchar *contents = NULL, *file;
+  gsize length = 0;
+  gint round;
+  GError *error = NULL;
+
+  texture_save (dir, "a.pvr", MGLPT_PVRTC4, 32, 32);
+  file_save (dir, "junk.pvr", junk, sizeof (junk));
+  file_save (dir, "notes.txt", junk, sizeof (junk));
+
+  /* a texture with part of its data missing */
+  texture_save (dir, "short.pvr", MGLPT_PVRTC4, 64, 64);
+  file = path_in (dir, "short.pvr");
+  g_file_get_contents (file, &contents, &length, &error);
+  g_assert_no_error (error);
+  g_free (file);
+  file_save (dir, "short.pvr", contents, length - 16);
+  g_free (contents);
+
+  for (round=0;round<2;round++)
+    {
+      index = index_new (dir);
+      g_assert_cmpuint (pvr_texture_index_get_n_entries (index), ==, 1);
+      assert_texture (index, "a.pvr", MGLPT_PVRTC4, 32, 32);
+      g_assert (pvr_texture_index_get_entry (index, 0) ==
+                pvr_texture_index_lookup (index, "a.pvr"));
+      g_assert (pvr_texture_index_lookup (index, "junk.pvr") == NULL);
+      g_assert (pvr_texture_index_lookup (index, "short.pvr") == NULL);
+      g_assert (pvr_texture_index_lookup (index, "notes.txt") == NULL);
+      pvr_texture_index_free (index);
+    }
+
+  /* and one that becomes a texture is picked up */
+  texture_save (dir, "junk.pvr", ETC_RGB_4BPP, 16, 8);
+  index = index_new (dir);
+  g_assert_cmpuint (pvr_texture_index_get_n_entries (index), ==, 2);
+  assert_texture (index, "junk.pvr", ETC_RGB_4BPP, 16, 8);
+  pvr_texture_index_free (index);
+
+  dir_remove (dir);
+}
+
+/* Textures that are replaced or removed after the table was written
+ * have to show up as they are now */
+static void
+test_index_changes (void)
+{
+  gchar *dir = dir_new ("changes");
+  PvrTextureIndex *index;
+
+  texture_save (dir, "a.pvr", MGLPT_PVRTC4, 64, 64);
+  texture_save (dir, "b.pvr", MGLPT_PVRTC4, 32, 16);
+  texture_save (dir, "c.pvr", ETC_RGB_4BPP, 8, 8);
+
+  index = index_new (dir);
+  g_assert_cmpuint (pvr_texture_index_get_n_entries (index), ==, 3);
+  assert_texture (index, "a.pvr", MGLPT_PVRTC4, 64, 64);
+  assert_texture (index, "b.pvr", MGLPT_PVRTC4, 32, 16);
+  assert_texture (index, "c.pvr", ETC_RGB_4BPP, 8, 8);
+  pvr_texture_index_free (index);
+
+  /* the same size of file, most likely within the same second, so only
+   * the inode tells them apart */
+  texture_save (dir, "a.pvr", ETC_RGB_4BPP, 64, 64);
+  /* a different size */
+  texture_save (dir, "b.pvr", MGLPT_PVRTC4, 128, 16);
+  file_remove (dir, "c.pvr");
+
+  index = index_new (dir);
+  g_assert_cmpuint (pvr_texture_index_get_n_entries (index), ==, 2);
+  assert_texture (index, "a.pvr", ETC_RGB_4BPP, 64, 64);
+  assert_texture (index, "b.pvr", MGLPT_PVRTC4, 128, 16);
+  g_assert (pvr_texture_index_lookup (index, "c.pvr") == NULL);
+  g_assert_cmpstr (pvr_texture_index_get_entry (index, 0)->name, ==,
+                   "a.pvr");
+  g_assert_cmpstr (pvr_texture_index_get_entry (index, 1)->name, ==,
+                   "b.pvr");
+  pvr_texture_index_free (index);
+
+  /* and the table written for that is right too */
+  index = index_new (dir);
+  g_assert_cmpuint (pvr_texture_index_get_n_entries (index), ==, 2);
+  assert_texture (index, "a.pvr", ETC_RGB_4BPP, 64, 64);
+  assert_texture (index, "b.pvr", MGLPT_PVRTC4, 128, 16);
+  pvr_texture_index_free (index);
+
+  dir_remove (dir);
+}
+
+/* Damages the table in dir in one of a few ways */
+static void
+table_damage (const gchar *dir, gint how)
+{
+  gchar *file = path_in (dir, ".pvr-index");
+  gchar *contents = NULL;
+  gsize length = 0;
+  guint32 value;
+  GError *error = NULL;
+
+  g_file_get_contents (file, &contents, &length, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (length, >, 16);
+
+  switch (how)
+    {
+    case 0:
+      /* cut short */
+      length /= 2;
+      break;
+    case 1:
+      /* the magic */
+      contents[0] ^= 0xff;
+      break;
+    case 2:
+      /* a version from the future */
+      value = 1000;
+      memcpy (contents + 4, &value, 4);
+      break;
+    case 3:
+      /* more records than there is room for */
+      value = 0x40000000;
+      memcpy (contents + 8, &value, 4);
+      break;
+    case 4:
+      /* names that aren't nul terminated */
+      contents[length - 1] = 'x';
+      break;
+    case 5:
+      /* one of the textures' headers */
+      memset (contents + 16, 0xff, 16);
+      break;
+    default:
+      /* nonsense of the same length */
+      memset (contents, 0x5a, length);
+      break;
+    }
+
+  file_save (dir, ".pvr-index", contents, length);
+  g_free (contents);
+  g_free (file);
+}
+
+/* A damaged table is as good as none */
+static void
+test_index_corrupt (void)
+{
+  gint how;
+
+  for (how=0;how<7;how++)
+    {
+      gchar *dir = dir_new ("corrupt");
+      PvrTextureIndex *index;
+      gint round;
+
+      texture_save (dir, "a.pvr", MGLPT_PVRTC4, 64, 32);
+      texture_save (dir, "b.pvr", ETC_RGB_4BPP, 16, 16);
+      file_save (dir, "junk.pvr", "junk", 4);
+
+      pvr_texture_index_free (index_new (dir));
+      table_damage (dir, how);
+
+      /* the second time round it's the table written in its place */
+      for (round=0;round<2;round++)
+        {
+          index = index_new (dir);
+          g_assert_cmpuint (pvr_texture_index_get_n_entries (index), ==, 2);
+          assert_texture (index, "a.pvr", MGLPT_PVRTC4, 64, 32);
+          assert_texture (index, "b.pvr", ETC_RGB_4BPP, 16, 16);
+          g_assert (pvr_texture_index_lookup (index, "junk.pvr") == NULL);
+          pvr_texture_index_free (index);
+        }
+
+      dir_remove (dir);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  GError *error = NULL;
+  int result;
+
+  g_test_init (&argc, &argv, NULL);
+
+  tmp_dir = g_dir_make_tmp ("test-pvr-index-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  g_test_add_func ("/pvr-texture/index/invalid", test_index_invalid);
+  g_test_add_func ("/pvr-texture/index/changes", test_index_changes);
+  g_test_add_func ("/pvr-texture/index/corrupt", test_index_corrupt);
+
+  result = g_test_run ();
+
+  g_rmdir (tmp_dir);
+  g_free (tmp_dir);
+
+  return result;
+}
@@ -0,0 +1,220 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* The encoders are free to change what they write, but not to get worse
+ * at it. This round trips a few smooth images through each codec at
+ * square and 4:1 sizes from 16 to 64 and fails if any comes out below
+ * the floor for its format, each of which sits just under the worst the
+ * codecs do today. Noise is left out, as no codec does well on it and it
+ * would hold the floors down. example-pvr-benchmark prints the same
+ * figures for any size and image.
+ */
+
+#include <glib.h>
+#include <math.h>
+#include <string.h>
+
+#include "pvr-texture.h"
+
+typedef struct {
+  const gchar *name;
+  gint         min_width;
+  gdouble      floor;
+  gboolean     alpha;     /* whether the format keeps alpha */
+} Codec;
+
+typedef struct {
+  const gchar *name;
+  void       (*generate) (guchar *data, gint width, gint height);
+} Image;
+
+static const Codec codecs[] =
+{
+  { "pvrtc4", 4, 25.0, TRUE },
+  { "pvrtc2", 8, 16.5, TRUE },
+  { "etc1",   4, 25.0, FALSE },
+};
+
+static void
+generate_gradient (guchar *data, gint width, gint height)
+{
+  gint x, y;
+
+  for (y=0;y<height;y++)
+    for (x=0;x<width;x++)
+      {
+        guchar *p = &data[(x + y*width)*4];
+
+        p[0] = x * 255 / MAX(width-1, 1);
+        p[1] = y * 255 / MAX(height-1, 1);
+        p[2] = 255 - (p[0] + p[1]) / 2;
+        p[3] = 255;
+      }
+}
+
+static void
+generate_rings (guchar *data, gint width, gint height)
+{
+  gint x, y;
+
+  for (y=0;y<height;y++)
+    for (x=0;x<width;x++)
+      {
+        guchar *p = &data[(x + y*width)*4];
+        gdouble dx = x - width/2.0, dy = y - height/2.0;
+        gdouble r = sqrt (dx*dx + dy*dy);
+
+        p[0] = 128 + 127 * sin (r / 3);
+        p[1] = 128 + 127 * cos (r / 7);
+        p[2] = 128 + 127 * sin (r / 11);
+        p[3] = 255;
+      }
+}
+
+/* Mostly transparent, like a widget with a drop shadow */
+static void
+generate_alpha (guchar *data, gint width, gint height)
+{
+  gint x, y;
+
+  for (y=0;y<height;y++)
+    for (x=0;x<width;x++)
+      {
+        guchar *p = &data[(x + y*width)*4];
+        gint edge = MIN(MIN(x, width-1-x), MIN(y, height-1-y));
+
+        p[0] = 40;
+        p[1] = 80;
+        p[2] = 160;
+        p[3] = edge > 8 ? 255 : edge * 255 / 8;
+      }
+}
+
+static const Image images[] =
+{
+  { "gradient", generate_gradient },
+  { "rings",    generate_rings },
+  { "alpha",    generate_alpha },
+};
+
+/* PSNR over the RGB channels, and alpha too if the format keeps it */
+static gdouble
+psnr (const guchar *a, const guchar *b, gint n_pixels, gboolean alpha)
+{
+  gint channels = alpha ? 4 : 3;
+  gdouble error = 0;
+  gint i, c;
+
+  for (i=0;i<n_pixels;i++)
+    for (c=0;c<channels;c++)
+      {
+        gdouble d = (gdouble)a[i*4 + c] - b[i*4 + c];
+
+        error += d*d;
+      }
+
+  if (error == 0)
+    return 99.0;
+
+  return 10 * log10 (255.0*255.0 * n_pixels * channels / error);
+}
+
+static guchar *
+round_trip (const Codec *codec, const guchar *data, gint width, gint height)
+{
+  guchar *compressed, *decompressed;
+  guint size;
+
+  if (!strcmp (codec->name, "pvrtc4"))
+    {
+      compressed = pvr_texture_compress_pvrtc4 (data, width, height, &size);
+      g_assert (compressed != NULL);
+      decompressed = pvr_texture_decompress_pvrtc4 (compressed, width, height);
+    }
+  else if (!strcmp (codec->name, "pvrtc2"))
+    {
+      compressed = pvr_texture_compress_pvrtc2 (data, width, height, &size);
+      g_assert (compressed != NULL);
+      decompressed = pvr_texture_decompress_pvrtc2 (compressed, width, height);
+    }
+  else
+    {
+      compressed = pvr_texture_compress_etc1 (data, width, height, FALSE,
+                                              &size);
+      g_assert (compressed != NULL);
+      decompressed = pvr_texture_decompress_etc1 (compressed, width, height);
+    }
+  g_assert (decompressed != NULL);
+  g_free (compressed);
+
+  return decompressed;
+}
+
+static void
+check_codec (gconstpointer user_data)
+{
+  const Codec *codec = user_data;
+  gint width, height;
+  guint i;
+
+  for (i=0;i<G_N_ELEMENTS(images);i++)
+    for (width=16;width<=64;width*=4)
+      for (height=16;height<=64;height*=4)
+        {
+          guchar *data, *decompressed;
+          gdouble quality;
+
+          if (width < codec->min_width)
+            continue;
+
+          data = g_malloc (width*height*4);
+          images[i].generate (data, width, height);
+          decompressed = round_trip (codec, data, width, height);
+          quality = psnr (data, decompressed, width*height, codec->alpha);
+
+          if (quality < codec->floor)
+            g_error ("%s on %s at %dx%d: PSNR %.2f is below %.2f",
+                     codec->name, images[i].name, width, height,
+                     quality, codec->floor);
+
+          g_free (decompressed);
+          g_free (data);
+        }
+}
+
+int
+main (int argc, char **argv)
+{
+  guint i;
+
+  g_test_init (&argc, &argv, NULL);
+
+  for (i=0;i<G_N_ELEMENTS(codecs);i++)
+    {
+      gchar *path = g_strdup_printf ("/pvr-texture/quality/%s",
+                                     codecs[i].name);
+
+      g_test_add_data_func (path, &codecs[i], check_codec);
+      g_free (path);
+    }
+
+  return g_test_run ();
+}
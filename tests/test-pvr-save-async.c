@@ -0,0 +1,222 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* hd_pvr_texture_save_async() compresses on a worker thread, but its
+ * progress and result have to come back in the main context of whoever
+ * started it, and cancelling it has to leave the file as it was.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <string.h>
+
+#include "hd-pvr-texture.h"
+
+static gchar *tmp_dir = NULL;
+
+typedef struct {
+  GMainContext  *context;
+  GThread       *thread;
+  GCancellable  *cancellable;
+  gboolean       cancel;     /* cancel at the first progress report */
+  guint          n_progress;
+  goffset        done;
+  gboolean       finished;
+  gboolean       saved;
+  GError        *error;
+} SaveState;
+
+static GdkPixbuf *
+pixbuf_new_pattern (gint width, gint height)
+{
+  GdkPixbuf *pixbuf;
+  guchar *pixels;
+  gint rowstride, x, y;
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8, width, height);
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+
+  for (y=0;y<height;y++)
+    for (x=0;x<width;x++)
+      {
+        guchar *p = pixels + y*rowstride + x*4;
+        p[0] = x*255 / width;
+        p[1] = y*255 / height;
+        p[2] = ((x/5 + y/7) & 1) ? 200 : 30;
+        p[3] = (x + y) & 16 ? 255 : 128;
+      }
+
+  return pixbuf;
+}
+
+static void
+save_progress (goffset  done,
+               goffset  total,
+               gpointer user_data)
+{
+  SaveState *state = user_data;
+
+  g_assert (g_thread_self () == state->thread);
+  g_assert (g_main_context_is_owner (state->context));
+  g_assert_cmpint (done, >=, state->done);
+  g_assert_cmpint (done, <=, total);
+
+  state->n_progress++;
+  state->done = done;
+
+  if (state->cancel)
+    g_cancellable_cancel (state->cancellable);
+}
+
+static void
+save_done (GObject      *source,
+           GAsyncResult *result,
+           gpointer      user_data)
+{
+  SaveState *state = user_data;
+
+  g_assert (g_thread_self () == state->thread);
+  g_assert (g_main_context_is_owner (state->context));
+
+  state->saved = hd_pvr_texture_save_finish (result, &state->error);
+  state->finished = TRUE;
+}
+
+/* Saves pixbuf to file from a main context of our own, pushed as the
+ * thread default, and runs only that context until the save is done.
+ * If cancel is set, cancels it as soon as there is any progress */
+static void
+save_and_wait (SaveState   *state,
+               const gchar *file,
+               GdkPixbuf   *pixbuf,
+               gboolean     cancel)
+{
+  memset (state, 0, sizeof (*state));
+  state->cancel = cancel;
+  state->context = g_main_context_new ();
+  state->thread = g_thread_self ();
+  state->cancellable = g_cancellable_new ();
+
+  g_main_context_push_thread_default (state->context);
+  hd_pvr_texture_save_async (file, pixbuf, HD_PVR_TEXTURE_FORMAT_PVRTC4,
+                             TRUE, state->cancellable,
+                             save_progress, state,
+                             save_done, state);
+  while (!state->finished)
+    g_main_context_iteration (state->context, TRUE);
+  g_main_context_pop_thread_default (state->context);
+}
+
+static void
+save_state_clear (SaveState *state)
+{
+  /* let go of any progress reports still queued */
+  while (g_main_context_iteration (state->context, FALSE));
+
+  g_clear_error (&state->error);
+  g_object_unref (state->cancellable);
+  g_main_context_unref (state->context);
+}
+
+/* Progress and the result come back in the caller's thread-default
+ * context, and not in the global default one, which nobody runs here */
+static void
+test_save_async_context (void)
+{
+  gchar *file = g_build_filename (tmp_dir, "texture.pvr", NULL);
+  GdkPixbuf *pixbuf = pixbuf_new_pattern (512, 512);
+  SaveState state;
+
+  save_and_wait (&state, file, pixbuf, FALSE);
+  g_assert_no_error (state.error);
+  g_assert (state.saved);
+  g_assert_cmpuint (state.n_progress, >, 0);
+  g_assert (g_file_test (file, G_FILE_TEST_IS_REGULAR));
+  save_state_clear (&state);
+
+  g_unlink (file);
+  g_free (file);
+  g_object_unref (pixbuf);
+}
+
+/* Cancelling part way through fails with G_IO_ERROR_CANCELLED and leaves
+ * what was in the file alone */
+static void
+test_save_async_cancel (void)
+{
+  static const gchar old_contents[] = "not replaced";
+  gchar *file = g_build_filename (tmp_dir, "texture.pvr", NULL);
+  /* big enough that compressing it takes far longer than the first
+   * progress report takes to come back */
+  GdkPixbuf *pixbuf = pixbuf_new_pattern (2048, 2048);
+  SaveState state;
+  gchar *contents;
+  gsize length;
+  GError *error = NULL;
+
+  g_file_set_contents (file, old_contents, sizeof (old_contents), &error);
+  g_assert_no_error (error);
+
+  save_and_wait (&state, file, pixbuf, TRUE);
+  g_assert (!state.saved);
+  g_assert_cmpuint (state.n_progress, >, 0);
+  g_assert_error (state.error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  save_state_clear (&state);
+
+  g_file_get_contents (file, &contents, &length, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (length, ==, sizeof (old_contents));
+  g_assert (memcmp (contents, old_contents, length) == 0);
+  g_free (contents);
+
+  g_unlink (file);
+  g_free (file);
+  g_object_unref (pixbuf);
+}
+
+int
+main (int argc, char **argv)
+{
+  GError *error = NULL;
+  int result;
+
+#if !GLIB_CHECK_VERSION(2,35,0)
+  g_type_init ();
+#endif
+  g_test_init (&argc, &argv, NULL);
+
+  tmp_dir = g_dir_make_tmp ("test-pvr-save-async-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  g_test_add_func ("/pvr-texture/save-async/context",
+                   test_save_async_context);
+  g_test_add_func ("/pvr-texture/save-async/cancel",
+                   test_save_async_cancel);
+
+  result = g_test_run ();
+
+  g_rmdir (tmp_dir);
+  g_free (tmp_dir);
+
+  return result;
+}
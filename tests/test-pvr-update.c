@@ -0,0 +1,200 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* hd_pvr_texture_update() only recompresses the blocks around the damage,
+ * but what it writes has to be exactly what hd_pvr_texture_save() would
+ * have written for the changed pixbuf.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+#include "hd-pvr-texture.h"
+#include "pvr-texture.h"
+
+static gchar *tmp_dir = NULL;
+
+/* Something with edges and gradients everywhere, so every block matters */
+static GdkPixbuf *
+pixbuf_new_pattern (gint width, gint height)
+{
+  GdkPixbuf *pixbuf;
+  guchar *pixels;
+  gint rowstride, x, y;
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8, width, height);
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+
+  for (y=0;y<height;y++)
+    for (x=0;x<width;x++)
+      {
+        guchar *p = pixels + y*rowstride + x*4;
+        p[0] = x*255 / width;
+        p[1] = y*255 / height;
+        p[2] = ((x/5 + y/7) & 1) ? 200 : 30;
+        p[3] = (x + y) & 16 ? 255 : 128;
+      }
+
+  return pixbuf;
+}
+
+/* Paints a rectangle of pixbuf so it's different from what was saved */
+static void
+pixbuf_damage (GdkPixbuf *pixbuf, gint x, gint y, gint width, gint height)
+{
+  guchar *pixels = gdk_pixbuf_get_pixels (pixbuf);
+  gint rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  gint i, j;
+
+  for (j=y;j<y+height;j++)
+    for (i=x;i<x+width;i++)
+      {
+        guchar *p = pixels + j*rowstride + i*4;
+        p[0] = 255 - p[0];
+        p[1] = (i*j) & 255;
+        p[2] = 255;
+        p[3] = 255;
+      }
+}
+
+static gchar *
+file_get_contents (const gchar *file, gsize *length)
+{
+  gchar *contents = NULL;
+  GError *error = NULL;
+
+  g_file_get_contents (file, &contents, length, &error);
+  g_assert_no_error (error);
+
+  return contents;
+}
+
+/* Saves a width x height pixbuf, damages the given rect, updates the
+ * texture and checks it against a texture saved from scratch */
+static void
+check_update (gint width, gint height,
+              gint x, gint y, gint damage_width, gint damage_height)
+{
+  GdkPixbuf *pixbuf;
+  gchar *updated_file, *saved_file;
+  gchar *updated, *saved;
+  gsize updated_length, saved_length;
+  const PVR_TEXTURE_HEADER *head;
+  GError *error = NULL;
+
+  updated_file = g_build_filename (tmp_dir, "updated.pvr", NULL);
+  saved_file = g_build_filename (tmp_dir, "saved.pvr", NULL);
+
+  pixbuf = pixbuf_new_pattern (width, height);
+  g_assert (hd_pvr_texture_save (updated_file, pixbuf, &error));
+  g_assert_no_error (error);
+
+  /* if this isn't what hd_pvr_texture_update() expects, it would just
+   * quietly save the whole texture again and we'd be testing nothing */
+  updated = file_get_contents (updated_file, &updated_length);
+  g_assert_cmpuint (updated_length, >=, sizeof (PVR_TEXTURE_HEADER));
+  head = (const PVR_TEXTURE_HEADER *) updated;
+  g_assert_cmpuint (head->dwpfFlags, ==,
+                    MGLPT_PVRTC4 | PVR_FLAG_TWIDDLED | PVR_FLAG_ALPHA);
+  g_assert_cmpuint (head->dwpfFlags & PVR_FLAG_MIPMAP, ==, 0);
+  g_free (updated);
+
+  pixbuf_damage (pixbuf, x, y, damage_width, damage_height);
+  g_assert (hd_pvr_texture_update (updated_file, pixbuf,
+                                   x, y, damage_width, damage_height,
+                                   &error));
+  g_assert_no_error (error);
+  g_assert (hd_pvr_texture_save (saved_file, pixbuf, &error));
+  g_assert_no_error (error);
+
+  updated = file_get_contents (updated_file, &updated_length);
+  saved = file_get_contents (saved_file, &saved_length);
+  g_assert_cmpuint (updated_length, ==, saved_length);
+  g_assert (memcmp (updated, saved, saved_length) == 0);
+
+  g_free (updated);
+  g_free (saved);
+  g_unlink (updated_file);
+  g_unlink (saved_file);
+  g_free (updated_file);
+  g_free (saved_file);
+  g_object_unref (pixbuf);
+}
+
+static void
+test_update_middle (void)
+{
+  check_update (64, 64, 20, 24, 5, 3);
+  check_update (128, 32, 61, 13, 9, 11);
+}
+
+static void
+test_update_edges (void)
+{
+  /* PVRTC blocks wrap around, so damage at one edge changes the
+   * blocks at the other */
+  check_update (64, 64, 0, 0, 3, 3);
+  check_update (64, 64, 60, 61, 4, 3);
+  check_update (32, 128, 0, 100, 32, 2);
+}
+
+static void
+test_update_padded (void)
+{
+  /* not a power of 2, so the texture is padded beyond the pixbuf */
+  check_update (100, 60, 95, 10, 5, 4);
+  check_update (33, 17, 0, 15, 33, 2);
+}
+
+static void
+test_update_whole (void)
+{
+  check_update (64, 32, 0, 0, 64, 32);
+}
+
+int
+main (int argc, char **argv)
+{
+  GError *error = NULL;
+  int result;
+
+#if !GLIB_CHECK_VERSION(2,35,0)
+  g_type_init ();
+#endif
+  g_test_init (&argc, &argv, NULL);
+
+  tmp_dir = g_dir_make_tmp ("test-pvr-update-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  g_test_add_func ("/pvr-texture/update/middle", test_update_middle);
+  g_test_add_func ("/pvr-texture/update/edges", test_update_edges);
+  g_test_add_func ("/pvr-texture/update/padded", test_update_padded);
+  g_test_add_func ("/pvr-texture/update/whole", test_update_whole);
+
+  result = g_test_run ();
+
+  g_rmdir (tmp_dir);
+  g_free (tmp_dir);
+
+  return result;
+}
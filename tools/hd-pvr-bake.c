@@ -0,0 +1,580 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Converts whole directories of images to compressed textures, for
+ * baking theme assets when an image is built.
+ *
+ * Every image found under the given files and directories is decoded
+ * and compressed on a pool of worker threads, and written (atomically)
+ * to a .pvr file next to it or, with --output, at the same relative path
+ * under another directory. Images whose texture is already up to date
+ * are skipped: by default that means the texture is newer than the
+ * image, and with --check=hash it means the image's contents and the
+ * settings haven't changed since the texture was made, which is kept
+ * track of in a manifest file.
+ *
+ * With --atlas, the images are all packed into one texture instead, and
+ * can be looked up in it by their path (under the directory given on the
+ * command line) without the extension.
+ *
+ * A tab separated line is printed for each image, and a summary of the
+ * throughput at the end.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <libhildondesktop/hd-pvr-texture.h>
+#include <libhildondesktop/pvr-texture.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define MANIFEST_NAME ".hd-pvr-bake-manifest"
+
+typedef struct {
+  gchar *input;
+  gchar *output;
+  gchar *name;    /* in an atlas */
+} Job;
+
+static gint      n_jobs = 0;
+static gchar    *format_name = NULL;
+static gboolean  mipmaps = FALSE;
+static gchar    *output_dir = NULL;
+static gchar    *check = NULL;
+static gchar    *manifest_file = NULL;
+static gboolean  force = FALSE;
+static gboolean  quiet = FALSE;
+static gchar    *atlas_file = NULL;
+
+static GOptionEntry entries[] =
+{
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &n_jobs,
+    "Images to convert at once (default one per CPU)", "N" },
+  { "format", 'f', 0, G_OPTION_ARG_STRING, &format_name,
+    "pvrtc4 (the default), pvrtc2 or etc1", "FORMAT" },
+  { "mipmaps", 'm', 0, G_OPTION_ARG_NONE, &mipmaps,
+    "Store mipmap levels too", NULL },
+  { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output_dir,
+    "Write textures under DIR instead of next to the images", "DIR" },
+  { "check", 'c', 0, G_OPTION_ARG_STRING, &check,
+    "How to tell a texture is up to date: mtime (the default) or hash",
+    "HOW" },
+  { "manifest", 0, 0, G_OPTION_ARG_FILENAME, &manifest_file,
+    "Where --check=hash keeps its hashes (default " MANIFEST_NAME
+    " in the output directory)", "FILE" },
+  { "force", 'F', 0, G_OPTION_ARG_NONE, &force,
+    "Convert everything, even if it looks up to date", NULL },
+  { "quiet", 'q', 0, G_OPTION_ARG_NONE, &quiet,
+    "Only print the summary and errors", NULL },
+  { "atlas", 'a', 0, G_OPTION_ARG_FILENAME, &atlas_file,
+    "Pack all the images into the one texture FILE, with a list of where "
+    "each is in FILE.atlas", "FILE" },
+  { NULL }
+};
+
+static HDPvrTextureFormat format = HD_PVR_TEXTURE_FORMAT_PVRTC4;
+static gboolean check_hash = FALSE;
+
+/* Everything below is shared between the workers */
+G_LOCK_DEFINE_STATIC (results);
+static GHashTable *manifest = NULL;     /* output path -> hash */
+static gboolean manifest_changed = FALSE;
+static guint n_converted = 0;
+static guint n_skipped = 0;
+static guint n_failed = 0;
+static gdouble total_megapixels = 0;
+static gint64 total_busy = 0;
+
+static gboolean
+is_image (const gchar *name)
+{
+  gchar *lower = g_ascii_strdown (name, -1);
+  gboolean image = g_str_has_suffix (lower, ".png") ||
+                   g_str_has_suffix (lower, ".jpg") ||
+                   g_str_has_suffix (lower, ".jpeg");
+
+  g_free (lower);
+  return image;
+}
+
+/* foo.png -> foo.pvr */
+static gchar *
+texture_name (const gchar *name)
+{
+  const gchar *dot = strrchr (name, '.');
+  gsize length = dot ? (gsize)(dot - name) : strlen (name);
+  gchar *base = g_strndup (name, length);
+  gchar *texture = g_strconcat (base, ".pvr", NULL);
+
+  g_free (base);
+  return texture;
+}
+
+static void
+add_job (GPtrArray   *jobs,
+         const gchar *input,
+         const gchar *relative)
+{
+  Job *job = g_new (Job, 1);
+  gchar *texture = texture_name (relative);
+
+  job->input = g_strdup (input);
+  job->name = g_strndup (texture, strlen (texture) - strlen (".pvr"));
+  if (output_dir)
+    {
+      job->output = g_build_filename (output_dir, texture, NULL);
+      g_free (texture);
+    }
+  else
+    {
+      gchar *dir = g_path_get_dirname (input);
+      gchar *name = g_path_get_basename (texture);
+
+      job->output = g_build_filename (dir, name, NULL);
+      g_free (dir);
+      g_free (name);
+      g_free (texture);
+    }
+
+  g_ptr_array_add (jobs, job);
+}
+
+/* Finds the images under path, which is relative to the directory given
+ * on the command line */
+static void
+find_images (GPtrArray   *jobs,
+             const gchar *path,
+             const gchar *relative)
+{
+  GDir *dir;
+  const gchar *name;
+  GPtrArray *names;
+  guint i;
+
+  if (!g_file_test (path, G_FILE_TEST_IS_DIR))
+    {
+      add_job (jobs, path, relative);
+      return;
+    }
+
+  dir = g_dir_open (path, 0, NULL);
+  if (!dir)
+    {
+      fprintf (stderr, "Couldn't read directory %s\n", path);
+      return;
+    }
+
+  /* sorted, so the report comes out in the same order every time */
+  names = g_ptr_array_new_with_free_func (g_free);
+  while ((name = g_dir_read_name (dir)))
+    g_ptr_array_add (names, g_strdup (name));
+  g_dir_close (dir);
+  g_ptr_array_sort (names, (GCompareFunc) g_ascii_strcasecmp);
+  for (i=0;i<names->len;i++)
+    {
+      const gchar *child = g_ptr_array_index (names, i);
+      gchar *child_path = g_build_filename (path, child, NULL);
+      gchar *child_relative = g_build_filename (relative, child, NULL);
+
+      if (g_file_test (child_path, G_FILE_TEST_IS_DIR) || is_image (child))
+        find_images (jobs, child_path, child_relative);
+
+      g_free (child_path);
+      g_free (child_relative);
+    }
+  g_ptr_array_free (names, TRUE);
+}
+
+/* The hash of an image file's contents and everything that changes the
+ * texture made from it */
+static gchar *
+input_hash (const gchar *input)
+{
+  GMappedFile *file = g_mapped_file_new (input, FALSE, NULL);
+  guint32 settings[2];
+  guint64 hash;
+
+  if (!file)
+    return NULL;
+
+  settings[0] = format;
+  settings[1] = mipmaps;
+  hash = pvr_texture_hash ((const guchar *)
+                           g_mapped_file_get_contents (file),
+                           g_mapped_file_get_length (file),
+                           pvr_texture_hash ((const guchar *) settings,
+                                             sizeof(settings), 0));
+  g_mapped_file_unref (file);
+
+  return g_strdup_printf ("%016" G_GINT64_MODIFIER "x", hash);
+}
+
+static gboolean
+up_to_date (Job   *job,
+            gchar *hash)
+{
+  struct stat in, out;
+  gboolean same;
+
+  if (force || g_stat (job->output, &out) == -1)
+    return FALSE;
+
+  if (!check_hash)
+    return g_stat (job->input, &in) == 0 && out.st_mtime >= in.st_mtime;
+
+  G_LOCK (results);
+  same = hash && !g_strcmp0 (g_hash_table_lookup (manifest, job->output),
+                             hash);
+  G_UNLOCK (results);
+
+  return same;
+}
+
+static void
+convert (gpointer data,
+         gpointer user_data)
+{
+  Job *job = data;
+  GdkPixbuf *pixbuf;
+  GError *error = NULL;
+  gchar *hash = check_hash ? input_hash (job->input) : NULL;
+  gchar *dir;
+  gint64 start, decoded, done;
+  gdouble megapixels;
+
+  if (up_to_date (job, hash))
+    {
+      G_LOCK (results);
+      n_skipped++;
+      if (!quiet)
+        printf ("%s\tskipped\n", job->input);
+      G_UNLOCK (results);
+      g_free (hash);
+      return;
+    }
+
+  start = g_get_monotonic_time ();
+  pixbuf = gdk_pixbuf_new_from_file (job->input, &error);
+  decoded = g_get_monotonic_time ();
+
+  dir = g_path_get_dirname (job->output);
+  if (pixbuf && g_mkdir_with_parents (dir, 0755) == -1)
+    g_set_error (&error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                 "Couldn't create directory %s", dir);
+  g_free (dir);
+
+  if (pixbuf && !error)
+    {
+      gboolean saved;
+
+      if (mipmaps)
+        saved = hd_pvr_texture_save_with_mipmaps (job->output, pixbuf,
+                                                  format, &error);
+      else
+        saved = hd_pvr_texture_save_with_format (job->output, pixbuf,
+                                                 format, &error);
+
+      /* some failures, such as a pixbuf format it can't deal with,
+       * don't come with an error */
+      if (!saved && !error)
+        g_set_error (&error, GDK_PIXBUF_ERROR,
+                     GDK_PIXBUF_ERROR_UNSUPPORTED_OPERATION,
+                     "Couldn't save %s as a texture", job->output);
+    }
+  done = g_get_monotonic_time ();
+
+  G_LOCK (results);
+  if (error)
+    {
+      n_failed++;
+      fprintf (stderr, "%s\tfailed\t%s\n", job->input, error->message);
+      g_error_free (error);
+    }
+  else
+    {
+      megapixels = gdk_pixbuf_get_width (pixbuf) *
+                   gdk_pixbuf_get_height (pixbuf) / 1000000.0;
+      n_converted++;
+      total_megapixels += megapixels;
+      total_busy += done - start;
+      if (hash)
+        {
+          g_hash_table_replace (manifest, g_strdup (job->output), hash);
+          manifest_changed = TRUE;
+          hash = NULL;
+        }
+      if (!quiet)
+        printf ("%s\t%s\t%dx%d\t%.1f ms\t%.1f ms\t%.2f MP/s\n",
+                job->input, job->output,
+                gdk_pixbuf_get_width (pixbuf),
+                gdk_pixbuf_get_height (pixbuf),
+                (decoded - start) / 1000.0,
+                (done - decoded) / 1000.0,
+                megapixels / MAX(done - start, 1) * 1000000.0);
+    }
+  G_UNLOCK (results);
+
+  if (pixbuf)
+    g_object_unref (pixbuf);
+  g_free (hash);
+}
+
+/* Packs all the images into one atlas, which is always made again */
+static gboolean
+make_atlas (GPtrArray *jobs)
+{
+  HDPvrTextureAtlas *atlas = hd_pvr_texture_atlas_new ();
+  GError *error = NULL;
+  gboolean ok;
+  guint i;
+
+  for (i=0;i<jobs->len;i++)
+    {
+      Job *job = g_ptr_array_index (jobs, i);
+      GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file (job->input, &error);
+
+      if (!pixbuf)
+        {
+          n_failed++;
+          fprintf (stderr, "%s\tfailed\t%s\n", job->input, error->message);
+          g_clear_error (&error);
+          continue;
+        }
+
+      hd_pvr_texture_atlas_add (atlas, job->name, pixbuf);
+      n_converted++;
+      total_megapixels += gdk_pixbuf_get_width (pixbuf) *
+                          gdk_pixbuf_get_height (pixbuf) / 1000000.0;
+      if (!quiet)
+        printf ("%s\t%s\t%dx%d\n",
+                job->input, job->name,
+                gdk_pixbuf_get_width (pixbuf),
+                gdk_pixbuf_get_height (pixbuf));
+      g_object_unref (pixbuf);
+    }
+
+  ok = hd_pvr_texture_atlas_save (atlas, atlas_file, format, &error);
+  if (!ok)
+    {
+      fprintf (stderr, "Couldn't write %s: %s\n", atlas_file, error->message);
+      g_error_free (error);
+    }
+  hd_pvr_texture_atlas_free (atlas);
+
+  return ok;
+}
+
+/* The manifest is lines of "hash<TAB>texture" */
+static void
+manifest_load (const gchar *filename)
+{
+  gchar *contents;
+  gchar **lines;
+  guint i;
+
+  manifest = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  if (!g_file_get_contents (filename, &contents, NULL, NULL))
+    return;
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i=0;lines[i];i++)
+    {
+      gchar *tab = strchr (lines[i], '\t');
+
+      if (tab)
+        {
+          *tab = 0;
+          g_hash_table_replace (manifest, g_strdup (tab + 1),
+                                g_strdup (lines[i]));
+        }
+    }
+  g_strfreev (lines);
+  g_free (contents);
+}
+
+static gboolean
+manifest_save (const gchar *filename)
+{
+  GString *contents = g_string_new (NULL);
+  GList *outputs, *l;
+  GError *error = NULL;
+  gchar *dir;
+  gboolean ok;
+
+  outputs = g_list_sort (g_hash_table_get_keys (manifest),
+                         (GCompareFunc) strcmp);
+  for (l=outputs;l;l=l->next)
+    g_string_append_printf (contents, "%s\t%s\n",
+                            (const gchar *) g_hash_table_lookup (manifest,
+                                                                 l->data),
+                            (const gchar *) l->data);
+  g_list_free (outputs);
+
+  dir = g_path_get_dirname (filename);
+  g_mkdir_with_parents (dir, 0755);
+  g_free (dir);
+
+  /* this writes to a temporary file and renames it */
+  ok = g_file_set_contents (filename, contents->str, contents->len, &error);
+  if (!ok)
+    {
+      fprintf (stderr, "%s\n", error->message);
+      g_error_free (error);
+    }
+  g_string_free (contents, TRUE);
+
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  GOptionContext *context;
+  GError *error = NULL;
+  GPtrArray *jobs;
+  GThreadPool *pool;
+  gint64 start, elapsed;
+  gboolean ok, batch_ok = TRUE;
+  guint i;
+
+#if !GLIB_CHECK_VERSION(2,35,0)
+  g_type_init ();
+#endif
+
+  context = g_option_context_new ("IMAGE|DIRECTORY... - "
+                                  "convert images to compressed textures");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      fprintf (stderr, "%s\n", error->message);
+      g_error_free (error);
+      return EXIT_FAILURE;
+    }
+  g_option_context_free (context);
+
+  if (argc < 2)
+    {
+      fprintf (stderr, "Nothing to convert. See %s --help\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  if (!format_name || !strcmp (format_name, "pvrtc4"))
+    format = HD_PVR_TEXTURE_FORMAT_PVRTC4;
+  else if (!strcmp (format_name, "pvrtc2"))
+    format = HD_PVR_TEXTURE_FORMAT_PVRTC2;
+  else if (!strcmp (format_name, "etc1"))
+    format = HD_PVR_TEXTURE_FORMAT_ETC1;
+  else
+    {
+      fprintf (stderr, "Unknown format %s\n", format_name);
+      return EXIT_FAILURE;
+    }
+
+  if (check && !strcmp (check, "hash"))
+    check_hash = TRUE;
+  else if (check && strcmp (check, "mtime"))
+    {
+      fprintf (stderr, "Unknown check %s\n", check);
+      return EXIT_FAILURE;
+    }
+
+  if (atlas_file && mipmaps)
+    {
+      fprintf (stderr, "An atlas can't have mipmaps\n");
+      return EXIT_FAILURE;
+    }
+
+  if (check_hash && !atlas_file)
+    {
+      if (!manifest_file)
+        manifest_file = g_build_filename (output_dir ? output_dir : ".",
+                                          MANIFEST_NAME, NULL);
+      manifest_load (manifest_file);
+    }
+
+  jobs = g_ptr_array_new ();
+  for (i=1;i<(guint)argc;i++)
+    {
+      gchar *base = g_path_get_basename (argv[i]);
+
+      /* a directory's images go straight under --output */
+      find_images (jobs, argv[i],
+                   g_file_test (argv[i], G_FILE_TEST_IS_DIR) ? "" : base);
+      g_free (base);
+    }
+
+  if (n_jobs <= 0)
+    n_jobs = g_get_num_processors ();
+
+  start = g_get_monotonic_time ();
+  if (atlas_file)
+    {
+      /* the images are decoded one at a time, and compressed together */
+      batch_ok = make_atlas (jobs);
+      total_busy = g_get_monotonic_time () - start;
+    }
+  else
+    {
+      /* the textures only need to reach the disk once they're all done */
+      hd_pvr_texture_begin_batch ();
+      pool = g_thread_pool_new (convert, NULL, n_jobs, TRUE, NULL);
+      for (i=0;i<jobs->len;i++)
+        g_thread_pool_push (pool, g_ptr_array_index (jobs, i), NULL);
+      g_thread_pool_free (pool, FALSE, TRUE);
+      if (!hd_pvr_texture_end_batch (&error))
+        {
+          fprintf (stderr, "Couldn't write textures: %s\n", error->message);
+          g_clear_error (&error);
+          batch_ok = FALSE;
+        }
+    }
+  elapsed = MAX(g_get_monotonic_time () - start, 1);
+
+  /* the manifest can't say they're up to date if they never got there */
+  ok = n_failed == 0 && batch_ok;
+  if (check_hash && !atlas_file && manifest_changed && batch_ok)
+    ok &= manifest_save (manifest_file);
+
+  printf ("%u converted, %u up to date, %u failed in %.2f s "
+          "on %d threads: %.2f MP, %.2f MP/s (%.2f MP/s per thread)\n",
+          n_converted, n_skipped, n_failed,
+          elapsed / 1000000.0, n_jobs,
+          total_megapixels,
+          total_megapixels / elapsed * 1000000.0,
+          total_megapixels / MAX(total_busy, 1) * 1000000.0);
+
+  for (i=0;i<jobs->len;i++)
+    {
+      Job *job = g_ptr_array_index (jobs, i);
+
+      g_free (job->input);
+      g_free (job->output);
+      g_free (job->name);
+      g_free (job);
+    }
+  g_ptr_array_free (jobs, TRUE);
+  if (manifest)
+    g_hash_table_destroy (manifest);
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}